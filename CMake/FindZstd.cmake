@@ -0,0 +1,23 @@
+# - Find zstd
+# Find the Zstandard compression library
+#
+#  ZSTD_INCLUDE_DIR - where to find zstd.h
+#  ZSTD_LIBRARY     - List of libraries when using zstd.
+#  ZSTD_FOUND       - True if zstd found.
+
+
+IF (ZSTD_INCLUDE_DIR)
+  # Already in cache, be silent
+  SET(ZSTD_FIND_QUIETLY TRUE)
+ENDIF ()
+
+FIND_PATH(ZSTD_INCLUDE_DIR zstd.h)
+
+FIND_LIBRARY(ZSTD_LIBRARY zstd)
+
+# handle the QUIETLY and REQUIRED arguments and set ZSTD_FOUND to TRUE if
+# all listed variables are TRUE
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(ZSTD DEFAULT_MSG ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+MARK_AS_ADVANCED(ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
@@ -0,0 +1,141 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <git2.h>
+#include <git2/sys/reflog.h>
+#include "reflog.h"
+
+/*
+ * Laid out like `struct git_reflog`, `struct git_reflog_entry` and
+ * `git_vector` from libgit2's src/, which git_reflog_free() releases
+ * with plain free().  git_reflog_entry__alloc() from the sys API sizes
+ * the entries, but their fields still have to be filled in here.
+ */
+typedef struct {
+	size_t _alloc_size;
+	int (*_cmp)(const void *, const void *);
+	void **contents;
+	size_t length;
+	uint32_t flags;
+} reflog_vector;
+
+typedef struct {
+	git_refdb *db;
+	char *ref_name;
+	reflog_vector entries;
+} reflog_layout;
+
+typedef struct {
+	git_oid oid_old;
+	git_oid oid_cur;
+	git_signature *committer;
+	char *msg;
+} reflog_entry_layout;
+
+int refdb_reflog_new(git_reflog **out, const char *name)
+{
+	reflog_layout *log;
+
+	log = calloc(1, sizeof(reflog_layout));
+	if (log == NULL || (log->ref_name = strdup(name)) == NULL) {
+		free(log);
+		return GIT_ENOMEM;
+	}
+
+	*out = (git_reflog *)log;
+	return GIT_OK;
+}
+
+static int push_entry(reflog_layout *log, reflog_entry_layout *entry)
+{
+	if (log->entries.length == log->entries._alloc_size) {
+		size_t new_size = log->entries._alloc_size ? log->entries._alloc_size * 2 : 8;
+		void **contents = realloc(log->entries.contents, new_size * sizeof(void *));
+		if (contents == NULL)
+			return GIT_ENOMEM;
+
+		log->entries.contents = contents;
+		log->entries._alloc_size = new_size;
+	}
+
+	log->entries.contents[log->entries.length++] = entry;
+	return GIT_OK;
+}
+
+int refdb_reflog_push(git_reflog *reflog,
+	const git_oid *old_id, const git_oid *new_id,
+	const char *committer_name, const char *committer_email,
+	git_time_t time, int offset, const char *msg)
+{
+	reflog_layout *log = (reflog_layout *)reflog;
+	reflog_entry_layout *entry;
+	int error;
+
+	entry = (reflog_entry_layout *)git_reflog_entry__alloc();
+	if (entry == NULL || push_entry(log, entry) < 0) {
+		free(entry);
+		return GIT_ENOMEM;
+	}
+
+	git_oid_cpy(&entry->oid_old, old_id);
+	git_oid_cpy(&entry->oid_cur, new_id);
+
+	if ((error = git_signature_new(&entry->committer,
+		committer_name, committer_email, time, offset)) < 0)
+		return error;
+
+	if (msg != NULL && (entry->msg = strdup(msg)) == NULL)
+		return GIT_ENOMEM;
+
+	return GIT_OK;
+}
+
+const char *refdb_reflog_name(const git_reflog *reflog)
+{
+	return ((const reflog_layout *)reflog)->ref_name;
+}
+
+void refdb_reflog_free(git_reflog *reflog)
+{
+	reflog_layout *log = (reflog_layout *)reflog;
+	size_t i;
+
+	if (log == NULL)
+		return;
+
+	for (i = 0; i < log->entries.length; ++i) {
+		reflog_entry_layout *entry = log->entries.contents[i];
+		git_signature_free(entry->committer);
+		free(entry->msg);
+		free(entry);
+	}
+
+	free(log->entries.contents);
+	free(log->ref_name);
+	free(log);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <git2.h>
+
+/*
+ * The git_reflog a refdb backend's reflog_read hands to libgit2.
+ * libgit2 has no public way to build one, so this is the only code that
+ * knows its layout; see reflog.c.  Entries are pushed oldest first, the
+ * order libgit2 keeps them in.  All of these that return int return 0
+ * on success and GIT_ENOMEM or another error code on failure.
+ */
+
+int refdb_reflog_new(git_reflog **out, const char *name);
+
+/* copies everything it is given; `msg` may be NULL */
+int refdb_reflog_push(git_reflog *reflog,
+	const git_oid *old_id, const git_oid *new_id,
+	const char *committer_name, const char *committer_email,
+	git_time_t time, int offset, const char *msg);
+
+/* the name of the ref the reflog belongs to */
+const char *refdb_reflog_name(const git_reflog *reflog);
+
+/* for a reflog that never made it to libgit2; otherwise git_reflog_free() */
+void refdb_reflog_free(git_reflog *reflog);
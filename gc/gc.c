@@ -0,0 +1,432 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <git2.h>
+#include "gc.h"
+
+#define GIT2_GC_MAX_THREADS 64
+
+struct git_odb_gc_marks {
+	git_oid *slots;
+	unsigned char *used;
+	size_t size;    /* always a power of two */
+	size_t count;
+};
+
+typedef struct {
+	git_oid oid;
+	git_otype type;     /* GIT_OBJ_ANY for roots */
+} gc_pending;
+
+typedef struct {
+	git_odb *odb;
+	int parallel_reads;
+
+	pthread_mutex_t lock;       /* marks, queue, busy and error */
+	pthread_cond_t cond;
+	pthread_mutex_t odb_lock;
+
+	git_odb_gc_marks *marks;
+	gc_pending *queue;
+	size_t queue_len;
+	size_t queue_alloc;
+	unsigned int busy;
+	int error;
+} gc_walk;
+
+
+static size_t oid_hash(const git_oid *oid)
+{
+	size_t h;
+	memcpy(&h, oid->id, sizeof(h));
+	return h;
+}
+
+static int marks_grow(git_odb_gc_marks *marks)
+{
+	git_odb_gc_marks grown;
+	size_t i, slot;
+
+	grown.size = marks->size ? marks->size * 2 : 1024;
+	grown.count = marks->count;
+	grown.slots = malloc(grown.size * sizeof(git_oid));
+	grown.used = calloc(grown.size, 1);
+
+	if (grown.slots == NULL || grown.used == NULL) {
+		free(grown.slots);
+		free(grown.used);
+		return GIT_ENOMEM;
+	}
+
+	for (i = 0; i < marks->size; ++i) {
+		if (!marks->used[i])
+			continue;
+
+		slot = oid_hash(&marks->slots[i]) & (grown.size - 1);
+		while (grown.used[slot])
+			slot = (slot + 1) & (grown.size - 1);
+
+		git_oid_cpy(&grown.slots[slot], &marks->slots[i]);
+		grown.used[slot] = 1;
+	}
+
+	free(marks->slots);
+	free(marks->used);
+	*marks = grown;
+	return GIT_OK;
+}
+
+/* returns 1 if the oid was newly marked, 0 if it already was */
+static int marks_insert(git_odb_gc_marks *marks, const git_oid *oid)
+{
+	size_t slot;
+
+	if (marks->count * 2 >= marks->size && marks_grow(marks) < 0)
+		return GIT_ENOMEM;
+
+	slot = oid_hash(oid) & (marks->size - 1);
+	while (marks->used[slot]) {
+		if (git_oid_cmp(&marks->slots[slot], oid) == 0)
+			return 0;
+		slot = (slot + 1) & (marks->size - 1);
+	}
+
+	git_oid_cpy(&marks->slots[slot], oid);
+	marks->used[slot] = 1;
+	marks->count++;
+	return 1;
+}
+
+int git_odb_gc_is_marked(const git_oid *oid, void *_marks)
+{
+	git_odb_gc_marks *marks = _marks;
+	size_t slot;
+
+	assert(oid && marks);
+
+	if (marks->size == 0)
+		return 0;
+
+	slot = oid_hash(oid) & (marks->size - 1);
+	while (marks->used[slot]) {
+		if (git_oid_cmp(&marks->slots[slot], oid) == 0)
+			return 1;
+		slot = (slot + 1) & (marks->size - 1);
+	}
+
+	return 0;
+}
+
+size_t git_odb_gc_marks_count(const git_odb_gc_marks *marks)
+{
+	return marks->count;
+}
+
+void git_odb_gc_marks_free(git_odb_gc_marks *marks)
+{
+	if (marks == NULL)
+		return;
+
+	free(marks->slots);
+	free(marks->used);
+	free(marks);
+}
+
+/* must be called with walk->lock held */
+static int walk_push(gc_walk *walk, const git_oid *oid, git_otype type)
+{
+	int error;
+
+	if ((error = marks_insert(walk->marks, oid)) <= 0)
+		return error;
+
+	/* blobs have no outgoing edges, marking them is enough */
+	if (type == GIT_OBJ_BLOB)
+		return GIT_OK;
+
+	if (walk->queue_len == walk->queue_alloc) {
+		size_t new_alloc = walk->queue_alloc ? walk->queue_alloc * 2 : 256;
+		gc_pending *queue = realloc(walk->queue, new_alloc * sizeof(gc_pending));
+		if (queue == NULL)
+			return GIT_ENOMEM;
+
+		walk->queue = queue;
+		walk->queue_alloc = new_alloc;
+	}
+
+	git_oid_cpy(&walk->queue[walk->queue_len].oid, oid);
+	walk->queue[walk->queue_len].type = type;
+	walk->queue_len++;
+	return GIT_OK;
+}
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+} gc_edge;
+
+typedef struct {
+	gc_edge *edges;
+	size_t len;
+	size_t alloc;
+} gc_edges;
+
+static int edges_add(gc_edges *edges, const git_oid *oid, git_otype type)
+{
+	if (edges->len == edges->alloc) {
+		size_t new_alloc = edges->alloc ? edges->alloc * 2 : 64;
+		gc_edge *e = realloc(edges->edges, new_alloc * sizeof(gc_edge));
+		if (e == NULL)
+			return GIT_ENOMEM;
+
+		edges->edges = e;
+		edges->alloc = new_alloc;
+	}
+
+	git_oid_cpy(&edges->edges[edges->len].oid, oid);
+	edges->edges[edges->len].type = type;
+	edges->len++;
+	return GIT_OK;
+}
+
+/* reads "<header> <hex oid>\n" header lines until the blank line */
+static int parse_header_edges(gc_edges *edges, const char *data, size_t len,
+	const char *header, git_otype type)
+{
+	const char *end = data + len, *line = data, *eol;
+	size_t header_len = strlen(header);
+	git_oid oid;
+	int error;
+
+	while (line < end && *line != '\n') {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+
+		if ((size_t)(eol - line) == header_len + 1 + GIT_OID_HEXSZ &&
+			!memcmp(line, header, header_len) && line[header_len] == ' ') {
+			if (git_oid_fromstrn(&oid, line + header_len + 1, GIT_OID_HEXSZ) < 0)
+				return GIT_ERROR;
+			if ((error = edges_add(edges, &oid, type)) < 0)
+				return error;
+		}
+
+		line = eol + 1;
+	}
+
+	return GIT_OK;
+}
+
+static int parse_commit(gc_edges *edges, const char *data, size_t len)
+{
+	int error;
+
+	if ((error = parse_header_edges(edges, data, len, "tree", GIT_OBJ_TREE)) < 0)
+		return error;
+
+	return parse_header_edges(edges, data, len, "parent", GIT_OBJ_COMMIT);
+}
+
+static int parse_tree(gc_edges *edges, const char *data, size_t len)
+{
+	const char *end = data + len, *p = data, *nul;
+	git_otype type;
+	git_oid oid;
+	int error;
+
+	while (p < end) {
+		/* "<octal mode> <name>\0<raw oid>" */
+		nul = memchr(p, '\0', end - p);
+		if (nul == NULL || end - nul - 1 < GIT_OID_RAWSZ)
+			return GIT_ERROR;
+
+		if (!strncmp(p, "40000 ", 6))
+			type = GIT_OBJ_TREE;
+		else if (!strncmp(p, "160000 ", 7))
+			type = GIT_OBJ_BAD;     /* submodule commit, lives elsewhere */
+		else
+			type = GIT_OBJ_BLOB;
+
+		git_oid_fromraw(&oid, (const unsigned char *)nul + 1);
+		if (type != GIT_OBJ_BAD && (error = edges_add(edges, &oid, type)) < 0)
+			return error;
+
+		p = nul + 1 + GIT_OID_RAWSZ;
+	}
+
+	return GIT_OK;
+}
+
+static int visit(gc_walk *walk, gc_edges *edges, const gc_pending *item)
+{
+	git_odb_object *obj;
+	int error;
+
+	if (!walk->parallel_reads)
+		pthread_mutex_lock(&walk->odb_lock);
+
+	error = git_odb_read(&obj, walk->odb, &item->oid);
+
+	if (!walk->parallel_reads)
+		pthread_mutex_unlock(&walk->odb_lock);
+
+	if (error < 0)
+		return error;
+
+	switch (git_odb_object_type(obj)) {
+	case GIT_OBJ_COMMIT:
+		error = parse_commit(edges, git_odb_object_data(obj), git_odb_object_size(obj));
+		break;
+
+	case GIT_OBJ_TREE:
+		error = parse_tree(edges, git_odb_object_data(obj), git_odb_object_size(obj));
+		break;
+
+	case GIT_OBJ_TAG:
+		error = parse_header_edges(edges, git_odb_object_data(obj),
+			git_odb_object_size(obj), "object", GIT_OBJ_ANY);
+		break;
+
+	default:
+		break;
+	}
+
+	git_odb_object_free(obj);
+	return error;
+}
+
+static void *walk_worker(void *payload)
+{
+	gc_walk *walk = payload;
+	gc_edges edges = { NULL, 0, 0 };
+	gc_pending item;
+	size_t i;
+	int error;
+
+	pthread_mutex_lock(&walk->lock);
+
+	for (;;) {
+		while (walk->queue_len == 0 && walk->busy > 0 && walk->error == 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+
+		/* nothing queued and nobody left to queue more: we're done */
+		if (walk->queue_len == 0 || walk->error != 0)
+			break;
+
+		item = walk->queue[--walk->queue_len];
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		edges.len = 0;
+		error = visit(walk, &edges, &item);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+
+		for (i = 0; error == 0 && i < edges.len; ++i)
+			error = walk_push(walk, &edges.edges[i].oid, edges.edges[i].type);
+
+		if (error < 0 && walk->error == 0)
+			walk->error = error;
+
+		pthread_cond_broadcast(&walk->cond);
+	}
+
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+
+	free(edges.edges);
+	return NULL;
+}
+
+int git_odb_gc_mark(git_odb_gc_marks **out, git_odb *odb,
+	const git_oid *roots, size_t nroots,
+	unsigned int nthreads, int parallel_reads)
+{
+	pthread_t threads[GIT2_GC_MAX_THREADS];
+	unsigned int started = 0, i;
+	gc_walk walk;
+	int error = GIT_OK;
+
+	assert(out && odb && (roots || !nroots));
+
+	if (nthreads == 0)
+		nthreads = 1;
+	if (nthreads > GIT2_GC_MAX_THREADS)
+		nthreads = GIT2_GC_MAX_THREADS;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.odb = odb;
+	walk.parallel_reads = parallel_reads;
+
+	if ((walk.marks = calloc(1, sizeof(git_odb_gc_marks))) == NULL) {
+		giterr_set_oom();
+		return GIT_ENOMEM;
+	}
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_mutex_init(&walk.odb_lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	for (i = 0; i < nroots && error == 0; ++i)
+		error = walk_push(&walk, &roots[i], GIT_OBJ_ANY);
+
+	for (i = 0; i < nthreads && error == 0; ++i) {
+		if (pthread_create(&threads[i], NULL, walk_worker, &walk) != 0) {
+			giterr_set_str(GITERR_THREAD, "failed to start gc worker");
+			error = GIT_ERROR;
+
+			pthread_mutex_lock(&walk.lock);
+			walk.error = error;
+			pthread_cond_broadcast(&walk.cond);
+			pthread_mutex_unlock(&walk.lock);
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	if (error == 0)
+		error = walk.error;
+
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.odb_lock);
+	pthread_mutex_destroy(&walk.lock);
+	free(walk.queue);
+
+	if (error < 0) {
+		git_odb_gc_marks_free(walk.marks);
+		return error;
+	}
+
+	*out = walk.marks;
+	return GIT_OK;
+}
@@ -0,0 +1,39 @@
+#include <git2.h>
+
+/*
+ * Mark phase of a mark-and-sweep collection for the SQL backends.
+ *
+ * git_odb_gc_mark() walks everything reachable from `roots` (the targets
+ * of every ref, reflog entry and anything else that must survive) and
+ * returns the set of reachable object ids.  Pass git_odb_gc_is_marked()
+ * and the marks as the reachability callback of a backend's sweep
+ * function, e.g. git_odb_backend_sqlite_sweep(), to delete the rest.
+ *
+ * Objects written while the collection runs are not in the marks; the
+ * sweep functions only delete rows older than their grace period, which
+ * must be longer than the whole collection takes.  An object libgit2
+ * found and so didn't write again is only re-stamped if the backends
+ * writing to the repository have the freshen option on.
+ */
+
+typedef struct git_odb_gc_marks git_odb_gc_marks;
+
+/* the reachability callback every sweep function takes */
+typedef int (*git_odb_gc_reachable_cb)(const git_oid *oid, void *payload);
+
+/*
+ * Commits, trees and tags are read through `odb` and parsed by `nthreads`
+ * worker threads.  Unless `parallel_reads` is set, the reads themselves
+ * are serialized, for backends that can't be used from several threads
+ * at once.  Fails if any reachable commit, tree or tag is missing.
+ */
+int git_odb_gc_mark(git_odb_gc_marks **out, git_odb *odb,
+	const git_oid *roots, size_t nroots,
+	unsigned int nthreads, int parallel_reads);
+
+/* matches git_odb_gc_reachable_cb, with the marks as payload */
+int git_odb_gc_is_marked(const git_oid *oid, void *marks);
+
+size_t git_odb_gc_marks_count(const git_odb_gc_marks *marks);
+
+void git_odb_gc_marks_free(git_odb_gc_marks *marks);
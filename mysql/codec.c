@@ -0,0 +1,290 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef GIT2_MYSQL_ZSTD
+#include <zstd.h>
+#endif
+#include "codec.h"
+
+#define CODEC_CHUNK 65536
+
+struct codec_stream {
+  git_odb_mysql_codec codec;
+  codec_sink sink;
+  void *payload;
+  z_stream zs;
+#ifdef GIT2_MYSQL_ZSTD
+  ZSTD_CStream *zstd;
+#endif
+  unsigned char out[CODEC_CHUNK];
+};
+
+int codec_supported(git_odb_mysql_codec codec)
+{
+  switch (codec) {
+  case GIT_ODB_MYSQL_CODEC_SERVER:
+  case GIT_ODB_MYSQL_CODEC_NONE:
+  case GIT_ODB_MYSQL_CODEC_ZLIB:
+    return 1;
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+int codec_encode(void **out, size_t *out_len, git_odb_mysql_codec codec, int level,
+  const void *data, size_t len)
+{
+  void *buf;
+  size_t bound;
+
+  switch (codec) {
+  // COMPRESS() runs on the server, so the data goes over as it is
+  case GIT_ODB_MYSQL_CODEC_SERVER:
+  case GIT_ODB_MYSQL_CODEC_NONE:
+    bound = len;
+    break;
+  case GIT_ODB_MYSQL_CODEC_ZLIB:
+    bound = compressBound(len);
+    break;
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD:
+    bound = ZSTD_compressBound(len);
+    break;
+#endif
+  default:
+    return -1;
+  }
+
+  if ((buf = malloc(bound ? bound : 1)) == NULL)
+    return -1;
+
+  switch (codec) {
+  case GIT_ODB_MYSQL_CODEC_ZLIB: {
+    uLongf dest_len = bound;
+    if (compress2(buf, &dest_len, data, len, level ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+      goto fail;
+    *out_len = dest_len;
+    break;
+  }
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD:
+    *out_len = ZSTD_compress(buf, bound, data, len, level ? level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(*out_len))
+      goto fail;
+    break;
+#endif
+  default:
+    memcpy(buf, data, len);
+    *out_len = len;
+    break;
+  }
+
+  *out = buf;
+  return 0;
+
+fail:
+  free(buf);
+  return -1;
+}
+
+static int inflate_exact(void *out, size_t out_len, const void *data, size_t len)
+{
+  uLongf dest_len = out_len;
+
+  if (out_len == 0)
+    return 0;
+
+  if (uncompress(out, &dest_len, data, len) != Z_OK || dest_len != out_len)
+    return -1;
+
+  return 0;
+}
+
+int codec_decode(void *out, size_t out_len, git_odb_mysql_codec codec,
+  const void *data, size_t len)
+{
+  switch (codec) {
+  case GIT_ODB_MYSQL_CODEC_SERVER:
+    // COMPRESS() output: empty for empty input, otherwise the length
+    // as 4 little-endian bytes followed by a zlib stream
+    if (len == 0)
+      return (out_len == 0) ? 0 : -1;
+    if (len < 4)
+      return -1;
+    return inflate_exact(out, out_len, (const unsigned char *)data + 4, len - 4);
+
+  case GIT_ODB_MYSQL_CODEC_NONE:
+    if (len != out_len)
+      return -1;
+    memcpy(out, data, len);
+    return 0;
+
+  case GIT_ODB_MYSQL_CODEC_ZLIB:
+    return inflate_exact(out, out_len, data, len);
+
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD: {
+    size_t n = ZSTD_decompress(out, out_len, data, len);
+    return (ZSTD_isError(n) || n != out_len) ? -1 : 0;
+  }
+#endif
+
+  default:
+    return -1;
+  }
+}
+
+int codec_stream_new(codec_stream **out, git_odb_mysql_codec codec, int level,
+  codec_sink sink, void *payload)
+{
+  codec_stream *stream;
+
+  if (!codec_supported(codec))
+    return -1;
+
+  if ((stream = calloc(1, sizeof(codec_stream))) == NULL)
+    return -1;
+
+  stream->codec = codec;
+  stream->sink = sink;
+  stream->payload = payload;
+
+  if (codec == GIT_ODB_MYSQL_CODEC_ZLIB &&
+      deflateInit(&stream->zs, level ? level : Z_DEFAULT_COMPRESSION) != Z_OK) {
+    free(stream);
+    return -1;
+  }
+
+#ifdef GIT2_MYSQL_ZSTD
+  if (codec == GIT_ODB_MYSQL_CODEC_ZSTD) {
+    if ((stream->zstd = ZSTD_createCStream()) == NULL ||
+        ZSTD_isError(ZSTD_initCStream(stream->zstd, level ? level : ZSTD_CLEVEL_DEFAULT))) {
+      ZSTD_freeCStream(stream->zstd);
+      free(stream);
+      return -1;
+    }
+  }
+#endif
+
+  *out = stream;
+  return 0;
+}
+
+static int stream_deflate(codec_stream *stream, const void *data, size_t len, int flush)
+{
+  int zerr;
+
+  stream->zs.next_in = (Bytef *)data;
+  stream->zs.avail_in = (uInt)len;
+
+  do {
+    stream->zs.next_out = stream->out;
+    stream->zs.avail_out = CODEC_CHUNK;
+
+    zerr = deflate(&stream->zs, flush);
+    if (zerr == Z_STREAM_ERROR)
+      return -1;
+
+    if (CODEC_CHUNK - stream->zs.avail_out > 0 &&
+        stream->sink(stream->out, CODEC_CHUNK - stream->zs.avail_out, stream->payload) < 0)
+      return -1;
+  } while (stream->zs.avail_out == 0 || (flush == Z_FINISH && zerr != Z_STREAM_END));
+
+  return 0;
+}
+
+#ifdef GIT2_MYSQL_ZSTD
+static int stream_zstd(codec_stream *stream, const void *data, size_t len, ZSTD_EndDirective mode)
+{
+  ZSTD_inBuffer in = { data, len, 0 };
+  ZSTD_outBuffer out;
+  size_t remaining;
+
+  do {
+    out.dst = stream->out;
+    out.size = CODEC_CHUNK;
+    out.pos = 0;
+
+    remaining = ZSTD_compressStream2(stream->zstd, &out, &in, mode);
+    if (ZSTD_isError(remaining))
+      return -1;
+
+    if (out.pos > 0 && stream->sink(stream->out, out.pos, stream->payload) < 0)
+      return -1;
+  } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+
+  return 0;
+}
+#endif
+
+int codec_stream_write(codec_stream *stream, const void *data, size_t len)
+{
+  switch (stream->codec) {
+  case GIT_ODB_MYSQL_CODEC_ZLIB:
+    return stream_deflate(stream, data, len, Z_NO_FLUSH);
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD:
+    return stream_zstd(stream, data, len, ZSTD_e_continue);
+#endif
+  default:
+    return (len == 0) ? 0 : stream->sink(data, len, stream->payload);
+  }
+}
+
+int codec_stream_finish(codec_stream *stream)
+{
+  switch (stream->codec) {
+  case GIT_ODB_MYSQL_CODEC_ZLIB:
+    return stream_deflate(stream, NULL, 0, Z_FINISH);
+#ifdef GIT2_MYSQL_ZSTD
+  case GIT_ODB_MYSQL_CODEC_ZSTD:
+    return stream_zstd(stream, NULL, 0, ZSTD_e_end);
+#endif
+  default:
+    return 0;
+  }
+}
+
+void codec_stream_free(codec_stream *stream)
+{
+  if (stream == NULL)
+    return;
+
+  if (stream->codec == GIT_ODB_MYSQL_CODEC_ZLIB)
+    deflateEnd(&stream->zs);
+#ifdef GIT2_MYSQL_ZSTD
+  if (stream->codec == GIT_ODB_MYSQL_CODEC_ZSTD)
+    ZSTD_freeCStream(stream->zstd);
+#endif
+
+  free(stream);
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stddef.h>
+#include "mysql-odb.h"
+
+/* all of these return 0 on success and -1 on failure */
+
+int codec_supported(git_odb_mysql_codec codec);
+
+/* compresses `len` bytes into a newly allocated buffer */
+int codec_encode(void **out, size_t *out_len, git_odb_mysql_codec codec, int level,
+  const void *data, size_t len);
+
+/* decompresses into `out`, which must hold exactly `out_len` bytes */
+int codec_decode(void *out, size_t out_len, git_odb_mysql_codec codec,
+  const void *data, size_t len);
+
+/* incremental compression; compressed output is handed to the sink
+ * as it becomes available */
+typedef int (*codec_sink)(const void *data, size_t len, void *payload);
+typedef struct codec_stream codec_stream;
+
+int codec_stream_new(codec_stream **out, git_odb_mysql_codec codec, int level,
+  codec_sink sink, void *payload);
+int codec_stream_write(codec_stream *stream, const void *data, size_t len);
+int codec_stream_finish(codec_stream *stream);
+void codec_stream_free(codec_stream *stream);
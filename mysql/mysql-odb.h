@@ -0,0 +1,103 @@
+#ifndef INCLUDE_git_odb_mysql_h__
+#define INCLUDE_git_odb_mysql_h__
+
+#include <git2.h>
+#include <git2/odb_backend.h>
+
+/*
+ * How object data is compressed in the `data` column.  The value is
+ * stored in each row's `codec` column, so rows written with different
+ * codecs can live in one table.
+ */
+typedef enum {
+  /* COMPRESS() on the server; the only format older clients can read */
+  GIT_ODB_MYSQL_CODEC_SERVER = 0,
+  GIT_ODB_MYSQL_CODEC_NONE = 1,
+  GIT_ODB_MYSQL_CODEC_ZLIB = 2,
+  /* only available when built with zstd */
+  GIT_ODB_MYSQL_CODEC_ZSTD = 3,
+} git_odb_mysql_codec;
+
+/*
+ * A pool of connections several backends can share, e.g. one per
+ * repository in a shared table.  Odb backends sharing a pool must use
+ * the same table and the same codec; the refdb in mysql-refdb.h can use
+ * any pool.  Each backend holds a reference to it.
+ */
+typedef struct conn_pool git_odb_mysql_pool;
+
+int git_odb_mysql_pool_new(git_odb_mysql_pool **out, size_t size, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag);
+
+void git_odb_mysql_pool_free(git_odb_mysql_pool *pool);
+
+typedef struct {
+  /* codec for newly written objects */
+  git_odb_mysql_codec codec;
+  /* codec-specific compression level, 0 for its default */
+  int level;
+  /* most connections the backend opens, 0 for the default of 4; each
+   * thread reuses the connection it had last whenever it is idle */
+  size_t pool_size;
+  /* use this pool instead of opening one; the connection arguments of
+   * git_odb_backend_mysql_ext() are then ignored */
+  git_odb_mysql_pool *pool;
+  /* store objects in the git2_odb_shared table, which holds every
+   * repository's objects keyed by (repo_id, oid), instead of git2_odb */
+  int shared;
+  unsigned long long repo_id;
+  /* if the shared table has to be created, partition it by repo_id
+   * into this many partitions; 0 leaves it unpartitioned */
+  unsigned int partitions;
+  /* have exists() re-stamp what it finds, since libgit2 doesn't write
+   * an object that exists and the sweep would otherwise take it for an
+   * old one; only deployments running git_odb_backend_mysql_sweep need
+   * it.  It makes lookups write, so it is best effort and fails quietly
+   * on a read-only server or user. */
+  int freshen;
+} git_odb_backend_mysql_options;
+
+#define GIT_ODB_BACKEND_MYSQL_OPTIONS_INIT { GIT_ODB_MYSQL_CODEC_SERVER, 0, 0, NULL, 0, 0, 0, 0 }
+
+int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag);
+
+/* like git_odb_backend_mysql(); `opts` may be NULL for the defaults */
+int git_odb_backend_mysql_ext(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag,
+        const git_odb_backend_mysql_options *opts);
+
+/*
+ * Rewrites up to `max_rows` rows stored with a different codec than the
+ * backend's own, `batch_size` rows per transaction.  A `max_rows` of 0
+ * migrates the whole table; otherwise call it repeatedly until
+ * *converted_out comes back 0.
+ */
+int git_odb_backend_mysql_recompress(git_odb_backend *backend,
+        size_t max_rows, size_t batch_size, size_t *converted_out);
+
+/* `data` is only valid until the callback returns; a non-zero return
+ * stops the read with GIT_EUSER */
+typedef int (*git_odb_mysql_read_cb)(const git_oid *oid, const void *data,
+        size_t len, git_otype type, void *payload);
+
+/*
+ * Reads many objects at once, a few hundred per round trip.  Objects
+ * that aren't in the database are skipped, and the rest are passed to
+ * `cb` in no particular order.  Each round trip's objects are held in
+ * memory until `cb` has seen them, and no connection is held while it
+ * runs, so it may use the backend.
+ */
+int git_odb_backend_mysql_read_batch(git_odb_backend *backend,
+        const git_oid *oids, size_t n, git_odb_mysql_read_cb cb, void *payload);
+
+/* sweep phase of a garbage collection, see gc/gc.h, for backends
+ * opened with the freshen option */
+int git_odb_backend_mysql_sweep(git_odb_backend *backend,
+        int (*is_reachable)(const git_oid *, void *), void *payload,
+        unsigned int grace_seconds, size_t batch_size);
+
+#endif
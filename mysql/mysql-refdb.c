@@ -0,0 +1,1145 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <git2.h>
+#include <git2/sys/refdb_backend.h>
+#include <git2/sys/refs.h>
+#include "mysql-refdb.h"
+#include "pool.h"
+#include "reflog.h"
+#include <mysql.h>
+
+#define GIT2_REFDB_TABLE_NAME "git2_refdb"
+#define GIT2_REFLOG_TABLE_NAME "git2_reflog"
+#define GIT2_REFLOG_REFS_TABLE_NAME "git2_reflog_refs"
+#define GIT2_STORAGE_ENGINE "InnoDB"
+
+// server errors that mean another writer holds the rows we wanted
+#define GIT2_ER_DUP_ENTRY 1062
+#define GIT2_ER_LOCK_WAIT_TIMEOUT 1205
+#define GIT2_ER_LOCK_DEADLOCK 1213
+
+// The refs of every repository live in one set of tables keyed by
+// (repo_id, name). Nothing is prepared: each operation checks out a
+// connection from the pool for as long as it runs, so the refdb can
+// share a pool with an odb backend without touching its statements.
+typedef struct {
+  git_refdb_backend parent;
+  conn_pool *pool;
+  unsigned long long repo_id;
+} mysql_refdb_backend;
+
+// the rows are buffered on the client by mysql_store_result, so the
+// iterator doesn't keep a connection checked out
+typedef struct {
+  git_reference_iterator parent;
+  MYSQL_RES *res;
+  char *glob;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+} mysql_refdb_iterator;
+
+
+static int set_giterr_from_mysql(MYSQL *db)
+{
+  giterr_set_str(GITERR_REFERENCE, mysql_error(db));
+
+  switch (mysql_errno(db)) {
+  case GIT2_ER_LOCK_WAIT_TIMEOUT:
+  case GIT2_ER_LOCK_DEADLOCK:
+    return GIT_ELOCKED;
+  default:
+    return GIT_ERROR;
+  }
+}
+
+// Builds a query from `fmt`, where %s is a quoted string (or NULL), %o an
+// oid as X'...' (or NULL), %u an unsigned long long, %d a long long and
+// %r a piece of SQL pasted in as it is. Strings are escaped for the
+// connection's character set.
+static char *sql_vbuild(MYSQL *db, const char *fmt, va_list ap)
+{
+  va_list aq;
+  const char *f, *s;
+  const git_oid *oid;
+  size_t alloc = 1;
+  char *sql, *p;
+
+  va_copy(aq, ap);
+  for (f = fmt; *f; ++f) {
+    if (*f != '%') {
+      alloc++;
+      continue;
+    }
+
+    switch (*++f) {
+    case 's':
+      s = va_arg(aq, const char *);
+      alloc += s ? strlen(s) * 2 + 2 : 4;
+      break;
+    case 'r':
+      alloc += strlen(va_arg(aq, const char *));
+      break;
+    case 'o':
+      (void)va_arg(aq, const git_oid *);
+      alloc += GIT_OID_HEXSZ + 3;
+      break;
+    case 'u':
+      (void)va_arg(aq, unsigned long long);
+      alloc += 20;
+      break;
+    case 'd':
+      (void)va_arg(aq, long long);
+      alloc += 21;
+      break;
+    }
+  }
+  va_end(aq);
+
+  if ((sql = malloc(alloc)) == NULL)
+    return NULL;
+
+  for (p = sql, f = fmt; *f; ++f) {
+    if (*f != '%') {
+      *p++ = *f;
+      continue;
+    }
+
+    switch (*++f) {
+    case 's':
+      if ((s = va_arg(ap, const char *)) == NULL) {
+        p += sprintf(p, "NULL");
+        break;
+      }
+      *p++ = '\'';
+      p += mysql_real_escape_string(db, p, s, strlen(s));
+      *p++ = '\'';
+      break;
+    case 'r':
+      s = va_arg(ap, const char *);
+      memcpy(p, s, strlen(s));
+      p += strlen(s);
+      break;
+    case 'o':
+      if ((oid = va_arg(ap, const git_oid *)) == NULL) {
+        p += sprintf(p, "NULL");
+        break;
+      }
+      *p++ = 'X';
+      *p++ = '\'';
+      git_oid_fmt(p, oid);
+      p += GIT_OID_HEXSZ;
+      *p++ = '\'';
+      break;
+    case 'u':
+      p += sprintf(p, "%llu", va_arg(ap, unsigned long long));
+      break;
+    case 'd':
+      p += sprintf(p, "%lld", va_arg(ap, long long));
+      break;
+    }
+  }
+  *p = '\0';
+
+  return sql;
+}
+
+// runs a query built as by sql_vbuild; if `res_out` isn't NULL the
+// result set is stored there
+static int exec_sql(MYSQL *db, MYSQL_RES **res_out, const char *fmt, ...)
+{
+  va_list ap;
+  char *sql;
+  int error = GIT_OK;
+
+  va_start(ap, fmt);
+  sql = sql_vbuild(db, fmt, ap);
+  va_end(ap);
+
+  if (sql == NULL)
+    return GIT_ENOMEM;
+
+  if (mysql_real_query(db, sql, strlen(sql)) != 0 ||
+      (res_out != NULL && (*res_out = mysql_store_result(db)) == NULL))
+    error = set_giterr_from_mysql(db);
+
+  free(sql);
+  return error;
+}
+
+static int begin_write(MYSQL *db)
+{
+  if (mysql_real_query(db, "START TRANSACTION;", strlen("START TRANSACTION;")) != 0)
+    return set_giterr_from_mysql(db);
+
+  return GIT_OK;
+}
+
+static int end_write(MYSQL *db, int error)
+{
+  if (error < 0) {
+    mysql_rollback(db);
+    return error;
+  }
+
+  if (mysql_commit(db) != 0) {
+    error = set_giterr_from_mysql(db);
+    mysql_rollback(db);
+    return error;
+  }
+
+  return GIT_OK;
+}
+
+// lookups of missing refs are routine; only a failed query should make
+// the pool check the connection before reusing it
+static void release(mysql_refdb_backend *backend, pool_conn *conn, int error)
+{
+  pool_put(backend->pool, conn, error == GIT_ERROR ? error : GIT_OK);
+}
+
+// rows are (name, type, target, peel)
+static int ref_from_row(git_reference **out, MYSQL_ROW row, unsigned long *lengths)
+{
+  switch (atoi(row[1])) {
+  case GIT_REF_OID:
+    if (lengths[2] != GIT_OID_RAWSZ)
+      break;
+
+    *out = git_reference__alloc(row[0], (const git_oid *)row[2],
+      (row[3] != NULL && lengths[3] == GIT_OID_RAWSZ) ? (const git_oid *)row[3] : NULL);
+    return (*out == NULL) ? GIT_ENOMEM : GIT_OK;
+
+  case GIT_REF_SYMBOLIC:
+    *out = git_reference__alloc_symbolic(row[0], row[2]);
+    return (*out == NULL) ? GIT_ENOMEM : GIT_OK;
+  }
+
+  giterr_set_str(GITERR_REFERENCE, "corrupt reference row");
+  return GIT_ERROR;
+}
+
+static int lookup(git_reference **out, mysql_refdb_backend *backend, MYSQL *db,
+  const char *ref_name)
+{
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int error;
+
+  if ((error = exec_sql(db, &res,
+      "SELECT `name`, `type`, `target`, `peel` FROM `" GIT2_REFDB_TABLE_NAME "`"
+      "  WHERE `repo_id` = %u AND `name` = %s;",
+      backend->repo_id, ref_name)) < 0)
+    return error;
+
+  if ((row = mysql_fetch_row(res)) != NULL)
+    error = ref_from_row(out, row, mysql_fetch_lengths(res));
+  else
+    error = GIT_ENOTFOUND;
+
+  mysql_free_result(res);
+  return error;
+}
+
+static int mysql_refdb_backend__exists(
+  int *exists,
+  git_refdb_backend *_backend,
+  const char *ref_name)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  MYSQL_RES *res;
+  int error;
+
+  assert(exists && backend && ref_name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = exec_sql(conn->db, &res,
+    "SELECT 1 FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+    backend->repo_id, ref_name);
+
+  if (error == GIT_OK) {
+    *exists = (mysql_num_rows(res) > 0);
+    mysql_free_result(res);
+  }
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int mysql_refdb_backend__lookup(
+  git_reference **out,
+  git_refdb_backend *_backend,
+  const char *ref_name)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(out && backend && ref_name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = lookup(out, backend, conn->db, ref_name);
+
+  release(backend, conn, error);
+  return error;
+}
+
+// Splits a glob into the literal part in front of its first wildcard
+// and the smallest string sorting after everything with that prefix.
+// `name >= lo AND name < hi` is then a range scan on the primary key,
+// and fnmatch only has to filter the rows inside that range.
+// *hi_out is left NULL when no such upper bound exists.
+static int glob_to_range(char **lo_out, char **hi_out, const char *glob)
+{
+  size_t prefix_len = strcspn(glob, "*?[\\");
+  char *lo, *hi;
+
+  *lo_out = *hi_out = NULL;
+
+  if ((lo = malloc(prefix_len + 1)) == NULL)
+    return GIT_ENOMEM;
+
+  memcpy(lo, glob, prefix_len);
+  lo[prefix_len] = '\0';
+
+  if ((hi = strdup(lo)) == NULL) {
+    free(lo);
+    return GIT_ENOMEM;
+  }
+
+  while (prefix_len > 0 && (unsigned char)hi[prefix_len - 1] == 0xff)
+    hi[--prefix_len] = '\0';
+
+  if (prefix_len > 0) {
+    hi[prefix_len - 1]++;
+  } else {
+    free(hi);
+    hi = NULL;
+  }
+
+  *lo_out = lo;
+  *hi_out = hi;
+  return GIT_OK;
+}
+
+static int mysql_refdb_iterator__step(mysql_refdb_iterator *iter)
+{
+  while ((iter->row = mysql_fetch_row(iter->res)) != NULL) {
+    if (iter->glob == NULL || fnmatch(iter->glob, iter->row[0], 0) == 0) {
+      iter->lengths = mysql_fetch_lengths(iter->res);
+      return GIT_OK;
+    }
+  }
+
+  return GIT_ITEROVER;
+}
+
+static int mysql_refdb_iterator__next(
+  git_reference **ref,
+  git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter = (mysql_refdb_iterator *)_iter;
+  int error;
+
+  if ((error = mysql_refdb_iterator__step(iter)) < 0)
+    return error;
+
+  return ref_from_row(ref, iter->row, iter->lengths);
+}
+
+static int mysql_refdb_iterator__next_name(
+  const char **ref_name,
+  git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter = (mysql_refdb_iterator *)_iter;
+  int error;
+
+  if ((error = mysql_refdb_iterator__step(iter)) < 0)
+    return error;
+
+  // the row stays valid until the result set is freed
+  *ref_name = iter->row[0];
+  return GIT_OK;
+}
+
+static void mysql_refdb_iterator__free(
+  git_reference_iterator *_iter)
+{
+  mysql_refdb_iterator *iter = (mysql_refdb_iterator *)_iter;
+
+  if (iter->res != NULL)
+    mysql_free_result(iter->res);
+  free(iter->glob);
+  free(iter);
+}
+
+static int mysql_refdb_backend__iterator(
+  git_reference_iterator **iter_out,
+  struct git_refdb_backend *_backend,
+  const char *glob)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  mysql_refdb_iterator *iter;
+  pool_conn *conn;
+  char *lo = NULL, *hi = NULL;
+  int error;
+
+  assert(iter_out && backend);
+
+  iter = calloc(1, sizeof(mysql_refdb_iterator));
+  if (iter == NULL)
+    return GIT_ENOMEM;
+
+  iter->parent.next = &mysql_refdb_iterator__next;
+  iter->parent.next_name = &mysql_refdb_iterator__next_name;
+  iter->parent.free = &mysql_refdb_iterator__free;
+
+  if (glob != NULL &&
+      ((iter->glob = strdup(glob)) == NULL ||
+       (error = glob_to_range(&lo, &hi, glob)) < 0)) {
+    mysql_refdb_iterator__free((git_reference_iterator *)iter);
+    return GIT_ENOMEM;
+  }
+
+  if (pool_get(&conn, backend->pool) < 0) {
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  if (glob == NULL)
+    error = exec_sql(conn->db, &iter->res,
+      "SELECT `name`, `type`, `target`, `peel` FROM `" GIT2_REFDB_TABLE_NAME "`"
+      "  WHERE `repo_id` = %u ORDER BY `name`;",
+      backend->repo_id);
+  else if (hi == NULL)
+    error = exec_sql(conn->db, &iter->res,
+      "SELECT `name`, `type`, `target`, `peel` FROM `" GIT2_REFDB_TABLE_NAME "`"
+      "  WHERE `repo_id` = %u AND `name` >= %s ORDER BY `name`;",
+      backend->repo_id, lo);
+  else
+    error = exec_sql(conn->db, &iter->res,
+      "SELECT `name`, `type`, `target`, `peel` FROM `" GIT2_REFDB_TABLE_NAME "`"
+      "  WHERE `repo_id` = %u AND `name` >= %s AND `name` < %s ORDER BY `name`;",
+      backend->repo_id, lo, hi);
+
+  release(backend, conn, error);
+
+cleanup:
+  if (error < 0)
+    mysql_refdb_iterator__free((git_reference_iterator *)iter);
+  else
+    *iter_out = (git_reference_iterator *)iter;
+  free(lo);
+  free(hi);
+  return error;
+}
+
+// Reads the current row for `ref_name` into the out parameters; *type_out
+// is GIT_REF_INVALID when the reference doesn't exist. With `for_update`
+// the row (or, for a missing ref, the gap it would go in) stays locked
+// until the transaction ends, which is what makes the old-value checks
+// of write, del and rename atomic.
+static int read_current(git_ref_t *type_out, git_oid *oid_out, char **symbolic_out,
+  mysql_refdb_backend *backend, MYSQL *db, const char *ref_name, int for_update)
+{
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  int error;
+
+  *type_out = GIT_REF_INVALID;
+  memset(oid_out, 0, sizeof(git_oid));
+  if (symbolic_out != NULL)
+    *symbolic_out = NULL;
+
+  if ((error = exec_sql(db, &res,
+      "SELECT `type`, `target` FROM `" GIT2_REFDB_TABLE_NAME "`"
+      "  WHERE `repo_id` = %u AND `name` = %s%r;",
+      backend->repo_id, ref_name, for_update ? " FOR UPDATE" : "")) < 0)
+    return error;
+
+  if ((row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    *type_out = (git_ref_t)atoi(row[0]);
+
+    if (*type_out == GIT_REF_OID && lengths[1] == GIT_OID_RAWSZ) {
+      memcpy(oid_out->id, row[1], GIT_OID_RAWSZ);
+    } else if (*type_out == GIT_REF_SYMBOLIC && symbolic_out != NULL &&
+        (*symbolic_out = strdup(row[1])) == NULL) {
+      error = GIT_ENOMEM;
+    }
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+// 1 if the ref has a log, 0 if not, or an error code
+static int has_log(mysql_refdb_backend *backend, MYSQL *db, const char *ref_name)
+{
+  MYSQL_RES *res;
+  int found;
+
+  if ((found = exec_sql(db, &res,
+      "SELECT 1 FROM `" GIT2_REFLOG_REFS_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+      backend->repo_id, ref_name)) < 0)
+    return found;
+
+  found = (mysql_num_rows(res) > 0);
+  mysql_free_result(res);
+  return found;
+}
+
+static int ensure_log(mysql_refdb_backend *backend, MYSQL *db, const char *ref_name)
+{
+  return exec_sql(db, NULL,
+    "INSERT IGNORE INTO `" GIT2_REFLOG_REFS_TABLE_NAME "` (`repo_id`, `name`) VALUES (%u, %s);",
+    backend->repo_id, ref_name);
+}
+
+// mirrors git's default of logging updates to branches, remote-tracking
+// branches, notes and HEAD, plus anything that already has a log; like
+// has_log, may return an error code
+static int should_log(mysql_refdb_backend *backend, MYSQL *db, const char *ref_name)
+{
+  if (!strcmp(ref_name, "HEAD") ||
+      !strncmp(ref_name, "refs/heads/", strlen("refs/heads/")) ||
+      !strncmp(ref_name, "refs/remotes/", strlen("refs/remotes/")) ||
+      !strncmp(ref_name, "refs/notes/", strlen("refs/notes/")))
+    return 1;
+
+  return has_log(backend, db, ref_name);
+}
+
+static int reflog_append(mysql_refdb_backend *backend, MYSQL *db, const char *ref_name,
+  const git_oid *old_id, const git_oid *new_id,
+  const git_signature *committer, const char *msg)
+{
+  int error;
+
+  if ((error = ensure_log(backend, db, ref_name)) < 0)
+    return error;
+
+  return exec_sql(db, NULL,
+    "INSERT INTO `" GIT2_REFLOG_TABLE_NAME "`"
+    "  (`repo_id`, `name`, `old`, `new`, `committer_name`, `committer_email`,"
+    "   `time`, `time_offset`, `message`)"
+    "  VALUES (%u, %s, %o, %o, %s, %s, %d, %d, %s);",
+    backend->repo_id, ref_name, old_id, new_id,
+    committer->name, committer->email,
+    (long long)committer->when.time, (long long)committer->when.offset, msg);
+}
+
+static int reflog_delete(mysql_refdb_backend *backend, MYSQL *db, const char *name)
+{
+  int error;
+
+  if ((error = exec_sql(db, NULL,
+      "DELETE FROM `" GIT2_REFLOG_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+      backend->repo_id, name)) < 0)
+    return error;
+
+  return exec_sql(db, NULL,
+    "DELETE FROM `" GIT2_REFLOG_REFS_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+    backend->repo_id, name);
+}
+
+static int reflog_rename(mysql_refdb_backend *backend, MYSQL *db,
+  const char *old_name, const char *new_name)
+{
+  int error;
+
+  if ((error = reflog_delete(backend, db, new_name)) < 0 ||
+      (error = exec_sql(db, NULL,
+        "UPDATE `" GIT2_REFLOG_TABLE_NAME "` SET `name` = %s"
+        "  WHERE `repo_id` = %u AND `name` = %s;",
+        new_name, backend->repo_id, old_name)) < 0)
+    return error;
+
+  return exec_sql(db, NULL,
+    "UPDATE `" GIT2_REFLOG_REFS_TABLE_NAME "` SET `name` = %s"
+    "  WHERE `repo_id` = %u AND `name` = %s;",
+    new_name, backend->repo_id, old_name);
+}
+
+static int check_old_value(git_ref_t cur_type, const git_oid *cur_oid, const char *cur_symbolic,
+  const git_oid *old_id, const char *old_target)
+{
+  if (old_id != NULL &&
+      (cur_type != GIT_REF_OID || git_oid_cmp(old_id, cur_oid) != 0))
+    goto modified;
+
+  if (old_target != NULL &&
+      (cur_type != GIT_REF_SYMBOLIC || strcmp(old_target, cur_symbolic) != 0))
+    goto modified;
+
+  return GIT_OK;
+
+modified:
+  giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+  return GIT_EMODIFIED;
+}
+
+// with `upsert` an existing row is overwritten, otherwise it makes the
+// INSERT fail with a duplicate key
+static int insert_ref(mysql_refdb_backend *backend, MYSQL *db,
+  const git_reference *ref, int upsert)
+{
+  const char *on_dup = upsert ?
+    " ON DUPLICATE KEY UPDATE `type` = VALUES(`type`), `target` = VALUES(`target`),"
+    " `peel` = VALUES(`peel`)" : "";
+
+  if (git_reference_type(ref) == GIT_REF_OID)
+    return exec_sql(db, NULL,
+      "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` (`repo_id`, `name`, `type`, `target`, `peel`)"
+      "  VALUES (%u, %s, %d, %o, %o)%r;",
+      backend->repo_id, git_reference_name(ref), (long long)GIT_REF_OID,
+      git_reference_target(ref), git_reference_target_peel(ref), on_dup);
+
+  return exec_sql(db, NULL,
+    "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` (`repo_id`, `name`, `type`, `target`, `peel`)"
+    "  VALUES (%u, %s, %d, %s, NULL)%r;",
+    backend->repo_id, git_reference_name(ref), (long long)GIT_REF_SYMBOLIC,
+    git_reference_symbolic_target(ref), on_dup);
+}
+
+static int write_ref(mysql_refdb_backend *backend, MYSQL *db,
+  const git_reference *ref, int force, const git_signature *who,
+  const char *message, const git_oid *old_id, const char *old_target)
+{
+  const char *ref_name = git_reference_name(ref);
+  git_ref_t ref_type = git_reference_type(ref);
+  git_ref_t cur_type = GIT_REF_INVALID, tgt_type;
+  git_oid cur_oid, new_oid;
+  char *cur_symbolic = NULL;
+  int error;
+
+  memset(&cur_oid, 0, sizeof(git_oid));
+  memset(&new_oid, 0, sizeof(git_oid));
+
+  if (ref_type != GIT_REF_OID && ref_type != GIT_REF_SYMBOLIC) {
+    giterr_set_str(GITERR_REFERENCE, "invalid reference type");
+    return GIT_ERROR;
+  }
+
+  if (ref_type == GIT_REF_OID)
+    git_oid_cpy(&new_oid, git_reference_target(ref));
+
+  if (!force && old_id == NULL && old_target == NULL) {
+    // creating a ref is a single INSERT; the primary key turns a race
+    // with another creator into a duplicate-key error
+    error = insert_ref(backend, db, ref, 0);
+
+    if (error < 0 && mysql_errno(db) == GIT2_ER_DUP_ENTRY) {
+      giterr_set_str(GITERR_REFERENCE,
+        "failed to write reference: a reference with that name already exists");
+      return GIT_EEXISTS;
+    }
+  } else {
+    if ((error = read_current(&cur_type, &cur_oid, &cur_symbolic,
+        backend, db, ref_name, 1)) < 0)
+      goto cleanup;
+
+    if (!force && cur_type != GIT_REF_INVALID) {
+      giterr_set_str(GITERR_REFERENCE,
+        "failed to write reference: a reference with that name already exists");
+      error = GIT_EEXISTS;
+      goto cleanup;
+    }
+
+    if ((error = check_old_value(cur_type, &cur_oid, cur_symbolic,
+        old_id, old_target)) < 0)
+      goto cleanup;
+
+    error = insert_ref(backend, db, ref, 1);
+  }
+
+  if (error < 0)
+    goto cleanup;
+
+  if (who == NULL || (error = should_log(backend, db, ref_name)) <= 0)
+    goto cleanup;
+
+  // log what a symbolic ref currently resolves to, one level deep
+  if (ref_type == GIT_REF_SYMBOLIC &&
+      (error = read_current(&tgt_type, &new_oid, NULL, backend, db,
+        git_reference_symbolic_target(ref), 0)) < 0)
+    goto cleanup;
+
+  error = reflog_append(backend, db, ref_name, &cur_oid, &new_oid, who, message);
+
+cleanup:
+  free(cur_symbolic);
+  return error;
+}
+
+static int mysql_refdb_backend__write(git_refdb_backend *_backend,
+  const git_reference *ref, int force, const git_signature *who,
+  const char *message, const git_oid *old_id, const char *old_target)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && ref);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, write_ref(backend, conn->db, ref, force, who,
+      message, old_id, old_target));
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int del_ref(mysql_refdb_backend *backend, MYSQL *db,
+  const char *ref_name, const git_oid *old_id, const char *old_target)
+{
+  git_ref_t cur_type;
+  git_oid cur_oid;
+  char *cur_symbolic = NULL;
+  int error;
+
+  if ((error = read_current(&cur_type, &cur_oid, &cur_symbolic,
+      backend, db, ref_name, 1)) < 0)
+    goto cleanup;
+
+  if (cur_type == GIT_REF_INVALID) {
+    giterr_set_str(GITERR_REFERENCE, "reference not found");
+    error = GIT_ENOTFOUND;
+    goto cleanup;
+  }
+
+  if ((error = check_old_value(cur_type, &cur_oid, cur_symbolic,
+      old_id, old_target)) < 0)
+    goto cleanup;
+
+  if ((error = exec_sql(db, NULL,
+      "DELETE FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+      backend->repo_id, ref_name)) < 0)
+    goto cleanup;
+
+  // like git, a deleted ref takes its log with it
+  error = reflog_delete(backend, db, ref_name);
+
+cleanup:
+  free(cur_symbolic);
+  return error;
+}
+
+static int mysql_refdb_backend__del(git_refdb_backend *_backend,
+  const char *ref_name, const git_oid *old_id, const char *old_target)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && ref_name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, del_ref(backend, conn->db, ref_name, old_id, old_target));
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int rename_ref(mysql_refdb_backend *backend, MYSQL *db,
+  const char *old_name, const char *new_name, int force,
+  const git_signature *who, const char *message)
+{
+  git_ref_t cur_type;
+  git_oid cur_oid;
+  int error;
+
+  if ((error = read_current(&cur_type, &cur_oid, NULL, backend, db, new_name, 1)) < 0)
+    return error;
+
+  if (cur_type != GIT_REF_INVALID) {
+    if (!force) {
+      giterr_set_str(GITERR_REFERENCE,
+        "failed to rename reference: a reference with that name already exists");
+      return GIT_EEXISTS;
+    }
+
+    if ((error = exec_sql(db, NULL,
+        "DELETE FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s;",
+        backend->repo_id, new_name)) < 0)
+      return error;
+  }
+
+  if ((error = read_current(&cur_type, &cur_oid, NULL, backend, db, old_name, 1)) < 0)
+    return error;
+
+  if (cur_type == GIT_REF_INVALID) {
+    giterr_set_str(GITERR_REFERENCE, "reference not found");
+    return GIT_ENOTFOUND;
+  }
+
+  if ((error = exec_sql(db, NULL,
+      "UPDATE `" GIT2_REFDB_TABLE_NAME "` SET `name` = %s"
+      "  WHERE `repo_id` = %u AND `name` = %s;",
+      new_name, backend->repo_id, old_name)) < 0 ||
+      (error = reflog_rename(backend, db, old_name, new_name)) < 0)
+    return error;
+
+  if (who != NULL && (error = should_log(backend, db, new_name)) > 0)
+    error = reflog_append(backend, db, new_name, &cur_oid, &cur_oid, who, message);
+
+  return error < 0 ? error : GIT_OK;
+}
+
+static int mysql_refdb_backend__rename(git_reference **out,
+  git_refdb_backend *_backend, const char *old_name, const char *new_name,
+  int force, const git_signature *who, const char *message)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(out && backend && old_name && new_name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, rename_ref(backend, conn->db, old_name, new_name,
+      force, who, message));
+
+  if (error == GIT_OK)
+    error = lookup(out, backend, conn->db, new_name);
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int mysql_refdb_backend__compress(git_refdb_backend *_backend)
+{
+  // there are no loose refs to pack
+  (void)_backend;
+  return GIT_OK;
+}
+
+static int mysql_refdb_backend__has_log(git_refdb_backend *_backend,
+  const char *refname)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int found;
+
+  assert(backend && refname);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  found = has_log(backend, conn->db, refname);
+
+  release(backend, conn, found);
+  return found;
+}
+
+static int mysql_refdb_backend__ensure_log(git_refdb_backend *_backend,
+  const char *refname)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && refname);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = ensure_log(backend, conn->db, refname);
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int reflog_read(git_reflog *log, mysql_refdb_backend *backend, MYSQL *db)
+{
+  git_oid old_id, new_id;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  int error;
+
+  // libgit2 keeps entries oldest first
+  if ((error = exec_sql(db, &res,
+      "SELECT `old`, `new`, `committer_name`, `committer_email`, `time`, `time_offset`, `message`"
+      "  FROM `" GIT2_REFLOG_TABLE_NAME "` WHERE `repo_id` = %u AND `name` = %s ORDER BY `id`;",
+      backend->repo_id, refdb_reflog_name(log))) < 0)
+    return error;
+
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (lengths[0] != GIT_OID_RAWSZ || lengths[1] != GIT_OID_RAWSZ)
+      continue;
+
+    git_oid_fromraw(&old_id, (const unsigned char *)row[0]);
+    git_oid_fromraw(&new_id, (const unsigned char *)row[1]);
+
+    if ((error = refdb_reflog_push(log, &old_id, &new_id, row[2], row[3],
+        strtoll(row[4], NULL, 10), atoi(row[5]), row[6])) < 0)
+      break;
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+static int mysql_refdb_backend__reflog_read(git_reflog **out,
+  git_refdb_backend *_backend, const char *name)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  git_reflog *log;
+  pool_conn *conn;
+  int error;
+
+  assert(out && backend && name);
+
+  if ((error = refdb_reflog_new(&log, name)) < 0)
+    return error;
+
+  if (pool_get(&conn, backend->pool) < 0) {
+    refdb_reflog_free(log);
+    return GIT_ERROR;
+  }
+
+  error = reflog_read(log, backend, conn->db);
+  release(backend, conn, error);
+
+  if (error < 0) {
+    refdb_reflog_free(log);
+    return error;
+  }
+
+  *out = log;
+  return GIT_OK;
+}
+
+static int reflog_write(mysql_refdb_backend *backend, MYSQL *db, git_reflog *reflog)
+{
+  const char *name = refdb_reflog_name(reflog);
+  const git_reflog_entry *entry;
+  size_t i;
+  int error;
+
+  if ((error = reflog_delete(backend, db, name)) < 0 ||
+      (error = ensure_log(backend, db, name)) < 0)
+    return error;
+
+  // index 0 is the newest entry; store oldest first
+  for (i = git_reflog_entrycount(reflog); i > 0; --i) {
+    entry = git_reflog_entry_byindex(reflog, i - 1);
+
+    if ((error = reflog_append(backend, db, name,
+        git_reflog_entry_id_old(entry),
+        git_reflog_entry_id_new(entry),
+        git_reflog_entry_committer(entry),
+        git_reflog_entry_message(entry))) < 0)
+      return error;
+  }
+
+  return GIT_OK;
+}
+
+static int mysql_refdb_backend__reflog_write(git_refdb_backend *_backend,
+  git_reflog *reflog)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && reflog);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, reflog_write(backend, conn->db, reflog));
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int mysql_refdb_backend__reflog_rename(git_refdb_backend *_backend,
+  const char *old_name, const char *new_name)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && old_name && new_name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, reflog_rename(backend, conn->db, old_name, new_name));
+
+  release(backend, conn, error);
+  return error;
+}
+
+static int mysql_refdb_backend__reflog_delete(git_refdb_backend *_backend,
+  const char *name)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend && name);
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((error = begin_write(conn->db)) == GIT_OK)
+    error = end_write(conn->db, reflog_delete(backend, conn->db, name));
+
+  release(backend, conn, error);
+  return error;
+}
+
+static void mysql_refdb_backend__free(git_refdb_backend *_backend)
+{
+  mysql_refdb_backend *backend = (mysql_refdb_backend *)_backend;
+  assert(backend);
+
+  pool_free(backend->pool);
+  free(backend);
+}
+
+static int init_db(MYSQL *db)
+{
+  // `target` holds the raw oid of a direct ref or the name a symbolic
+  // one points at
+  static const char *sql_create[] = {
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFDB_TABLE_NAME "` ("
+    "  `repo_id` bigint(20) unsigned NOT NULL,"
+    "  `name` varbinary(512) NOT NULL,"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `target` varbinary(512) NOT NULL,"
+    "  `peel` binary(20) NULL,"
+    "  PRIMARY KEY (`repo_id`, `name`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;",
+
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFLOG_REFS_TABLE_NAME "` ("
+    "  `repo_id` bigint(20) unsigned NOT NULL,"
+    "  `name` varbinary(512) NOT NULL,"
+    "  PRIMARY KEY (`repo_id`, `name`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;",
+
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFLOG_TABLE_NAME "` ("
+    "  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+    "  `repo_id` bigint(20) unsigned NOT NULL,"
+    "  `name` varbinary(512) NOT NULL,"
+    "  `old` binary(20) NOT NULL,"
+    "  `new` binary(20) NOT NULL,"
+    "  `committer_name` blob NOT NULL,"
+    "  `committer_email` blob NOT NULL,"
+    "  `time` bigint(20) NOT NULL,"
+    "  `time_offset` int(11) NOT NULL,"
+    "  `message` blob NULL,"
+    "  PRIMARY KEY (`id`),"
+    "  KEY `name` (`repo_id`, `name`, `id`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;",
+  };
+
+  size_t i;
+
+  for (i = 0; i < sizeof(sql_create) / sizeof(sql_create[0]); ++i)
+    if (mysql_real_query(db, sql_create[i], strlen(sql_create[i])) != 0)
+      return set_giterr_from_mysql(db);
+
+  return GIT_OK;
+}
+
+int git_refdb_backend_mysql(git_refdb_backend **backend_out,
+        git_odb_mysql_pool *pool, unsigned long long repo_id)
+{
+  mysql_refdb_backend *backend;
+  pool_conn *conn;
+  int error;
+
+  assert(backend_out && pool);
+
+  backend = calloc(1, sizeof(mysql_refdb_backend));
+  if (backend == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  pool_ref(pool);
+  backend->pool = pool;
+  backend->repo_id = repo_id;
+
+  if (pool_get(&conn, backend->pool) < 0) {
+    giterr_set_str(GITERR_REFERENCE, "failed to connect to the database");
+    mysql_refdb_backend__free((git_refdb_backend *)backend);
+    return GIT_ERROR;
+  }
+
+  error = init_db(conn->db);
+  release(backend, conn, error);
+  if (error < 0) {
+    mysql_refdb_backend__free((git_refdb_backend *)backend);
+    return error;
+  }
+
+  backend->parent.version = GIT_REFDB_BACKEND_VERSION;
+  backend->parent.exists = &mysql_refdb_backend__exists;
+  backend->parent.lookup = &mysql_refdb_backend__lookup;
+  backend->parent.iterator = &mysql_refdb_backend__iterator;
+  backend->parent.write = &mysql_refdb_backend__write;
+  backend->parent.rename = &mysql_refdb_backend__rename;
+  backend->parent.del = &mysql_refdb_backend__del;
+  backend->parent.compress = &mysql_refdb_backend__compress;
+  backend->parent.has_log = &mysql_refdb_backend__has_log;
+  backend->parent.ensure_log = &mysql_refdb_backend__ensure_log;
+  backend->parent.free = &mysql_refdb_backend__free;
+  backend->parent.reflog_read = &mysql_refdb_backend__reflog_read;
+  backend->parent.reflog_write = &mysql_refdb_backend__reflog_write;
+  backend->parent.reflog_rename = &mysql_refdb_backend__reflog_rename;
+  backend->parent.reflog_delete = &mysql_refdb_backend__reflog_delete;
+
+  *backend_out = (git_refdb_backend *)backend;
+  return GIT_OK;
+}
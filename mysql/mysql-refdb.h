@@ -0,0 +1,21 @@
+#ifndef INCLUDE_git_refdb_mysql_h__
+#define INCLUDE_git_refdb_mysql_h__
+
+#include <git2.h>
+#include <git2/sys/refdb_backend.h>
+#include "mysql-odb.h"
+
+/*
+ * A refdb keeping refs and reflogs in MySQL, with one set of tables
+ * shared by every repository and keyed by `repo_id`.  It takes its
+ * connections from `pool`, which may be the pool an odb backend uses;
+ * the backend holds a reference to it.
+ *
+ * Updates that check the old value lock the ref's row for the length
+ * of their transaction.  When two writers collide on a lock,
+ * the loser gets GIT_ELOCKED and may retry.
+ */
+int git_refdb_backend_mysql(git_refdb_backend **backend_out,
+        git_odb_mysql_pool *pool, unsigned long long repo_id);
+
+#endif
@@ -24,9 +24,19 @@
  */
 
 #include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <git2.h>
 #include <git2/odb_backend.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "mysql-odb.h"
+#include "codec.h"
+#include "pool.h"
 
 /* MySQL C Api docs:
  *   http://dev.mysql.com/doc/refman/5.1/en/c-api-function-overview.html
@@ -37,26 +47,104 @@
 #include <mysql.h>
 
 #define GIT2_TABLE_NAME "git2_odb"
+// objects of every repository sharing a table, keyed by `repo_id`
+#define GIT2_SHARED_TABLE_NAME "git2_odb_shared"
+// pieces of objects still being streamed in, keyed by a random stream id
+#define GIT2_CHUNKS_TABLE_NAME "git2_odb_chunks"
 #define GIT2_STORAGE_ENGINE "InnoDB"
 
+// number of ids bound to the batch read statement
+#define GIT2_READ_BATCH 256
+
+// number of ids foreach lists per query
+#define GIT2_FOREACH_BATCH 10000
+
+// upper bound for one multi-row INSERT, whatever max_allowed_packet allows
+#define GIT2_WRITEPACK_MAX_BATCH (16 * 1024 * 1024)
+
+// streams send their data to the server in pieces of this size
+#define GIT2_STREAM_CHUNK (1024 * 1024)
+
+// connections in the pool unless the options say otherwise
+#define GIT2_POOL_SIZE 4
+
+// a duplicate write or exists() re-stamps `created` on a row older than
+// this many seconds, so a sweep running meanwhile keeps it; sweeps add
+// as much to their grace period
+#define GIT2_FRESHEN_SECONDS 60
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#define GIT2_FRESHEN_SQL \
+  " ON DUPLICATE KEY UPDATE `created` =" \
+  "  IF(`created` < NOW() - INTERVAL " XSTR(GIT2_FRESHEN_SECONDS) " SECOND, NOW(), `created`)"
+
 typedef struct {
   git_odb_backend parent;
-  MYSQL *db;
-  MYSQL_STMT *st_read;
-  MYSQL_STMT *st_write;
-  MYSQL_STMT *st_read_header;
+  conn_pool *pool;
+  char *sql[POOL_ST__COUNT];
+  git_odb_mysql_codec codec;
+  int level;
+  // in a shared table every query is limited to the backend's repository;
+  // prepared statements take the id as their last parameter, and
+  // plain queries append repo_where or repo_and
+  const char *table;
+  int shared;
+  unsigned long long repo_id;
+  char repo_where[64];
+  char repo_and[64];
+  // exists() re-stamps what it finds, for sweeps
+  int freshen;
 } mysql_backend;
 
-int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+typedef struct {
+  git_odb_stream parent;
+  // the connection the data goes out on as it comes, or NULL when it
+  // goes to the chunk table GIT2_STREAM_CHUNK bytes at a time
+  pool_conn *conn;
+  unsigned long long stream_id;
+  unsigned int seq;
+  char *buf;
+  size_t buf_len;
+  EVP_MD_CTX *hash_ctx;
+  git_oid oid;
+  git_otype type;
+  unsigned long long size;
+  unsigned char codec;
+  size_t written;
+  codec_stream *compress;
+  MYSQL_BIND bind_buffers[6];
+  unsigned long oid_len;
+  unsigned long empty_len;
+} mysql_writestream;
+
+// each connection prepares its statements the first time it needs them
+static MYSQL_STMT *backend_stmt(mysql_backend *backend, pool_conn *conn, int slot)
+{
+  return pool_stmt(conn, slot, backend->sql[slot]);
+}
+
+// the repository id always goes after a statement's other parameters;
+// statements on the unshared table don't have a placeholder for it, and
+// libmysql ignores binds past the statement's parameter count
+static void bind_repo(MYSQL_BIND *bind, const unsigned long long *repo_id)
+{
+  bind->buffer = (void *)repo_id;
+  bind->buffer_type = MYSQL_TYPE_LONGLONG;
+  bind->is_unsigned = 1;
+}
+
+static int read_header(MYSQL_STMT *st, size_t *len_p, git_otype *type_p, const git_oid *oid,
+  const unsigned long long *repo_id)
 {
-  mysql_backend *backend;
   int error;
-  MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[1];
+  MYSQL_BIND bind_buffers[2];
+  MYSQL_BIND result_buffers[2];
 
-  assert(len_p && type_p && _backend && oid);
+  if (st == NULL)
+    return GIT_ERROR;
 
-  backend = (mysql_backend *)_backend;
   error = GIT_ERROR;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
@@ -67,19 +155,20 @@ int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
-    return 0;
+  bind_repo(&bind_buffers[1], repo_id);
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0)
+    return GIT_ERROR;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_execute(st) != 0)
+    return GIT_ERROR;
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_store_result(st) != 0)
+    return GIT_ERROR;
 
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+  if (mysql_stmt_num_rows(st) == 1) {
     result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
     result_buffers[0].buffer = type_p;
     result_buffers[0].buffer_length = sizeof(type_p);
@@ -90,11 +179,11 @@ int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend
     result_buffers[1].buffer_length = sizeof(len_p);
     memset(len_p, 0, sizeof(len_p));
 
-    if(mysql_stmt_bind_result(backend->st_read_header, result_buffers) != 0)
+    if(mysql_stmt_bind_result(st, result_buffers) != 0)
       return GIT_ERROR;
 
     // this should populate the buffers at *type_p and *len_p
-    if(mysql_stmt_fetch(backend->st_read_header) != 0)
+    if(mysql_stmt_fetch(st) != 0)
       return GIT_ERROR;
 
     error = GIT_SUCCESS;
@@ -103,23 +192,45 @@ int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_reset(st) != 0)
+    return GIT_ERROR;
 
   return error;
 }
 
-int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+int mysql_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
 {
   mysql_backend *backend;
+  pool_conn *conn;
   int error;
-  MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[3];
-  unsigned long data_len;
 
   assert(len_p && type_p && _backend && oid);
 
   backend = (mysql_backend *)_backend;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = read_header(backend_stmt(backend, conn, POOL_ST_READ_HEADER), len_p, type_p, oid,
+    &backend->repo_id);
+
+  pool_put(backend->pool, conn, error == GIT_ENOTFOUND ? GIT_SUCCESS : error);
+  return error;
+}
+
+static int read_object(MYSQL_STMT *st, void **data_p, size_t *len_p, git_otype *type_p, const git_oid *oid,
+  const unsigned long long *repo_id)
+{
+  int error;
+  MYSQL_BIND bind_buffers[2];
+  MYSQL_BIND result_buffers[4];
+  unsigned long data_len;
+  unsigned char codec;
+  void *stored;
+
+  if (st == NULL)
+    return GIT_ERROR;
+
   error = GIT_ERROR;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
@@ -130,19 +241,20 @@ int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0)
-    return 0;
+  bind_repo(&bind_buffers[1], repo_id);
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0)
+    return GIT_ERROR;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read) != 0)
-    return 0;
+  if (mysql_stmt_execute(st) != 0)
+    return GIT_ERROR;
 
-  if (mysql_stmt_store_result(backend->st_read) != 0)
-    return 0;
+  if (mysql_stmt_store_result(st) != 0)
+    return GIT_ERROR;
 
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read) == 1) {
+  if (mysql_stmt_num_rows(st) == 1) {
     result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
     result_buffers[0].buffer = type_p;
     result_buffers[0].buffer_length = sizeof(type_p);
@@ -153,55 +265,262 @@ int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb
     result_buffers[1].buffer_length = sizeof(len_p);
     memset(len_p, 0, sizeof(len_p));
 
+    result_buffers[2].buffer_type = MYSQL_TYPE_TINY;
+    result_buffers[2].buffer = &codec;
+    result_buffers[2].buffer_length = sizeof(codec);
+
     // by setting buffer and buffer_length to 0, this tells libmysql
     // we want it to set data_len to the *actual* length of that field
     // this way we can malloc exactly as much memory as we need for the buffer
-    //
-    // come to think of it, we can probably just use the length set in *len_p
-    // once we fetch the result?
-    result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
-    result_buffers[2].buffer = 0;
-    result_buffers[2].buffer_length = 0;
-    result_buffers[2].length = &data_len;
-
-    if(mysql_stmt_bind_result(backend->st_read, result_buffers) != 0)
+    result_buffers[3].buffer_type = MYSQL_TYPE_LONG_BLOB;
+    result_buffers[3].buffer = 0;
+    result_buffers[3].buffer_length = 0;
+    result_buffers[3].length = &data_len;
+
+    if(mysql_stmt_bind_result(st, result_buffers) != 0)
       return GIT_ERROR;
 
-    // this should populate the buffers at *type_p, *len_p and &data_len
-    error = mysql_stmt_fetch(backend->st_read);
+    // this should populate the buffers at *type_p, *len_p, &codec and &data_len
+    error = mysql_stmt_fetch(st);
     // if(error != 0 || error != MYSQL_DATA_TRUNCATED)
     //   return GIT_ERROR;
 
-    if (data_len > 0) {
-      *data_p = malloc(data_len);
-      result_buffers[2].buffer = *data_p;
-      result_buffers[2].buffer_length = data_len;
+    stored = malloc(data_len ? data_len : 1);
+    *data_p = malloc(*len_p ? *len_p : 1);
+    if (stored == NULL || *data_p == NULL) {
+      free(stored);
+      free(*data_p);
+      mysql_stmt_reset(st);
+      return GIT_ENOMEM;
+    }
 
-      if (mysql_stmt_fetch_column(backend->st_read, &result_buffers[2], 2, 0) != 0)
-        return GIT_ERROR;
+    result_buffers[3].buffer = stored;
+    result_buffers[3].buffer_length = data_len;
+
+    // rows carry the codec they were written with, so decompression
+    // happens here rather than in an UNCOMPRESS() on the server
+    if ((data_len > 0 &&
+         mysql_stmt_fetch_column(st, &result_buffers[3], 3, 0) != 0) ||
+        codec_decode(*data_p, *len_p, (git_odb_mysql_codec)codec, stored, data_len) < 0) {
+      free(stored);
+      free(*data_p);
+      mysql_stmt_reset(st);
+      return GIT_ERROR;
     }
 
+    free(stored);
     error = GIT_SUCCESS;
   } else {
     error = GIT_ENOTFOUND;
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read) != 0)
-    return 0;
+  if (mysql_stmt_reset(st) != 0)
+    return GIT_ERROR;
 
   return error;
 }
 
-int mysql_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+int mysql_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
 {
   mysql_backend *backend;
-  int found;
-  MYSQL_BIND bind_buffers[1];
+  pool_conn *conn;
+  int error;
 
-  assert(_backend && oid);
+  assert(data_p && len_p && type_p && _backend && oid);
+
+  backend = (mysql_backend *)_backend;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = read_object(backend_stmt(backend, conn, POOL_ST_READ), data_p, len_p, type_p, oid,
+    &backend->repo_id);
+
+  pool_put(backend->pool, conn, error == GIT_ENOTFOUND ? GIT_SUCCESS : error);
+  return error;
+}
+
+// one object of a read_batch chunk, decoded and waiting for the callback
+typedef struct {
+  git_oid oid;
+  git_otype type;
+  size_t len;
+  void *data;
+} read_batch_row;
+
+// Fetches one chunk of up to GIT2_READ_BATCH objects into `rows`, which
+// has room for that many; the caller frees each row's data.
+static int read_batch_chunk(MYSQL_STMT *st, const git_oid *oids, size_t n,
+  const unsigned long long *repo_id, read_batch_row *rows, size_t *count_out)
+{
+  MYSQL_BIND bind_buffers[GIT2_READ_BATCH + 1];
+  MYSQL_BIND result_buffers[5];
+  MYSQL_RES *meta;
+  unsigned long oid_len = 20, result_oid_len, data_len, data_max, i;
+  unsigned char codec;
+  unsigned long long size;
+  git_oid oid;
+  signed char type;
+  void *stored = NULL, *object;
+  size_t count = 0;
+  int error = GIT_ERROR, fetch;
+
+  if (st == NULL)
+    return GIT_ERROR;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  // short batches repeat their last id, which IN () doesn't mind
+  for (i = 0; i < GIT2_READ_BATCH; ++i) {
+    const git_oid *id = &oids[i < n ? i : n - 1];
+    bind_buffers[i].buffer = (void *)id->id;
+    bind_buffers[i].buffer_length = 20;
+    bind_buffers[i].length = &oid_len;
+    bind_buffers[i].buffer_type = MYSQL_TYPE_BLOB;
+  }
+  bind_repo(&bind_buffers[GIT2_READ_BATCH], repo_id);
+
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+      mysql_stmt_execute(st) != 0 ||
+      mysql_stmt_store_result(st) != 0)
+    goto cleanup;
+
+  // max_length of the data column covers every row we got back, so a
+  // single buffer takes each blob without a second fetch
+  if ((meta = mysql_stmt_result_metadata(st)) == NULL)
+    goto cleanup;
+  data_max = mysql_fetch_field_direct(meta, 4)->max_length;
+  mysql_free_result(meta);
+
+  stored = malloc(data_max ? data_max : 1);
+  if (stored == NULL) {
+    error = GIT_ENOMEM;
+    goto cleanup;
+  }
+
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = oid.id;
+  result_buffers[0].buffer_length = 20;
+  result_buffers[0].length = &result_oid_len;
+
+  result_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  result_buffers[1].buffer = &type;
+  result_buffers[1].buffer_length = sizeof(type);
+
+  result_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  result_buffers[2].buffer = &size;
+  result_buffers[2].buffer_length = sizeof(size);
+
+  result_buffers[3].buffer_type = MYSQL_TYPE_TINY;
+  result_buffers[3].buffer = &codec;
+  result_buffers[3].buffer_length = sizeof(codec);
+
+  result_buffers[4].buffer_type = MYSQL_TYPE_LONG_BLOB;
+  result_buffers[4].buffer = stored;
+  result_buffers[4].buffer_length = data_max;
+  result_buffers[4].length = &data_len;
+
+  if (mysql_stmt_bind_result(st, result_buffers) != 0)
+    goto cleanup;
+
+  error = GIT_SUCCESS;
+  while (error == GIT_SUCCESS && count < GIT2_READ_BATCH &&
+      (fetch = mysql_stmt_fetch(st)) == 0) {
+    // each object gets its own buffer sized from `size`, since the
+    // callbacks only run once the connection is back in the pool
+    object = malloc(size + 1);
+    if (object == NULL) {
+      error = GIT_ENOMEM;
+      break;
+    }
+
+    if (codec == GIT_ODB_MYSQL_CODEC_NONE && data_len == size)
+      memcpy(object, stored, data_len);
+    else if (codec_decode(object, size, (git_odb_mysql_codec)codec, stored, data_len) < 0) {
+      free(object);
+      error = GIT_ERROR;
+      break;
+    }
+
+    git_oid_cpy(&rows[count].oid, &oid);
+    rows[count].type = (git_otype)type;
+    rows[count].len = (size_t)size;
+    rows[count].data = object;
+    count++;
+  }
+
+  // IN () returns each row once, so there can't be more than asked for
+  if (error == GIT_SUCCESS && count == GIT2_READ_BATCH)
+    fetch = mysql_stmt_fetch(st);
+  if (error == GIT_SUCCESS && fetch != MYSQL_NO_DATA)
+    error = GIT_ERROR;
+
+cleanup:
+  mysql_stmt_free_result(st);
+  mysql_stmt_reset(st);
+  free(stored);
+  *count_out = count;
+  return error;
+}
+
+// Reads `n` objects with one round trip per GIT2_READ_BATCH of them.
+// Missing objects are skipped; rows come back in no particular order.
+// Each chunk is fetched whole and its connection put back before `cb`
+// sees any of it, so the callback can use the backend itself.
+int git_odb_backend_mysql_read_batch(git_odb_backend *_backend,
+        const git_oid *oids, size_t n, git_odb_mysql_read_cb cb, void *payload)
+{
+  mysql_backend *backend;
+  pool_conn *conn;
+  read_batch_row *rows;
+  size_t i, j, chunk, count;
+  int error = GIT_SUCCESS;
+
+  assert(_backend && (oids || !n) && cb);
 
   backend = (mysql_backend *)_backend;
+
+  rows = malloc(GIT2_READ_BATCH * sizeof(read_batch_row));
+  if (rows == NULL)
+    return GIT_ENOMEM;
+
+  for (i = 0; error == GIT_SUCCESS && i < n; i += chunk) {
+    chunk = (n - i < GIT2_READ_BATCH) ? n - i : GIT2_READ_BATCH;
+
+    if (pool_get(&conn, backend->pool) < 0) {
+      error = GIT_ERROR;
+      break;
+    }
+
+    error = read_batch_chunk(backend_stmt(backend, conn, POOL_ST_READ_BATCH),
+      oids + i, chunk, &backend->repo_id, rows, &count);
+
+    pool_put(backend->pool, conn, error);
+
+    for (j = 0; j < count; ++j) {
+      if (error == GIT_SUCCESS &&
+          cb(&rows[j].oid, rows[j].data, rows[j].len, rows[j].type, payload) != 0)
+        error = GIT_EUSER;
+      free(rows[j].data);
+    }
+  }
+
+  free(rows);
+  return error;
+}
+
+// 1 if the object is there, 0 if it isn't and -1 on errors
+static int exists(MYSQL_STMT *st, const git_oid *oid, const unsigned long long *repo_id)
+{
+  int found;
+  MYSQL_BIND bind_buffers[2];
+
+  if (st == NULL)
+    return -1;
+
   found = 0;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
@@ -211,233 +530,1640 @@ int mysql_backend__exists(git_odb_backend *_backend, const git_oid *oid)
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
-    return 0;
+  bind_repo(&bind_buffers[1], repo_id);
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0)
+    return -1;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_execute(st) != 0)
+    return -1;
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_store_result(st) != 0)
+    return -1;
 
   // now lets see if any rows matched our query
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+  if (mysql_stmt_num_rows(st) == 1) {
     found = 1;
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
-    return 0;
+  if (mysql_stmt_reset(st) != 0)
+    return -1;
 
   return found;
 }
 
-int mysql_backend__write(git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+// re-stamps `created` on a stale row; libgit2 doesn't write an object
+// that exists, so a duplicate write only ever gets as far as exists()
+static int freshen(MYSQL_STMT *st, const git_oid *oid, const unsigned long long *repo_id)
 {
-  int error;
-  mysql_backend *backend;
-  MYSQL_BIND bind_buffers[4];
-  my_ulonglong affected_rows;
+  MYSQL_BIND bind_buffers[2];
+  int error = GIT_SUCCESS;
 
-  assert(oid && _backend && data);
-
-  backend = (mysql_backend *)_backend;
-
-  if ((error = git_odb_hash(oid, data, len, type)) < 0)
-    return error;
+  if (st == NULL)
+    return GIT_ERROR;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
-  // bind the oid
   bind_buffers[0].buffer = (void*)oid->id;
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  bind_repo(&bind_buffers[1], repo_id);
 
-  // bind the type
-  bind_buffers[1].buffer = &type;
-  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+      mysql_stmt_execute(st) != 0)
+    error = GIT_ERROR;
 
-  // bind the size of the data
-  bind_buffers[2].buffer = &len;
-  bind_buffers[2].buffer_type = MYSQL_TYPE_LONG;
+  if (mysql_stmt_reset(st) != 0)
+    error = GIT_ERROR;
 
-  // bind the data
-  bind_buffers[3].buffer = (void*)data;
-  bind_buffers[3].buffer_length = len;
-  bind_buffers[3].length = &bind_buffers[3].buffer_length;
-  bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+  return error;
+}
 
-  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0)
-    return GIT_ERROR;
+int mysql_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_backend *backend;
+  pool_conn *conn;
+  int found;
 
-  // TODO: use the streaming backend API so this actually makes sense to use :P
-  // once we want to use this we should comment out 
-  // if (mysql_stmt_send_long_data(backend->st_write, 2, data, len) != 0)
-  //   return GIT_ERROR;
+  assert(_backend && oid);
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_write) != 0)
-    return GIT_ERROR;
+  backend = (mysql_backend *)_backend;
 
-  // now lets see if the insert worked
-  affected_rows = mysql_stmt_affected_rows(backend->st_write);
-  if (affected_rows != 1)
-    return GIT_ERROR;
+  if (pool_get(&conn, backend->pool) < 0)
+    return 0;
 
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
-    return GIT_ERROR;
+  found = exists(backend_stmt(backend, conn, POOL_ST_READ_HEADER), oid, &backend->repo_id);
 
-  return GIT_SUCCESS;
+  // the object is there either way, so a failed re-stamp (say on a
+  // read-only replica) only costs the grace period it would have bought
+  if (found > 0 && backend->freshen)
+    freshen(backend_stmt(backend, conn, POOL_ST_FRESHEN), oid, &backend->repo_id);
+
+  pool_put(backend->pool, conn, found < 0 ? GIT_ERROR : GIT_SUCCESS);
+  return found > 0;
 }
 
-void mysql_backend__free(git_odb_backend *_backend)
+// fills in the smallest and largest raw ids starting with the first
+// `len` hex digits of short_oid
+static void prefix_range(git_oid *lo, git_oid *hi, const git_oid *short_oid, unsigned int len)
 {
-  mysql_backend *backend;
-  assert(_backend);
-  backend = (mysql_backend *)_backend;
+  unsigned int i;
 
-  if (backend->st_read)
-    mysql_stmt_close(backend->st_read);
-  if (backend->st_read_header)
-    mysql_stmt_close(backend->st_read_header);
-  if (backend->st_write)
-    mysql_stmt_close(backend->st_write);
+  memset(lo->id, 0x00, 20);
+  memset(hi->id, 0xff, 20);
 
-  mysql_close(backend->db);
+  memcpy(lo->id, short_oid->id, len / 2);
+  memcpy(hi->id, short_oid->id, len / 2);
 
-  free(backend);
+  if (len % 2) {
+    i = len / 2;
+    lo->id[i] = short_oid->id[i] & 0xf0;
+    hi->id[i] = short_oid->id[i] | 0x0f;
+  }
 }
 
-static int create_table(MYSQL *db)
+// resolves a prefix with a range scan on the primary key; two rows is
+// all it takes to know the prefix is ambiguous
+static int find_prefix(git_oid *out, MYSQL_STMT *st, const git_oid *short_oid, unsigned int len,
+  const unsigned long long *repo_id)
 {
-  static const char *sql_create =
-    "CREATE TABLE `" GIT2_TABLE_NAME "` ("
-    "  `oid` binary(20) NOT NULL DEFAULT '',"
-    "  `type` tinyint(1) unsigned NOT NULL,"
-    "  `size` bigint(20) unsigned NOT NULL,"
-    "  `data` longblob NOT NULL,"
-    "  PRIMARY KEY (`oid`),"
-    "  KEY `type` (`type`),"
-    "  KEY `size` (`size`)"
-    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  MYSQL_BIND bind_buffers[3];
+  MYSQL_BIND result_buffers[1];
+  unsigned long oid_len = 20, result_len;
+  git_oid lo, hi;
+  my_ulonglong num_rows;
+  int error = GIT_ERROR;
 
-  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+  if (st == NULL)
     return GIT_ERROR;
 
-  return GIT_SUCCESS;
-}
+  prefix_range(&lo, &hi, short_oid, len);
 
-static int init_db(MYSQL *db)
-{
-  static const char *sql_check =
-    "SHOW TABLES LIKE '" GIT2_TABLE_NAME "';";
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
 
-  MYSQL_RES *res;
-  int error;
-  my_ulonglong num_rows;
+  bind_buffers[0].buffer = lo.id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &oid_len;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-  if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
-    return GIT_ERROR;
+  bind_buffers[1].buffer = hi.id;
+  bind_buffers[1].buffer_length = 20;
+  bind_buffers[1].length = &oid_len;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
 
-  res = mysql_store_result(db);
-  if (res == NULL)
-    return GIT_ERROR;
+  bind_repo(&bind_buffers[2], repo_id);
 
-  num_rows = mysql_num_rows(res);
+  if (mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+      mysql_stmt_execute(st) != 0 ||
+      mysql_stmt_store_result(st) != 0)
+    goto cleanup;
+
+  num_rows = mysql_stmt_num_rows(st);
   if (num_rows == 0) {
-    /* the table was not found */
-    error = create_table(db);
-  } else if (num_rows > 0) {
-    /* the table was found */
-    error = GIT_SUCCESS;
-  } else {
-    error = GIT_ERROR;
+    error = GIT_ENOTFOUND;
+    goto cleanup;
+  }
+  if (num_rows > 1) {
+    error = GIT_EAMBIGUOUS;
+    goto cleanup;
   }
 
-  mysql_free_result(res);
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = out->id;
+  result_buffers[0].buffer_length = 20;
+  result_buffers[0].length = &result_len;
+
+  if (mysql_stmt_bind_result(st, result_buffers) == 0 &&
+      mysql_stmt_fetch(st) == 0 && result_len == 20)
+    error = GIT_SUCCESS;
+
+cleanup:
+  mysql_stmt_free_result(st);
+  mysql_stmt_reset(st);
   return error;
 }
 
-static int init_statements(mysql_backend *backend)
+int mysql_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
+        const git_oid *short_oid, unsigned int len)
 {
-  my_bool truth = 1;
-
-  static const char *sql_read =
-    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+  mysql_backend *backend;
+  pool_conn *conn;
+  git_oid found;
+  int error;
 
-  static const char *sql_read_header =
-    "SELECT `type`, `size` FROM `" GIT2_TABLE_NAME "` WHERE `oid` = ?;";
+  assert(out_oid && data_p && len_p && type_p && _backend && short_oid);
 
-  static const char *sql_write =
-    "INSERT IGNORE INTO `" GIT2_TABLE_NAME "` VALUES (?, ?, ?, COMPRESS(?));";
+  backend = (mysql_backend *)_backend;
 
+  if (len >= GIT_OID_HEXSZ) {
+    // just match the full identifier
+    error = mysql_backend__read(data_p, len_p, type_p, _backend, short_oid);
+    if (error == GIT_SUCCESS)
+      git_oid_cpy(out_oid, short_oid);
+    return error;
+  }
 
-  backend->st_read = mysql_stmt_init(backend->db);
-  if (backend->st_read == NULL)
+  if (pool_get(&conn, backend->pool) < 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_attr_set(backend->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  error = find_prefix(&found, backend_stmt(backend, conn, POOL_ST_PREFIX), short_oid, len,
+    &backend->repo_id);
+  if (error == GIT_SUCCESS)
+    error = read_object(backend_stmt(backend, conn, POOL_ST_READ), data_p, len_p, type_p, &found,
+      &backend->repo_id);
+  if (error == GIT_SUCCESS)
+    git_oid_cpy(out_oid, &found);
 
-  if (mysql_stmt_prepare(backend->st_read, sql_read, strlen(sql_read)) != 0)
-    return GIT_ERROR;
+  pool_put(backend->pool, conn, (error == GIT_ENOTFOUND || error == GIT_EAMBIGUOUS) ? GIT_SUCCESS : error);
+  return error;
+}
 
+// Lists the ids in batches of GIT2_FOREACH_BATCH, each starting after
+// the last id of the one before, and calls `cb` once the batch's
+// connection is back in the pool, so a callback that reads objects
+// doesn't need a second connection and a slow one holds none.
+int mysql_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+  mysql_backend *backend;
+  char sql[320];
+  char hex[GIT_OID_HEXSZ + 1] = "";
+  pool_conn *conn;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid *oids;
+  size_t count, i;
+  int error = GIT_SUCCESS;
 
-  backend->st_read_header = mysql_stmt_init(backend->db);
-  if (backend->st_read_header == NULL)
-    return GIT_ERROR;
+  assert(_backend && cb);
 
-  if (mysql_stmt_attr_set(backend->st_read_header, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  backend = (mysql_backend *)_backend;
 
-  if (mysql_stmt_prepare(backend->st_read_header, sql_read_header, strlen(sql_read)) != 0)
-    return GIT_ERROR;
+  oids = malloc(GIT2_FOREACH_BATCH * sizeof(git_oid));
+  if (oids == NULL)
+    return GIT_ENOMEM;
 
+  do {
+    // X'' is the empty string, which sorts before every id
+    snprintf(sql, sizeof(sql),
+      "SELECT `oid` FROM `%s` WHERE `oid` > X'%s'%s ORDER BY `oid` LIMIT %d;",
+      backend->table, hex, backend->repo_and, GIT2_FOREACH_BATCH);
 
-  backend->st_write = mysql_stmt_init(backend->db);
-  if (backend->st_write == NULL)
-    return GIT_ERROR;
+    if (pool_get(&conn, backend->pool) < 0) {
+      error = GIT_ERROR;
+      break;
+    }
 
-  if (mysql_stmt_attr_set(backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+    if (mysql_real_query(conn->db, sql, strlen(sql)) != 0 ||
+        (res = mysql_store_result(conn->db)) == NULL) {
+      pool_put(backend->pool, conn, GIT_ERROR);
+      error = GIT_ERROR;
+      break;
+    }
 
-  if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_read)) != 0)
-    return GIT_ERROR;
+    count = 0;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+      lengths = mysql_fetch_lengths(res);
+      if (lengths[0] != GIT_OID_RAWSZ)
+        continue;
+      git_oid_fromraw(&oids[count++], (const unsigned char *)row[0]);
+    }
 
+    mysql_free_result(res);
+    pool_put(backend->pool, conn, GIT_SUCCESS);
 
-  return GIT_SUCCESS;
+    for (i = 0; i < count; ++i) {
+      if (cb(&oids[i], payload) != 0) {
+        error = GIT_EUSER;
+        break;
+      }
+    }
+
+    if (count > 0) {
+      git_oid_fmt(hex, &oids[count - 1]);
+      hex[GIT_OID_HEXSZ] = '\0';
+    }
+  } while (error == GIT_SUCCESS && count == GIT2_FOREACH_BATCH);
+
+  free(oids);
+  return error;
 }
 
-int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+int mysql_backend__write(git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+{
+  int error;
+  mysql_backend *backend;
+  pool_conn *conn;
+  MYSQL_STMT *st;
+  MYSQL_BIND bind_buffers[6];
+  my_ulonglong affected_rows;
+  unsigned char codec;
+  unsigned long long size;
+  void *encoded;
+  size_t encoded_len;
+
+  assert(oid && _backend && data);
+
+  backend = (mysql_backend *)_backend;
+
+  if ((error = git_odb_hash(oid, data, len, type)) < 0)
+    return error;
+
+  if (codec_encode(&encoded, &encoded_len, backend->codec, backend->level, data, len) < 0)
+    return GIT_ERROR;
+
+  codec = (unsigned char)backend->codec;
+  size = len;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  // bind the oid
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  // bind the type
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+
+  // bind the size of the data
+  bind_buffers[2].buffer = &size;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+
+  // bind the codec the data is compressed with
+  bind_buffers[3].buffer = &codec;
+  bind_buffers[3].buffer_type = MYSQL_TYPE_TINY;
+
+  // bind the data
+  bind_buffers[4].buffer = encoded;
+  bind_buffers[4].buffer_length = encoded_len;
+  bind_buffers[4].length = &bind_buffers[4].buffer_length;
+  bind_buffers[4].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_repo(&bind_buffers[5], &backend->repo_id);
+
+  // large objects should go through mysql_backend__writestream, which
+  // sends the data in chunks with mysql_stmt_send_long_data
+
+  if (pool_get(&conn, backend->pool) < 0) {
+    free(encoded);
+    return GIT_ERROR;
+  }
+
+  // execute the statement
+  error = GIT_ERROR;
+  st = backend_stmt(backend, conn, POOL_ST_WRITE);
+  if (st != NULL &&
+      mysql_stmt_bind_param(st, bind_buffers) == 0 &&
+      mysql_stmt_execute(st) == 0) {
+    // now lets see if the insert worked; an object that was already
+    // there reports 2 rows if it was re-stamped and 0 if it wasn't
+    affected_rows = mysql_stmt_affected_rows(st);
+    if (affected_rows <= 2)
+      error = GIT_SUCCESS;
+  }
+
+  // reset the statement for further use
+  if (st != NULL && mysql_stmt_reset(st) != 0)
+    error = GIT_ERROR;
+
+  pool_put(backend->pool, conn, error);
+  free(encoded);
+  return error;
+}
+
+int mysql_writestream__write(git_odb_stream *_stream, const char *data, size_t len)
+{
+  mysql_writestream *stream;
+
+  assert(_stream && (data || !len));
+
+  stream = (mysql_writestream *)_stream;
+
+  if (stream->written + len > stream->size)
+    return GIT_ERROR;
+
+  if (len == 0)
+    return GIT_SUCCESS;
+
+  if (EVP_DigestUpdate(stream->hash_ctx, data, len) != 1)
+    return GIT_ERROR;
+
+  if (codec_stream_write(stream->compress, data, len) < 0)
+    return GIT_ERROR;
+
+  stream->written += len;
+  return GIT_SUCCESS;
+}
+
+// takes a connection from the pool for a single chunk, so a stream
+// doesn't hold on to one while the caller produces the data
+static int flush_chunk(mysql_writestream *stream)
+{
+  mysql_backend *backend = (mysql_backend *)stream->parent.backend;
+  MYSQL_BIND bind_buffers[3];
+  unsigned long buf_len = stream->buf_len;
+  pool_conn *conn;
+  MYSQL_STMT *st;
+  int error = GIT_ERROR;
+
+  if (stream->buf_len == 0)
+    return GIT_SUCCESS;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  bind_buffers[0].buffer = &stream->stream_id;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_LONGLONG;
+  bind_buffers[0].is_unsigned = 1;
+
+  bind_buffers[1].buffer = &stream->seq;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_LONG;
+  bind_buffers[1].is_unsigned = 1;
+
+  bind_buffers[2].buffer = stream->buf;
+  bind_buffers[2].buffer_length = buf_len;
+  bind_buffers[2].length = &buf_len;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  st = backend_stmt(backend, conn, POOL_ST_WRITE_CHUNK);
+  if (st != NULL &&
+      mysql_stmt_bind_param(st, bind_buffers) == 0 &&
+      mysql_stmt_execute(st) == 0)
+    error = GIT_SUCCESS;
+
+  if (st != NULL && mysql_stmt_reset(st) != 0)
+    error = GIT_ERROR;
+
+  pool_put(backend->pool, conn, error);
+  if (error < 0)
+    return error;
+
+  stream->seq++;
+  stream->buf_len = 0;
+  return GIT_SUCCESS;
+}
+
+static int mysql_writestream__send(const void *data, size_t len, void *payload)
+{
+  mysql_writestream *stream = payload;
+  size_t n;
+
+  // the server appends each chunk to the `data` parameter, so neither
+  // side ever needs the whole object in a single packet
+  if (stream->conn != NULL)
+    return mysql_stmt_send_long_data(stream->conn->st[POOL_ST_WRITE_STREAM], 4, data, len) != 0 ? -1 : 0;
+
+  while (len > 0) {
+    if (stream->buf_len == GIT2_STREAM_CHUNK && flush_chunk(stream) < 0)
+      return -1;
+
+    n = GIT2_STREAM_CHUNK - stream->buf_len;
+    if (n > len)
+      n = len;
+
+    memcpy(stream->buf + stream->buf_len, data, n);
+    stream->buf_len += n;
+    data = (const char *)data + n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int writestream_execute(MYSQL_STMT *st)
+{
+  // the oid parameter was bound to stream->oid when the stream was
+  // opened; libmysql only reads it now
+  if (mysql_stmt_execute(st) != 0)
+    return GIT_ERROR;
+
+  // zero or two rows means the object was already there, which is fine
+  if (mysql_stmt_affected_rows(st) > 2)
+    return GIT_ERROR;
+
+  return GIT_SUCCESS;
+}
+
+static int discard_chunks(MYSQL *db, unsigned long long stream_id)
+{
+  char sql[128];
+
+  snprintf(sql, sizeof(sql),
+    "DELETE FROM `" GIT2_CHUNKS_TABLE_NAME "` WHERE `stream` = %llu;", stream_id);
+
+  return mysql_real_query(db, sql, strlen(sql)) != 0 ? GIT_ERROR : GIT_SUCCESS;
+}
+
+// Feeds the chunks back to the write statement as its long data, one
+// at a time so no packet is bigger than a chunk, and drops them once
+// the row is in.  The data goes over the wire twice, but a connection
+// is only held here, while nothing waits on the caller.
+static int writestream_assemble(mysql_writestream *stream)
+{
+  mysql_backend *backend = (mysql_backend *)stream->parent.backend;
+  pool_conn *conn;
+  MYSQL_STMT *st;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  char sql[160];
+  unsigned int seq;
+  int error = GIT_ERROR;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  if ((st = backend_stmt(backend, conn, POOL_ST_WRITE_STREAM)) == NULL)
+    goto done;
+
+  if (mysql_stmt_bind_param(st, stream->bind_buffers) != 0)
+    goto reset;
+
+  for (seq = 0; seq < stream->seq; ++seq) {
+    snprintf(sql, sizeof(sql),
+      "SELECT `data` FROM `" GIT2_CHUNKS_TABLE_NAME "` WHERE `stream` = %llu AND `seq` = %u;",
+      stream->stream_id, seq);
+
+    if (mysql_real_query(conn->db, sql, strlen(sql)) != 0 ||
+        (res = mysql_store_result(conn->db)) == NULL)
+      goto reset;
+
+    row = mysql_fetch_row(res);
+    lengths = row ? mysql_fetch_lengths(res) : NULL;
+    if (row == NULL || mysql_stmt_send_long_data(st, 4, row[0], lengths[0]) != 0) {
+      mysql_free_result(res);
+      goto reset;
+    }
+    mysql_free_result(res);
+  }
+
+  if ((error = writestream_execute(st)) == GIT_SUCCESS)
+    error = discard_chunks(conn->db, stream->stream_id);
+
+reset:
+  // throw away any long data the server is still holding for us
+  mysql_stmt_reset(st);
+done:
+  pool_put(backend->pool, conn, error);
+  return error;
+}
+
+int mysql_writestream__finalize_write(git_oid *oid_p, git_odb_stream *_stream)
+{
+  mysql_writestream *stream;
+  unsigned int hash_len;
+  int error;
+
+  assert(oid_p && _stream);
+
+  stream = (mysql_writestream *)_stream;
+
+  if (stream->written != stream->size)
+    return GIT_ERROR;
+
+  if (EVP_DigestFinal_ex(stream->hash_ctx, stream->oid.id, &hash_len) != 1 ||
+      hash_len != 20)
+    return GIT_ERROR;
+
+  // flush whatever the compressor is still holding on to
+  if (codec_stream_finish(stream->compress) < 0)
+    return GIT_ERROR;
+
+  if (stream->conn != NULL)
+    error = writestream_execute(stream->conn->st[POOL_ST_WRITE_STREAM]);
+  else if ((error = flush_chunk(stream)) == GIT_SUCCESS)
+    error = writestream_assemble(stream);
+
+  if (error < 0)
+    return error;
+
+  // the chunks went away with the row going in
+  stream->seq = 0;
+  git_oid_cpy(oid_p, &stream->oid);
+  return GIT_SUCCESS;
+}
+
+void mysql_writestream__free(git_odb_stream *_stream)
+{
+  mysql_writestream *stream;
+  mysql_backend *backend;
+  pool_conn *conn;
+
+  assert(_stream);
+
+  stream = (mysql_writestream *)_stream;
+  backend = (mysql_backend *)_stream->backend;
+
+  // throw away any long data the server is still holding for us
+  if (stream->conn != NULL)
+    mysql_stmt_reset(stream->conn->st[POOL_ST_WRITE_STREAM]);
+
+  // drop whatever an abandoned stream sent; if this fails, the sweep
+  // drops it once it is older than the grace period
+  if (stream->seq > 0 && pool_get(&conn, backend->pool) == 0)
+    pool_put(backend->pool, conn, discard_chunks(conn->db, stream->stream_id));
+
+  codec_stream_free(stream->compress);
+  EVP_MD_CTX_free(stream->hash_ctx);
+  free(stream->buf);
+  free(stream);
+}
+
+// opens a stream that sends its data on `conn`, which stays the
+// caller's, as it comes.  Without a connection the compressed data goes
+// into the chunk table under a random stream id, a connection per chunk,
+// and finalize_write puts the row together from there, so a stream that
+// is still being written doesn't keep a connection from everyone else.
+static int writestream_open(mysql_writestream **stream_out, mysql_backend *backend,
+  pool_conn *conn, size_t len, git_otype type)
+{
+  mysql_writestream *stream;
+  MYSQL_STMT *st = NULL;
+  char header[64];
+  int header_len;
+
+  if (conn != NULL && (st = backend_stmt(backend, conn, POOL_ST_WRITE_STREAM)) == NULL)
+    return GIT_ERROR;
+
+  stream = calloc(1, sizeof(mysql_writestream));
+  if (stream == NULL)
+    return GIT_ENOMEM;
+
+  if (conn == NULL &&
+      ((stream->buf = malloc(GIT2_STREAM_CHUNK)) == NULL ||
+       RAND_bytes((unsigned char *)&stream->stream_id, sizeof(stream->stream_id)) != 1)) {
+    free(stream->buf);
+    free(stream);
+    return GIT_ERROR;
+  }
+
+  stream->parent.backend = (git_odb_backend *)backend;
+  stream->conn = conn;
+  stream->parent.mode = GIT_STREAM_WRONLY;
+  stream->parent.write = &mysql_writestream__write;
+  stream->parent.finalize_write = &mysql_writestream__finalize_write;
+  stream->parent.free = &mysql_writestream__free;
+  stream->type = type;
+  stream->size = len;
+  stream->codec = (unsigned char)backend->codec;
+
+  if (codec_stream_new(&stream->compress, backend->codec, backend->level,
+      &mysql_writestream__send, stream) < 0)
+    goto cleanup;
+
+  // git hashes "<type> <size>\0" followed by the contents
+  header_len = snprintf(header, sizeof(header), "%s %lu",
+    git_object_type2string(type), (unsigned long)len) + 1;
+
+  stream->hash_ctx = EVP_MD_CTX_new();
+  if (stream->hash_ctx == NULL ||
+      EVP_DigestInit_ex(stream->hash_ctx, EVP_sha1(), NULL) != 1 ||
+      EVP_DigestUpdate(stream->hash_ctx, header, header_len) != 1)
+    goto cleanup;
+
+  // bind the oid, filled in by finalize_write
+  stream->oid_len = 20;
+  stream->bind_buffers[0].buffer = stream->oid.id;
+  stream->bind_buffers[0].buffer_length = 20;
+  stream->bind_buffers[0].length = &stream->oid_len;
+  stream->bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  // bind the type
+  stream->bind_buffers[1].buffer = &stream->type;
+  stream->bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+
+  // bind the size of the data
+  stream->bind_buffers[2].buffer = &stream->size;
+  stream->bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+
+  // bind the codec the data is compressed with
+  stream->bind_buffers[3].buffer = &stream->codec;
+  stream->bind_buffers[3].buffer_type = MYSQL_TYPE_TINY;
+
+  // bind the data; this is what an empty object ends up as, anything
+  // else arrives through mysql_stmt_send_long_data
+  stream->empty_len = 0;
+  stream->bind_buffers[4].buffer = "";
+  stream->bind_buffers[4].buffer_length = 0;
+  stream->bind_buffers[4].length = &stream->empty_len;
+  stream->bind_buffers[4].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_repo(&stream->bind_buffers[5], &backend->repo_id);
+
+  if (st != NULL && mysql_stmt_bind_param(st, stream->bind_buffers) != 0)
+    goto cleanup;
+
+  *stream_out = stream;
+  return GIT_SUCCESS;
+
+cleanup:
+  codec_stream_free(stream->compress);
+  EVP_MD_CTX_free(stream->hash_ctx);
+  free(stream->buf);
+  free(stream);
+  return GIT_ERROR;
+}
+
+int mysql_backend__writestream(git_odb_stream **stream_out, git_odb_backend *_backend, size_t len, git_otype type)
+{
+  mysql_backend *backend;
+  mysql_writestream *stream;
+  int error;
+
+  assert(stream_out && _backend);
+
+  backend = (mysql_backend *)_backend;
+
+  if ((error = writestream_open(&stream, backend, NULL, len, type)) < 0)
+    return error;
+
+  *stream_out = (git_odb_stream *)stream;
+  return GIT_SUCCESS;
+}
+
+typedef struct {
+  git_odb_writepack parent;
+  git_indexer_stream *indexer;
+  char *path;
+} mysql_writepack;
+
+typedef struct {
+  mysql_backend *backend;
+  pool_conn *conn;
+  git_odb_backend *pack;
+  char *sql;
+  size_t sql_len;
+  size_t sql_max;
+  size_t head_len;
+  size_t rows;
+  int error;
+} mysql_writepack_batch;
+
+static void remove_dir(const char *path)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char file[4096];
+
+  if ((dir = opendir(path)) != NULL) {
+    while ((entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      unlink(file);
+    }
+    closedir(dir);
+  }
+
+  rmdir(path);
+}
+
+static int max_allowed_packet(MYSQL *db, size_t *out)
+{
+  static const char *sql = "SELECT @@max_allowed_packet;";
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if (mysql_real_query(db, sql, strlen(sql)) != 0)
+    return GIT_ERROR;
+
+  res = mysql_store_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  row = mysql_fetch_row(res);
+  *out = row && row[0] ? (size_t)strtoull(row[0], NULL, 10) : 0;
+  mysql_free_result(res);
+
+  return *out ? GIT_SUCCESS : GIT_ERROR;
+}
+
+static int batch_flush(mysql_writepack_batch *batch)
+{
+  MYSQL *db = batch->conn->db;
+
+  if (batch->rows == 0)
+    return GIT_SUCCESS;
+
+  // sql_max leaves room for this
+  memcpy(batch->sql + batch->sql_len, GIT2_FRESHEN_SQL, sizeof(GIT2_FRESHEN_SQL) - 1);
+  batch->sql_len += sizeof(GIT2_FRESHEN_SQL) - 1;
+
+  // one statement and one commit for the whole batch
+  if (mysql_real_query(db, batch->sql, batch->sql_len) != 0 ||
+      mysql_commit(db) != 0)
+    return GIT_ERROR;
+
+  batch->sql_len = batch->head_len;
+  batch->rows = 0;
+  return GIT_SUCCESS;
+}
+
+// objects that don't fit in a batch on their own go through the
+// streaming statement, which sends them in pieces
+static int write_large_object(mysql_writepack_batch *batch, const void *data, size_t len, git_otype type)
+{
+  mysql_writestream *stream;
+  git_odb_stream *_stream;
+  git_oid oid;
+  size_t chunk, i;
+  int error;
+
+  if ((error = writestream_open(&stream, batch->backend, batch->conn, len, type)) < 0)
+    return error;
+
+  _stream = (git_odb_stream *)stream;
+  for (i = 0; error == GIT_SUCCESS && i < len; i += chunk) {
+    chunk = (len - i < GIT2_STREAM_CHUNK) ? len - i : GIT2_STREAM_CHUNK;
+    error = _stream->write(_stream, (const char *)data + i, chunk);
+  }
+
+  if (error == GIT_SUCCESS)
+    error = _stream->finalize_write(&oid, _stream);
+
+  _stream->free(_stream);
+  return error;
+}
+
+static int batch_add(const git_oid *oid, void *payload)
+{
+  mysql_writepack_batch *batch = payload;
+  mysql_backend *backend = batch->backend;
+  void *data = NULL, *encoded = NULL;
+  size_t len, encoded_len, row_max, i;
+  git_otype type;
+  char *p;
+  int error;
+
+  if ((error = batch->pack->read(&data, &len, &type, batch->pack, oid)) < 0)
+    goto done;
+
+  if ((error = codec_encode(&encoded, &encoded_len, backend->codec, backend->level, data, len)) < 0)
+    goto done;
+
+  // ",(X'<oid>',<type>,<size>,<codec>,COMPRESS('<escaped data>'),<repo>)"
+  row_max = 2 + 3 + GIT_OID_HEXSZ + 1 + 4 * 21 + 12 + 2 * encoded_len + 3;
+
+  if (batch->sql_len + row_max > batch->sql_max) {
+    if ((error = batch_flush(batch)) < 0)
+      goto done;
+
+    if (batch->sql_len + row_max > batch->sql_max) {
+      error = write_large_object(batch, data, len, type);
+      goto done;
+    }
+  }
+
+  p = batch->sql + batch->sql_len;
+  if (batch->rows > 0)
+    *p++ = ',';
+
+  p += sprintf(p, "(X'");
+  for (i = 0; i < 20; ++i)
+    p += sprintf(p, "%02x", oid->id[i]);
+  p += sprintf(p, "',%d,%lu,%d,%s'", (int)type, (unsigned long)len, (int)backend->codec,
+    backend->codec == GIT_ODB_MYSQL_CODEC_SERVER ? "COMPRESS(" : "");
+
+  p += mysql_real_escape_string(batch->conn->db, p, encoded, encoded_len);
+  p += sprintf(p, "'%s", backend->codec == GIT_ODB_MYSQL_CODEC_SERVER ? ")" : "");
+  if (backend->shared)
+    p += sprintf(p, ",%llu", backend->repo_id);
+  *p++ = ')';
+
+  batch->sql_len = p - batch->sql;
+  batch->rows++;
+
+done:
+  free(encoded);
+  free(data);
+
+  if (error < 0) {
+    batch->error = error;
+    return 1;
+  }
+  return 0;
+}
+
+int mysql_writepack__add(git_odb_writepack *_writepack, const void *data, size_t size, git_transfer_progress *stats)
+{
+  mysql_writepack *writepack;
+
+  assert(_writepack && stats);
+
+  writepack = (mysql_writepack *)_writepack;
+  return git_indexer_stream_add(writepack->indexer, data, size, stats);
+}
+
+int mysql_writepack__commit(git_odb_writepack *_writepack, git_transfer_progress *stats)
+{
+  mysql_writepack *writepack;
+  mysql_writepack_batch batch;
+  char idx_path[4096], hex[GIT_OID_HEXSZ + 1];
+  size_t packet;
+  int error;
+
+  assert(_writepack && stats);
+
+  writepack = (mysql_writepack *)_writepack;
+  memset(&batch, 0, sizeof(batch));
+  batch.backend = (mysql_backend *)_writepack->backend;
+
+  // let libgit2 resolve the deltas into a pack and index on disk, so
+  // every object can be read back whole
+  if ((error = git_indexer_stream_finalize(writepack->indexer, stats)) < 0)
+    return error;
+
+  git_oid_fmt(hex, git_indexer_stream_hash(writepack->indexer));
+  hex[GIT_OID_HEXSZ] = '\0';
+  snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", writepack->path, hex);
+
+  if ((error = git_odb_backend_one_pack(&batch.pack, idx_path)) < 0)
+    return error;
+
+  if (pool_get(&batch.conn, batch.backend->pool) < 0) {
+    batch.pack->free(batch.pack);
+    return GIT_ERROR;
+  }
+
+  if ((error = max_allowed_packet(batch.conn->db, &packet)) < 0)
+    goto cleanup;
+
+  // leave some room for the packet header and the escaping estimate
+  batch.sql_max = packet > 1024 ? packet - 1024 : packet;
+  if (batch.sql_max > GIT2_WRITEPACK_MAX_BATCH)
+    batch.sql_max = GIT2_WRITEPACK_MAX_BATCH;
+
+  batch.sql = malloc(batch.sql_max + sizeof(GIT2_FRESHEN_SQL));
+  if (batch.sql == NULL) {
+    error = GIT_ENOMEM;
+    goto cleanup;
+  }
+
+  batch.sql_len = batch.head_len = sprintf(batch.sql,
+    "INSERT INTO `%s` (`oid`, `type`, `size`, `codec`, `data`%s) VALUES ",
+    batch.backend->table, batch.backend->shared ? ", `repo_id`" : "");
+
+  if (mysql_autocommit(batch.conn->db, 0) != 0) {
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  error = batch.pack->foreach(batch.pack, &batch_add, &batch);
+  if (batch.error < 0)
+    error = batch.error;
+
+  if (error == GIT_SUCCESS)
+    error = batch_flush(&batch);
+
+  // objects are content-addressed, so a failed batch only leaves behind
+  // rows a retry would have inserted anyway
+  if (error < 0)
+    mysql_rollback(batch.conn->db);
+
+  mysql_autocommit(batch.conn->db, 1);
+
+cleanup:
+  pool_put(batch.backend->pool, batch.conn, error);
+  free(batch.sql);
+  batch.pack->free(batch.pack);
+  return error;
+}
+
+void mysql_writepack__free(git_odb_writepack *_writepack)
+{
+  mysql_writepack *writepack;
+
+  assert(_writepack);
+
+  writepack = (mysql_writepack *)_writepack;
+
+  git_indexer_stream_free(writepack->indexer);
+  if (writepack->path) {
+    remove_dir(writepack->path);
+    free(writepack->path);
+  }
+  free(writepack);
+}
+
+int mysql_backend__writepack(git_odb_writepack **out, git_odb_backend *_backend,
+        git_transfer_progress_callback progress_cb, void *progress_payload)
+{
+  mysql_writepack *writepack;
+  const char *tmpdir;
+
+  assert(out && _backend);
+
+  writepack = calloc(1, sizeof(mysql_writepack));
+  if (writepack == NULL)
+    return GIT_ENOMEM;
+
+  writepack->parent.backend = _backend;
+  writepack->parent.add = &mysql_writepack__add;
+  writepack->parent.commit = &mysql_writepack__commit;
+  writepack->parent.free = &mysql_writepack__free;
+
+  if ((tmpdir = getenv("TMPDIR")) == NULL)
+    tmpdir = "/tmp";
+
+  writepack->path = malloc(strlen(tmpdir) + sizeof("/git2-mysql-XXXXXX"));
+  if (writepack->path == NULL) {
+    free(writepack);
+    return GIT_ENOMEM;
+  }
+
+  sprintf(writepack->path, "%s/git2-mysql-XXXXXX", tmpdir);
+  if (mkdtemp(writepack->path) == NULL) {
+    free(writepack->path);
+    free(writepack);
+    return GIT_ERROR;
+  }
+
+  if (git_indexer_stream_new(&writepack->indexer, writepack->path, progress_cb, progress_payload) < 0) {
+    mysql_writepack__free((git_odb_writepack *)writepack);
+    return GIT_ERROR;
+  }
+
+  *out = (git_odb_writepack *)writepack;
+  return GIT_SUCCESS;
+}
+
+// rows re-stamped since they were listed are kept
+static int delete_oids(mysql_backend *backend, MYSQL *db, const git_oid *oids, size_t count,
+  unsigned long long grace_seconds)
+{
+  static const char hex[] = "0123456789abcdef";
+  char *sql, *p;
+  size_t i, j;
+  int error;
+
+  // every id goes in as X'<40 hex digits>',
+  sql = malloc(128 + strlen(backend->table) + count * (GIT_OID_HEXSZ + 4) + sizeof(backend->repo_and));
+  if (sql == NULL)
+    return GIT_ENOMEM;
+
+  p = sql + sprintf(sql, "DELETE FROM `%s` WHERE `oid` IN (", backend->table);
+  for (i = 0; i < count; ++i) {
+    *p++ = 'X';
+    *p++ = '\'';
+    for (j = 0; j < 20; ++j) {
+      *p++ = hex[oids[i].id[j] >> 4];
+      *p++ = hex[oids[i].id[j] & 0xf];
+    }
+    *p++ = '\'';
+    *p++ = (i + 1 < count) ? ',' : ')';
+  }
+  p += sprintf(p, " AND `created` < NOW() - INTERVAL %llu SECOND%s",
+    grace_seconds, backend->repo_and);
+
+  error = (mysql_real_query(db, sql, p - sql) == 0) ? GIT_SUCCESS : GIT_ERROR;
+  free(sql);
+  return error;
+}
+
+// Sweep phase of a garbage collection (see gc/gc.h): deletes every row
+// older than grace_seconds that is_reachable doesn't claim, with one
+// DELETE (and so one InnoDB transaction) per batch_size rows.  The
+// grace period is widened by GIT2_FRESHEN_SECONDS.
+static int sweep(mysql_backend *backend, MYSQL *db,
+        int (*is_reachable)(const git_oid *, void *), void *payload,
+        unsigned int grace_seconds, size_t batch_size)
+{
+  unsigned long long grace = (unsigned long long)grace_seconds + GIT2_FRESHEN_SECONDS;
+  char sql[256];
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid *unreachable = NULL, *grown, oid;
+  size_t len = 0, alloc = 0, i;
+  int error = GIT_SUCCESS;
+
+  if (batch_size == 0)
+    batch_size = 1000;
+
+  snprintf(sql, sizeof(sql),
+    "SELECT `oid` FROM `%s`"
+    "  WHERE `created` < NOW() - INTERVAL %llu SECOND%s;",
+    backend->table, grace, backend->repo_and);
+
+  if (mysql_real_query(db, sql, strlen(sql)) != 0)
+    return GIT_ERROR;
+
+  // stream the candidates instead of buffering the whole table
+  res = mysql_use_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (lengths[0] != 20)
+      continue;
+
+    memcpy(oid.id, row[0], 20);
+    if (is_reachable(&oid, payload))
+      continue;
+
+    if (len == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      grown = realloc(unreachable, alloc * sizeof(git_oid));
+      if (grown == NULL) {
+        error = GIT_ENOMEM;
+        break;
+      }
+      unreachable = grown;
+    }
+
+    git_oid_cpy(&unreachable[len++], &oid);
+  }
+
+  // drain whatever is left so the connection is usable again
+  while (row != NULL)
+    row = mysql_fetch_row(res);
+
+  if (error == GIT_SUCCESS && mysql_errno(db) != 0)
+    error = GIT_ERROR;
+
+  mysql_free_result(res);
+
+  for (i = 0; error == GIT_SUCCESS && i < len; i += batch_size)
+    error = delete_oids(backend, db, unreachable + i,
+      (len - i < batch_size) ? len - i : batch_size, grace);
+
+  free(unreachable);
+
+  // streams no writer finished or discarded, e.g. because it crashed;
+  // one still being written keeps getting newer chunks
+  snprintf(sql, sizeof(sql),
+    "DELETE c FROM `" GIT2_CHUNKS_TABLE_NAME "` c"
+    "  JOIN (SELECT `stream` FROM `" GIT2_CHUNKS_TABLE_NAME "` GROUP BY `stream`"
+    "    HAVING MAX(`created`) < NOW() - INTERVAL %llu SECOND) s USING (`stream`);",
+    grace);
+
+  if (error == GIT_SUCCESS && mysql_real_query(db, sql, strlen(sql)) != 0)
+    error = GIT_ERROR;
+
+  return error;
+}
+
+int git_odb_backend_mysql_sweep(git_odb_backend *_backend,
+        int (*is_reachable)(const git_oid *, void *), void *payload,
+        unsigned int grace_seconds, size_t batch_size)
+{
+  mysql_backend *backend;
+  pool_conn *conn;
+  int error;
+
+  assert(_backend && is_reachable);
+
+  backend = (mysql_backend *)_backend;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = sweep(backend, conn->db, is_reachable, payload, grace_seconds, batch_size);
+
+  pool_put(backend->pool, conn, error);
+  return error;
+}
+
+static int recompress_row(mysql_backend *backend, MYSQL_STMT *st_update,
+  MYSQL_ROW row, unsigned long *lengths)
+{
+  MYSQL_BIND bind_buffers[3];
+  unsigned long long size;
+  unsigned char codec;
+  void *data, *encoded = NULL;
+  size_t encoded_len;
+  int error = GIT_ERROR;
+
+  size = strtoull(row[1], NULL, 10);
+  if ((data = malloc(size ? size : 1)) == NULL)
+    return GIT_ENOMEM;
+
+  if (codec_decode(data, size, (git_odb_mysql_codec)atoi(row[2]), row[3], lengths[3]) < 0 ||
+      codec_encode(&encoded, &encoded_len, backend->codec, backend->level, data, size) < 0)
+    goto cleanup;
+
+  codec = (unsigned char)backend->codec;
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  bind_buffers[0].buffer = &codec;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+
+  bind_buffers[1].buffer = encoded;
+  bind_buffers[1].buffer_length = encoded_len;
+  bind_buffers[1].length = &bind_buffers[1].buffer_length;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_buffers[2].buffer = row[0];
+  bind_buffers[2].buffer_length = lengths[0];
+  bind_buffers[2].length = &bind_buffers[2].buffer_length;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
+
+  if (mysql_stmt_bind_param(st_update, bind_buffers) == 0 &&
+      mysql_stmt_execute(st_update) == 0)
+    error = GIT_SUCCESS;
+
+cleanup:
+  free(encoded);
+  free(data);
+  return error;
+}
+
+// Rewrites rows stored with another codec in the backend's own codec,
+// one transaction per batch_size rows.  `codec` isn't indexed, so the
+// batches walk the primary key, each starting after the last oid of the
+// one before, instead of scanning the table from the start every time.
+static int recompress(mysql_backend *backend, MYSQL *db,
+        size_t max_rows, size_t batch_size, size_t *converted_out)
+{
+  MYSQL_STMT *st_update;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  char sql[320], sql_update[256];
+  char after[sizeof(" AND `oid` > X''") + GIT_OID_HEXSZ] = "";
+  char hex[GIT_OID_HEXSZ + 1];
+  git_oid last;
+  size_t converted = 0, batch, wanted;
+  int error = GIT_SUCCESS;
+
+  if (batch_size == 0)
+    batch_size = 100;
+
+  snprintf(sql_update, sizeof(sql_update),
+    "UPDATE `%s` SET `codec` = ?, `data` = %s WHERE `oid` = ?%s;", backend->table,
+    (backend->codec == GIT_ODB_MYSQL_CODEC_SERVER) ? "COMPRESS(?)" : "?", backend->repo_and);
+
+  st_update = mysql_stmt_init(db);
+  if (st_update == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(st_update, sql_update, strlen(sql_update)) != 0) {
+    mysql_stmt_close(st_update);
+    return GIT_ERROR;
+  }
+
+  while (error == GIT_SUCCESS && (max_rows == 0 || converted < max_rows)) {
+    batch = batch_size;
+    if (max_rows != 0 && max_rows - converted < batch)
+      batch = max_rows - converted;
+
+    snprintf(sql, sizeof(sql),
+      "SELECT `oid`, `size`, `codec`, `data` FROM `%s`"
+      "  WHERE `codec` <> %d%s%s ORDER BY `oid` LIMIT %lu FOR UPDATE;", backend->table,
+      (int)backend->codec, backend->repo_and, after, (unsigned long)batch);
+    wanted = batch;
+
+    if (mysql_autocommit(db, 0) != 0) {
+      error = GIT_ERROR;
+      break;
+    }
+
+    // the rows are updated while we walk them, so they have to be
+    // buffered on the client first
+    if (mysql_real_query(db, sql, strlen(sql)) != 0 ||
+        (res = mysql_store_result(db)) == NULL) {
+      mysql_rollback(db);
+      error = GIT_ERROR;
+      break;
+    }
+
+    batch = 0;
+    while (error == GIT_SUCCESS && (row = mysql_fetch_row(res)) != NULL) {
+      lengths = mysql_fetch_lengths(res);
+      if (lengths[0] != GIT_OID_RAWSZ) {
+        error = GIT_ERROR;
+        break;
+      }
+      git_oid_fromraw(&last, (const unsigned char *)row[0]);
+      error = recompress_row(backend, st_update, row, lengths);
+      batch++;
+    }
+
+    mysql_free_result(res);
+
+    if (error == GIT_SUCCESS && mysql_commit(db) == 0)
+      converted += batch;
+    else {
+      mysql_rollback(db);
+      error = GIT_ERROR;
+    }
+
+    if (batch < wanted)
+      break;
+
+    git_oid_fmt(hex, &last);
+    hex[GIT_OID_HEXSZ] = '\0';
+    snprintf(after, sizeof(after), " AND `oid` > X'%s'", hex);
+  }
+
+  mysql_autocommit(db, 1);
+  mysql_stmt_close(st_update);
+
+  *converted_out = converted;
+  return error;
+}
+
+int git_odb_backend_mysql_recompress(git_odb_backend *_backend,
+        size_t max_rows, size_t batch_size, size_t *converted_out)
+{
+  mysql_backend *backend;
+  pool_conn *conn;
+  int error;
+
+  assert(_backend && converted_out);
+
+  backend = (mysql_backend *)_backend;
+
+  if (pool_get(&conn, backend->pool) < 0)
+    return GIT_ERROR;
+
+  error = recompress(backend, conn->db, max_rows, batch_size, converted_out);
+
+  pool_put(backend->pool, conn, error);
+  return error;
+}
+
+void mysql_backend__free(git_odb_backend *_backend)
+{
+  mysql_backend *backend;
+  int i;
+  assert(_backend);
+  backend = (mysql_backend *)_backend;
+
+  // closes every connection along with its statements, unless other
+  // backends still use the pool
+  pool_free(backend->pool);
+
+  for (i = 0; i < POOL_ST__COUNT; ++i)
+    free(backend->sql[i]);
+  free(backend);
+}
+
+static int create_table(MYSQL *db)
+{
+  static const char *sql_create =
+    "CREATE TABLE `" GIT2_TABLE_NAME "` ("
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `size` bigint(20) unsigned NOT NULL,"
+    "  `codec` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+    "  `data` longblob NOT NULL,"
+    "  `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+    "  PRIMARY KEY (`oid`),"
+    "  KEY `type` (`type`),"
+    "  KEY `size` (`size`),"
+    "  KEY `created` (`created`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+    return GIT_ERROR;
+
+  return GIT_SUCCESS;
+}
+
+static int add_column(MYSQL *db, const char *column, const char *sql_alter)
+{
+  char sql_check[128];
+  MYSQL_RES *res;
+  my_ulonglong num_rows;
+
+  snprintf(sql_check, sizeof(sql_check),
+    "SHOW COLUMNS FROM `" GIT2_TABLE_NAME "` LIKE '%s';", column);
+
+  if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
+    return GIT_ERROR;
+
+  res = mysql_store_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  num_rows = mysql_num_rows(res);
+  mysql_free_result(res);
+
+  if (num_rows > 0)
+    return GIT_SUCCESS;
+
+  if (mysql_real_query(db, sql_alter, strlen(sql_alter)) != 0)
+    return GIT_ERROR;
+
+  return GIT_SUCCESS;
+}
+
+static int upgrade_table(MYSQL *db)
+{
+  // tables from before the sweep grace period existed lack `created`;
+  // the ALTER stamps their rows with the current time, so the first sweep
+  // after upgrading only collects them once the grace period has passed
+  static const char *sql_add_created =
+    "ALTER TABLE `" GIT2_TABLE_NAME "`"
+    "  ADD COLUMN `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+    "  ADD KEY `created` (`created`);";
+
+  // all rows in older tables went through COMPRESS(), which is codec 0
+  static const char *sql_add_codec =
+    "ALTER TABLE `" GIT2_TABLE_NAME "`"
+    "  ADD COLUMN `codec` tinyint(1) unsigned NOT NULL DEFAULT 0 AFTER `size`;";
+
+  if (add_column(db, "created", sql_add_created) < 0)
+    return GIT_ERROR;
+
+  return add_column(db, "codec", sql_add_codec);
+}
+
+// one table for every repository, clustered by repository so each one's
+// objects sit together in the buffer pool
+static int create_shared_table(MYSQL *db, unsigned int partitions)
+{
+  char sql_create[1024], partition[64] = "";
+
+  if (partitions)
+    snprintf(partition, sizeof(partition),
+      " PARTITION BY KEY (`repo_id`) PARTITIONS %u", partitions);
+
+  snprintf(sql_create, sizeof(sql_create),
+    "CREATE TABLE IF NOT EXISTS `" GIT2_SHARED_TABLE_NAME "` ("
+    "  `repo_id` bigint(20) unsigned NOT NULL,"
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `size` bigint(20) unsigned NOT NULL,"
+    "  `codec` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+    "  `data` longblob NOT NULL,"
+    "  `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+    "  PRIMARY KEY (`repo_id`, `oid`),"
+    "  KEY `created` (`repo_id`, `created`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin%s;",
+    partition);
+
+  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+    return GIT_ERROR;
+
+  return GIT_SUCCESS;
+}
+
+// unlike the object tables, one for every backend on the database
+static int create_chunks_table(MYSQL *db)
+{
+  static const char *sql_create =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_CHUNKS_TABLE_NAME "` ("
+    "  `stream` bigint(20) unsigned NOT NULL,"
+    "  `seq` int(10) unsigned NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+    "  PRIMARY KEY (`stream`, `seq`)"
+    ") ENGINE=" GIT2_STORAGE_ENGINE ";";
+
+  if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0)
+    return GIT_ERROR;
+
+  return GIT_SUCCESS;
+}
+
+static int init_db(MYSQL *db)
+{
+  static const char *sql_check =
+    "SHOW TABLES LIKE '" GIT2_TABLE_NAME "';";
+
+  MYSQL_RES *res;
+  int error;
+  my_ulonglong num_rows;
+
+  if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
+    return GIT_ERROR;
+
+  res = mysql_store_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  num_rows = mysql_num_rows(res);
+  if (num_rows == 0) {
+    /* the table was not found */
+    error = create_table(db);
+  } else if (num_rows > 0) {
+    /* the table was found */
+    error = upgrade_table(db);
+  } else {
+    error = GIT_ERROR;
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+static char *sql_printf(const char *fmt, ...)
+{
+  va_list ap;
+  char *sql;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  if (len < 0 || (sql = malloc(len + 1)) == NULL)
+    return NULL;
+
+  va_start(ap, fmt);
+  vsnprintf(sql, len + 1, fmt, ap);
+  va_end(ap);
+
+  return sql;
+}
+
+// statements are prepared on each connection as it needs them, so
+// this only picks the queries
+static int init_statements(mysql_backend *backend)
+{
+  const char *table = backend->table;
+  const char *repo = backend->shared ? " AND `repo_id` = ?" : "";
+  char in_list[GIT2_READ_BATCH * 2 + 1], *p;
+  int i;
+
+  // "?,?,...,?" with GIT2_READ_BATCH placeholders
+  for (p = in_list, i = 0; i < GIT2_READ_BATCH; ++i) {
+    *p++ = '?';
+    *p++ = ',';
+  }
+  p[-1] = '\0';
+
+  backend->sql[POOL_ST_READ] = sql_printf(
+    "SELECT `type`, `size`, `codec`, `data` FROM `%s` WHERE `oid` = ?%s;", table, repo);
+
+  backend->sql[POOL_ST_READ_HEADER] = sql_printf(
+    "SELECT `type`, `size` FROM `%s` WHERE `oid` = ?%s;", table, repo);
+
+  backend->sql[POOL_ST_WRITE] = sql_printf(
+    "INSERT INTO `%s` (`oid`, `type`, `size`, `codec`, `data`%s)"
+    "  VALUES (?, ?, ?, ?, %s%s)" GIT2_FRESHEN_SQL ";", table,
+    backend->shared ? ", `repo_id`" : "",
+    (backend->codec == GIT_ODB_MYSQL_CODEC_SERVER) ? "COMPRESS(?)" : "?",
+    backend->shared ? ", ?" : "");
+
+  // same query, but kept apart so a plain write can't reset the long
+  // data of a stream that is still open
+  backend->sql[POOL_ST_WRITE_STREAM] = backend->sql[POOL_ST_WRITE] ?
+    strdup(backend->sql[POOL_ST_WRITE]) : NULL;
+
+  backend->sql[POOL_ST_WRITE_CHUNK] = sql_printf(
+    "INSERT INTO `" GIT2_CHUNKS_TABLE_NAME "` (`stream`, `seq`, `data`) VALUES (?, ?, ?);");
+
+  backend->sql[POOL_ST_READ_BATCH] = sql_printf(
+    "SELECT `oid`, `type`, `size`, `codec`, `data` FROM `%s` WHERE `oid` IN (%s)%s;",
+    table, in_list, repo);
+
+  backend->sql[POOL_ST_PREFIX] = sql_printf(
+    "SELECT `oid` FROM `%s` WHERE `oid` BETWEEN ? AND ?%s LIMIT 2;", table, repo);
+
+  backend->sql[POOL_ST_FRESHEN] = sql_printf(
+    "UPDATE `%s` SET `created` = NOW()"
+    "  WHERE `oid` = ? AND `created` < NOW() - INTERVAL " XSTR(GIT2_FRESHEN_SECONDS) " SECOND%s;",
+    table, repo);
+
+  for (i = 0; i < POOL_ST__COUNT; ++i)
+    if (backend->sql[i] == NULL)
+      return GIT_ENOMEM;
+
+  return GIT_SUCCESS;
+}
+
+int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  return git_odb_backend_mysql_ext(backend_out, mysql_host, mysql_user, mysql_passwd,
+    mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag, NULL);
+}
+
+int git_odb_mysql_pool_new(git_odb_mysql_pool **out, size_t size, const char *mysql_host,
         const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
         unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
 {
+  assert(out);
+
+  if (pool_new(out, size ? size : GIT2_POOL_SIZE, mysql_host, mysql_user, mysql_passwd,
+      mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) < 0)
+    return GIT_ENOMEM;
+
+  return GIT_SUCCESS;
+}
+
+void git_odb_mysql_pool_free(git_odb_mysql_pool *pool)
+{
+  pool_free(pool);
+}
+
+int git_odb_backend_mysql_ext(git_odb_backend **backend_out, const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag,
+        const git_odb_backend_mysql_options *opts)
+{
+  git_odb_backend_mysql_options defaults = GIT_ODB_BACKEND_MYSQL_OPTIONS_INIT;
   mysql_backend *backend;
+  pool_conn *conn;
+  char layout[64];
   int error;
-  my_bool reconnect;
+
+  if (opts == NULL)
+    opts = &defaults;
+
+  if (!codec_supported(opts->codec))
+    return GIT_ERROR;
 
   backend = calloc(1, sizeof(mysql_backend));
   if (backend == NULL)
     return GIT_ENOMEM;
 
-  backend->db = mysql_init(backend->db);
+  backend->codec = opts->codec;
+  backend->level = opts->level;
+  backend->shared = opts->shared;
+  backend->repo_id = opts->repo_id;
+  backend->freshen = opts->freshen;
+  backend->table = opts->shared ? GIT2_SHARED_TABLE_NAME : GIT2_TABLE_NAME;
+
+  if (backend->shared) {
+    snprintf(backend->repo_where, sizeof(backend->repo_where),
+      " WHERE `repo_id` = %llu", backend->repo_id);
+    snprintf(backend->repo_and, sizeof(backend->repo_and),
+      " AND `repo_id` = %llu", backend->repo_id);
+  }
+
+  if (opts->pool != NULL) {
+    pool_ref(opts->pool);
+    backend->pool = opts->pool;
+  } else if (pool_new(&backend->pool, opts->pool_size ? opts->pool_size : GIT2_POOL_SIZE,
+      mysql_host, mysql_user, mysql_passwd, mysql_db, mysql_port,
+      mysql_unix_socket, mysql_client_flag) < 0) {
+    goto cleanup;
+  }
 
-  reconnect = 1;
-  // allow libmysql to reconnect gracefully
-  if (mysql_options(backend->db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
+  // the statements other backends prepared on a shared pool have to be
+  // the ones this backend would have prepared
+  snprintf(layout, sizeof(layout), "odb:%s:%d", backend->table,
+    backend->codec == GIT_ODB_MYSQL_CODEC_SERVER);
+  if (pool_claim(backend->pool, layout) < 0)
     goto cleanup;
 
-  // make the connection
-  if (mysql_real_connect(backend->db, mysql_host, mysql_user, mysql_passwd, mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) != backend->db)
+  // make the first connection, which also tells us the server is there
+  if (pool_get(&conn, backend->pool) < 0)
     goto cleanup;
 
   // check for and possibly create the database
-  error = init_db(backend->db);
+  if (backend->shared)
+    error = create_shared_table(conn->db, opts->partitions);
+  else
+    error = init_db(conn->db);
+  if (error == GIT_SUCCESS)
+    error = create_chunks_table(conn->db);
+  pool_put(backend->pool, conn, error);
   if (error < 0)
     goto cleanup;
 
@@ -446,9 +2172,13 @@ int git_odb_backend_mysql(git_odb_backend **backend_out, const char *mysql_host,
     goto cleanup;
 
   backend->parent.read = &mysql_backend__read;
+  backend->parent.read_prefix = &mysql_backend__read_prefix;
   backend->parent.read_header = &mysql_backend__read_header;
   backend->parent.write = &mysql_backend__write;
+  backend->parent.writestream = &mysql_backend__writestream;
+  backend->parent.writepack = &mysql_backend__writepack;
   backend->parent.exists = &mysql_backend__exists;
+  backend->parent.foreach = &mysql_backend__foreach;
   backend->parent.free = &mysql_backend__free;
 
   *backend_out = (git_odb_backend *)backend;
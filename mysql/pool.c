@@ -0,0 +1,317 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+
+// idle connections older than this are pinged before they're reused
+#define POOL_PING_AFTER 30
+
+// libmysql keeps state per thread: the library is set up once, before
+// any pool is used, and each thread that takes a connection starts the
+// client library for itself and ends it when the thread exits
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_started;
+static int library_error;
+
+static void thread_end(void *started)
+{
+  (void)started;
+  mysql_thread_end();
+}
+
+static void library_setup(void)
+{
+  if (mysql_library_init(0, NULL, NULL) != 0 ||
+      pthread_key_create(&thread_started, &thread_end) != 0)
+    library_error = -1;
+}
+
+static int thread_start(void)
+{
+  pthread_once(&library_once, &library_setup);
+  if (library_error < 0)
+    return -1;
+
+  if (pthread_getspecific(thread_started) != NULL)
+    return 0;
+
+  if (mysql_thread_init() != 0)
+    return -1;
+
+  pthread_setspecific(thread_started, &thread_started);
+  return 0;
+}
+
+struct conn_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  pthread_key_t last_conn;
+  pool_conn *conns;
+  size_t size;
+  size_t refcount;
+  char *layout;
+  char *host, *user, *passwd, *db, *unix_socket;
+  unsigned int port;
+  unsigned long client_flag;
+};
+
+static char *dup_or_null(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+static void conn_close(pool_conn *conn)
+{
+  int i;
+
+  for (i = 0; i < POOL_ST__COUNT; ++i) {
+    if (conn->st[i])
+      mysql_stmt_close(conn->st[i]);
+    conn->st[i] = NULL;
+  }
+
+  if (conn->db)
+    mysql_close(conn->db);
+  conn->db = NULL;
+}
+
+static int conn_open(conn_pool *pool, pool_conn *conn)
+{
+  // no MYSQL_OPT_RECONNECT: a silent reconnect drops the server side of
+  // every prepared statement, so the pool reconnects by itself instead
+  conn->db = mysql_init(NULL);
+  if (conn->db == NULL)
+    return -1;
+
+  if (mysql_real_connect(conn->db, pool->host, pool->user, pool->passwd, pool->db,
+      pool->port, pool->unix_socket, pool->client_flag) != conn->db) {
+    conn_close(conn);
+    return -1;
+  }
+
+  return 0;
+}
+
+// makes sure a connection we're about to hand out is usable
+static int conn_check(conn_pool *pool, pool_conn *conn)
+{
+  if (conn->db != NULL &&
+      (conn->failed || time(NULL) - conn->last_used > POOL_PING_AFTER) &&
+      mysql_ping(conn->db) != 0)
+    conn_close(conn);
+
+  conn->failed = 0;
+
+  if (conn->db == NULL)
+    return conn_open(pool, conn);
+
+  return 0;
+}
+
+int pool_new(conn_pool **out, size_t size, const char *host, const char *user,
+  const char *passwd, const char *db, unsigned int port,
+  const char *unix_socket, unsigned long client_flag)
+{
+  conn_pool *pool;
+
+  if (thread_start() < 0)
+    return -1;
+
+  if (size == 0)
+    size = 1;
+
+  pool = calloc(1, sizeof(conn_pool));
+  if (pool == NULL)
+    return -1;
+
+  pool->conns = calloc(size, sizeof(pool_conn));
+  if (pool->conns == NULL) {
+    free(pool);
+    return -1;
+  }
+
+  pool->size = size;
+  pool->refcount = 1;
+  pool->host = dup_or_null(host);
+  pool->user = dup_or_null(user);
+  pool->passwd = dup_or_null(passwd);
+  pool->db = dup_or_null(db);
+  pool->unix_socket = dup_or_null(unix_socket);
+  pool->port = port;
+  pool->client_flag = client_flag;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->freed, NULL);
+  pthread_key_create(&pool->last_conn, NULL);
+
+  *out = pool;
+  return 0;
+}
+
+int pool_get(pool_conn **out, conn_pool *pool)
+{
+  pool_conn *conn;
+  size_t i;
+
+  if (thread_start() < 0)
+    return -1;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (;;) {
+    // prefer the connection this thread used last, whose statements
+    // (and server-side caches) are warm for it
+    conn = pthread_getspecific(pool->last_conn);
+    if (conn != NULL && !conn->in_use)
+      break;
+
+    // then an open idle one, then a slot we haven't connected yet
+    conn = NULL;
+    for (i = 0; i < pool->size; ++i) {
+      if (pool->conns[i].in_use)
+        continue;
+      if (pool->conns[i].db != NULL) {
+        conn = &pool->conns[i];
+        break;
+      }
+      if (conn == NULL)
+        conn = &pool->conns[i];
+    }
+
+    if (conn != NULL)
+      break;
+
+    pthread_cond_wait(&pool->freed, &pool->lock);
+  }
+
+  conn->in_use = 1;
+  pthread_mutex_unlock(&pool->lock);
+
+  // connecting and pinging happen outside the lock
+  if (conn_check(pool, conn) < 0) {
+    pool_put(pool, conn, -1);
+    return -1;
+  }
+
+  *out = conn;
+  return 0;
+}
+
+void pool_put(conn_pool *pool, pool_conn *conn, int error)
+{
+  pthread_mutex_lock(&pool->lock);
+
+  conn->failed = (error < 0);
+  conn->last_used = time(NULL);
+  conn->in_use = 0;
+
+  pthread_setspecific(pool->last_conn, conn);
+  pthread_cond_signal(&pool->freed);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_ref(conn_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->refcount++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_claim(conn_pool *pool, const char *layout)
+{
+  int error = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  if (pool->layout == NULL) {
+    if ((pool->layout = strdup(layout)) == NULL)
+      error = -1;
+    else
+      error = 1;
+  } else if (strcmp(pool->layout, layout) != 0) {
+    error = -1;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return error;
+}
+
+MYSQL_STMT *pool_stmt(pool_conn *conn, int slot, const char *sql)
+{
+  my_bool truth = 1;
+  MYSQL_STMT *st;
+
+  if (conn->st[slot] != NULL)
+    return conn->st[slot];
+
+  st = mysql_stmt_init(conn->db);
+  if (st == NULL)
+    return NULL;
+
+  // lets mysql_stmt_store_result report the longest value per column
+  if (mysql_stmt_attr_set(st, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0 ||
+      mysql_stmt_prepare(st, sql, strlen(sql)) != 0) {
+    mysql_stmt_close(st);
+    return NULL;
+  }
+
+  conn->st[slot] = st;
+  return st;
+}
+
+void pool_free(conn_pool *pool)
+{
+  size_t i, refcount;
+
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  refcount = --pool->refcount;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (refcount > 0)
+    return;
+
+  for (i = 0; i < pool->size; ++i)
+    conn_close(&pool->conns[i]);
+
+  pthread_key_delete(pool->last_conn);
+  pthread_cond_destroy(&pool->freed);
+  pthread_mutex_destroy(&pool->lock);
+
+  free(pool->host);
+  free(pool->user);
+  free(pool->passwd);
+  free(pool->db);
+  free(pool->unix_socket);
+  free(pool->layout);
+  free(pool->conns);
+  free(pool);
+}
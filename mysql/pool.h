@@ -0,0 +1,86 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stddef.h>
+#include <time.h>
+#include <mysql.h>
+
+/*
+ * A fixed-size pool of connections shared by every thread using a
+ * backend, and possibly by several backends.  Each connection carries
+ * its own prepared statements, so two threads never touch the same
+ * MYSQL_STMT.
+ */
+
+// statement slots a connection can hold; each one is prepared on a
+// connection the first time it is used there
+enum {
+  POOL_ST_READ,
+  POOL_ST_READ_HEADER,
+  POOL_ST_WRITE,
+  POOL_ST_WRITE_STREAM,
+  POOL_ST_WRITE_CHUNK,
+  POOL_ST_READ_BATCH,
+  POOL_ST_PREFIX,
+  POOL_ST_FRESHEN,
+  POOL_ST__COUNT
+};
+
+typedef struct {
+  MYSQL *db;
+  MYSQL_STMT *st[POOL_ST__COUNT];
+  time_t last_used;
+  int in_use;
+  int failed;
+} pool_conn;
+
+typedef struct conn_pool conn_pool;
+
+// connections are opened lazily, up to `size` of them
+int pool_new(conn_pool **out, size_t size, const char *host, const char *user,
+  const char *passwd, const char *db, unsigned int port,
+  const char *unix_socket, unsigned long client_flag);
+
+// blocks until a connection is free; a thread gets back the connection
+// it used last whenever that one is idle
+int pool_get(pool_conn **out, conn_pool *pool);
+
+// `error` is the result of the operation; a connection that failed is
+// checked with mysql_ping before it is handed out again
+void pool_put(conn_pool *pool, pool_conn *conn, int error);
+
+// pools are reference counted; pool_free drops a reference
+void pool_ref(conn_pool *pool);
+
+// backends sharing a pool share the statements in its slots, so they
+// must agree on the queries behind them.  Returns 1 for the first
+// backend to claim `layout`, 0 for later ones with the same layout and
+// -1 on a mismatch.
+int pool_claim(conn_pool *pool, const char *layout);
+
+// the statement in `slot`, prepared from `sql` if it isn't yet
+MYSQL_STMT *pool_stmt(pool_conn *conn, int slot, const char *sql);
+
+void pool_free(conn_pool *pool);
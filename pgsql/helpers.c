@@ -22,6 +22,23 @@ int get_int_from_result(PGresult *result, int *intp, int row, int col)
     return 0;
 }
 
+int get_int64_from_result(PGresult *result, int64_t *intp, int row, int col)
+{
+    int value_len;
+
+    assert(result && intp);
+
+    value_len = PQgetlength(result, row, col);
+    if (value_len != sizeof(*intp)) {
+        giterr_set_str(GITERR_ODB, "bigint column has bad size");
+        return 1;
+    }
+
+    memcpy(intp, PQgetvalue(result, row, col), sizeof(*intp));
+    *intp = be64toh(*intp);
+    return 0;
+}
+
 int complete_pq_exec(PGresult *result)
 {
     ExecStatusType exec_status = PQresultStatus(result);
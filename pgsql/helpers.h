@@ -1,5 +1,8 @@
+#include <stdint.h>
 #include <libpq-fe.h>
 
 int get_int_from_result(PGresult *result, int *intp, int row, int col);
 
+int get_int64_from_result(PGresult *result, int64_t *intp, int row, int col);
+
 int complete_pq_exec(PGresult *result);
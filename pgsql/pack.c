@@ -0,0 +1,318 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <zlib.h>
+#include "pack.h"
+
+#define IDX_HEADER_LEN 8
+#define IDX_FANOUT_LEN (256 * 4)
+
+static int by_offset(const void *a, const void *b)
+{
+    uint64_t x = ((const pack_idx_entry*)a)->offset;
+    uint64_t y = ((const pack_idx_entry*)b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static int read_file(unsigned char **out, size_t *len, const char *path)
+{
+    FILE *f;
+    long size;
+    unsigned char *buf = NULL;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return -1;
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0
+        || (buf = malloc(size ? size : 1)) == NULL
+        || fread(buf, 1, size, f) != (size_t)size) {
+        free(buf);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    *out = buf;
+    *len = size;
+    return 0;
+}
+
+int pack_idx_read(pack_idx_entry **out, size_t *n, const char *idx_path,
+    uint64_t pack_size)
+{
+    static const unsigned char magic[IDX_HEADER_LEN] = {0xff, 't', 'O', 'c', 0, 0, 0, 2};
+    unsigned char *idx;
+    const unsigned char *oids, *offsets, *large;
+    pack_idx_entry *entries = NULL;
+    size_t len, count, n_large, i;
+    uint32_t offset;
+
+    if (read_file(&idx, &len, idx_path) < 0)
+        return -1;
+
+    if (len < IDX_HEADER_LEN + IDX_FANOUT_LEN || memcmp(idx, magic, sizeof(magic)) != 0)
+        goto fail;
+
+    /* the last fanout entry counts every object */
+    count = read_be32(idx + IDX_HEADER_LEN + IDX_FANOUT_LEN - 4);
+
+    /* oids, then CRCs, then 31-bit offsets; an offset with the high bit
+     * set indexes the table of 64-bit ones that follows */
+    oids = idx + IDX_HEADER_LEN + IDX_FANOUT_LEN;
+    offsets = oids + count * (GIT_OID_RAWSZ + 4);
+    large = offsets + count * 4;
+    if (len < (size_t)(large - idx))
+        goto fail;
+    n_large = (len - (large - idx)) / 8;
+
+    if ((entries = calloc(count ? count : 1, sizeof(pack_idx_entry))) == NULL)
+        goto fail;
+
+    for (i = 0; i < count; ++i) {
+        git_oid_fromraw(&entries[i].oid, oids + i * GIT_OID_RAWSZ);
+
+        offset = read_be32(offsets + i * 4);
+        if (offset & 0x80000000) {
+            offset &= 0x7fffffff;
+            if (offset >= n_large)
+                goto fail;
+            entries[i].offset = ((uint64_t)read_be32(large + offset * 8) << 32)
+                | read_be32(large + offset * 8 + 4);
+        } else {
+            entries[i].offset = offset;
+        }
+    }
+
+    qsort(entries, count, sizeof(pack_idx_entry), &by_offset);
+
+    for (i = 0; i < count; ++i) {
+        uint64_t end = (i + 1 < count) ? entries[i + 1].offset : pack_size - GIT_OID_RAWSZ;
+        if (end <= entries[i].offset)
+            goto fail;
+        entries[i].length = end - entries[i].offset;
+    }
+
+    free(idx);
+    *out = entries;
+    *n = count;
+    return 0;
+
+fail:
+    free(entries);
+    free(idx);
+    return -1;
+}
+
+int pack_entry_parse(pack_entry *out, const unsigned char *data, size_t len,
+    uint64_t offset)
+{
+    size_t pos = 0;
+    unsigned int shift = 4;
+    uint64_t distance;
+    unsigned char c;
+
+    memset(out, 0, sizeof(*out));
+
+    if (len == 0)
+        return -1;
+
+    /* type in bits 4-6 of the first byte, then the size, 4 bits and
+     * then 7 per byte while the high bit is set */
+    c = data[pos++];
+    out->type = (c >> 4) & 7;
+    out->size = c & 15;
+
+    while (c & 0x80) {
+        if (pos == len || shift > sizeof(size_t) * 8 - 7)
+            return -1;
+        c = data[pos++];
+        out->size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    switch (out->type) {
+    case GIT_OBJ_COMMIT:
+    case GIT_OBJ_TREE:
+    case GIT_OBJ_BLOB:
+    case GIT_OBJ_TAG:
+        break;
+
+    case PACK_OFS_DELTA:
+        /* a big-endian distance back to the base, where each
+         * continuation also adds one */
+        if (pos == len)
+            return -1;
+        c = data[pos++];
+        distance = c & 0x7f;
+        while (c & 0x80) {
+            if (pos == len || distance >= ((uint64_t)1 << 56))
+                return -1;
+            c = data[pos++];
+            distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+        if (distance == 0 || distance > offset)
+            return -1;
+        out->base_offset = offset - distance;
+        break;
+
+    case PACK_REF_DELTA:
+        if (len - pos < GIT_OID_RAWSZ)
+            return -1;
+        git_oid_fromraw(&out->base_oid, data + pos);
+        pos += GIT_OID_RAWSZ;
+        break;
+
+    default:
+        return -1;
+    }
+
+    out->header_len = pos;
+    return 0;
+}
+
+int pack_inflate(void **out, const unsigned char *data, size_t len, size_t size)
+{
+    z_stream zs;
+    unsigned char *buf;
+    int zerr;
+
+    if ((buf = malloc(size ? size : 1)) == NULL)
+        return -1;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = buf;
+    zs.avail_out = (uInt)size;
+
+    zerr = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (zerr != Z_STREAM_END || zs.total_out != size) {
+        free(buf);
+        return -1;
+    }
+
+    *out = buf;
+    return 0;
+}
+
+static int delta_varint(size_t *out, const unsigned char **p, const unsigned char *end)
+{
+    unsigned int shift = 0;
+    unsigned char c;
+
+    *out = 0;
+    do {
+        if (*p == end || shift > sizeof(size_t) * 8 - 7)
+            return -1;
+        c = *(*p)++;
+        *out |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return 0;
+}
+
+int pack_delta_apply(void **out, size_t *out_len,
+    const unsigned char *base, size_t base_len,
+    const unsigned char *delta, size_t delta_len)
+{
+    const unsigned char *p = delta, *end = delta + delta_len;
+    unsigned char *buf, *dst;
+    size_t src_size, dst_size, off, n;
+    unsigned char cmd;
+
+    if (delta_varint(&src_size, &p, end) < 0 || src_size != base_len
+        || delta_varint(&dst_size, &p, end) < 0)
+        return -1;
+
+    if ((buf = malloc(dst_size ? dst_size : 1)) == NULL)
+        return -1;
+    dst = buf;
+
+    while (p < end) {
+        cmd = *p++;
+
+        if (cmd & 0x80) {
+            /* copy from the base; the low bits say which bytes of the
+             * offset and size follow */
+            off = n = 0;
+            if ((cmd & 0x01) && p < end) off = *p++;
+            if ((cmd & 0x02) && p < end) off |= (size_t)*p++ << 8;
+            if ((cmd & 0x04) && p < end) off |= (size_t)*p++ << 16;
+            if ((cmd & 0x08) && p < end) off |= (size_t)*p++ << 24;
+            if ((cmd & 0x10) && p < end) n = *p++;
+            if ((cmd & 0x20) && p < end) n |= (size_t)*p++ << 8;
+            if ((cmd & 0x40) && p < end) n |= (size_t)*p++ << 16;
+            if (n == 0)
+                n = 0x10000;
+
+            if (off > base_len || n > base_len - off
+                || n > dst_size - (size_t)(dst - buf))
+                goto fail;
+            memcpy(dst, base + off, n);
+            dst += n;
+        } else if (cmd) {
+            /* insert the next `cmd` bytes of the delta */
+            if (cmd > end - p || cmd > dst_size - (size_t)(dst - buf))
+                goto fail;
+            memcpy(dst, p, cmd);
+            dst += cmd;
+            p += cmd;
+        } else {
+            goto fail;
+        }
+    }
+
+    if ((size_t)(dst - buf) != dst_size)
+        goto fail;
+
+    *out = buf;
+    *out_len = dst_size;
+    return 0;
+
+fail:
+    free(buf);
+    return -1;
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <git2.h>
+
+/*
+ * Just enough of the packfile format to read objects out of a pack
+ * stored in the database.  All of these return 0 on success and -1 on
+ * failure.
+ */
+
+/* entry types besides the four object types */
+#define PACK_OFS_DELTA 6
+#define PACK_REF_DELTA 7
+
+typedef struct {
+    git_oid oid;
+    uint64_t offset;
+    /* bytes up to the next entry, or to the trailing checksum */
+    uint64_t length;
+} pack_idx_entry;
+
+/* reads a version 2 .idx file into a newly allocated array, sorted by
+ * offset in a pack of `pack_size` bytes */
+int pack_idx_read(pack_idx_entry **out, size_t *n, const char *idx_path,
+    uint64_t pack_size);
+
+typedef struct {
+    int type;
+    /* of the inflated data: the object, or the delta */
+    size_t size;
+    /* where the entry's base starts, for PACK_OFS_DELTA */
+    uint64_t base_offset;
+    /* and which object it is, for PACK_REF_DELTA */
+    git_oid base_oid;
+    /* the zlib data follows this many bytes of header */
+    size_t header_len;
+} pack_entry;
+
+/* parses the header of the entry at `offset`, whose bytes are `data` */
+int pack_entry_parse(pack_entry *out, const unsigned char *data, size_t len,
+    uint64_t offset);
+
+/* inflates into a newly allocated buffer of exactly `size` bytes */
+int pack_inflate(void **out, const unsigned char *data, size_t len, size_t size);
+
+/* applies a git delta to `base`, into a newly allocated buffer */
+int pack_delta_apply(void **out, size_t *out_len,
+    const unsigned char *base, size_t base_len,
+    const unsigned char *delta, size_t delta_len);
@@ -24,64 +24,861 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <libpq-fe.h>
 #include <endian.h>
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
+#include "pgsql-odb.h"
 #include "helpers.h"
+#include "pool.h"
+#include "pack.h"
 
 
 #define GIT2_TABLE_NAME "git2_odb"
 #define GIT2_PK_NAME "git2_odb_pkey"
+#define GIT2_PARTITION_PREFIX "git2_odb_p"
+#define GIT2_REPOS_TABLE_NAME "git2_odb_repos"
+#define GIT2_REPOS_OID_IDX_NAME "git2_odb_repos_idx_oid"
+#define GIT2_REPOS_FK_NAME "git2_odb_repos_oid_fkey"
+#define GIT2_PACKS_TABLE_NAME "git2_packs"
+#define GIT2_PACK_CHUNKS_TABLE_NAME "git2_pack_chunks"
+#define GIT2_PACK_INDEX_TABLE_NAME "git2_pack_index"
+#define GIT2_PACK_POS_IDX_NAME "git2_pack_index_idx_pos"
 #define GIT2_TYPE_IDX_NAME "git2_odb_idx_type"
+#define GIT2_HEADER_IDX_NAME "git2_odb_idx_header"
+#define GIT2_STAGING_TABLE_NAME "git2_odb_staging"
+#define GIT2_CHUNKS_TABLE_NAME "git2_odb_chunks"
+#define GIT2_STREAM_SEQ_NAME "git2_odb_stream_seq"
+#define GIT2_GRAPH_TABLE_NAME "git2_commit_graph"
+#define GIT2_GRAPH_PENDING_IDX_NAME "git2_commit_graph_idx_pending"
+#define GIT2_GRAPH_TRIGGER_NAME "git2_odb_commit_graph"
 
+/* merge_base first only walks this many generations below the lower of
+ * the two commits, and widens that by 16 times for every retry */
+#define GIT2_GRAPH_BAND 1024
+
+/* plpgsql that settles every generation number that is still 0 and now
+ * can be, a level of history per UPDATE */
+#define GIT2_GRAPH_SETTLE_SQL \
+    "LOOP" \
+    "  UPDATE \"" GIT2_GRAPH_TABLE_NAME "\" c" \
+    "    SET \"generation\" = r.\"generation\"" \
+    "    FROM (" \
+    "      SELECT c.\"oid\", 1 + coalesce(max(p.\"generation\"), 0) AS \"generation\"" \
+    "        FROM \"" GIT2_GRAPH_TABLE_NAME "\" c" \
+    "        LEFT JOIN LATERAL unnest(c.\"parents\") AS u(\"parent\") ON true" \
+    "        LEFT JOIN \"" GIT2_GRAPH_TABLE_NAME "\" p ON p.\"oid\" = u.\"parent\"" \
+    "        WHERE c.\"generation\" = 0" \
+    "        GROUP BY c.\"oid\"" \
+    "        HAVING bool_and(u.\"parent\" IS NULL OR coalesce(p.\"generation\", 0) > 0)" \
+    "    ) r" \
+    "    WHERE c.\"oid\" = r.\"oid\";" \
+    "  EXIT WHEN NOT FOUND;" \
+    "END LOOP;"
+
+/* statements sent ahead in a pipeline before their results are read */
+#define GIT2_PIPELINE_DEPTH 256
+
+/* COPY data is handed to libpq in pieces of about this size */
+#define GIT2_COPY_BUFFER (1024 * 1024)
+
+/* streams move object data to and from the server in pieces of this
+ * size, which bounds the memory they need on either side */
+#define GIT2_STREAM_CHUNK (1024 * 1024)
+
+/* packs are stored in rows of this many bytes; a plain number, as it is
+ * pasted into SQL too */
+#define GIT2_PACK_CHUNK 1048576
+
+/* delta bases a backend keeps around, by slot and by total size */
+#define GIT2_PACK_CACHE_SLOTS 1024
+#define GIT2_PACK_CACHE_BYTES (32 * 1024 * 1024)
+
+/* foreach lists this many oids a query; a plain number, pasted into SQL */
+#define GIT2_FOREACH_BATCH 10000
+
+/* a duplicate write or a lookup re-stamps "created" on a row older than
+ * this many seconds, so a sweep running meanwhile keeps it; sweeps add
+ * as much to their grace period.  A plain number, pasted into SQL. */
+#define GIT2_FRESHEN_SECONDS 60
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+
+typedef struct {
+    int64_t pack_id;
+    uint64_t offset;
+    git_otype type;
+    void *data;
+    size_t len;
+} pack_cache_entry;
 
 typedef struct {
     git_odb_backend parent;
-    PGconn *db;
+    pg_pool *pool;
+    /* objects live in the shared table, and the repository's own are
+     * the ones with a row for `repo_id` in GIT2_REPOS_TABLE_NAME */
+    int shared;
+    unsigned long long repo_id;
+    /* repo_id as a binary bigint parameter */
+    uint64_t fmtd_repo_id;
+    /* writepacks are stored as packs */
+    int packs;
+    /* exists() re-stamps what it finds, for sweeps */
+    int freshen;
+    pthread_mutex_t cache_lock;
+    pack_cache_entry *cache;
+    size_t cache_bytes;
 } pgsql_odb_backend;
 
 
-static void set_giterr_from_pg(pgsql_odb_backend *backend)
+/* the bytes of a pack entry, l."offset" to l."end", out of the chunks
+ * joined as c; substring() only detoasts the part of a chunk it needs */
+#define GIT2_PACK_SLICE_SQL \
+    "string_agg(substring(c.\"data\"" \
+    "    FROM (greatest(l.\"offset\" - c.\"seq\"::bigint * " XSTR(GIT2_PACK_CHUNK) ", 0) + 1)::int" \
+    "    FOR (least(l.\"end\" - c.\"seq\"::bigint * " XSTR(GIT2_PACK_CHUNK) ", " XSTR(GIT2_PACK_CHUNK) ")" \
+    "      - greatest(l.\"offset\" - c.\"seq\"::bigint * " XSTR(GIT2_PACK_CHUNK) ", 0))::int)," \
+    "  ''::bytea ORDER BY c.\"seq\")"
+
+/* a conflicting insert re-stamps the existing row instead, which also
+ * locks it until the writer commits */
+#define GIT2_FRESHEN_SQL(table) \
+    " DO UPDATE SET \"created\" = now()" \
+    "  WHERE \"" table "\".\"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds'"
+
+#define GIT2_PACK_SLICE_JOIN \
+    "  JOIN \"" GIT2_PACK_CHUNKS_TABLE_NAME "\" c ON c.\"pack_id\" = l.\"pack_id\"" \
+    "    AND c.\"seq\" BETWEEN l.\"offset\" / " XSTR(GIT2_PACK_CHUNK) \
+    "      AND (l.\"end\" - 1) / " XSTR(GIT2_PACK_CHUNK) \
+    "  GROUP BY l.\"pack_id\", l.\"offset\""
+
+/* prepared on a connection the first time it runs them */
+static const pg_stmt odb_stmts[] = {
+    {"read",
+        "SELECT \"type\", \"data\""
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"},
+    {"read_header",
+        "SELECT \"type\", \"size\""
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"},
+    /* for rows of upgraded tables the backfill hasn't got to yet */
+    {"read_size",
+        "SELECT length(\"data\")"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"},
+    /* a batch of the primary key after $1, and how many of its rows
+     * had no size yet */
+    {"backfill_size",
+        "WITH \"batch\" AS ("
+        "  SELECT \"oid\" FROM \"" GIT2_TABLE_NAME "\""
+        "    WHERE \"oid\" > $1::bytea ORDER BY \"oid\" LIMIT $2::bigint"
+        "), \"filled\" AS ("
+        "  UPDATE \"" GIT2_TABLE_NAME "\" o SET \"size\" = length(o.\"data\")"
+        "    FROM \"batch\" b"
+        "    WHERE o.\"oid\" = b.\"oid\" AND o.\"size\" IS NULL"
+        "    RETURNING 1"
+        ")"
+        "SELECT (SELECT max(\"oid\") FROM \"batch\"), (SELECT count(*) FROM \"filled\")"},
+    {"exists",
+        "SELECT 1"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"},
+    /* libgit2 skips writing an object that exists, so with the freshen
+     * option exists() runs this after a hit, to re-stamp the row for a
+     * sweep as a duplicate write would */
+    {"freshen",
+        "UPDATE \"" GIT2_TABLE_NAME "\" SET \"created\" = now()"
+        "  WHERE \"oid\" = $1::bytea"
+        "    AND \"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds'"},
+    /* the range of ids starting with a prefix; a second row means the
+     * prefix is ambiguous */
+    {"prefix",
+        "SELECT \"oid\""
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" >= $1::bytea AND \"oid\" <= $2::bytea"
+        "  LIMIT 2"},
+    {"read_chunk",
+        "SELECT substring(\"data\" FROM $2::int FOR $3::int)"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"},
+    {"write_chunk",
+        "INSERT INTO \"" GIT2_CHUNKS_TABLE_NAME "\""
+        "  (\"stream\", \"seq\", \"data\")"
+        "  VALUES($1::bigint, $2::int, $3::bytea)"},
+    {"finalize_stream",
+        "WITH \"chunks\" AS ("
+        "  DELETE FROM \"" GIT2_CHUNKS_TABLE_NAME "\""
+        "    WHERE \"stream\" = $1::bigint"
+        "    RETURNING \"seq\", \"data\""
+        ")"
+        "INSERT INTO \"" GIT2_TABLE_NAME "\""
+        "  (\"oid\", \"type\", \"size\", \"data\")"
+        "  SELECT $2::bytea, $3::int, $4::bigint,"
+        "    coalesce(string_agg(\"data\", ''::bytea ORDER BY \"seq\"), ''::bytea)"
+        "  FROM \"chunks\""
+        "  ON CONFLICT (\"oid\")" GIT2_FRESHEN_SQL(GIT2_TABLE_NAME)},
+    {"discard_stream",
+        "DELETE FROM \"" GIT2_CHUNKS_TABLE_NAME "\""
+        "  WHERE \"stream\" = $1::bigint"},
+    {"write",
+        "INSERT INTO \"" GIT2_TABLE_NAME "\""
+        "  (\"oid\", \"type\", \"size\", \"data\")"
+        "  VALUES($1::bytea, $2::int, $3::bigint, $4::bytea)"
+        /* objects are immutable, and batches often repeat some */
+        "  ON CONFLICT (\"oid\")" GIT2_FRESHEN_SQL(GIT2_TABLE_NAME)},
+    {"next_stream_id",
+        "SELECT nextval('" GIT2_STREAM_SEQ_NAME "')"},
+    {"partitions",
+        "SELECT \"inhrelid\"::regclass::text"
+        "  FROM pg_inherits"
+        "  WHERE \"inhparent\" = '\"" GIT2_TABLE_NAME "\"'::regclass"
+        "  ORDER BY 1"},
+    /* a commit with a known generation at or below the ancestor's
+     * can't lead to it, so the walk stops there.  A row of 1 means the
+     * walk reached the ancestor; otherwise a row of 0 means it came to a
+     * commit the graph doesn't have, so the answer isn't known. */
+    {"is_ancestor",
+        "WITH RECURSIVE \"target\" AS ("
+        "  SELECT coalesce((SELECT \"generation\" FROM \"" GIT2_GRAPH_TABLE_NAME "\""
+        "    WHERE \"oid\" = $1::bytea), 0) AS \"generation\""
+        "), \"walk\"(\"oid\") AS ("
+        "  SELECT $2::bytea"
+        "  UNION"
+        "  SELECT unnest(g.\"parents\")"
+        "    FROM \"walk\""
+        "    JOIN \"" GIT2_GRAPH_TABLE_NAME "\" g ON g.\"oid\" = \"walk\".\"oid\","
+        "    \"target\""
+        "    WHERE \"walk\".\"oid\" <> $1::bytea"
+        "      AND (g.\"generation\" = 0 OR \"target\".\"generation\" = 0"
+        "        OR g.\"generation\" > \"target\".\"generation\")"
+        ")"
+        "(SELECT 1 FROM \"walk\" WHERE \"oid\" = $1::bytea LIMIT 1)"
+        "UNION ALL"
+        "(SELECT 0 FROM \"walk\" w WHERE NOT EXISTS("
+        "  SELECT 1 FROM \"" GIT2_GRAPH_TABLE_NAME "\" g WHERE g.\"oid\" = w.\"oid\")"
+        "  LIMIT 1)"
+        "LIMIT 1"},
+    /* the common ancestor with the highest generation can't be an
+     * ancestor of another one, as long as none of them is still at 0.
+     * Generations only go down along parents, so the walks stop below
+     * "bottom", $3 generations under the lower of the two commits, and
+     * still meet every common ancestor at or above it.  Along with the
+     * best one come whether a common ancestor is still at 0, whether
+     * either walk came to a commit the graph doesn't have, and whether
+     * the walks went all the way down. */
+    {"merge_base",
+        "WITH RECURSIVE \"tips\" AS ("
+        "  SELECT least("
+        "    coalesce((SELECT \"generation\" FROM \"" GIT2_GRAPH_TABLE_NAME "\""
+        "      WHERE \"oid\" = $1::bytea), 0),"
+        "    coalesce((SELECT \"generation\" FROM \"" GIT2_GRAPH_TABLE_NAME "\""
+        "      WHERE \"oid\" = $2::bytea), 0)) AS \"generation\""
+        "), \"bottom\" AS ("
+        /* a tip still at 0 gives no bound */
+        "  SELECT CASE WHEN \"generation\" > 0 THEN \"generation\" - $3::bigint ELSE 0 END"
+        "    AS \"generation\""
+        "    FROM \"tips\""
+        "), \"a\"(\"oid\") AS ("
+        "  SELECT $1::bytea"
+        "  UNION"
+        "  SELECT unnest(g.\"parents\")"
+        "    FROM \"a\" JOIN \"" GIT2_GRAPH_TABLE_NAME "\" g USING (\"oid\"), \"bottom\""
+        "    WHERE g.\"generation\" = 0 OR g.\"generation\" > \"bottom\".\"generation\""
+        "), \"b\"(\"oid\") AS ("
+        "  SELECT $2::bytea"
+        "  UNION"
+        "  SELECT unnest(g.\"parents\")"
+        "    FROM \"b\" JOIN \"" GIT2_GRAPH_TABLE_NAME "\" g USING (\"oid\"), \"bottom\""
+        "    WHERE g.\"generation\" = 0 OR g.\"generation\" > \"bottom\".\"generation\""
+        "), \"common\" AS ("
+        "  SELECT g.\"oid\", g.\"generation\", g.\"commit_time\""
+        "    FROM \"" GIT2_GRAPH_TABLE_NAME "\" g"
+        "    JOIN \"a\" USING (\"oid\")"
+        "    JOIN \"b\" USING (\"oid\"), \"bottom\""
+        "    WHERE g.\"generation\" = 0 OR g.\"generation\" >= \"bottom\".\"generation\""
+        ")"
+        "SELECT (SELECT \"oid\" FROM \"common\""
+        "    ORDER BY \"generation\" DESC, \"commit_time\" DESC LIMIT 1),"
+        "  EXISTS(SELECT 1 FROM \"common\" WHERE \"generation\" = 0)::int,"
+        "  EXISTS(SELECT 1 FROM (SELECT \"oid\" FROM \"a\" UNION ALL SELECT \"oid\" FROM \"b\") w"
+        "    WHERE NOT EXISTS(SELECT 1 FROM \"" GIT2_GRAPH_TABLE_NAME "\" g"
+        "      WHERE g.\"oid\" = w.\"oid\"))::int,"
+        "  (SELECT \"generation\" <= 0 FROM \"bottom\")::int"},
+    /* the parents along a commit's longest line of history have every
+     * generation below its own, so its $2 newest ancestors by generation
+     * all have one above its own minus $2, and so does every commit on
+     * the way to them: the walk doesn't go further down.  A commit still
+     * at 0 is newer than every ancestor that isn't, and gives no bound. */
+    {"ancestors",
+        "WITH RECURSIVE \"tip\" AS ("
+        "  SELECT coalesce((SELECT \"generation\" FROM \"" GIT2_GRAPH_TABLE_NAME "\""
+        "    WHERE \"oid\" = $1::bytea), 0) AS \"generation\""
+        "), \"walk\"(\"oid\") AS ("
+        "  SELECT $1::bytea"
+        "  UNION"
+        "  SELECT unnest(g.\"parents\")"
+        "    FROM \"walk\" JOIN \"" GIT2_GRAPH_TABLE_NAME "\" g USING (\"oid\"), \"tip\""
+        "    WHERE $2::bigint IS NULL OR \"tip\".\"generation\" = 0 OR g.\"generation\" = 0"
+        "      OR g.\"generation\" > \"tip\".\"generation\" - $2::bigint + 1"
+        ")"
+        "SELECT g.\"oid\", g.\"generation\", g.\"commit_time\""
+        "  FROM \"" GIT2_GRAPH_TABLE_NAME "\" g"
+        "  JOIN \"walk\" USING (\"oid\")"
+        "  ORDER BY g.\"generation\" = 0 DESC, g.\"generation\" DESC, g.\"commit_time\" DESC"
+        "  LIMIT $2::bigint"},
+    {"pack_entry_at",
+        "SELECT " GIT2_PACK_SLICE_SQL
+        "  FROM ("
+        "    SELECT \"pack_id\", \"offset\", \"offset\" + \"length\" AS \"end\""
+        "      FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "      WHERE \"pack_id\" = $1::bigint AND \"offset\" = $2::bigint"
+        "  ) l"
+        GIT2_PACK_SLICE_JOIN},
+};
+
+/* what a backend storing packs runs instead of the statements of the
+ * same name without the prefix; objects written one at a time are
+ * still rows, and are looked for first */
+static const pg_stmt packed_stmts[] = {
+    /* a row comes back as its type and data; a pack entry as its raw
+     * bytes, pack id and offset */
+    {"packed_read",
+        "SELECT \"type\", \"data\", NULL::bigint, NULL::bigint"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"
+        " UNION ALL "
+        "SELECT NULL::int, " GIT2_PACK_SLICE_SQL ", l.\"pack_id\", l.\"offset\""
+        "  FROM ("
+        "    SELECT \"pack_id\", \"offset\", \"offset\" + \"length\" AS \"end\""
+        "      FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "      WHERE \"oid\" = $1::bytea"
+        "      LIMIT 1"
+        "  ) l"
+        GIT2_PACK_SLICE_JOIN
+        " LIMIT 1"},
+    /* the third column tells pack entries from rows */
+    {"packed_read_header",
+        "SELECT \"type\", \"size\", false"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"
+        " UNION ALL "
+        "SELECT \"type\", \"size\", true"
+        "  FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"
+        " LIMIT 1"},
+    {"packed_exists",
+        "SELECT 1"
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"
+        " UNION ALL "
+        "SELECT 1"
+        "  FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea"
+        " LIMIT 1"},
+    /* a stored pack is swept as a whole, so this re-stamps the packs
+     * the object is in too */
+    {"packed_freshen",
+        "WITH \"fresh_packs\" AS ("
+        "  UPDATE \"" GIT2_PACKS_TABLE_NAME "\" p SET \"created\" = now()"
+        "    FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\" i"
+        "    WHERE i.\"oid\" = $1::bytea AND p.\"pack_id\" = i.\"pack_id\""
+        "      AND p.\"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds'"
+        ")"
+        "UPDATE \"" GIT2_TABLE_NAME "\" SET \"created\" = now()"
+        "  WHERE \"oid\" = $1::bytea"
+        "    AND \"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds'"},
+    /* UNION, since an object can be both a row and in a pack, or in
+     * several packs */
+    {"packed_prefix",
+        "(SELECT \"oid\""
+        "  FROM \"" GIT2_TABLE_NAME "\""
+        "  WHERE \"oid\" >= $1::bytea AND \"oid\" <= $2::bytea"
+        "  LIMIT 2)"
+        " UNION "
+        "(SELECT DISTINCT \"oid\""
+        "  FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "  WHERE \"oid\" >= $1::bytea AND \"oid\" <= $2::bytea"
+        "  LIMIT 2)"
+        " LIMIT 2"},
+};
+
+/* what a shared backend runs instead of the statements of the same
+ * name without the prefix; each takes the repository id as its last
+ * parameter */
+static const pg_stmt shared_stmts[] = {
+    {"shared_read",
+        "SELECT o.\"type\", o.\"data\""
+        "  FROM \"" GIT2_TABLE_NAME "\" o"
+        "  JOIN \"" GIT2_REPOS_TABLE_NAME "\" r ON r.\"oid\" = o.\"oid\""
+        "  WHERE o.\"oid\" = $1::bytea AND r.\"repo_id\" = $2::bigint"},
+    {"shared_read_header",
+        "SELECT o.\"type\", o.\"size\""
+        "  FROM \"" GIT2_TABLE_NAME "\" o"
+        "  JOIN \"" GIT2_REPOS_TABLE_NAME "\" r ON r.\"oid\" = o.\"oid\""
+        "  WHERE o.\"oid\" = $1::bytea AND r.\"repo_id\" = $2::bigint"},
+    {"shared_exists",
+        "SELECT 1"
+        "  FROM \"" GIT2_REPOS_TABLE_NAME "\""
+        "  WHERE \"oid\" = $1::bytea AND \"repo_id\" = $2::bigint"},
+    {"shared_freshen",
+        "UPDATE \"" GIT2_REPOS_TABLE_NAME "\" SET \"created\" = now()"
+        "  WHERE \"oid\" = $1::bytea AND \"repo_id\" = $2::bigint"
+        "    AND \"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds'"},
+    {"shared_prefix",
+        "SELECT \"oid\""
+        "  FROM \"" GIT2_REPOS_TABLE_NAME "\""
+        "  WHERE \"repo_id\" = $3::bigint"
+        "    AND \"oid\" >= $1::bytea AND \"oid\" <= $2::bytea"
+        "  LIMIT 2"},
+    {"shared_read_chunk",
+        "SELECT substring(o.\"data\" FROM $2::int FOR $3::int)"
+        "  FROM \"" GIT2_TABLE_NAME "\" o"
+        "  JOIN \"" GIT2_REPOS_TABLE_NAME "\" r ON r.\"oid\" = o.\"oid\""
+        "  WHERE o.\"oid\" = $1::bytea AND r.\"repo_id\" = $4::bigint"},
+    /* the content is only stored if no repository has it yet;
+     * otherwise all that is written is the membership row.  Either way
+     * the content row stays locked until the membership row commits,
+     * so another repository's sweep can't delete it in between */
+    {"shared_write",
+        "WITH \"content\" AS ("
+        "  INSERT INTO \"" GIT2_TABLE_NAME "\""
+        "    (\"oid\", \"type\", \"size\", \"data\")"
+        "    VALUES($1::bytea, $2::int, $3::bigint, $4::bytea)"
+        "    ON CONFLICT (\"oid\")" GIT2_FRESHEN_SQL(GIT2_TABLE_NAME)
+        ")"
+        "INSERT INTO \"" GIT2_REPOS_TABLE_NAME "\" (\"repo_id\", \"oid\")"
+        "  VALUES($5::bigint, $1::bytea)"
+        "  ON CONFLICT (\"repo_id\", \"oid\")" GIT2_FRESHEN_SQL(GIT2_REPOS_TABLE_NAME)},
+    {"shared_finalize_stream",
+        "WITH \"chunks\" AS ("
+        "  DELETE FROM \"" GIT2_CHUNKS_TABLE_NAME "\""
+        "    WHERE \"stream\" = $1::bigint"
+        "    RETURNING \"seq\", \"data\""
+        "), \"content\" AS ("
+        "  INSERT INTO \"" GIT2_TABLE_NAME "\""
+        "    (\"oid\", \"type\", \"size\", \"data\")"
+        "    SELECT $2::bytea, $3::int, $4::bigint,"
+        "      coalesce(string_agg(\"data\", ''::bytea ORDER BY \"seq\"), ''::bytea)"
+        "    FROM \"chunks\""
+        "    ON CONFLICT (\"oid\")" GIT2_FRESHEN_SQL(GIT2_TABLE_NAME)
+        ")"
+        "INSERT INTO \"" GIT2_REPOS_TABLE_NAME "\" (\"repo_id\", \"oid\")"
+        "  VALUES($5::bigint, $2::bytea)"
+        "  ON CONFLICT (\"repo_id\", \"oid\")" GIT2_FRESHEN_SQL(GIT2_REPOS_TABLE_NAME)},
+    {"shared_fork",
+        "INSERT INTO \"" GIT2_REPOS_TABLE_NAME "\" (\"repo_id\", \"oid\")"
+        "  SELECT $1::bigint, \"oid\""
+        "  FROM \"" GIT2_REPOS_TABLE_NAME "\""
+        "  WHERE \"repo_id\" = $2::bigint"
+        "  ON CONFLICT (\"repo_id\", \"oid\")" GIT2_FRESHEN_SQL(GIT2_REPOS_TABLE_NAME)},
+};
+
+
+static void set_giterr_from_pg(PGconn *db)
 {
-    giterr_set_str(GITERR_ODB, PQerrorMessage(backend->db));
+    giterr_set_str(GITERR_ODB, PQerrorMessage(db));
 }
 
 static void pgsql_odb_backend__free(git_odb_backend *_backend)
 {
     pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    size_t i;
     assert(backend);
 
-    PQfinish(backend->db);
+    for (i = 0; backend->cache && i < GIT2_PACK_CACHE_SLOTS; ++i)
+        free(backend->cache[i].data);
+    free(backend->cache);
+    pthread_mutex_destroy(&backend->cache_lock);
+
+    pg_pool_free(backend->pool);
     free(backend);
 }
 
+static int get_conn(pg_conn **out, pgsql_odb_backend *backend)
+{
+    if (pg_pool_get(out, backend->pool) < 0) {
+        giterr_set_str(GITERR_ODB, "could not connect to the database");
+        return GIT_ERROR;
+    }
+
+    return GIT_OK;
+}
+
+static int is_shared_stmt(const pg_stmt *stmt)
+{
+    return stmt >= shared_stmts
+        && stmt < shared_stmts + sizeof(shared_stmts) / sizeof(shared_stmts[0]);
+}
+
+static const pg_stmt *find_stmt(pgsql_odb_backend *backend, const char *stmt_name)
+{
+    size_t i;
+
+    for (i = 0; backend->shared && i < sizeof(shared_stmts) / sizeof(shared_stmts[0]); ++i)
+        if (strcmp(shared_stmts[i].name + strlen("shared_"), stmt_name) == 0)
+            return &shared_stmts[i];
+
+    for (i = 0; backend->packs && i < sizeof(packed_stmts) / sizeof(packed_stmts[0]); ++i)
+        if (strcmp(packed_stmts[i].name + strlen("packed_"), stmt_name) == 0)
+            return &packed_stmts[i];
+
+    for (i = 0; i < sizeof(odb_stmts) / sizeof(odb_stmts[0]); ++i)
+        if (strcmp(odb_stmts[i].name, stmt_name) == 0)
+            return &odb_stmts[i];
+
+    assert(!"unknown statement");
+    return NULL;
+}
+
+/* prepares the backend's version of the statement called `stmt_name`
+ * on `conn` if it isn't yet, and returns it */
+static const pg_stmt *prepare_stmt(pgsql_odb_backend *backend, pg_conn *conn,
+    const char *stmt_name)
+{
+    const pg_stmt *stmt = find_stmt(backend, stmt_name);
+
+    if (NULL == stmt) {
+        giterr_set_str(GITERR_ODB, "unknown statement");
+        return NULL;
+    }
+
+    if (pg_pool_prepare(conn, stmt) < 0) {
+        set_giterr_from_pg(conn->db);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+/* appends the repository id to the parameters of a shared statement,
+ * for which `values` and `lengths` need room; returns the new count */
+static int add_repo_param(pgsql_odb_backend *backend, const pg_stmt *stmt,
+    int n_params, const char **values, int *lengths)
+{
+    if (!is_shared_stmt(stmt))
+        return n_params;
+
+    values[n_params] = (const char*)&backend->fmtd_repo_id;
+    lengths[n_params] = sizeof(backend->fmtd_repo_id);
+    return n_params + 1;
+}
+
+/*
+ * Runs a prepared statement with binary parameters on a connection of
+ * its own for the duration.  The result doesn't depend on the
+ * connection, which is back in the pool by the time it is returned.  On
+ * failure (NULL, or an error status) the error is already set.
+ */
+static PGresult *exec_stmt(pgsql_odb_backend *backend, const char *stmt_name,
+    int n_params, const char * const *values, const int *lengths)
+{
+    static const int formats[5] = {1, 1, 1, 1, 1};     /* binary */
+    const char *all_values[5];
+    int all_lengths[5];
+    const pg_stmt *stmt;
+    pg_conn *conn;
+    PGresult *result = NULL;
+    ExecStatusType status;
+
+    assert(n_params <= 4);
+
+    if (n_params > 0) {
+        memcpy(all_values, values, n_params * sizeof(*values));
+        memcpy(all_lengths, lengths, n_params * sizeof(*lengths));
+    }
+
+    if (get_conn(&conn, backend) < 0)
+        return NULL;
+
+    if ((stmt = prepare_stmt(backend, conn, stmt_name)) != NULL) {
+        n_params = add_repo_param(backend, stmt, n_params, all_values, all_lengths);
+        result = PQexecPrepared(conn->db, stmt->name,
+            n_params, all_values, all_lengths, formats,
+            /* binary result */ 1);
+    }
+
+    status = PQresultStatus(result);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK) {
+        set_giterr_from_pg(conn->db);
+        pg_pool_put(backend->pool, conn, -1);
+    } else {
+        pg_pool_put(backend->pool, conn, 0);
+    }
+
+    return result;
+}
+
 static PGresult *exec_read_stmt(pgsql_odb_backend *backend, const char *stmt_name,
     const git_oid *oid)
 {
-    const char * const param_values[1] = {oid->id};
+    const char * const param_values[1] = {(const char*)oid->id};
     int param_lengths[1] = {GIT_OID_RAWSZ};
-    int param_formats[1] = {1};     /* binary */
-    return PQexecPrepared(backend->db, stmt_name,
-        1, param_values, param_lengths, param_formats,
-        /* binary result */ 1);
+    return exec_stmt(backend, stmt_name, 1, param_values, param_lengths);
 }
 
 
-static int pgsql_odb_backend__read_header(size_t *len_p, git_otype *type_p,
-    git_odb_backend *_backend, const git_oid *oid)
+
+/*
+ * Entries of a stored pack are resolved here rather than on the server.
+ * Deltas in a chain share their bases, so resolved bases are kept in a
+ * small direct-mapped cache keyed by pack and offset, which holds at
+ * most GIT2_PACK_CACHE_BYTES.
+ */
+static pack_cache_entry *cache_slot(pgsql_odb_backend *backend,
+    int64_t pack_id, uint64_t offset)
+{
+    uint64_t h = ((uint64_t)pack_id * 0x9e3779b97f4a7c15ULL) ^ offset;
+    return &backend->cache[(h ^ (h >> 29)) % GIT2_PACK_CACHE_SLOTS];
+}
+
+/* copies a cached entry into a malloc'd buffer; returns 0 on a miss */
+static int cache_get(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, int64_t pack_id, uint64_t offset)
+{
+    pack_cache_entry *entry;
+    int found = 0;
+
+    pthread_mutex_lock(&backend->cache_lock);
+
+    entry = cache_slot(backend, pack_id, offset);
+    if (entry->data != NULL && entry->pack_id == pack_id && entry->offset == offset
+        && NULL != (*data = malloc(entry->len > 0 ? entry->len : 1))) {
+        memcpy(*data, entry->data, entry->len);
+        *len = entry->len;
+        *type = entry->type;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&backend->cache_lock);
+    return found;
+}
+
+/* replaces whatever was in the entry's slot; an entry that doesn't fit
+ * the budget just isn't cached */
+static void cache_put(pgsql_odb_backend *backend, int64_t pack_id, uint64_t offset,
+    const void *data, size_t len, git_otype type)
+{
+    pack_cache_entry *entry;
+    void *copy;
+
+    if (len > GIT2_PACK_CACHE_BYTES / 8 || NULL == (copy = malloc(len > 0 ? len : 1)))
+        return;
+    memcpy(copy, data, len);
+
+    pthread_mutex_lock(&backend->cache_lock);
+
+    entry = cache_slot(backend, pack_id, offset);
+    if (entry->data != NULL) {
+        backend->cache_bytes -= entry->len;
+        free(entry->data);
+        entry->data = NULL;
+    }
+
+    if (backend->cache_bytes + len <= GIT2_PACK_CACHE_BYTES) {
+        entry->pack_id = pack_id;
+        entry->offset = offset;
+        entry->type = type;
+        entry->data = copy;
+        entry->len = len;
+        backend->cache_bytes += len;
+        copy = NULL;
+    }
+
+    pthread_mutex_unlock(&backend->cache_lock);
+    free(copy);
+}
+
+static int packed_read(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, const git_oid *oid);
+static int read_pack_base(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, int64_t pack_id, uint64_t offset);
+
+/* turns the raw bytes of the entry at `offset` of a pack into a malloc'd
+ * object, resolving its delta base first if it has one */
+static int resolve_entry(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, int64_t pack_id, uint64_t offset,
+    const unsigned char *raw, size_t raw_len)
+{
+    pack_entry entry;
+    void *delta = NULL, *base = NULL;
+    size_t base_len;
+    int error;
+
+    if (pack_entry_parse(&entry, raw, raw_len, offset) < 0
+        || pack_inflate(entry.type < PACK_OFS_DELTA ? data : &delta,
+            raw + entry.header_len, raw_len - entry.header_len, entry.size) < 0) {
+        giterr_set_str(GITERR_ODB, "corrupt pack entry");
+        return GIT_ERROR;
+    }
+
+    if (entry.type < PACK_OFS_DELTA) {
+        *len = entry.size;
+        *type = (git_otype)entry.type;
+        return GIT_OK;
+    }
+
+    if (entry.type == PACK_OFS_DELTA)
+        error = read_pack_base(&base, &base_len, type, backend, pack_id, entry.base_offset);
+    else
+        error = packed_read(&base, &base_len, type, backend, &entry.base_oid);
+
+    if (error == GIT_ENOTFOUND) {
+        giterr_set_str(GITERR_ODB, "delta base missing from the database");
+        error = GIT_ERROR;
+    }
+
+    if (error == GIT_OK
+        && pack_delta_apply(data, len, base, base_len, delta, entry.size) < 0) {
+        giterr_set_str(GITERR_ODB, "corrupt pack entry");
+        error = GIT_ERROR;
+    }
+
+    free(base);
+    free(delta);
+    return error;
+}
+
+/* the base of an offset delta, from the cache if it's there */
+static int read_pack_base(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, int64_t pack_id, uint64_t offset)
+{
+    uint64_t fmtd_pack_id = htobe64((uint64_t)pack_id);
+    uint64_t fmtd_offset = htobe64(offset);
+    const char * const param_values[2] = {
+        (const char*)&fmtd_pack_id,
+        (const char*)&fmtd_offset};
+    int param_lengths[2] = {sizeof(fmtd_pack_id), sizeof(fmtd_offset)};
+    PGresult *result;
+    int error;
+
+    if (cache_get(data, len, type, backend, pack_id, offset))
+        return GIT_OK;
+
+    result = exec_stmt(backend, "pack_entry_at", 2, param_values, param_lengths);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        PQclear(result);
+        return GIT_ERROR;
+    }
+
+    if (PQntuples(result) == 0)
+        error = GIT_ENOTFOUND;
+    else
+        error = resolve_entry(data, len, type, backend, pack_id, (uint64_t)offset,
+            (const unsigned char*)PQgetvalue(result, 0, 0), PQgetlength(result, 0, 0));
+    PQclear(result);
+
+    if (error == GIT_OK)
+        cache_put(backend, pack_id, offset, *data, *len, *type);
+
+    return error;
+}
+
+/* resolves `row` of a "read" result that found a pack entry */
+static int resolve_result(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, PGresult *result, int row)
+{
+    int64_t pack_id, offset;
+
+    if (get_int64_from_result(result, &pack_id, row, 2)
+        || get_int64_from_result(result, &offset, row, 3))
+        return GIT_ERROR;
+
+    return resolve_entry(data, len, type, backend, pack_id, (uint64_t)offset,
+        (const unsigned char*)PQgetvalue(result, row, 1), PQgetlength(result, row, 1));
+}
+
+/* reads an object of a backend storing packs, row or pack entry, into
+ * a malloc'd buffer */
+static int packed_read(void **data, size_t *len, git_otype *type,
+    pgsql_odb_backend *backend, const git_oid *oid)
+{
+    PGresult *result;
+    int error = GIT_ERROR;
+
+    result = exec_read_stmt(backend, "read", oid);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        goto cleanup;
+    }
+
+    if (PQntuples(result) == 0) {
+        error = GIT_ENOTFOUND;
+        goto cleanup;
+    }
+
+    if (!PQgetisnull(result, 0, 2)) {
+        error = resolve_result(data, len, type, backend, result, 0);
+        goto cleanup;
+    }
+
+    if (get_int_from_result(result, (int*)type, 0, 0))
+        goto cleanup;
+
+    *len = PQgetlength(result, 0, 1);
+    if (NULL == (*data = malloc(*len > 0 ? *len : 1))) {
+        giterr_set_oom();
+        goto cleanup;
+    }
+    memcpy(*data, PQgetvalue(result, 0, 1), *len);
+    error = GIT_OK;
+
+cleanup:
+    PQclear(result);
+    return error;
+}
+
+static int read_size(size_t *len_p, pgsql_odb_backend *backend, const git_oid *oid)
+{
+    PGresult *result;
+    int size;
+    int error = GIT_ERROR;
+
+    result = exec_read_stmt(backend, "read_size", oid);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK)
+        goto cleanup;
+
+    if (PQntuples(result) == 0) {
+        giterr_set_str(GITERR_ODB, "object went away while being read");
+        error = GIT_ENOTFOUND;
+        goto cleanup;
+    }
+
+    if (get_int_from_result(result, &size, 0, 0) == 0) {
+        *len_p = (size_t)size;
+        error = GIT_OK;
+    }
+
+cleanup:
+    PQclear(result);
+    return error;
+}
+
+/* `packed`, if given, is set when the object is a pack entry */
+static int read_header(size_t *len_p, git_otype *type_p, int *packed,
+    pgsql_odb_backend *backend, const git_oid *oid)
 {
-    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
     PGresult *result;
+    int64_t size;
     int error = GIT_ERROR;
 
     assert(len_p && type_p && backend && oid);
 
-    result = exec_read_stmt(backend, "read", oid);
+    /* answered from the header index, without touching "data" */
+    result = exec_read_stmt(backend, "read_header", oid);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
         error = GIT_ERROR;
-        set_giterr_from_pg(backend);
         goto cleanup;
     }
 
@@ -90,13 +887,29 @@ static int pgsql_odb_backend__read_header(size_t *len_p, git_otype *type_p,
         goto cleanup;
     }
 
-    if (get_int_from_result(result, type_p, 0, 0)
-        || get_int_from_result(result, len_p, 0, 1)) {
+    if (packed != NULL)
+        *packed = backend->packs && *PQgetvalue(result, 0, 2) != 0;
+
+    if (get_int_from_result(result, type_p, 0, 0)) {
         error = GIT_ERROR;
         /* error string already set by function call */
         goto cleanup;
     }
 
+    /* a row of an upgraded table that git_odb_backend_pgsql_backfill_size()
+     * hasn't filled in yet; pack entries always have their size */
+    if (PQgetisnull(result, 0, 1)) {
+        PQclear(result);
+        error = read_size(len_p, backend, oid);
+        return error;
+    }
+
+    if (get_int64_from_result(result, &size, 0, 1)) {
+        error = GIT_ERROR;
+        goto cleanup;
+    }
+
+    *len_p = (size_t)size;
     error = GIT_OK;
 
 cleanup:
@@ -104,20 +917,41 @@ cleanup:
     return error;
 }
 
+static int pgsql_odb_backend__read_header(size_t *len_p, git_otype *type_p,
+    git_odb_backend *_backend, const git_oid *oid)
+{
+    return read_header(len_p, type_p, NULL, (pgsql_odb_backend*)_backend, oid);
+}
+
 static int pgsql_odb_backend__read(void **data_p, size_t *len_p, git_otype *type_p,
     git_odb_backend *_backend, const git_oid *oid)
 {
     pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
     PGresult *result;
+    void *data;
     int error = GIT_ERROR;
     int value_len;
 
     assert(len_p && type_p && backend && oid);
 
+    /* pack entries have to be resolved, and rows come back the same */
+    if (backend->packs) {
+        if ((error = packed_read(&data, len_p, type_p, backend, oid)) < 0)
+            return error;
+
+        if (*len_p > 0) {
+            *data_p = git_odb_backend_malloc(_backend, *len_p);
+            memcpy(*data_p, data, *len_p);
+        }
+
+        free(data);
+        return GIT_OK;
+    }
+
     result = exec_read_stmt(backend, "read", oid);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
         error = GIT_ERROR;
-        set_giterr_from_pg(backend);
         goto cleanup;
     }
 
@@ -145,6 +979,18 @@ cleanup:
     return error;
 }
 
+/* best effort: the object is there either way, and a read-only server
+ * or role can't re-stamp it at all, so a failure only costs the grace
+ * period the re-stamp would have bought */
+static void freshen(pgsql_odb_backend *backend, const git_oid *oid)
+{
+    PGresult *result = exec_read_stmt(backend, "freshen", oid);
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        giterr_clear();
+    PQclear(result);
+}
+
 static int pgsql_odb_backend__exists(git_odb_backend *_backend, const git_oid *oid)
 {
     pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
@@ -153,7 +999,7 @@ static int pgsql_odb_backend__exists(git_odb_backend *_backend, const git_oid *o
 
     assert(backend && oid);
 
-    result = exec_read_stmt(backend, "read", oid);
+    result = exec_read_stmt(backend, "exists", oid);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
         goto cleanup;
     }
@@ -164,49 +1010,2191 @@ static int pgsql_odb_backend__exists(git_odb_backend *_backend, const git_oid *o
 
 cleanup:
     PQclear(result);
+
+    if (found && backend->freshen)
+        freshen(backend, oid);
+
     return found;
 }
 
-static int pgsql_odb_backend__write(git_odb_backend *_backend,
-    const git_oid *oid, const void *data, size_t len, git_otype type)
+/* fills in the smallest and largest raw ids starting with the first
+ * `len` hex digits of short_oid */
+static void prefix_range(git_oid *lo, git_oid *hi, const git_oid *short_oid, size_t len)
 {
-    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
-    PGresult *result;
-    uint32_t fmtd_type = htobe32(type);
-    const char * const param_values[3] = {
-        oid->id,
-        (const char*)&fmtd_type,
-        data};
-    int param_lengths[3] = {GIT_OID_RAWSZ, sizeof(fmtd_type), len};
-    int param_formats[3] = {1, 1, 1};     /* binary */
+    size_t i;
 
-    assert(data && backend && oid);
+    memset(lo->id, 0x00, GIT_OID_RAWSZ);
+    memset(hi->id, 0xff, GIT_OID_RAWSZ);
 
-    result = PQexecPrepared(backend->db, "write",
-        3, param_values, param_lengths, param_formats,
-        /* binary result */ 1);
-    if (complete_pq_exec(result)) {
-        set_giterr_from_pg(backend);
-        return GIT_ERROR;
-    }
+    memcpy(lo->id, short_oid->id, len / 2);
+    memcpy(hi->id, short_oid->id, len / 2);
 
-    return GIT_OK;
+    if (len % 2) {
+        i = len / 2;
+        lo->id[i] = short_oid->id[i] & 0xf0;
+        hi->id[i] = short_oid->id[i] | 0x0f;
+    }
 }
 
-static int init_db(PGconn *db)
+/* resolves a prefix with one range scan of the primary key */
+static int find_prefix(git_oid *out, pgsql_odb_backend *backend,
+    const git_oid *short_oid, size_t len)
 {
+    git_oid lo, hi;
+    const char * const param_values[2] = {(const char*)lo.id, (const char*)hi.id};
+    int param_lengths[2] = {GIT_OID_RAWSZ, GIT_OID_RAWSZ};
     PGresult *result;
+    int error = GIT_ERROR;
 
-    result = PQexec(db,
-        /* run as plpgsql so if statement works */
-        "DO $BODY$ BEGIN "
+    prefix_range(&lo, &hi, short_oid, len);
 
-        "CREATE TABLE IF NOT EXISTS \"" GIT2_TABLE_NAME "\" ("
-        "  \"oid\" bytea NOT NULL DEFAULT '',"
-        "  \"type\" int NOT NULL,"
-        "  \"data\" bytea NOT NULL,"
-        "  CONSTRAINT \"" GIT2_PK_NAME "\" PRIMARY KEY (\"oid\")"
-        ");"
+    result = exec_stmt(backend, "prefix", 2, param_values, param_lengths);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        goto cleanup;
+    }
+
+    if (PQntuples(result) == 0) {
+        error = GIT_ENOTFOUND;
+        goto cleanup;
+    }
+
+    if (PQntuples(result) > 1) {
+        error = GIT_EAMBIGUOUS;
+        goto cleanup;
+    }
+
+    if (PQgetlength(result, 0, 0) != GIT_OID_RAWSZ) {
+        giterr_set_str(GITERR_ODB, "malformed object id in the database");
+        goto cleanup;
+    }
+
+    git_oid_fromraw(out, (const unsigned char*)PQgetvalue(result, 0, 0));
+    error = GIT_OK;
+
+cleanup:
+    PQclear(result);
+    return error;
+}
+
+static int pgsql_odb_backend__read_prefix(git_oid *out_oid, void **data_p,
+    size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
+    const git_oid *short_oid, size_t len)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    git_oid found;
+    int error;
+
+    assert(out_oid && data_p && len_p && type_p && backend && short_oid);
+
+    /* just match the full identifier */
+    if (len >= GIT_OID_HEXSZ)
+        git_oid_cpy(&found, short_oid);
+    else if ((error = find_prefix(&found, backend, short_oid, len)) < 0)
+        return error;
+
+    if ((error = pgsql_odb_backend__read(data_p, len_p, type_p, _backend, &found)) == GIT_OK)
+        git_oid_cpy(out_oid, &found);
+
+    return error;
+}
+
+static int pgsql_odb_backend__exists_prefix(git_oid *out_oid,
+    git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+
+    assert(out_oid && backend && short_oid);
+
+    if (len > GIT_OID_HEXSZ)
+        len = GIT_OID_HEXSZ;
+
+    return find_prefix(out_oid, backend, short_oid, len);
+}
+
+static int pgsql_odb_backend__write(git_odb_backend *_backend,
+    const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    uint32_t fmtd_type = htobe32(type);
+    uint64_t fmtd_size = htobe64(len);
+    const char * const param_values[4] = {
+        (const char*)oid->id,
+        (const char*)&fmtd_type,
+        (const char*)&fmtd_size,
+        data};
+    int param_lengths[4] = {GIT_OID_RAWSZ, sizeof(fmtd_type), sizeof(fmtd_size), len};
+
+    assert(data && backend && oid);
+
+    result = exec_stmt(backend, "write", 4, param_values, param_lengths);
+    if (complete_pq_exec(result))
+        return GIT_ERROR;
+
+    return GIT_OK;
+}
+
+typedef struct {
+    git_odb_stream parent;
+    git_oid oid;
+    size_t offset;
+    char *buf;
+    size_t buf_len;
+    size_t buf_pos;
+} pgsql_readstream;
+
+typedef struct {
+    git_odb_stream parent;
+    git_otype type;
+    int64_t stream_id;
+    int32_t seq;
+    char *buf;
+    size_t buf_len;
+} pgsql_writestream;
+
+static int fetch_chunk(pgsql_readstream *stream)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)stream->parent.backend;
+    PGresult *result;
+    size_t want = stream->parent.declared_size - stream->offset;
+    uint32_t from, count;
+    const char * const param_values[3] = {
+        (const char*)stream->oid.id,
+        (const char*)&from,
+        (const char*)&count};
+    int param_lengths[3] = {GIT_OID_RAWSZ, sizeof(from), sizeof(count)};
+    int error = GIT_ERROR;
+
+    if (want > GIT2_STREAM_CHUNK)
+        want = GIT2_STREAM_CHUNK;
+
+    /* substring() counts from 1 */
+    from = htobe32((uint32_t)stream->offset + 1);
+    count = htobe32((uint32_t)want);
+
+    result = exec_stmt(backend, "read_chunk", 3, param_values, param_lengths);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK)
+        goto cleanup;
+
+    if (PQntuples(result) == 0 || (size_t)PQgetlength(result, 0, 0) != want) {
+        giterr_set_str(GITERR_ODB, "object changed size while it was being read");
+        goto cleanup;
+    }
+
+    memcpy(stream->buf, PQgetvalue(result, 0, 0), want);
+    stream->buf_len = want;
+    stream->buf_pos = 0;
+    stream->offset += want;
+    error = GIT_OK;
+
+cleanup:
+    PQclear(result);
+    return error;
+}
+
+/* returns how many bytes were copied into `buffer`, 0 at the end */
+static int pgsql_readstream__read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+    pgsql_readstream *stream = (pgsql_readstream*)_stream;
+    size_t n;
+
+    assert(stream && buffer);
+
+    if (stream->buf_pos == stream->buf_len) {
+        if (stream->offset == stream->parent.declared_size)
+            return 0;
+
+        if (fetch_chunk(stream) < 0)
+            return GIT_ERROR;
+    }
+
+    n = stream->buf_len - stream->buf_pos;
+    if (n > len)
+        n = len;
+    if (n > INT_MAX)
+        n = INT_MAX;
+
+    memcpy(buffer, stream->buf + stream->buf_pos, n);
+    stream->buf_pos += n;
+    stream->parent.received_bytes += n;
+    return (int)n;
+}
+
+static void pgsql_readstream__free(git_odb_stream *_stream)
+{
+    pgsql_readstream *stream = (pgsql_readstream*)_stream;
+
+    free(stream->buf);
+    free(stream);
+}
+
+/*
+ * Reads an object a chunk at a time with substring().  The "data"
+ * column is stored uncompressed out of line, so Postgres only fetches
+ * the TOAST chunks a substring covers, and neither side ever holds more
+ * than GIT2_STREAM_CHUNK bytes of the object.  Objects in a stored pack
+ * are the exception.
+ */
+static int pgsql_odb_backend__readstream(git_odb_stream **stream_out,
+    git_odb_backend *_backend, const git_oid *oid)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    pgsql_readstream *stream;
+    size_t len;
+    git_otype type;
+    int packed = 0, error;
+
+    assert(stream_out && _backend && oid);
+
+    if ((error = read_header(&len, &type, &packed, backend, oid)) < 0)
+        return error;
+
+    if (NULL == (stream = calloc(1, sizeof(pgsql_readstream)))) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    /* a pack entry can only be resolved whole, so it is read up front
+     * and the stream hands out the buffer */
+    if (packed) {
+        if ((error = packed_read((void**)&stream->buf, &stream->buf_len,
+                &type, backend, oid)) < 0) {
+            free(stream);
+            return error;
+        }
+        len = stream->offset = stream->buf_len;
+    } else if (NULL == (stream->buf = malloc(GIT2_STREAM_CHUNK))) {
+        free(stream);
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    git_oid_cpy(&stream->oid, oid);
+    stream->parent.backend = _backend;
+    stream->parent.mode = GIT_STREAM_RDONLY;
+    stream->parent.declared_size = len;
+    stream->parent.read = &pgsql_readstream__read;
+    stream->parent.free = &pgsql_readstream__free;
+
+    *stream_out = (git_odb_stream*)stream;
+    return GIT_OK;
+}
+
+static int flush_chunk(pgsql_writestream *stream)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)stream->parent.backend;
+    PGresult *result;
+    int64_t fmtd_id = htobe64(stream->stream_id);
+    int32_t fmtd_seq = htobe32(stream->seq);
+    const char * const param_values[3] = {
+        (const char*)&fmtd_id,
+        (const char*)&fmtd_seq,
+        stream->buf};
+    int param_lengths[3] = {sizeof(fmtd_id), sizeof(fmtd_seq), stream->buf_len};
+
+    if (stream->buf_len == 0)
+        return GIT_OK;
+
+    /* a chunk at a time, so a stream doesn't hold on to a connection
+     * while the caller produces the data */
+    result = exec_stmt(backend, "write_chunk", 3, param_values, param_lengths);
+    if (complete_pq_exec(result))
+        return GIT_ERROR;
+
+    stream->seq++;
+    stream->buf_len = 0;
+    return GIT_OK;
+}
+
+static int pgsql_writestream__write(git_odb_stream *_stream, const char *data, size_t len)
+{
+    pgsql_writestream *stream = (pgsql_writestream*)_stream;
+    size_t n;
+
+    assert(stream && data);
+
+    while (len > 0) {
+        if (stream->buf_len == GIT2_STREAM_CHUNK && flush_chunk(stream) < 0)
+            return GIT_ERROR;
+
+        n = GIT2_STREAM_CHUNK - stream->buf_len;
+        if (n > len)
+            n = len;
+
+        memcpy(stream->buf + stream->buf_len, data, n);
+        stream->buf_len += n;
+        data += n;
+        len -= n;
+    }
+
+    return GIT_OK;
+}
+
+/* glues the chunks back together on the server */
+static int pgsql_writestream__finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+    pgsql_writestream *stream = (pgsql_writestream*)_stream;
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_stream->backend;
+    PGresult *result;
+    int64_t fmtd_id = htobe64(stream->stream_id);
+    uint32_t fmtd_type = htobe32(stream->type);
+    uint64_t fmtd_size = htobe64(_stream->declared_size);
+    const char * const param_values[4] = {
+        (const char*)&fmtd_id,
+        (const char*)oid->id,
+        (const char*)&fmtd_type,
+        (const char*)&fmtd_size};
+    int param_lengths[4] = {sizeof(fmtd_id), GIT_OID_RAWSZ, sizeof(fmtd_type), sizeof(fmtd_size)};
+
+    assert(stream && oid);
+
+    if (flush_chunk(stream) < 0)
+        return GIT_ERROR;
+
+    result = exec_stmt(backend, "finalize_stream", 4, param_values, param_lengths);
+    if (complete_pq_exec(result))
+        return GIT_ERROR;
+
+    /* the chunks went away with the INSERT */
+    stream->seq = 0;
+    return GIT_OK;
+}
+
+static void pgsql_writestream__free(git_odb_stream *_stream)
+{
+    pgsql_writestream *stream = (pgsql_writestream*)_stream;
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_stream->backend;
+    int64_t fmtd_id = htobe64(stream->stream_id);
+    const char * const param_values[1] = {(const char*)&fmtd_id};
+    int param_lengths[1] = {sizeof(fmtd_id)};
+
+    /* drop whatever an abandoned stream sent */
+    if (stream->seq > 0)
+        complete_pq_exec(exec_stmt(backend, "discard_stream",
+            1, param_values, param_lengths));
+
+    free(stream->buf);
+    free(stream);
+}
+
+/*
+ * Objects are sent GIT2_STREAM_CHUNK bytes at a time into an unlogged
+ * chunk table, under an id drawn from a sequence, and assembled into
+ * their row by one INSERT ... SELECT when the stream is finalized.
+ */
+static int pgsql_odb_backend__writestream(git_odb_stream **stream_out,
+    git_odb_backend *_backend, size_t len, git_otype type)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    pgsql_writestream *stream;
+    PGresult *result;
+    int error = GIT_ERROR;
+
+    assert(stream_out && backend);
+
+    stream = calloc(1, sizeof(pgsql_writestream));
+    if (NULL == stream || NULL == (stream->buf = malloc(GIT2_STREAM_CHUNK))) {
+        free(stream);
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    result = exec_stmt(backend, "next_stream_id", 0, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) != 1
+        || get_int64_from_result(result, &stream->stream_id, 0, 0))
+        goto cleanup;
+
+    stream->type = type;
+    stream->parent.backend = _backend;
+    stream->parent.mode = GIT_STREAM_WRONLY;
+    stream->parent.declared_size = len;
+    stream->parent.write = &pgsql_writestream__write;
+    stream->parent.finalize_write = &pgsql_writestream__finalize_write;
+    stream->parent.free = &pgsql_writestream__free;
+
+    *stream_out = (git_odb_stream*)stream;
+    error = GIT_OK;
+
+cleanup:
+    PQclear(result);
+    if (error < 0) {
+        free(stream->buf);
+        free(stream);
+    }
+    return error;
+}
+
+/* fills in the parameters of the i-th statement in a batch */
+typedef void (*batch_params_cb)(size_t i, const char **values, int *lengths,
+    void *payload);
+
+/* handles the result of the i-th statement; a non-zero return is passed
+ * back from run_batch, and the rest of the results are only drained */
+typedef int (*batch_result_cb)(PGresult *result, size_t i, void *payload);
+
+static int batch_result(PGconn *db, PGresult *result,
+    ExecStatusType expected, size_t i, batch_result_cb handle, void *payload)
+{
+    if (PQresultStatus(result) != expected) {
+        set_giterr_from_pg(db);
+        return GIT_ERROR;
+    }
+
+    return handle(result, i, payload);
+}
+
+/*
+ * Runs a prepared statement once for every item in a batch.  With libpq
+ * pipeline mode, up to GIT2_PIPELINE_DEPTH statements go out before the
+ * first result is read, so a batch costs a round trip per
+ * GIT2_PIPELINE_DEPTH items instead of one per item.  The statements of
+ * one round trip run in a single implicit transaction.
+ */
+static int run_batch(pgsql_odb_backend *backend, const char *stmt_name,
+    int n_params, ExecStatusType expected, size_t n,
+    batch_params_cb params, batch_result_cb handle, void *payload)
+{
+    const char *values[5];
+    int lengths[5];
+    int formats[5] = {1, 1, 1, 1, 1};     /* binary */
+    const pg_stmt *stmt;
+    pg_conn *conn;
+    PGconn *db;
+    PGresult *result;
+    size_t i;
+#ifdef LIBPQ_HAS_PIPELINING
+    size_t start, end, sent;
+#endif
+    int error = GIT_OK;
+
+    assert(n_params <= 4);
+
+    if (get_conn(&conn, backend) < 0)
+        return GIT_ERROR;
+    db = conn->db;
+
+    /* PQprepare can't be sent down a pipeline along with the rest */
+    if ((stmt = prepare_stmt(backend, conn, stmt_name)) == NULL) {
+        error = GIT_ERROR;
+        goto done;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!PQenterPipelineMode(db)) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto done;
+    }
+
+    for (start = 0; start < n && error == GIT_OK; start = end) {
+        end = (n - start < GIT2_PIPELINE_DEPTH) ? n : start + GIT2_PIPELINE_DEPTH;
+
+        for (sent = start; sent < end; ++sent) {
+            params(sent, values, lengths, payload);
+            if (!PQsendQueryPrepared(db, stmt->name,
+                    add_repo_param(backend, stmt, n_params, values, lengths),
+                    values, lengths, formats, /* binary result */ 1)) {
+                set_giterr_from_pg(db);
+                error = GIT_ERROR;
+                break;
+            }
+        }
+
+        if (!PQpipelineSync(db)) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+            break;
+        }
+
+        /* every statement yields its result and then a NULL */
+        for (i = start; i < sent; ++i) {
+            result = PQgetResult(db);
+            if (error == GIT_OK)
+                error = batch_result(db, result, expected, i, handle, payload);
+            PQclear(result);
+            PQclear(PQgetResult(db));
+        }
+
+        /* and the sync point its own PGRES_PIPELINE_SYNC */
+        PQclear(PQgetResult(db));
+    }
+
+    if (!PQexitPipelineMode(db) && error == GIT_OK) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+    }
+#else
+    for (i = 0; i < n && error == GIT_OK; ++i) {
+        params(i, values, lengths, payload);
+        result = PQexecPrepared(db, stmt->name,
+            add_repo_param(backend, stmt, n_params, values, lengths),
+            values, lengths, formats, /* binary result */ 1);
+        error = batch_result(db, result, expected, i, handle, payload);
+        PQclear(result);
+    }
+#endif
+
+done:
+    /* GIT_EUSER stops the batch but leaves the connection fine */
+    pg_pool_put(backend->pool, conn, error == GIT_ERROR ? -1 : 0);
+    return error;
+}
+
+static void oid_params(size_t i, const char **values, int *lengths, void *payload)
+{
+    const git_oid *oids = payload;
+
+    values[0] = (const char*)oids[i].id;
+    lengths[0] = GIT_OID_RAWSZ;
+}
+
+typedef struct {
+    const git_oid *oids;
+    git_odb_pgsql_read_cb cb;
+    void *payload;
+    /* set for the pack entries, which are resolved after the batch */
+    int packs;
+    char *pending;
+} read_batch_payload;
+
+static void read_batch_params(size_t i, const char **values, int *lengths, void *payload)
+{
+    oid_params(i, values, lengths, (void*)((read_batch_payload*)payload)->oids);
+}
+
+static int read_batch_result(PGresult *result, size_t i, void *payload)
+{
+    read_batch_payload *batch = payload;
+    int type;
+
+    if (PQntuples(result) == 0)
+        return GIT_OK;
+
+    /* resolving takes connections of its own, while the batch holds one */
+    if (batch->packs && !PQgetisnull(result, 0, 2)) {
+        batch->pending[i] = 1;
+        return GIT_OK;
+    }
+
+    if (get_int_from_result(result, &type, 0, 0))
+        return GIT_ERROR;
+
+    if (batch->cb(&batch->oids[i], PQgetvalue(result, 0, 1),
+            PQgetlength(result, 0, 1), (git_otype)type, batch->payload)) {
+        giterr_clear();
+        return GIT_EUSER;
+    }
+
+    return GIT_OK;
+}
+
+int git_odb_backend_pgsql_read_batch(git_odb_backend *_backend,
+    const git_oid *oids, size_t n, git_odb_pgsql_read_cb cb, void *payload)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    read_batch_payload batch = {oids, cb, payload, backend->packs, NULL};
+    void *data;
+    size_t len, i;
+    git_otype type;
+    int error;
+
+    assert(backend && (oids || n == 0) && cb);
+
+    if (batch.packs && n > 0 && NULL == (batch.pending = calloc(n, 1))) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    error = run_batch(backend, "read", 1, PGRES_TUPLES_OK, n,
+        &read_batch_params, &read_batch_result, &batch);
+
+    for (i = 0; error == GIT_OK && batch.pending && i < n; ++i) {
+        if (!batch.pending[i])
+            continue;
+
+        /* gone since the batch ran, as if it hadn't been found */
+        if ((error = packed_read(&data, &len, &type, backend, &oids[i])) == GIT_ENOTFOUND) {
+            error = GIT_OK;
+            continue;
+        }
+
+        if (error == GIT_OK) {
+            if (cb(&oids[i], data, len, type, payload)) {
+                giterr_clear();
+                error = GIT_EUSER;
+            }
+            free(data);
+        }
+    }
+
+    free(batch.pending);
+    return error;
+}
+
+typedef struct {
+    const git_oid *oids;
+    int *found;
+} exists_batch_payload;
+
+static void exists_batch_params(size_t i, const char **values, int *lengths, void *payload)
+{
+    oid_params(i, values, lengths, (void*)((exists_batch_payload*)payload)->oids);
+}
+
+static int exists_batch_result(PGresult *result, size_t i, void *payload)
+{
+    ((exists_batch_payload*)payload)->found[i] = (PQntuples(result) > 0);
+    return GIT_OK;
+}
+
+static int freshen_batch_result(PGresult *result, size_t i, void *payload)
+{
+    (void)result;
+    (void)i;
+    (void)payload;
+    return GIT_OK;
+}
+
+int git_odb_backend_pgsql_exists_batch(git_odb_backend *_backend,
+    const git_oid *oids, size_t n, int *found)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    exists_batch_payload batch = {oids, found};
+
+    int error;
+
+    assert(backend && (oids || n == 0) && found);
+
+    error = run_batch(backend, "exists", 1, PGRES_TUPLES_OK, n,
+        &exists_batch_params, &exists_batch_result, &batch);
+
+    /* re-stamping an oid that wasn't found updates nothing, so the
+     * whole batch goes; as with exists(), failing is fine */
+    if (error == GIT_OK && backend->freshen && n > 0 &&
+            run_batch(backend, "freshen", 1, PGRES_COMMAND_OK, n,
+                &exists_batch_params, &freshen_batch_result, &batch) < 0)
+        giterr_clear();
+
+    return error;
+}
+
+typedef struct {
+    const git_odb_pgsql_object *objects;
+    uint32_t type;
+    uint64_t size;
+} write_batch_payload;
+
+static void write_batch_params(size_t i, const char **values, int *lengths, void *payload)
+{
+    write_batch_payload *batch = payload;
+    const git_odb_pgsql_object *obj = &batch->objects[i];
+
+    /* libpq copies the parameters as soon as the statement is sent, so
+     * one set of converted integers serves every statement */
+    batch->type = htobe32(obj->type);
+    batch->size = htobe64(obj->len);
+
+    values[0] = (const char*)obj->oid.id;
+    lengths[0] = GIT_OID_RAWSZ;
+    values[1] = (const char*)&batch->type;
+    lengths[1] = sizeof(batch->type);
+    values[2] = (const char*)&batch->size;
+    lengths[2] = sizeof(batch->size);
+    values[3] = obj->data;
+    lengths[3] = obj->len;
+}
+
+static int write_batch_result(PGresult *result, size_t i, void *payload)
+{
+    (void)result;
+    (void)i;
+    (void)payload;
+    return GIT_OK;
+}
+
+int git_odb_backend_pgsql_write_batch(git_odb_backend *_backend,
+    const git_odb_pgsql_object *objects, size_t n)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    write_batch_payload batch = {objects, 0, 0};
+
+    assert(backend && (objects || n == 0));
+
+    return run_batch(backend, "write", 4, PGRES_COMMAND_OK, n,
+        &write_batch_params, &write_batch_result, &batch);
+}
+
+typedef struct {
+    git_odb_writepack parent;
+    git_indexer *indexer;
+    char *path;
+} pgsql_writepack;
+
+typedef struct {
+    PGconn *db;
+    git_odb_backend *pack;
+    char *buf;
+    size_t len;
+    int error;
+} pgsql_copy_state;
+
+static void remove_dir(const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char file[4096];
+
+    if ((dir = opendir(path)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+        closedir(dir);
+    }
+
+    rmdir(path);
+}
+
+static int copy_flush(pgsql_copy_state *copy)
+{
+    if (copy->len > 0 && PQputCopyData(copy->db, copy->buf, copy->len) != 1) {
+        set_giterr_from_pg(copy->db);
+        return GIT_ERROR;
+    }
+
+    copy->len = 0;
+    return GIT_OK;
+}
+
+static int copy_put(pgsql_copy_state *copy, const void *data, size_t len)
+{
+    /* big objects skip the buffer instead of growing it */
+    if (copy->len + len > GIT2_COPY_BUFFER) {
+        if (copy_flush(copy) < 0)
+            return GIT_ERROR;
+
+        if (len > GIT2_COPY_BUFFER) {
+            if (PQputCopyData(copy->db, data, len) != 1) {
+                set_giterr_from_pg(copy->db);
+                return GIT_ERROR;
+            }
+            return GIT_OK;
+        }
+    }
+
+    memcpy(copy->buf + copy->len, data, len);
+    copy->len += len;
+    return GIT_OK;
+}
+
+/* starts a binary COPY with `sql`; once it has started, it has to be
+ * ended with copy_end */
+static int copy_begin(pgsql_copy_state *copy, const char *sql)
+{
+    static const char copy_header[] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+    PGresult *result;
+
+    result = PQexec(copy->db, sql);
+    if (PQresultStatus(result) != PGRES_COPY_IN) {
+        set_giterr_from_pg(copy->db);
+        PQclear(result);
+        return GIT_ERROR;
+    }
+    PQclear(result);
+
+    copy->len = 0;
+    copy->error = 0;
+
+    /* the buffer is empty, so this can't fail */
+    return copy_put(copy, copy_header, sizeof(copy_header) - 1);
+}
+
+/* finishes the COPY, or aborts it when `error` is set; returns how it
+ * went */
+static int copy_end(pgsql_copy_state *copy, int error)
+{
+    uint16_t trailer = htobe16((uint16_t)-1);
+    PGresult *result;
+
+    if (error == GIT_OK
+        && (error = copy_put(copy, &trailer, sizeof(trailer))) == GIT_OK)
+        error = copy_flush(copy);
+
+    /* a failed COPY is ended with an error message, which aborts it */
+    if (PQputCopyEnd(copy->db, error == GIT_OK ? NULL : "writepack failed") != 1) {
+        set_giterr_from_pg(copy->db);
+        return GIT_ERROR;
+    }
+
+    result = PQgetResult(copy->db);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK && error == GIT_OK) {
+        set_giterr_from_pg(copy->db);
+        error = GIT_ERROR;
+    }
+    PQclear(result);
+
+    /* drain the rest so the connection is ready for the next command */
+    while ((result = PQgetResult(copy->db)) != NULL)
+        PQclear(result);
+
+    return error;
+}
+
+/* appends one object as a row of the binary COPY format: a field count,
+ * then a length and the big-endian value of every field */
+static int copy_object(const git_oid *oid, void *payload)
+{
+    pgsql_copy_state *copy = payload;
+    void *data = NULL;
+    size_t len;
+    git_otype type;
+    uint16_t fields = htobe16(4);
+    uint32_t oid_len = htobe32(GIT_OID_RAWSZ);
+    uint32_t type_len = htobe32(sizeof(uint32_t)), fmtd_type;
+    uint32_t size_len = htobe32(sizeof(uint64_t)), data_len;
+    uint64_t fmtd_size;
+    int error;
+
+    if ((error = copy->pack->read(&data, &len, &type, copy->pack, oid)) < 0)
+        goto done;
+
+    fmtd_type = htobe32(type);
+    fmtd_size = htobe64(len);
+    data_len = htobe32(len);
+
+    if (copy_put(copy, &fields, sizeof(fields))
+        || copy_put(copy, &oid_len, sizeof(oid_len))
+        || copy_put(copy, oid->id, GIT_OID_RAWSZ)
+        || copy_put(copy, &type_len, sizeof(type_len))
+        || copy_put(copy, &fmtd_type, sizeof(fmtd_type))
+        || copy_put(copy, &size_len, sizeof(size_len))
+        || copy_put(copy, &fmtd_size, sizeof(fmtd_size))
+        || copy_put(copy, &data_len, sizeof(data_len))
+        || copy_put(copy, data, len))
+        error = GIT_ERROR;
+
+done:
+    free(data);
+
+    if (error < 0) {
+        copy->error = error;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Streams every object in `pack` into a staging table with a binary
+ * COPY, then moves them into the object table with one INSERT.  The
+ * staging table is a temporary one: like an unlogged table it skips the
+ * WAL, and being private to the session, concurrent writepacks can't see
+ * each other's rows.  Everything happens in one transaction, so either
+ * the whole pack lands or none of it does.
+ */
+static int copy_pack(pgsql_odb_backend *backend, PGconn *db, git_odb_backend *pack)
+{
+    const char *repo_values[1] = {(const char*)&backend->fmtd_repo_id};
+    int repo_lengths[1] = {sizeof(backend->fmtd_repo_id)};
+    int repo_formats[1] = {1};     /* binary */
+    pgsql_copy_state copy;
+    PGresult *result;
+    int error;
+
+    memset(&copy, 0, sizeof(copy));
+    copy.db = db;
+    copy.pack = pack;
+
+    if ((copy.buf = malloc(GIT2_COPY_BUFFER)) == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    result = PQexec(db,
+        "BEGIN;"
+        "CREATE TEMPORARY TABLE \"" GIT2_STAGING_TABLE_NAME "\" ("
+        "  \"oid\" bytea NOT NULL,"
+        "  \"type\" int NOT NULL,"
+        "  \"size\" bigint NOT NULL,"
+        "  \"data\" bytea NOT NULL"
+        ") ON COMMIT DROP");
+    if (complete_pq_exec(result)) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    error = copy_begin(&copy,
+        "COPY \"" GIT2_STAGING_TABLE_NAME "\" (\"oid\", \"type\", \"size\", \"data\")"
+        "  FROM STDIN (FORMAT binary)");
+    if (error < 0)
+        goto rollback;
+
+    error = pack->foreach(pack, &copy_object, &copy);
+    if (copy.error < 0)
+        error = copy.error;
+
+    if ((error = copy_end(&copy, error)) < 0)
+        goto rollback;
+
+    /* DO UPDATE can't meet the same row twice in one statement, and
+     * de-duplicating the staging table would sort it data and all, so
+     * the rows that are already there are re-stamped first and then
+     * left alone */
+    result = PQexec(db,
+        "UPDATE \"" GIT2_TABLE_NAME "\" o SET \"created\" = now()"
+        "  FROM \"" GIT2_STAGING_TABLE_NAME "\" s"
+        "  WHERE o.\"oid\" = s.\"oid\""
+        "    AND o.\"created\" < now() - interval '" XSTR(GIT2_FRESHEN_SECONDS) " seconds';"
+        "INSERT INTO \"" GIT2_TABLE_NAME "\" (\"oid\", \"type\", \"size\", \"data\")"
+        "  SELECT \"oid\", \"type\", \"size\", \"data\""
+        "  FROM \"" GIT2_STAGING_TABLE_NAME "\""
+        "  WHERE \"type\" <> 1"
+        "  ON CONFLICT (\"oid\") DO NOTHING;"
+        /* then the commits alone, oldest first, so the commit graph
+         * trigger usually finds a commit's parents before the commit */
+        "INSERT INTO \"" GIT2_TABLE_NAME "\" (\"oid\", \"type\", \"size\", \"data\")"
+        "  SELECT \"oid\", \"type\", \"size\", \"data\""
+        "  FROM \"" GIT2_STAGING_TABLE_NAME "\""
+        "  WHERE \"type\" = 1"
+        "  ORDER BY \"git2_commit_time\"(\"data\")"
+        "  ON CONFLICT (\"oid\") DO NOTHING");
+    if (complete_pq_exec(result)) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    if (backend->shared) {
+        result = PQexecParams(db,
+            "INSERT INTO \"" GIT2_REPOS_TABLE_NAME "\" (\"repo_id\", \"oid\")"
+            "  SELECT DISTINCT $1::bigint, \"oid\" FROM \"" GIT2_STAGING_TABLE_NAME "\""
+            "  ON CONFLICT (\"repo_id\", \"oid\")" GIT2_FRESHEN_SQL(GIT2_REPOS_TABLE_NAME),
+            1, NULL, repo_values, repo_lengths, repo_formats, 0);
+        if (complete_pq_exec(result)) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+            goto rollback;
+        }
+    }
+
+    if (complete_pq_exec(PQexec(db, "COMMIT"))) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    free(copy.buf);
+    return GIT_OK;
+
+rollback:
+    complete_pq_exec(PQexec(db, "ROLLBACK"));
+    free(copy.buf);
+    return error;
+}
+
+/* a big-endian field of the binary COPY format, behind its length */
+static int copy_field(pgsql_copy_state *copy, const void *data, size_t len)
+{
+    uint32_t field_len = htobe32((uint32_t)len);
+
+    if (copy_put(copy, &field_len, sizeof(field_len))
+        || copy_put(copy, data, len))
+        return GIT_ERROR;
+
+    return GIT_OK;
+}
+
+/* copies the pack file into the chunk table, GIT2_PACK_CHUNK at a time */
+static int copy_pack_file(pgsql_copy_state *copy, uint64_t fmtd_pack_id,
+    const char *pack_path, char *chunk)
+{
+    uint16_t fields = htobe16(3);
+    uint32_t fmtd_seq;
+    int32_t seq;
+    size_t len;
+    FILE *f;
+    int error = GIT_OK;
+
+    if (NULL == (f = fopen(pack_path, "rb"))) {
+        giterr_set_str(GITERR_ODB, "could not open the pack file");
+        return GIT_ERROR;
+    }
+
+    for (seq = 0; error == GIT_OK && (len = fread(chunk, 1, GIT2_PACK_CHUNK, f)) > 0; ++seq) {
+        fmtd_seq = htobe32((uint32_t)seq);
+
+        if (copy_put(copy, &fields, sizeof(fields))
+            || copy_field(copy, &fmtd_pack_id, sizeof(fmtd_pack_id))
+            || copy_field(copy, &fmtd_seq, sizeof(fmtd_seq))
+            || copy_field(copy, chunk, len))
+            error = GIT_ERROR;
+    }
+
+    if (error == GIT_OK && ferror(f)) {
+        giterr_set_str(GITERR_ODB, "could not read the pack file");
+        error = GIT_ERROR;
+    }
+
+    fclose(f);
+    return error;
+}
+
+/* copies an index row for every entry of the pack; the type and size
+ * of the object behind each one come from `pack` */
+static int copy_pack_index(pgsql_copy_state *copy, uint64_t fmtd_pack_id,
+    const pack_idx_entry *entries, size_t n)
+{
+    uint16_t fields = htobe16(6);
+    uint64_t fmtd_offset, fmtd_length, fmtd_size;
+    uint32_t fmtd_type;
+    size_t i, size;
+    git_otype type;
+    int error;
+
+    for (i = 0; i < n; ++i) {
+        if ((error = copy->pack->read_header(&size, &type, copy->pack, &entries[i].oid)) < 0)
+            return error;
+
+        fmtd_offset = htobe64(entries[i].offset);
+        fmtd_length = htobe64(entries[i].length);
+        fmtd_type = htobe32(type);
+        fmtd_size = htobe64(size);
+
+        if (copy_put(copy, &fields, sizeof(fields))
+            || copy_field(copy, entries[i].oid.id, GIT_OID_RAWSZ)
+            || copy_field(copy, &fmtd_pack_id, sizeof(fmtd_pack_id))
+            || copy_field(copy, &fmtd_offset, sizeof(fmtd_offset))
+            || copy_field(copy, &fmtd_length, sizeof(fmtd_length))
+            || copy_field(copy, &fmtd_type, sizeof(fmtd_type))
+            || copy_field(copy, &fmtd_size, sizeof(fmtd_size)))
+            return GIT_ERROR;
+    }
+
+    return GIT_OK;
+}
+
+/* copies the oid and content of every commit in the pack */
+static int copy_pack_commits(pgsql_copy_state *copy,
+    const pack_idx_entry *entries, size_t n)
+{
+    uint16_t fields = htobe16(2);
+    void *data;
+    size_t i, len;
+    git_otype type;
+    int error;
+
+    for (i = 0; i < n; ++i) {
+        if ((error = copy->pack->read_header(&len, &type, copy->pack, &entries[i].oid)) < 0)
+            return error;
+        if (type != GIT_OBJ_COMMIT)
+            continue;
+
+        if ((error = copy->pack->read(&data, &len, &type, copy->pack, &entries[i].oid)) < 0)
+            return error;
+
+        if (copy_put(copy, &fields, sizeof(fields))
+            || copy_field(copy, entries[i].oid.id, GIT_OID_RAWSZ)
+            || copy_field(copy, data, len))
+            error = GIT_ERROR;
+
+        free(data);
+        if (error < 0)
+            return error;
+    }
+
+    return GIT_OK;
+}
+
+/*
+ * Stores the pack as it came, split into GIT2_PACK_CHUNK byte rows,
+ * along with an index row per object giving its entry's place in the
+ * pack.  Reads fetch just the bytes of an entry and resolve deltas
+ * themselves.  Its commits go through a staging table into the commit
+ * graph, since the trigger only sees the object table.  Like copy_pack,
+ * it is all one transaction.
+ */
+static int upload_pack(PGconn *db, git_odb_backend *pack,
+    const char *pack_path, const char *idx_path, const git_oid *checksum)
+{
+    pack_idx_entry *entries = NULL;
+    size_t n = 0;
+    char *chunk = NULL;
+    FILE *f;
+    long pack_size;
+    uint64_t fmtd_size, fmtd_pack_id;
+    int64_t pack_id;
+    const char *values[2];
+    int lengths[2] = {GIT_OID_RAWSZ, sizeof(fmtd_size)};
+    int formats[2] = {1, 1};     /* binary */
+    pgsql_copy_state copy;
+    PGresult *result;
+    int error = GIT_ERROR;
+
+    memset(&copy, 0, sizeof(copy));
+    copy.db = db;
+    copy.pack = pack;
+
+    if (NULL == (f = fopen(pack_path, "rb"))
+        || fseek(f, 0, SEEK_END) != 0
+        || (pack_size = ftell(f)) < 0) {
+        if (f != NULL)
+            fclose(f);
+        giterr_set_str(GITERR_ODB, "could not open the pack file");
+        return GIT_ERROR;
+    }
+    fclose(f);
+
+    if (pack_idx_read(&entries, &n, idx_path, (uint64_t)pack_size) < 0) {
+        giterr_set_str(GITERR_ODB, "could not read the pack index");
+        return GIT_ERROR;
+    }
+
+    if (NULL == (copy.buf = malloc(GIT2_COPY_BUFFER))
+        || NULL == (chunk = malloc(GIT2_PACK_CHUNK))) {
+        giterr_set_oom();
+        goto cleanup;
+    }
+
+    if (complete_pq_exec(PQexec(db, "BEGIN"))) {
+        set_giterr_from_pg(db);
+        goto cleanup;
+    }
+
+    fmtd_size = htobe64((uint64_t)pack_size);
+    values[0] = (const char*)checksum->id;
+    values[1] = (const char*)&fmtd_size;
+    result = PQexecParams(db,
+        "INSERT INTO \"" GIT2_PACKS_TABLE_NAME "\" (\"checksum\", \"size\")"
+        "  VALUES ($1::bytea, $2::bigint)"
+        "  RETURNING \"pack_id\"",
+        2, NULL, values, lengths, formats, /* binary result */ 1);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        set_giterr_from_pg(db);
+        PQclear(result);
+        goto rollback;
+    }
+    error = get_int64_from_result(result, &pack_id, 0, 0) ? GIT_ERROR : GIT_OK;
+    PQclear(result);
+    if (error < 0)
+        goto rollback;
+
+    fmtd_pack_id = htobe64((uint64_t)pack_id);
+
+    error = copy_begin(&copy,
+        "COPY \"" GIT2_PACK_CHUNKS_TABLE_NAME "\" (\"pack_id\", \"seq\", \"data\")"
+        "  FROM STDIN (FORMAT binary)");
+    if (error < 0)
+        goto rollback;
+    error = copy_pack_file(&copy, fmtd_pack_id, pack_path, chunk);
+    if ((error = copy_end(&copy, error)) < 0)
+        goto rollback;
+
+    error = copy_begin(&copy,
+        "COPY \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "  (\"oid\", \"pack_id\", \"offset\", \"length\", \"type\", \"size\")"
+        "  FROM STDIN (FORMAT binary)");
+    if (error < 0)
+        goto rollback;
+    error = copy_pack_index(&copy, fmtd_pack_id, entries, n);
+    if ((error = copy_end(&copy, error)) < 0)
+        goto rollback;
+
+    if (complete_pq_exec(PQexec(db,
+            "CREATE TEMPORARY TABLE \"" GIT2_STAGING_TABLE_NAME "\" ("
+            "  \"oid\" bytea NOT NULL,"
+            "  \"data\" bytea NOT NULL"
+            ") ON COMMIT DROP"))) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    error = copy_begin(&copy,
+        "COPY \"" GIT2_STAGING_TABLE_NAME "\" (\"oid\", \"data\")"
+        "  FROM STDIN (FORMAT binary)");
+    if (error < 0)
+        goto rollback;
+    error = copy_pack_commits(&copy, entries, n);
+    if ((error = copy_end(&copy, error)) < 0)
+        goto rollback;
+
+    if (complete_pq_exec(PQexec(db,
+            "DO $BODY$ BEGIN "
+            "INSERT INTO \"" GIT2_GRAPH_TABLE_NAME "\""
+            "  (\"oid\", \"parents\", \"generation\", \"commit_time\")"
+            "  SELECT \"oid\", \"git2_commit_parents\"(\"data\"), 0,"
+            "    \"git2_commit_time\"(\"data\")"
+            "  FROM \"" GIT2_STAGING_TABLE_NAME "\""
+            "  ON CONFLICT (\"oid\") DO NOTHING;"
+            GIT2_GRAPH_SETTLE_SQL
+            "END; $BODY$"))) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    if (complete_pq_exec(PQexec(db, "COMMIT"))) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+        goto rollback;
+    }
+
+    error = GIT_OK;
+    goto cleanup;
+
+rollback:
+    complete_pq_exec(PQexec(db, "ROLLBACK"));
+    if (error == GIT_OK)
+        error = GIT_ERROR;
+
+cleanup:
+    free(entries);
+    free(chunk);
+    free(copy.buf);
+    return error;
+}
+
+static int pgsql_writepack__add(git_odb_writepack *_writepack,
+    const void *data, size_t size, git_transfer_progress *stats)
+{
+    pgsql_writepack *writepack = (pgsql_writepack*)_writepack;
+
+    assert(writepack && stats);
+
+    return git_indexer_append(writepack->indexer, data, size, stats);
+}
+
+static int pgsql_writepack__commit(git_odb_writepack *_writepack,
+    git_transfer_progress *stats)
+{
+    pgsql_writepack *writepack = (pgsql_writepack*)_writepack;
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_writepack->backend;
+    git_odb_backend *pack;
+    pg_conn *conn;
+    char idx_path[4096], pack_path[4096], hex[GIT_OID_HEXSZ + 1];
+    int error;
+
+    assert(writepack && stats);
+
+    /* let libgit2 resolve the deltas into a pack and index on disk, so
+     * every object can be read back whole */
+    if ((error = git_indexer_commit(writepack->indexer, stats)) < 0)
+        return error;
+
+    git_oid_fmt(hex, git_indexer_hash(writepack->indexer));
+    hex[GIT_OID_HEXSZ] = '\0';
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", writepack->path, hex);
+    snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", writepack->path, hex);
+
+    if ((error = git_odb_backend_one_pack(&pack, idx_path)) < 0)
+        return error;
+
+    if ((error = get_conn(&conn, backend)) == GIT_OK) {
+        if (backend->packs)
+            error = upload_pack(conn->db, pack, pack_path, idx_path,
+                git_indexer_hash(writepack->indexer));
+        else
+            error = copy_pack(backend, conn->db, pack);
+        pg_pool_put(backend->pool, conn, error);
+    }
+
+    pack->free(pack);
+    return error;
+}
+
+static void pgsql_writepack__free(git_odb_writepack *_writepack)
+{
+    pgsql_writepack *writepack = (pgsql_writepack*)_writepack;
+
+    assert(writepack);
+
+    git_indexer_free(writepack->indexer);
+    if (writepack->path) {
+        remove_dir(writepack->path);
+        free(writepack->path);
+    }
+    free(writepack);
+}
+
+static int pgsql_odb_backend__writepack(git_odb_writepack **out,
+    git_odb_backend *_backend, git_odb *odb,
+    git_transfer_progress_callback progress_cb, void *progress_payload)
+{
+    pgsql_writepack *writepack;
+    const char *tmpdir;
+
+    assert(out && _backend);
+
+    writepack = calloc(1, sizeof(pgsql_writepack));
+    if (NULL == writepack) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    writepack->parent.backend = _backend;
+    writepack->parent.add = &pgsql_writepack__add;
+    writepack->parent.commit = &pgsql_writepack__commit;
+    writepack->parent.free = &pgsql_writepack__free;
+
+    if ((tmpdir = getenv("TMPDIR")) == NULL)
+        tmpdir = "/tmp";
+
+    writepack->path = malloc(strlen(tmpdir) + sizeof("/git2-pgsql-XXXXXX"));
+    if (NULL == writepack->path) {
+        free(writepack);
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    sprintf(writepack->path, "%s/git2-pgsql-XXXXXX", tmpdir);
+    if (mkdtemp(writepack->path) == NULL) {
+        free(writepack->path);
+        free(writepack);
+        giterr_set_str(GITERR_OS, "failed to create a directory for the pack");
+        return GIT_ERROR;
+    }
+
+    /* `odb` lets the indexer find the bases of a thin pack */
+    if (git_indexer_new(&writepack->indexer, writepack->path, 0, odb,
+            progress_cb, progress_payload) < 0) {
+        pgsql_writepack__free((git_odb_writepack*)writepack);
+        return GIT_ERROR;
+    }
+
+    *out = (git_odb_writepack*)writepack;
+    return GIT_OK;
+}
+
+static int oid_from_result(git_oid *out, PGresult *result, int row, int col)
+{
+    if (PQgetlength(result, row, col) != GIT_OID_RAWSZ) {
+        giterr_set_str(GITERR_ODB, "oid column has bad size");
+        return GIT_ERROR;
+    }
+
+    git_oid_fromraw(out, (const unsigned char*)PQgetvalue(result, row, col));
+    return GIT_OK;
+}
+
+int git_odb_backend_pgsql_is_ancestor(git_odb_backend *_backend,
+    const git_oid *ancestor, const git_oid *descendant)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    const char * const param_values[2] = {
+        (const char*)ancestor->id,
+        (const char*)descendant->id};
+    int param_lengths[2] = {GIT_OID_RAWSZ, GIT_OID_RAWSZ};
+    int error;
+
+    assert(backend && ancestor && descendant);
+
+    result = exec_stmt(backend, "is_ancestor", 2, param_values, param_lengths);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        error = GIT_ERROR;
+    } else if (PQntuples(result) == 0) {
+        error = 0;
+    } else if (get_int_from_result(result, &error, 0, 0)) {
+        error = GIT_ERROR;
+    } else if (error == 0) {
+        giterr_set_str(GITERR_ODB, "the commit graph doesn't have all of the history");
+        error = GIT_ENOTFOUND;
+    }
+
+    PQclear(result);
+    return error;
+}
+
+/* settles the generations still at 0 that can be, like the end of
+ * git_odb_backend_pgsql_commit_graph_refresh() */
+static int settle_generations(pgsql_odb_backend *backend)
+{
+    pg_conn *conn;
+    int error = GIT_OK;
+
+    if (get_conn(&conn, backend) < 0)
+        return GIT_ERROR;
+
+    if (complete_pq_exec(PQexec(conn->db,
+            "DO $BODY$ BEGIN " GIT2_GRAPH_SETTLE_SQL " END; $BODY$"))) {
+        set_giterr_from_pg(conn->db);
+        error = GIT_ERROR;
+    }
+
+    pg_pool_put(backend->pool, conn, error);
+    return error;
+}
+
+int git_odb_backend_pgsql_merge_base(git_oid *out, git_odb_backend *_backend,
+    const git_oid *one, const git_oid *two)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    int64_t band = GIT2_GRAPH_BAND;
+    uint64_t fmtd_band;
+    const char * const param_values[3] = {
+        (const char*)one->id,
+        (const char*)two->id,
+        (const char*)&fmtd_band};
+    int param_lengths[3] = {GIT_OID_RAWSZ, GIT_OID_RAWSZ, sizeof(fmtd_band)};
+    int pending, missing, complete, settled = 0;
+    int error;
+
+    assert(out && backend && one && two);
+
+    for (;;) {
+        fmtd_band = htobe64(band);
+        result = exec_stmt(backend, "merge_base", 3, param_values, param_lengths);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK
+            || PQntuples(result) != 1
+            || get_int_from_result(result, &pending, 0, 1)
+            || get_int_from_result(result, &missing, 0, 2)
+            || get_int_from_result(result, &complete, 0, 3)) {
+            PQclear(result);
+            return GIT_ERROR;
+        }
+
+        if (missing)
+            break;
+
+        /* a common ancestor still at generation 0 may sort below one of
+         * its own ancestors, so those are settled and the query run
+         * again */
+        if (pending) {
+            if (settled)
+                break;
+            PQclear(result);
+            if (settle_generations(backend) < 0)
+                return GIT_ERROR;
+            settled = 1;
+            continue;
+        }
+
+        if (!PQgetisnull(result, 0, 0) || complete)
+            break;
+
+        /* nothing in common that close to the commits; look further */
+        PQclear(result);
+        band *= 16;
+    }
+
+    if (missing || pending) {
+        giterr_set_str(GITERR_ODB, "the commit graph doesn't have all of the history");
+        error = GIT_ENOTFOUND;
+    } else if (PQgetisnull(result, 0, 0)) {
+        giterr_set_str(GITERR_ODB, "no merge base found");
+        error = GIT_ENOTFOUND;
+    } else {
+        error = oid_from_result(out, result, 0, 0);
+    }
+
+    PQclear(result);
+    return error;
+}
+
+int git_odb_backend_pgsql_ancestors(git_odb_backend *_backend, const git_oid *oid,
+    size_t limit, git_odb_pgsql_commit_cb cb, void *payload)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    uint64_t fmtd_limit = htobe64(limit);
+    const char * const param_values[2] = {
+        (const char*)oid->id,
+        /* a NULL limit is no limit */
+        limit ? (const char*)&fmtd_limit : NULL};
+    int param_lengths[2] = {GIT_OID_RAWSZ, sizeof(fmtd_limit)};
+    git_oid commit;
+    int generation;
+    int64_t time;
+    int i, error = GIT_OK;
+
+    assert(backend && oid && cb);
+
+    result = exec_stmt(backend, "ancestors", 2, param_values, param_lengths);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        PQclear(result);
+        return GIT_ERROR;
+    }
+
+    for (i = 0; i < PQntuples(result) && error == GIT_OK; ++i) {
+        if (oid_from_result(&commit, result, i, 0)
+            || get_int_from_result(result, &generation, i, 1)
+            || get_int64_from_result(result, &time, i, 2)) {
+            error = GIT_ERROR;
+        } else if (cb(&commit, (unsigned int)generation, time, payload)) {
+            giterr_clear();
+            error = GIT_EUSER;
+        }
+    }
+
+    PQclear(result);
+    return error;
+}
+
+/*
+ * Adds the commits written before the graph existed, then settles
+ * every generation number that is still 0 and now can be.
+ */
+int git_odb_backend_pgsql_commit_graph_refresh(git_odb_backend *_backend)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    pg_conn *conn;
+    int error = GIT_OK;
+
+    assert(backend);
+
+    if (get_conn(&conn, backend) < 0)
+        return GIT_ERROR;
+
+    if (complete_pq_exec(PQexec(conn->db,
+            "DO $BODY$ BEGIN "
+
+            "INSERT INTO \"" GIT2_GRAPH_TABLE_NAME "\""
+            "  (\"oid\", \"parents\", \"generation\", \"commit_time\")"
+            "  SELECT o.\"oid\", \"git2_commit_parents\"(o.\"data\"), 0,"
+            "    \"git2_commit_time\"(o.\"data\")"
+            "  FROM \"" GIT2_TABLE_NAME "\" o"
+            "  WHERE o.\"type\" = 1 AND NOT EXISTS("
+            "    SELECT 1 FROM \"" GIT2_GRAPH_TABLE_NAME "\" g WHERE g.\"oid\" = o.\"oid\")"
+            "  ON CONFLICT (\"oid\") DO NOTHING;"
+
+            GIT2_GRAPH_SETTLE_SQL
+
+            "END; $BODY$"))) {
+        set_giterr_from_pg(conn->db);
+        error = GIT_ERROR;
+    }
+
+    pg_pool_put(backend->pool, conn, error);
+    return error;
+}
+
+/*
+ * Walks the primary key `batch_size` rows at a time, each batch its own
+ * statement and transaction, so no lock is held for long.
+ */
+int git_odb_backend_pgsql_backfill_size(git_odb_backend *_backend,
+    size_t batch_size, size_t *filled_out)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    git_oid last;
+    uint64_t fmtd_limit = htobe64(batch_size ? batch_size : 1000);
+    /* the empty bytea sorts before every oid */
+    const char *param_values[2] = {"", (const char*)&fmtd_limit};
+    int param_lengths[2] = {0, sizeof(fmtd_limit)};
+    int64_t filled;
+    int error = GIT_OK;
+
+    assert(backend && filled_out);
+
+    *filled_out = 0;
+
+    for (;;) {
+        result = exec_stmt(backend, "backfill_size", 2, param_values, param_lengths);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) != 1) {
+            error = GIT_ERROR;
+            break;
+        }
+
+        /* past the end of the table */
+        if (PQgetisnull(result, 0, 0))
+            break;
+
+        if (oid_from_result(&last, result, 0, 0)
+            || get_int64_from_result(result, &filled, 0, 1)) {
+            error = GIT_ERROR;
+            break;
+        }
+
+        *filled_out += (size_t)filled;
+        param_values[0] = (const char*)last.id;
+        param_lengths[0] = GIT_OID_RAWSZ;
+        PQclear(result);
+    }
+
+    PQclear(result);
+    return error;
+}
+
+int git_odb_backend_pgsql_fork(git_odb_backend *_backend, unsigned long long repo_id)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    uint64_t fmtd_repo_id = htobe64(repo_id);
+    const char * const param_values[1] = {(const char*)&fmtd_repo_id};
+    int param_lengths[1] = {sizeof(fmtd_repo_id)};
+
+    assert(backend);
+
+    if (!backend->shared) {
+        giterr_set_str(GITERR_ODB, "only a shared backend can be forked");
+        return GIT_ERROR;
+    }
+
+    if (complete_pq_exec(exec_stmt(backend, "fork", 1, param_values, param_lengths)))
+        return GIT_ERROR;
+
+    return GIT_OK;
+}
+
+typedef struct {
+    pgsql_odb_backend *backend;
+    git_odb_foreach_cb cb;
+    void *payload;
+    /* guards the fields below, and is held around every call to `cb` */
+    pthread_mutex_t lock;
+    char **tables;
+    size_t n_tables;
+    size_t next_table;
+    int error;
+    /* errors are per thread in libgit2, so a worker's message is
+     * passed back to the caller's thread */
+    char *message;
+} foreach_state;
+
+static void foreach_fail(foreach_state *state, PGconn *db)
+{
+    pthread_mutex_lock(&state->lock);
+    if (state->error == GIT_OK) {
+        state->error = GIT_ERROR;
+        state->message = strdup(db ? PQerrorMessage(db)
+            : "could not connect to the database");
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+/*
+ * Lists the oids of one table or partition to the callback, a batch at
+ * a time in oid order, each batch starting after the last oid of the
+ * one before.  A connection is only held while a batch is fetched, so
+ * `cb` can always get one.
+ */
+static void foreach_table(foreach_state *state, const char *table)
+{
+    static const char sql_format[] =
+        "SELECT \"oid\" FROM %s WHERE \"oid\" > $1::bytea"
+        "  ORDER BY \"oid\" LIMIT " XSTR(GIT2_FOREACH_BATCH);
+    pg_pool *pool = state->backend->pool;
+    pg_conn *conn;
+    PGresult *result;
+    char *sql, last[GIT_OID_RAWSZ];
+    /* the first batch starts after the empty bytea, before every oid */
+    const char *values[1] = {last};
+    int lengths[1] = {0};
+    int formats[1] = {1};     /* binary */
+    git_oid oid;
+    int i, n, stop = 0;
+
+    sql = malloc(strlen(table) + sizeof(sql_format));
+    if (NULL == sql) {
+        foreach_fail(state, NULL);
+        return;
+    }
+    sprintf(sql, sql_format, table);
+
+    do {
+        if (pg_pool_get(&conn, pool) < 0) {
+            foreach_fail(state, NULL);
+            break;
+        }
+
+        result = PQexecParams(conn->db, sql, 1, NULL, values, lengths, formats,
+            /* binary result */ 1);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            foreach_fail(state, conn->db);
+            PQclear(result);
+            pg_pool_put(pool, conn, -1);
+            break;
+        }
+        pg_pool_put(pool, conn, 0);
+
+        n = PQntuples(result);
+        for (i = 0; i < n && !stop; ++i) {
+            if (PQgetlength(result, i, 0) != GIT_OID_RAWSZ)
+                continue;
+            git_oid_fromraw(&oid, (const unsigned char*)PQgetvalue(result, i, 0));
+
+            pthread_mutex_lock(&state->lock);
+            if (state->error == GIT_OK && state->cb(&oid, state->payload))
+                state->error = GIT_EUSER;
+            stop = (state->error != GIT_OK);
+            pthread_mutex_unlock(&state->lock);
+        }
+
+        if (n > 0 && PQgetlength(result, n - 1, 0) == GIT_OID_RAWSZ) {
+            memcpy(last, PQgetvalue(result, n - 1, 0), GIT_OID_RAWSZ);
+            lengths[0] = GIT_OID_RAWSZ;
+        } else {
+            stop = 1;
+        }
+
+        PQclear(result);
+    } while (!stop && n == GIT2_FOREACH_BATCH);
+
+    free(sql);
+}
+
+static void *foreach_worker(void *_state)
+{
+    foreach_state *state = _state;
+    const char *table;
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        table = (state->error == GIT_OK && state->next_table < state->n_tables)
+            ? state->tables[state->next_table++] : NULL;
+        pthread_mutex_unlock(&state->lock);
+
+        if (NULL == table)
+            break;
+
+        foreach_table(state, table);
+    }
+
+    return NULL;
+}
+
+static int list_tables(foreach_state *state)
+{
+    PGresult *result;
+    char table[128];
+    int i, n;
+
+    /* a shared backend lists its own objects */
+    if (state->backend->shared) {
+        snprintf(table, sizeof(table),
+            "(SELECT \"oid\" FROM \"" GIT2_REPOS_TABLE_NAME "\""
+            " WHERE \"repo_id\" = %llu) r",
+            state->backend->repo_id);
+
+        state->tables = calloc(1, sizeof(char*));
+        if (NULL == state->tables || NULL == (state->tables[0] = strdup(table))) {
+            giterr_set_oom();
+            return GIT_ERROR;
+        }
+
+        state->n_tables = 1;
+        return GIT_OK;
+    }
+
+    result = exec_stmt(state->backend, "partitions", 0, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        PQclear(result);
+        return GIT_ERROR;
+    }
+
+    /* an unpartitioned table is scanned as a whole */
+    n = PQntuples(result);
+    state->tables = calloc((n > 0 ? n : 1) + 1, sizeof(char*));
+    if (NULL == state->tables)
+        goto oom;
+
+    if (n == 0) {
+        if (NULL == (state->tables[0] = strdup("\"" GIT2_TABLE_NAME "\"")))
+            goto oom;
+        state->n_tables = 1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (NULL == (state->tables[i] = strdup(PQgetvalue(result, i, 0))))
+            goto oom;
+        state->n_tables++;
+    }
+
+    /* an object is in as many packs as it was pushed in */
+    if (state->backend->packs) {
+        if (NULL == (state->tables[state->n_tables] = strdup(
+                "(SELECT DISTINCT \"oid\" FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\") p")))
+            goto oom;
+        state->n_tables++;
+    }
+
+    PQclear(result);
+    return GIT_OK;
+
+oom:
+    PQclear(result);
+    giterr_set_oom();
+    return GIT_ERROR;
+}
+
+/*
+ * Enumerates every object.  On a partitioned table each partition is
+ * listed separately, several at a time from their own threads.  No
+ * connection is held while `cb` runs, so it may use the backend even
+ * with a pool of one.  Calls to `cb` are serialized, though they may
+ * come from different threads.
+ */
+static int pgsql_odb_backend__foreach(git_odb_backend *_backend,
+    git_odb_foreach_cb cb, void *payload)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    foreach_state state;
+    pthread_t *threads = NULL;
+    size_t n_workers, started = 0, i;
+    int error;
+
+    assert(backend && cb);
+
+    memset(&state, 0, sizeof(state));
+    state.backend = backend;
+    state.cb = cb;
+    state.payload = payload;
+
+    if ((error = list_tables(&state)) < 0)
+        goto cleanup;
+
+    pthread_mutex_init(&state.lock, NULL);
+
+    n_workers = pg_pool_size(backend->pool);
+    n_workers = (n_workers > 1) ? n_workers - 1 : 1;
+    if (n_workers > state.n_tables)
+        n_workers = state.n_tables;
+
+    /* the calling thread is one of the workers */
+    if (n_workers > 1 && NULL != (threads = calloc(n_workers - 1, sizeof(pthread_t)))) {
+        for (started = 0; started < n_workers - 1; ++started)
+            if (pthread_create(&threads[started], NULL, &foreach_worker, &state) != 0)
+                break;
+    }
+
+    foreach_worker(&state);
+
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&state.lock);
+
+    error = state.error;
+    if (error == GIT_EUSER)
+        giterr_clear();
+    else if (error < 0)
+        giterr_set_str(GITERR_ODB, state.message ? state.message : "foreach failed");
+
+cleanup:
+    for (i = 0; i < state.n_tables; ++i)
+        free(state.tables[i]);
+    free(state.tables);
+    free(state.message);
+    free(threads);
+    return error;
+}
+
+/* `repo` is the repository id in text for a shared backend, or NULL;
+ * rows re-stamped since they were listed are kept */
+static int delete_oids(PGconn *db, const char *grace, const char *repo,
+    const git_oid *oids, size_t count)
+{
+    PGresult *result;
+    char *hex_list;
+    const char *param_values[3];
+    size_t i;
+
+    /* "<hex>,<hex>,...", split and decoded again on the server */
+    hex_list = malloc(count * (GIT_OID_HEXSZ + 1));
+    if (NULL == hex_list) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
+    for (i = 0; i < count; ++i) {
+        git_oid_fmt(hex_list + i * (GIT_OID_HEXSZ + 1), &oids[i]);
+        hex_list[i * (GIT_OID_HEXSZ + 1) + GIT_OID_HEXSZ] = (i + 1 < count) ? ',' : '\0';
+    }
+
+    param_values[0] = hex_list;
+    param_values[1] = grace;
+    param_values[2] = repo;
+    if (NULL == repo)
+        result = PQexecParams(db,
+            "DELETE FROM \"" GIT2_TABLE_NAME "\""
+            "  WHERE \"oid\" = ANY(ARRAY("
+            "    SELECT decode(h, 'hex') FROM unnest(string_to_array($1::text, ',')) AS h))"
+            "    AND \"created\" < now() - $2::bigint * interval '1 second'",
+            2, NULL, param_values, NULL, NULL, 0);
+    else
+        /* drop the repository's claim, and the content along with it
+         * when no other repository has one; the outer DELETE doesn't
+         * see the inner one's, hence the repo_id condition.  A writer
+         * adding a claim holds the content row locked, and one that
+         * just did re-stamped it (or found it fresh), so both keep
+         * their content; the foreign key, where the server could add
+         * it, catches anything else */
+        result = PQexecParams(db,
+            "WITH \"gone\" AS ("
+            "  DELETE FROM \"" GIT2_REPOS_TABLE_NAME "\""
+            "    WHERE \"repo_id\" = $3::bigint AND \"oid\" = ANY(ARRAY("
+            "      SELECT decode(h, 'hex') FROM unnest(string_to_array($1::text, ',')) AS h))"
+            "      AND \"created\" < now() - $2::bigint * interval '1 second'"
+            "    RETURNING \"oid\""
+            "), \"unclaimed\" AS ("
+            "  SELECT o.\"oid\""
+            "    FROM \"" GIT2_TABLE_NAME "\" o"
+            "    JOIN \"gone\" ON o.\"oid\" = \"gone\".\"oid\""
+            "    WHERE o.\"created\" < now() - $2::bigint * interval '1 second'"
+            "      AND NOT EXISTS("
+            "        SELECT 1 FROM \"" GIT2_REPOS_TABLE_NAME "\" r"
+            "        WHERE r.\"oid\" = o.\"oid\" AND r.\"repo_id\" <> $3::bigint)"
+            "    FOR UPDATE OF o SKIP LOCKED"
+            ")"
+            "DELETE FROM \"" GIT2_TABLE_NAME "\" o"
+            "  USING \"unclaimed\""
+            "  WHERE o.\"oid\" = \"unclaimed\".\"oid\"",
+            3, NULL, param_values, NULL, NULL, 0);
+    free(hex_list);
+
+    if (complete_pq_exec(result)) {
+        set_giterr_from_pg(db);
+        return GIT_ERROR;
+    }
+
+    return GIT_OK;
+}
+
+/*
+ * Sweep phase of a garbage collection (see gc/gc.h): deletes every row
+ * older than `grace_seconds` that `is_reachable` doesn't claim, with one
+ * DELETE (and so one transaction) per `batch_size` rows.  The grace
+ * period is widened by GIT2_FRESHEN_SECONDS, how stale a row has to be
+ * before a duplicate write re-stamps it.  Chunks of streams that got
+ * nothing new for that long are dropped too.
+ */
+/*
+ * The pack half of a sweep.  A stored pack is only dropped whole, once
+ * it is older than the grace period and none of its objects is
+ * reachable; the indexer completes thin packs, so no other pack's
+ * deltas need it.  The age is checked again as it is deleted, in case
+ * a lookup re-stamped it meanwhile.
+ */
+static int sweep_packs(PGconn *db, int (*is_reachable)(const git_oid *, void *),
+    void *payload, const char *grace)
+{
+    PGresult *packs, *result;
+    const char *param_values[2] = {NULL, grace};
+    git_oid oid;
+    int i, reachable, error = GIT_OK;
+
+    packs = PQexecParams(db,
+        "SELECT \"pack_id\" FROM \"" GIT2_PACKS_TABLE_NAME "\""
+        "  WHERE \"created\" < now() - $1::bigint * interval '1 second'",
+        1, NULL, &grace, NULL, NULL, 0);
+    if (PQresultStatus(packs) != PGRES_TUPLES_OK) {
+        set_giterr_from_pg(db);
+        PQclear(packs);
+        return GIT_ERROR;
+    }
+
+    for (i = 0; error == GIT_OK && i < PQntuples(packs); ++i) {
+        param_values[0] = PQgetvalue(packs, i, 0);
+        reachable = 0;
+
+        if (!PQsendQueryParams(db,
+                "SELECT \"oid\" FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+                "  WHERE \"pack_id\" = $1::bigint",
+                1, NULL, param_values, NULL, NULL, /* binary result */ 1)
+            || !PQsetSingleRowMode(db)) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+            break;
+        }
+
+        /* once one object is reachable the rest are only drained */
+        while ((result = PQgetResult(db)) != NULL) {
+            if (PQresultStatus(result) == PGRES_SINGLE_TUPLE) {
+                if (!reachable && PQgetlength(result, 0, 0) == GIT_OID_RAWSZ) {
+                    git_oid_fromraw(&oid, (const unsigned char*)PQgetvalue(result, 0, 0));
+                    reachable = is_reachable(&oid, payload);
+                }
+            } else if (PQresultStatus(result) != PGRES_TUPLES_OK && error == GIT_OK) {
+                set_giterr_from_pg(db);
+                error = GIT_ERROR;
+            }
+
+            PQclear(result);
+        }
+
+        if (error < 0 || reachable)
+            continue;
+
+        if (complete_pq_exec(PQexecParams(db,
+                "WITH \"gone\" AS ("
+                "  DELETE FROM \"" GIT2_PACKS_TABLE_NAME "\""
+                "    WHERE \"pack_id\" = $1::bigint"
+                "      AND \"created\" < now() - $2::bigint * interval '1 second'"
+                "    RETURNING \"pack_id\""
+                "), \"index\" AS ("
+                "  DELETE FROM \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+                "    WHERE \"pack_id\" IN (SELECT \"pack_id\" FROM \"gone\")"
+                ")"
+                "DELETE FROM \"" GIT2_PACK_CHUNKS_TABLE_NAME "\""
+                "  WHERE \"pack_id\" IN (SELECT \"pack_id\" FROM \"gone\")",
+                2, NULL, param_values, NULL, NULL, 0))) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+        }
+    }
+
+    PQclear(packs);
+    return error;
+}
+
+int git_odb_backend_pgsql_sweep(git_odb_backend *_backend,
+    int (*is_reachable)(const git_oid *, void *), void *payload,
+    unsigned int grace_seconds, size_t batch_size)
+{
+    pgsql_odb_backend *backend = (pgsql_odb_backend*)_backend;
+    PGresult *result;
+    char grace[24], repo[24];
+    const char *param_values[2] = {grace, repo};
+    git_oid *unreachable = NULL, *grown, oid;
+    size_t len = 0, alloc = 0, i;
+    pg_conn *conn;
+    PGconn *db;
+    int error = GIT_OK;
+
+    assert(backend && is_reachable);
+
+    if (batch_size == 0)
+        batch_size = 1000;
+
+    snprintf(grace, sizeof(grace), "%llu",
+        (unsigned long long)grace_seconds + GIT2_FRESHEN_SECONDS);
+    snprintf(repo, sizeof(repo), "%llu", backend->repo_id);
+
+    if (get_conn(&conn, backend) < 0)
+        return GIT_ERROR;
+    db = conn->db;
+
+    if (!(backend->shared
+            ? PQsendQueryParams(db,
+                "SELECT \"oid\" FROM \"" GIT2_REPOS_TABLE_NAME "\""
+                "  WHERE \"repo_id\" = $2::bigint"
+                "    AND \"created\" < now() - $1::bigint * interval '1 second'",
+                2, NULL, param_values, NULL, NULL, /* binary result */ 1)
+            : PQsendQueryParams(db,
+                "SELECT \"oid\" FROM \"" GIT2_TABLE_NAME "\""
+                "  WHERE \"created\" < now() - $1::bigint * interval '1 second'",
+                1, NULL, param_values, NULL, NULL, /* binary result */ 1))
+        || !PQsetSingleRowMode(db)) {
+        set_giterr_from_pg(db);
+        pg_pool_put(backend->pool, conn, -1);
+        return GIT_ERROR;
+    }
+
+    /* stream the candidates instead of buffering the whole table */
+    while ((result = PQgetResult(db)) != NULL) {
+        if (PQresultStatus(result) == PGRES_SINGLE_TUPLE && error == GIT_OK
+            && PQgetlength(result, 0, 0) == GIT_OID_RAWSZ) {
+            git_oid_fromraw(&oid, (const unsigned char*)PQgetvalue(result, 0, 0));
+
+            if (!is_reachable(&oid, payload)) {
+                if (len == alloc) {
+                    alloc = alloc ? alloc * 2 : 1024;
+                    grown = realloc(unreachable, alloc * sizeof(git_oid));
+                    if (NULL == grown) {
+                        giterr_set_oom();
+                        error = GIT_ERROR;
+                    } else {
+                        unreachable = grown;
+                    }
+                }
+
+                if (error == GIT_OK)
+                    git_oid_cpy(&unreachable[len++], &oid);
+            }
+        } else if (PQresultStatus(result) != PGRES_SINGLE_TUPLE
+            && PQresultStatus(result) != PGRES_TUPLES_OK && error == GIT_OK) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+        }
+
+        PQclear(result);
+    }
+
+    for (i = 0; error == GIT_OK && i < len; i += batch_size)
+        error = delete_oids(db, grace, backend->shared ? repo : NULL, unreachable + i,
+            (len - i < batch_size) ? len - i : batch_size);
+
+    /* streams no writer finished or discarded, e.g. because it crashed;
+     * one still being written keeps getting newer chunks */
+    if (error == GIT_OK
+        && complete_pq_exec(PQexecParams(db,
+            "DELETE FROM \"" GIT2_CHUNKS_TABLE_NAME "\""
+            "  WHERE \"stream\" IN ("
+            "    SELECT \"stream\" FROM \"" GIT2_CHUNKS_TABLE_NAME "\""
+            "    GROUP BY \"stream\""
+            "    HAVING max(\"created\") < now() - $1::bigint * interval '1 second')",
+            1, NULL, param_values, NULL, NULL, 0))) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+    }
+
+    if (error == GIT_OK && backend->packs)
+        error = sweep_packs(db, is_reachable, payload, grace);
+
+    pg_pool_put(backend->pool, conn, error);
+    free(unreachable);
+    return error;
+}
+
+/* creates the object table partitioned by a hash of the oid, unless
+ * there already is one */
+static int create_partitioned(PGconn *db, unsigned int partitions)
+{
+    char sql[1024];
+
+    snprintf(sql, sizeof(sql),
+        "DO $BODY$ BEGIN "
+
+        "IF to_regclass('\"" GIT2_TABLE_NAME "\"') IS NULL "
+        "THEN"
+        "  CREATE TABLE \"" GIT2_TABLE_NAME "\" ("
+        "    \"oid\" bytea NOT NULL DEFAULT '',"
+        "    \"type\" int NOT NULL,"
+        "    \"size\" bigint NOT NULL,"
+        "    \"data\" bytea NOT NULL,"
+        "    \"created\" timestamptz NOT NULL DEFAULT now(),"
+        "    CONSTRAINT \"" GIT2_PK_NAME "\" PRIMARY KEY (\"oid\")"
+        "  ) PARTITION BY HASH (\"oid\");"
+        "  FOR i IN 0..%u LOOP"
+        "    EXECUTE format('CREATE TABLE %%I PARTITION OF \"" GIT2_TABLE_NAME "\""
+        "      FOR VALUES WITH (MODULUS %u, REMAINDER %%s)',"
+        "      '" GIT2_PARTITION_PREFIX "' || i, i);"
+        "  END LOOP;"
+        "END IF;"
+
+        "END; $BODY$",
+        partitions - 1, partitions);
+
+    return complete_pq_exec(PQexec(db, sql));
+}
+
+/* `payload` points to the number of partitions for a new table */
+static int init_db(PGconn *db, void *payload)
+{
+    unsigned int partitions = *(const unsigned int*)payload;
+    PGresult *result;
+
+    /* the rest of the DDL below applies to a partitioned table just the
+     * same, and recurses into its partitions */
+    if (partitions > 0 && create_partitioned(db, partitions))
+        return 1;
+
+    result = PQexec(db,
+        /* run as plpgsql so if statement works */
+        "DO $BODY$ BEGIN "
+
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_TABLE_NAME "\" ("
+        "  \"oid\" bytea NOT NULL DEFAULT '',"
+        "  \"type\" int NOT NULL,"
+        "  \"size\" bigint NOT NULL,"
+        "  \"data\" bytea NOT NULL,"
+        "  \"created\" timestamptz NOT NULL DEFAULT now(),"
+        "  CONSTRAINT \"" GIT2_PK_NAME "\" PRIMARY KEY (\"oid\")"
+        ");"
 
         "IF NOT EXISTS("
         "  select 1 from pg_index, pg_class"
@@ -219,86 +3207,296 @@ static int init_db(PGconn *db)
         "    (\"type\");"
         "END IF;"
 
+        /* tables from before the sweep grace period existed; checked
+         * first, since even a no-op ALTER TABLE waits for an ACCESS
+         * EXCLUSIVE lock behind every open transaction on the table */
+        "IF NOT EXISTS("
+        "  select 1 from information_schema.columns"
+        "  where table_name = '" GIT2_TABLE_NAME "'"
+        "    and column_name = 'created'"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_TABLE_NAME "\""
+        "    ADD COLUMN \"created\" timestamptz NOT NULL DEFAULT now();"
+        "END IF;"
+
+        /* tables from before the size column existed get it nullable,
+         * which only touches the catalog; the old rows are filled in by
+         * git_odb_backend_pgsql_backfill_size(), outside of this lock */
+        "IF NOT EXISTS("
+        "  select 1 from information_schema.columns"
+        "  where table_name = '" GIT2_TABLE_NAME "'"
+        "    and column_name = 'size'"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_TABLE_NAME "\" ADD COLUMN \"size\" bigint;"
+        "END IF;"
+
+        /* out of line and uncompressed, so substring() in readstream
+         * only fetches the TOAST chunks it needs; rows written before
+         * this keep their compressed values and still read fine.  Like
+         * any ALTER TABLE it waits for an ACCESS EXCLUSIVE lock, so it
+         * only runs when the column isn't set up that way yet */
+        "IF EXISTS("
+        "  select 1 from pg_attribute"
+        "  where attrelid = '\"" GIT2_TABLE_NAME "\"'::regclass"
+        "    and attname = 'data' and attstorage <> 'e'"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_TABLE_NAME "\""
+        "    ALTER COLUMN \"data\" SET STORAGE EXTERNAL;"
+        "END IF;"
+
+        /* pieces of objects still being streamed in; unlogged, since
+         * a crash abandons the stream anyway */
+        "CREATE UNLOGGED TABLE IF NOT EXISTS \"" GIT2_CHUNKS_TABLE_NAME "\" ("
+        "  \"stream\" bigint NOT NULL,"
+        "  \"seq\" int NOT NULL,"
+        "  \"data\" bytea NOT NULL,"
+        "  \"created\" timestamptz NOT NULL DEFAULT now(),"
+        "  PRIMARY KEY (\"stream\", \"seq\")"
+        ");"
+        /* chunk tables from before the sweep dropped abandoned streams */
+        "IF NOT EXISTS("
+        "  select 1 from information_schema.columns"
+        "  where table_name = '" GIT2_CHUNKS_TABLE_NAME "'"
+        "    and column_name = 'created'"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_CHUNKS_TABLE_NAME "\""
+        "    ADD COLUMN \"created\" timestamptz NOT NULL DEFAULT now();"
+        "END IF;"
+        "CREATE SEQUENCE IF NOT EXISTS \"" GIT2_STREAM_SEQ_NAME "\";"
+
+        /* covers read_header and the lookup in exists, so they can be
+         * index-only scans that never detoast "data" */
+        "CREATE INDEX IF NOT EXISTS \"" GIT2_HEADER_IDX_NAME "\""
+        "  ON \"" GIT2_TABLE_NAME "\""
+        "  (\"oid\") INCLUDE (\"type\", \"size\");"
+
+        /* which repositories have which objects, for shared backends */
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_REPOS_TABLE_NAME "\" ("
+        "  \"repo_id\" bigint NOT NULL,"
+        "  \"oid\" bytea NOT NULL,"
+        "  \"created\" timestamptz NOT NULL DEFAULT now(),"
+        "  PRIMARY KEY (\"repo_id\", \"oid\")"
+        ");"
+        "CREATE INDEX IF NOT EXISTS \"" GIT2_REPOS_OID_IDX_NAME "\""
+        "  ON \"" GIT2_REPOS_TABLE_NAME "\" (\"oid\");"
+        /* a membership row never outlives its content; NOT VALID, so
+         * adding it doesn't scan a table that predates it.  A partitioned
+         * table can only be referenced from PostgreSQL 12 on, so older
+         * servers go without */
+        "IF NOT EXISTS("
+        "  select 1 from pg_constraint"
+        "  where conname = '" GIT2_REPOS_FK_NAME "'"
+        ") AND ("
+        "  current_setting('server_version_num')::int >= 120000"
+        "  OR NOT EXISTS("
+        "    select 1 from pg_class"
+        "    where oid = '\"" GIT2_TABLE_NAME "\"'::regclass and relkind = 'p'"
+        "  )"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_REPOS_TABLE_NAME "\""
+        "    ADD CONSTRAINT \"" GIT2_REPOS_FK_NAME "\""
+        "    FOREIGN KEY (\"oid\") REFERENCES \"" GIT2_TABLE_NAME "\" (\"oid\")"
+        "    NOT VALID;"
+        "END IF;"
+
+        /* packs stored as they were received, for backends storing
+         * packs: the file in chunks, kept out of line and uncompressed
+         * like "data" above, and where in it each object's entry is */
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_PACKS_TABLE_NAME "\" ("
+        "  \"pack_id\" bigserial PRIMARY KEY,"
+        "  \"checksum\" bytea NOT NULL,"
+        "  \"size\" bigint NOT NULL,"
+        "  \"created\" timestamptz NOT NULL DEFAULT now()"
+        ");"
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_PACK_CHUNKS_TABLE_NAME "\" ("
+        "  \"pack_id\" bigint NOT NULL,"
+        "  \"seq\" int NOT NULL,"
+        "  \"data\" bytea NOT NULL,"
+        "  PRIMARY KEY (\"pack_id\", \"seq\")"
+        ");"
+        "IF EXISTS("
+        "  select 1 from pg_attribute"
+        "  where attrelid = '\"" GIT2_PACK_CHUNKS_TABLE_NAME "\"'::regclass"
+        "    and attname = 'data' and attstorage <> 'e'"
+        ")"
+        "THEN"
+        "  ALTER TABLE \"" GIT2_PACK_CHUNKS_TABLE_NAME "\""
+        "    ALTER COLUMN \"data\" SET STORAGE EXTERNAL;"
+        "END IF;"
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_PACK_INDEX_TABLE_NAME "\" ("
+        "  \"oid\" bytea NOT NULL,"
+        "  \"pack_id\" bigint NOT NULL,"
+        "  \"offset\" bigint NOT NULL,"
+        "  \"length\" bigint NOT NULL,"
+        "  \"type\" int NOT NULL,"
+        "  \"size\" bigint NOT NULL,"
+        "  PRIMARY KEY (\"oid\", \"pack_id\")"
+        ");"
+        /* finds the base of an offset delta */
+        "CREATE UNIQUE INDEX IF NOT EXISTS \"" GIT2_PACK_POS_IDX_NAME "\""
+        "  ON \"" GIT2_PACK_INDEX_TABLE_NAME "\""
+        "  (\"pack_id\", \"offset\") INCLUDE (\"length\");"
+
+        /* parents, generation number (1 for a root commit, otherwise 1
+         * more than its highest parent; 0 until all parents are known)
+         * and committer time of every commit */
+        "CREATE TABLE IF NOT EXISTS \"" GIT2_GRAPH_TABLE_NAME "\" ("
+        "  \"oid\" bytea NOT NULL PRIMARY KEY,"
+        "  \"parents\" bytea[] NOT NULL,"
+        "  \"generation\" int NOT NULL,"
+        "  \"commit_time\" bigint NOT NULL"
+        ");"
+        "CREATE INDEX IF NOT EXISTS \"" GIT2_GRAPH_PENDING_IDX_NAME "\""
+        "  ON \"" GIT2_GRAPH_TABLE_NAME "\" (\"oid\") WHERE \"generation\" = 0;"
+
+        /* commit headers are parsed on the server, so every way of
+         * writing an object feeds the graph without another round trip */
+        "CREATE OR REPLACE FUNCTION \"git2_commit_header\"(bytea) RETURNS text"
+        "  LANGUAGE sql IMMUTABLE AS $FN$"
+        "    SELECT encode(substring($1 FROM 1 FOR"
+        "      coalesce(nullif(position(decode('0a0a', 'hex') IN $1), 0), length($1))), 'escape')"
+        "  $FN$;"
+        "CREATE OR REPLACE FUNCTION \"git2_commit_parents\"(bytea) RETURNS bytea[]"
+        "  LANGUAGE sql IMMUTABLE AS $FN$"
+        "    SELECT ARRAY(SELECT decode(m[1], 'hex')"
+        "      FROM regexp_matches(\"git2_commit_header\"($1),"
+        "        '^parent ([0-9a-f]{40})$', 'gn') AS m)"
+        "  $FN$;"
+        "CREATE OR REPLACE FUNCTION \"git2_commit_time\"(bytea) RETURNS bigint"
+        "  LANGUAGE sql IMMUTABLE AS $FN$"
+        "    SELECT coalesce((regexp_match(\"git2_commit_header\"($1),"
+        "      '^committer .*> (-?[0-9]+) [-+][0-9]{4}$', 'n'))[1]::bigint, 0)"
+        "  $FN$;"
+
+        "CREATE OR REPLACE FUNCTION \"git2_commit_graph_add\"() RETURNS trigger"
+        "  LANGUAGE plpgsql AS $FN$"
+        "  DECLARE parent_oids bytea[] := \"git2_commit_parents\"(NEW.\"data\");"
+        "  BEGIN"
+        "    INSERT INTO \"" GIT2_GRAPH_TABLE_NAME "\""
+        "      (\"oid\", \"parents\", \"generation\", \"commit_time\")"
+        "      SELECT NEW.\"oid\", parent_oids,"
+        "        CASE WHEN count(g.\"oid\") = cardinality(parent_oids)"
+        "            AND coalesce(bool_and(g.\"generation\" > 0), true)"
+        "          THEN 1 + coalesce(max(g.\"generation\"), 0)"
+        "          ELSE 0 END,"
+        "        \"git2_commit_time\"(NEW.\"data\")"
+        "      FROM unnest(parent_oids) AS p(\"parent\")"
+        "      LEFT JOIN \"" GIT2_GRAPH_TABLE_NAME "\" g ON g.\"oid\" = p.\"parent\""
+        "      ON CONFLICT (\"oid\") DO NOTHING;"
+        "    RETURN NULL;"
+        "  END $FN$;"
+
+        "IF NOT EXISTS("
+        "  select 1 from pg_trigger"
+        "  where tgname = '" GIT2_GRAPH_TRIGGER_NAME "'"
+        ")"
+        "THEN"
+        "  CREATE TRIGGER \"" GIT2_GRAPH_TRIGGER_NAME "\""
+        "    AFTER INSERT ON \"" GIT2_TABLE_NAME "\""
+        "    FOR EACH ROW WHEN (NEW.\"type\" = 1)"
+        "    EXECUTE PROCEDURE \"git2_commit_graph_add\"();"
+        "END IF;"
+
         /* end plpgsql statement */
         "END; $BODY$");
     return complete_pq_exec(result);
 }
 
-static int prepare_stmts(PGconn *db)
+int git_pgsql_pool_new(git_pgsql_pool **out, const char *conninfo, size_t size)
 {
-    PGresult *result;
-
-    result = PQprepare(db, "read",
-        "SELECT \"type\", \"data\""
-        "  FROM \"" GIT2_TABLE_NAME "\""
-        "  WHERE \"oid\" = $1::bytea",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
-
-    result = PQprepare(db, "read_header",
-        "SELECT \"type\", length(\"data\")"
-        "  FROM \"" GIT2_TABLE_NAME "\""
-        "  WHERE \"oid\" = $1::bytea",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
+    assert(out);
 
-    result = PQprepare(db, "exists",
-        "SELECT 1"
-        "  FROM \"" GIT2_TABLE_NAME "\""
-        "  WHERE \"oid\" = $1::bytea",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
+    if (pg_pool_new(out, conninfo, size) < 0) {
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
 
-    result = PQprepare(db, "write",
-        "INSERT INTO \"" GIT2_TABLE_NAME "\""
-        "  (\"oid\", \"type\", \"data\")"
-        "  VALUES($1::bytea, $2::int, $3::bytea)",
-        4, NULL);
-    if (complete_pq_exec(result))
-        return 1;
+    return GIT_OK;
+}
 
-    return 0;
+void git_pgsql_pool_free(git_pgsql_pool *pool)
+{
+    pg_pool_free(pool);
 }
 
-git_error_code git_odb_backend_pgsql(git_odb_backend **backend_out,
-    const char *conninfo)
+int git_odb_backend_pgsql_ext(git_odb_backend **backend_out, git_pgsql_pool *pool,
+    const git_odb_backend_pgsql_options *opts)
 {
+    git_odb_backend_pgsql_options defaults = GIT_ODB_BACKEND_PGSQL_OPTIONS_INIT;
     pgsql_odb_backend *backend;
-    int error;
 
-    backend = calloc(1, sizeof(pgsql_odb_backend));
-    if (NULL == backend) {
-        giterr_set_oom();
+    assert(backend_out && pool);
+
+    if (NULL == opts)
+        opts = &defaults;
+
+    if (opts->shared && opts->packs) {
+        giterr_set_str(GITERR_ODB, "a shared backend can't store packs");
         return GIT_ERROR;
     }
 
-    backend->db = PQconnectdb(conninfo);
-    if (PQstatus(backend->db) != CONNECTION_OK)
-        goto cleanup;
+    /* only the first backend on a pool creates the tables; the rest
+     * open without a single round trip */
+    if (pg_pool_init_schema(pool, PG_SCHEMA_ODB, &init_db, (void*)&opts->partitions) < 0) {
+        giterr_set_str(GITERR_ODB, "failed to set up the object table");
+        return GIT_ERROR;
+    }
 
-    error = init_db(backend->db);
-    if (error)
-        goto cleanup;
+    backend = calloc(1, sizeof(pgsql_odb_backend));
+    if (NULL == backend || (opts->packs
+            && NULL == (backend->cache = calloc(GIT2_PACK_CACHE_SLOTS, sizeof(pack_cache_entry))))) {
+        free(backend);
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
 
-    error = prepare_stmts(backend->db);
-    if (error)
-        goto cleanup;
+    pthread_mutex_init(&backend->cache_lock, NULL);
+    pg_pool_ref(pool);
+    backend->pool = pool;
+    backend->shared = opts->shared;
+    backend->repo_id = opts->repo_id;
+    backend->fmtd_repo_id = htobe64(opts->repo_id);
+    backend->packs = opts->packs;
+    backend->freshen = opts->freshen;
 
     backend->parent.version = GIT_ODB_BACKEND_VERSION;
     backend->parent.read = &pgsql_odb_backend__read;
+    backend->parent.read_prefix = &pgsql_odb_backend__read_prefix;
     backend->parent.read_header = &pgsql_odb_backend__read_header;
     backend->parent.write = &pgsql_odb_backend__write;
+    backend->parent.writepack = &pgsql_odb_backend__writepack;
+    backend->parent.readstream = &pgsql_odb_backend__readstream;
+    backend->parent.writestream = &pgsql_odb_backend__writestream;
     backend->parent.exists = &pgsql_odb_backend__exists;
+    backend->parent.exists_prefix = &pgsql_odb_backend__exists_prefix;
+    backend->parent.foreach = &pgsql_odb_backend__foreach;
     backend->parent.free = &pgsql_odb_backend__free;
 
     *backend_out = (git_odb_backend*)backend;
     return GIT_OK;
+}
 
-cleanup:
-    set_giterr_from_pg(backend);
-    pgsql_odb_backend__free((git_odb_backend*)backend);
-    return GIT_ERROR;
+int git_odb_backend_pgsql_pool(git_odb_backend **backend_out, git_pgsql_pool *pool)
+{
+    return git_odb_backend_pgsql_ext(backend_out, pool, NULL);
+}
+
+git_error_code git_odb_backend_pgsql(git_odb_backend **backend_out,
+    const char *conninfo)
+{
+    git_pgsql_pool *pool;
+    int error;
+
+    if ((error = git_pgsql_pool_new(&pool, conninfo, 1)) < 0)
+        return error;
+
+    /* the backend holds its own reference */
+    error = git_odb_backend_pgsql_pool(backend_out, pool);
+    git_pgsql_pool_free(pool);
+    return error;
 }
@@ -0,0 +1,159 @@
+#ifndef INCLUDE_git_odb_pgsql_h__
+#define INCLUDE_git_odb_pgsql_h__
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * A pool of connections the odb and refdb backends of any number of
+ * repositories can share.  Each backend holds a reference to it, and
+ * checks a connection out for each call, so a backend can be used from
+ * several threads at once; calls block while all `size` connections are
+ * busy.  Statements are prepared on a connection the first time they
+ * run there.  A ref transaction keeps one connection for as long as it
+ * is open, so a pool shared with refdb backends needs at least one more
+ * than those can have open at once; see pgsql-refdb.h.
+ */
+typedef struct pg_pool git_pgsql_pool;
+
+int git_pgsql_pool_new(git_pgsql_pool **out, const char *conninfo, size_t size);
+
+void git_pgsql_pool_free(git_pgsql_pool *pool);
+
+/* a backend with a pool of one connection of its own */
+git_error_code git_odb_backend_pgsql(git_odb_backend **backend_out,
+    const char *conninfo);
+
+/* creates the tables when it is the first backend on `pool` to need
+ * them, and otherwise doesn't talk to the server at all */
+int git_odb_backend_pgsql_pool(git_odb_backend **backend_out, git_pgsql_pool *pool);
+
+typedef struct {
+    /* if the object table has to be created, partition it by a hash of
+     * the oid into this many partitions (git2_odb_p0, ...), which are
+     * vacuumed and indexed separately and scanned in parallel by
+     * foreach; 0 leaves it unpartitioned.  An existing table is kept
+     * the way it is. */
+    unsigned int partitions;
+    /* store each object once for every shared backend on the database,
+     * and track which repository has which in git2_odb_repos; a write
+     * of an object another repository already has only adds a row
+     * there.  Shared backends don't see the objects of unshared ones. */
+    int shared;
+    unsigned long long repo_id;
+    /* keep the packs of writepack (fetches and pushes) as they came,
+     * in chunks in git2_pack_chunks with an index in git2_pack_index,
+     * instead of a row per object; reads resolve deltas on the client.
+     * Objects written one at a time are still rows.  Pack commits go
+     * into the commit graph like any others; the sweep drops a pack
+     * only as a whole, once none of its objects is reachable.  Packs
+     * can't be shared. */
+    int packs;
+    /* have exists() re-stamp what it finds, since libgit2 doesn't write
+     * an object that exists and the sweep would otherwise take it for
+     * an old one; only deployments running git_odb_backend_pgsql_sweep
+     * need it.  It makes lookups write, so it is best effort and fails
+     * quietly on a read-only server or role. */
+    int freshen;
+} git_odb_backend_pgsql_options;
+
+#define GIT_ODB_BACKEND_PGSQL_OPTIONS_INIT { 0, 0, 0, 0, 0 }
+
+/* like git_odb_backend_pgsql_pool(); `opts` may be NULL for the defaults */
+int git_odb_backend_pgsql_ext(git_odb_backend **backend_out, git_pgsql_pool *pool,
+    const git_odb_backend_pgsql_options *opts);
+
+/*
+ * Gives the repository `repo_id` every object of a shared backend's
+ * repository, without copying any of their content.
+ */
+int git_odb_backend_pgsql_fork(git_odb_backend *backend, unsigned long long repo_id);
+
+/* sweep phase of a garbage collection, see gc/gc.h, for backends
+ * opened with the freshen option; a shared backend
+ * only deletes content no other repository has, and a packs backend
+ * also drops stored packs none of whose objects is reachable.  Also
+ * drops the chunks of object streams that were abandoned for longer
+ * than the grace period. */
+int git_odb_backend_pgsql_sweep(git_odb_backend *backend,
+    int (*is_reachable)(const git_oid *, void *), void *payload,
+    unsigned int grace_seconds, size_t batch_size);
+
+/*
+ * The batch calls below send their statements through libpq's pipeline
+ * mode when it is available (PostgreSQL 14 client libraries), a few
+ * hundred per round trip, and one at a time otherwise.
+ */
+
+/* `data` is only valid until the callback returns; a non-zero return
+ * stops the read with GIT_EUSER */
+typedef int (*git_odb_pgsql_read_cb)(const git_oid *oid, const void *data,
+    size_t len, git_otype type, void *payload);
+
+/* objects that aren't in the database are skipped; the rest are passed
+ * to `cb` in the order of `oids` */
+int git_odb_backend_pgsql_read_batch(git_odb_backend *backend,
+    const git_oid *oids, size_t n, git_odb_pgsql_read_cb cb, void *payload);
+
+/* sets found[i] to whether oids[i] is in the database */
+int git_odb_backend_pgsql_exists_batch(git_odb_backend *backend,
+    const git_oid *oids, size_t n, int *found);
+
+typedef struct {
+    git_oid oid;
+    git_otype type;
+    const void *data;
+    size_t len;
+} git_odb_pgsql_object;
+
+/* objects that are already stored are only re-stamped for the sweep */
+int git_odb_backend_pgsql_write_batch(git_odb_backend *backend,
+    const git_odb_pgsql_object *objects, size_t n);
+
+/*
+ * The backend keeps a commit graph table up to date as commits are
+ * written, so history can be queried on the server instead of by
+ * reading commits one at a time.  A commit written before one of its
+ * parents has generation 0 until git_odb_backend_pgsql_commit_graph_refresh()
+ * runs, which is also what adds commits written before the graph
+ * existed.  The queries return GIT_ENOTFOUND when they need a commit
+ * the graph doesn't have.
+ */
+
+/* 1 if `ancestor` is reachable from `descendant` (or is it), 0 if not;
+ * generation 0 only makes it prune less */
+int git_odb_backend_pgsql_is_ancestor(git_odb_backend *backend,
+    const git_oid *ancestor, const git_oid *descendant);
+
+/* GIT_ENOTFOUND if the commits have no common ancestor; settles the
+ * generation numbers first when a candidate is still at 0.  The walks
+ * start close to the commits and only go deeper while they find none. */
+int git_odb_backend_pgsql_merge_base(git_oid *out, git_odb_backend *backend,
+    const git_oid *one, const git_oid *two);
+
+/* a non-zero return stops the walk with GIT_EUSER */
+typedef int (*git_odb_pgsql_commit_cb)(const git_oid *oid,
+    unsigned int generation, int64_t commit_time, void *payload);
+
+/* `oid` and its ancestors, newest first by generation and then by
+ * committer time, so a commit always comes before its parents; a `limit`
+ * of 0 returns all of them.  With a limit the walk only goes as deep as
+ * it can matter.  It stops at commits the graph doesn't have. */
+int git_odb_backend_pgsql_ancestors(git_odb_backend *backend, const git_oid *oid,
+    size_t limit, git_odb_pgsql_commit_cb cb, void *payload);
+
+/* adds commits written before the graph existed and fills in missing
+ * generation numbers; the first run reads every commit in the table */
+int git_odb_backend_pgsql_commit_graph_refresh(git_odb_backend *backend);
+
+/*
+ * Fills in the size column of rows written before it existed, which
+ * the backend otherwise works out from the data on every read_header.
+ * Run it once after upgrading, while the repository is in use if need
+ * be: it goes `batch_size` rows at a time (0 for 1000), each batch in a
+ * transaction of its own.  *filled_out is how many rows it filled in.
+ */
+int git_odb_backend_pgsql_backfill_size(git_odb_backend *backend,
+    size_t batch_size, size_t *filled_out);
+
+#endif
@@ -24,34 +24,191 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <libpq-fe.h>
+#include <endian.h>
 #include <git2.h>
 #include <git2/sys/refdb_backend.h>
 #include <git2/sys/refs.h>
+#include "pgsql-refdb.h"
 #include "helpers.h"
+#include "pool.h"
 
 
 #define GIT2_REFDB_TABLE_NAME "git2_refdb"
 #define GIT2_REFDB_PK_NAME "git2_refdb_pkey"
+#define GIT2_REFDB_NAME_IDX_NAME "git2_refdb_idx_name_c"
+
+/* refs an iterator fetches per round trip */
+#define GIT2_REFDB_ITER_BATCH 1000
+
+/* updates a transaction sends before reading their results back */
+#define GIT2_PIPELINE_DEPTH 256
+
+/* the first key of the advisory locks on refs ('git2'); the second is
+ * a hash of the name */
+#define GIT2_REFDB_LOCK_SPACE 1734964274
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+/* what every write of the ref named $1 starts with: it waits for the
+ * advisory lock a transaction takes in ref_lock, so a plain write can't
+ * slip in while the ref is locked, not even one creating it.  The
+ * transaction holding the lock just takes it again. */
+#define GIT2_REFDB_WRITE_LOCK \
+    "WITH \"lock\" AS (" \
+    "  SELECT 1 FROM pg_advisory_xact_lock(" XSTR(GIT2_REFDB_LOCK_SPACE) ", hashtext($1::text))" \
+    ")"
 
 
+typedef struct {
+    /* the name a lock was taken on, and what to write there; a NULL
+     * ref deletes it */
+    char *name;
+    git_reference *ref;
+} pgsql_refdb_update;
+
+/*
+ * The database transaction behind lock and unlock.  The refs a thread
+ * locks share one until the last of them is unlocked, on a connection
+ * held for the duration.  Updates are queued as the refs are unlocked,
+ * then sent together in pipelined batches and committed once.
+ */
+typedef struct {
+    pg_conn *conn;
+    pthread_t owner;
+    size_t locks;
+    pgsql_refdb_update *updates;
+    size_t n_updates;
+    size_t alloc_updates;
+    /* a statement failed, which aborts the whole transaction */
+    int failed;
+} pgsql_refdb_txn;
+
 typedef struct {
     git_refdb_backend parent;
-    PGconn *db;
+    pg_pool *pool;
+    /* one thread's transaction at a time; others wait for txn_done */
+    pthread_mutex_t txn_lock;
+    pthread_cond_t txn_done;
+    pgsql_refdb_txn *txn;
 } pgsql_refdb_backend;
 
 typedef struct {
     git_reference_iterator parent;
     git_refdb_backend *backend;
+    char *like_pattern;
+    /* the range of names starting with the glob's literal prefix; `hi`
+     * is NULL when the prefix is empty */
+    char *lo, *hi;
+    /* the current batch */
     PGresult *result;
     int cur_row;
+    /* set once a batch comes back short */
+    int done;
 } pgsql_refdb_iterator;
 
 
-static void set_giterr_from_pg(pgsql_refdb_backend *backend)
+/* the names share a namespace with the odb's statements on a shared
+ * connection, hence the prefix */
+static const pg_stmt refdb_stmts[] = {
+    {"ref_lookup",
+        "SELECT \"name\", \"type\", \"target\", \"peel\""
+        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "  WHERE \"name\" = $1::text"},
+    /* the batch after the ref named $2, in byte order so the range
+     * from $3 (to $4) is a scan of GIT2_REFDB_NAME_IDX_NAME and LIKE
+     * only filters what it finds */
+    {"ref_iterator",
+        "SELECT \"name\", \"type\", \"target\", \"peel\""
+        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "  WHERE \"name\" COLLATE \"C\" > $2::text"
+        "    AND \"name\" COLLATE \"C\" >= $3::text"
+        "    AND \"name\" LIKE $1::text ESCAPE '\\'"
+        "  ORDER BY \"name\" COLLATE \"C\""
+        "  LIMIT " XSTR(GIT2_REFDB_ITER_BATCH)},
+    {"ref_iterator_range",
+        "SELECT \"name\", \"type\", \"target\", \"peel\""
+        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "  WHERE \"name\" COLLATE \"C\" > $2::text"
+        "    AND \"name\" COLLATE \"C\" >= $3::text"
+        "    AND \"name\" COLLATE \"C\" < $4::text"
+        "    AND \"name\" LIKE $1::text ESCAPE '\\'"
+        "  ORDER BY \"name\" COLLATE \"C\""
+        "  LIMIT " XSTR(GIT2_REFDB_ITER_BATCH)},
+    {"ref_exists",
+        "SELECT 1"
+        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "  WHERE \"name\" = $1::text"},
+    /* each write is one statement, which comes back with a row if it
+     * changed the ref; the primary key settles races between them */
+    {"ref_create",
+        GIT2_REFDB_WRITE_LOCK
+        "INSERT INTO \"" GIT2_REFDB_TABLE_NAME "\""
+        "  (\"name\", \"type\", \"target\", \"peel\")"
+        "  SELECT $1::text, $2::int, $3::bytea, $4::bytea FROM \"lock\""
+        "  ON CONFLICT (\"name\") DO NOTHING"
+        "  RETURNING 1"},
+    {"ref_upsert",
+        GIT2_REFDB_WRITE_LOCK
+        "INSERT INTO \"" GIT2_REFDB_TABLE_NAME "\""
+        "  (\"name\", \"type\", \"target\", \"peel\")"
+        "  SELECT $1::text, $2::int, $3::bytea, $4::bytea FROM \"lock\""
+        "  ON CONFLICT (\"name\") DO UPDATE"
+        "    SET \"type\" = EXCLUDED.\"type\", \"target\" = EXCLUDED.\"target\","
+        "      \"peel\" = EXCLUDED.\"peel\""
+        "  RETURNING 1"},
+    /* compare-and-swap against the type and target in $5 and $6; a
+     * concurrent writer's change is rechecked against them before the
+     * row is updated */
+    {"ref_replace",
+        GIT2_REFDB_WRITE_LOCK
+        "UPDATE \"" GIT2_REFDB_TABLE_NAME "\""
+        "  SET \"type\" = $2::int, \"target\" = $3::bytea, \"peel\" = $4::bytea"
+        "  FROM \"lock\""
+        "  WHERE \"name\" = $1::text"
+        "    AND \"type\" = $5::int AND \"target\" = $6::bytea"
+        "  RETURNING 1"},
+    {"ref_del",
+        GIT2_REFDB_WRITE_LOCK
+        "DELETE FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "  USING \"lock\""
+        "  WHERE \"name\" = $1::text"
+        "  RETURNING 1"},
+    /* 0 if another transaction holds the ref.  The advisory lock keeps
+     * other transactions and plain writes out until the commit, whether
+     * the ref exists or not; the row lock (only taken once that one is
+     * had) also holds off anything else updating the row */
+    {"ref_lock",
+        "SELECT CASE"
+        "  WHEN pg_try_advisory_xact_lock(" XSTR(GIT2_REFDB_LOCK_SPACE) ", hashtext($1::text))"
+        "  THEN 1 + (SELECT count(*) FROM ("
+        "    SELECT 1 FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "      WHERE \"name\" = $1::text FOR UPDATE"
+        "  ) r)::int"
+        "  ELSE 0 END"},
+    /* how many rows went, and how many there were to begin with, which
+     * the DELETE doesn't change for the outer query */
+    {"ref_del_cas",
+        GIT2_REFDB_WRITE_LOCK
+        ", \"deleted\" AS ("
+        "  DELETE FROM \"" GIT2_REFDB_TABLE_NAME "\""
+        "    USING \"lock\""
+        "    WHERE \"name\" = $1::text"
+        "      AND \"type\" = $2::int AND \"target\" = $3::bytea"
+        "    RETURNING 1"
+        ")"
+        "SELECT (SELECT count(*) FROM \"deleted\")::int,"
+        "  (SELECT count(*) FROM \"" GIT2_REFDB_TABLE_NAME "\" WHERE \"name\" = $1::text)::int"},
+};
+
+
+static void set_giterr_from_pg(PGconn *db)
 {
-    giterr_set_str(GITERR_REFERENCE, PQerrorMessage(backend->db));
+    giterr_set_str(GITERR_REFERENCE, PQerrorMessage(db));
 }
 
 static void pgsql_refdb_backend__free(git_refdb_backend *_backend)
@@ -59,19 +216,88 @@ static void pgsql_refdb_backend__free(git_refdb_backend *_backend)
     pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
     assert(backend);
 
-    PQfinish(backend->db);
+    pthread_cond_destroy(&backend->txn_done);
+    pthread_mutex_destroy(&backend->txn_lock);
+    pg_pool_free(backend->pool);
     free(backend);
 }
 
+static const pg_stmt *find_stmt(const char *stmt_name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(refdb_stmts) / sizeof(refdb_stmts[0]); ++i)
+        if (strcmp(refdb_stmts[i].name, stmt_name) == 0)
+            return &refdb_stmts[i];
+
+    return NULL;
+}
+
+/* the transaction the calling thread has open, if any */
+static pgsql_refdb_txn *own_txn(pgsql_refdb_backend *backend)
+{
+    pgsql_refdb_txn *txn;
+
+    pthread_mutex_lock(&backend->txn_lock);
+    txn = backend->txn;
+    if (txn != NULL && !pthread_equal(txn->owner, pthread_self()))
+        txn = NULL;
+    pthread_mutex_unlock(&backend->txn_lock);
+
+    return txn;
+}
+
+/*
+ * Runs a prepared statement on a connection checked out of the pool for
+ * just this call, preparing it there first if need be.  A thread with
+ * refs locked runs it in its transaction instead, so it sees its own
+ * locks and doesn't need a second connection.  On failure the error is
+ * already set.
+ */
+static PGresult *exec_stmt(pgsql_refdb_backend *backend, const char *stmt_name,
+    int n_params, const char * const *values, const int *lengths,
+    const int *formats)
+{
+    pgsql_refdb_txn *txn = own_txn(backend);
+    const pg_stmt *stmt = find_stmt(stmt_name);
+    pg_conn *conn;
+    PGresult *result = NULL;
+    ExecStatusType status;
+
+    if (txn != NULL) {
+        conn = txn->conn;
+    } else if (pg_pool_get(&conn, backend->pool) < 0) {
+        giterr_set_str(GITERR_REFERENCE, "could not connect to the database");
+        return NULL;
+    }
+
+    if (stmt != NULL && pg_pool_prepare(conn, stmt) == 0)
+        result = PQexecPrepared(conn->db, stmt_name,
+            n_params, values, lengths, formats,
+            /* binary result */ 1);
+
+    status = PQresultStatus(result);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK) {
+        set_giterr_from_pg(conn->db);
+        if (txn != NULL)
+            txn->failed = 1;
+        else
+            pg_pool_put(backend->pool, conn, -1);
+    } else if (txn == NULL) {
+        pg_pool_put(backend->pool, conn, 0);
+    }
+
+    return result;
+}
+
 static PGresult *exec_read_stmt(pgsql_refdb_backend *backend,
     const char *stmt_name, const char *str_param)
 {
     const char * const param_values[1] = {str_param};
     int param_lengths[1] = {strlen(str_param)};
     int param_formats[1] = {0};     /* text */
-    return PQexecPrepared(backend->db, stmt_name,
-        1, param_values, param_lengths, param_formats,
-        /* binary result */ 1);
+    return exec_stmt(backend, stmt_name,
+        1, param_values, param_lengths, param_formats);
 }
 
 static int pgsql_refdb_backend__exists(
@@ -85,10 +311,10 @@ static int pgsql_refdb_backend__exists(
 
     assert(exists && backend && ref_name);
 
-    result = exec_read_stmt(backend, "exists", ref_name);
+    result = exec_read_stmt(backend, "ref_exists", ref_name);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
         error = GIT_ERROR;
-        set_giterr_from_pg(backend);
         goto cleanup;
     }
 
@@ -108,6 +334,9 @@ static char *glob_to_like_pattern(const char *glob)
     int i = 0;
     int j = 0;
 
+    if (NULL == like_pattern)
+        return NULL;
+
     for (; glob[i] != '\0'; ++i) {
         switch (glob[i]) {
         /* escaping */
@@ -135,6 +364,39 @@ static char *glob_to_like_pattern(const char *glob)
     return like_pattern;
 }
 
+/*
+ * The names a glob can match all start with its literal prefix, up to
+ * the first wildcard, so they lie between the prefix and the prefix
+ * with its last byte bumped.  Non-ASCII bytes at the end are dropped
+ * first, which widens the range a little but keeps the bound valid
+ * UTF-8.  Returns -1 when out of memory.
+ */
+static int glob_prefix_range(char **lo, char **hi, const char *glob)
+{
+    size_t len = strcspn(glob, "*?[\\");
+
+    *hi = NULL;
+    if (NULL == (*lo = malloc(len + 1)))
+        return -1;
+    memcpy(*lo, glob, len);
+    (*lo)[len] = '\0';
+
+    while (len > 0 && (unsigned char)glob[len - 1] >= 0x7f)
+        --len;
+
+    if (len == 0)
+        return 0;
+
+    if (NULL == (*hi = malloc(len + 1))) {
+        free(*lo);
+        return -1;
+    }
+    memcpy(*hi, glob, len);
+    (*hi)[len - 1]++;
+    (*hi)[len] = '\0';
+    return 0;
+}
+
 static int get_ref_from_result(PGresult *result, int row, git_reference **ref)
 {
     const char *ref_name;
@@ -165,14 +427,68 @@ static int get_ref_from_result(PGresult *result, int row, git_reference **ref)
     }
 }
 
+/*
+ * Replaces the current batch with the one after it.  Each batch is a
+ * query of its own that picks up after the last name of the one
+ * before, so no connection is held between calls to `next` and only
+ * GIT2_REFDB_ITER_BATCH refs are ever in memory.
+ */
+static int fetch_batch(pgsql_refdb_iterator *iter)
+{
+    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)iter->backend;
+    int n = PQntuples(iter->result);
+    const char *after = (n > 0) ? PQgetvalue(iter->result, n - 1, 0) : "";
+    const char * const param_values[4] =
+        {iter->like_pattern, after, iter->lo, iter->hi};
+    int param_lengths[4] = {strlen(iter->like_pattern), strlen(after),
+        strlen(iter->lo), iter->hi ? strlen(iter->hi) : 0};
+    int param_formats[4] = {0, 0, 0, 0};     /* text */
+    PGresult *result;
+
+    if (iter->hi)
+        result = exec_stmt(backend, "ref_iterator_range",
+            4, param_values, param_lengths, param_formats);
+    else
+        result = exec_stmt(backend, "ref_iterator",
+            3, param_values, param_lengths, param_formats);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        PQclear(result);
+        return GIT_ERROR;
+    }
+
+    PQclear(iter->result);
+    iter->result = result;
+    iter->cur_row = 0;
+    iter->done = (PQntuples(result) < GIT2_REFDB_ITER_BATCH);
+    return GIT_OK;
+}
+
+/* makes sure the current row is a ref, fetching the next batch if the
+ * current one is used up */
+static int iterator_advance(pgsql_refdb_iterator *iter)
+{
+    if (iter->cur_row < PQntuples(iter->result))
+        return GIT_OK;
+
+    if (iter->done)
+        return GIT_ITEROVER;
+
+    if (fetch_batch(iter) < 0)
+        return GIT_ERROR;
+
+    return (iter->cur_row < PQntuples(iter->result)) ? GIT_OK : GIT_ITEROVER;
+}
+
 static int pgsql_refdb_iterator__next(
     git_reference **ref,
     git_reference_iterator *_iter)
 {
     pgsql_refdb_iterator *iter = (pgsql_refdb_iterator*)_iter;
+    int error;
 
-    if (iter->cur_row >= PQntuples(iter->result)) {
-        return GIT_ITEROVER;
+    if ((error = iterator_advance(iter)) != GIT_OK) {
+        return error;
     }
 
     if (get_ref_from_result(iter->result, iter->cur_row, ref)) {
@@ -183,14 +499,16 @@ static int pgsql_refdb_iterator__next(
     return GIT_OK;
 }
 
+/* the name stays valid until the next call */
 static int pgsql_refdb_iterator__next_name(
     const char **ref_name,
     git_reference_iterator *_iter)
 {
     pgsql_refdb_iterator *iter = (pgsql_refdb_iterator*)_iter;
+    int error;
 
-    if (iter->cur_row >= PQntuples(iter->result)) {
-        return GIT_ITEROVER;
+    if ((error = iterator_advance(iter)) != GIT_OK) {
+        return error;
     }
 
     *ref_name = PQgetvalue(iter->result, iter->cur_row, 0);
@@ -203,6 +521,9 @@ static void pgsql_refdb_iterator__free(
 {
     pgsql_refdb_iterator *iter = (pgsql_refdb_iterator*)_iter;
     PQclear(iter->result);
+    free(iter->like_pattern);
+    free(iter->lo);
+    free(iter->hi);
     free(iter);
 }
 
@@ -217,10 +538,10 @@ static int pgsql_refdb_backend__lookup(
 
     assert(out && backend && ref_name);
 
-    result = exec_read_stmt(backend, "lookup", ref_name);
+    result = exec_read_stmt(backend, "ref_lookup", ref_name);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
         error = GIT_ERROR;
-        set_giterr_from_pg(backend);
         goto cleanup;
     }
 
@@ -246,114 +567,562 @@ static int pgsql_refdb_backend__iterator(
     struct git_refdb_backend *_backend,
     const char *glob)
 {
-    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
     pgsql_refdb_iterator *iter = NULL;
-    int error = GIT_ERROR;
-    char *like_pattern = glob_to_like_pattern(glob);
+
+    assert(iter_out && _backend);
+
+    if (NULL == glob)
+        glob = "*";
 
     iter = (pgsql_refdb_iterator*)calloc(1, sizeof(pgsql_refdb_iterator));
+    if (NULL == iter
+        || NULL == (iter->like_pattern = glob_to_like_pattern(glob))
+        || glob_prefix_range(&iter->lo, &iter->hi, glob) < 0) {
+        if (iter)
+            free(iter->like_pattern);
+        free(iter);
+        giterr_set_oom();
+        return GIT_ERROR;
+    }
+
     iter->parent.next = pgsql_refdb_iterator__next;
     iter->parent.next_name = pgsql_refdb_iterator__next_name;
     iter->parent.free = pgsql_refdb_iterator__free;
     iter->backend = _backend;
     iter->cur_row = 0;  /* ok, calloc does this */
 
-    iter->result = exec_read_stmt(backend, "iterator", like_pattern);
-    if (PQresultStatus(iter->result) != PGRES_TUPLES_OK) {
-        error = GIT_ERROR;
-        set_giterr_from_pg(backend);
-        goto err_cleanup;
+    /* the first batch now, so a bad connection shows up here */
+    if (fetch_batch(iter) < 0) {
+        pgsql_refdb_iterator__free((git_reference_iterator*)iter);
+        return GIT_ERROR;
     }
 
     *iter_out = (git_reference_iterator*)iter;
-    free(like_pattern);
     return GIT_OK;
-
-err_cleanup:
-    free(iter);
-    free(like_pattern);
-    return error;
 }
 
-static int pgsql_refdb_backend__write(git_refdb_backend *_backend,
-    const git_reference *ref, int force)
+/* fills in the name, type, target and peel parameters a ref is
+ * written with */
+static int ref_params(const char **values, int *lengths, uint32_t *fmtd_type,
+    const git_reference *ref)
 {
-    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
-    PGresult *result;
-
-    const char *ref_name = git_reference_name(ref);
-    int ref_type = git_reference_type(ref);
-    uint32_t fmtd_ref_type = htobe32(ref_type);
-
-    const char *ref_peel = (const char *)git_reference_target_peel(ref);
-    int ref_peel_size = (ref_peel == NULL) ? 0 : GIT_OID_RAWSZ;
-
     const char *ref_tgt;
-    int ref_tgt_size;
-    switch (ref_type) {
+
+    switch (git_reference_type(ref)) {
     case GIT_REF_OID:
         ref_tgt = (const char*)git_reference_target(ref);
-        ref_tgt_size = (ref_tgt == NULL) ? 0 : GIT_OID_RAWSZ;
+        lengths[2] = (ref_tgt == NULL) ? 0 : GIT_OID_RAWSZ;
         break;
 
     case GIT_REF_SYMBOLIC:
         ref_tgt = git_reference_symbolic_target(ref);
-        ref_tgt_size = (ref_tgt == NULL) ? 0 : strlen(ref_tgt);
+        lengths[2] = (ref_tgt == NULL) ? 0 : strlen(ref_tgt);
         break;
 
     default:
+        giterr_set_str(GITERR_REFERENCE, "invalid reference type");
         return GIT_ERROR;
     }
 
-    const char * const param_values[4] =
-        { ref_name, (const char*)&fmtd_ref_type, ref_tgt, ref_peel };
+    *fmtd_type = htobe32(git_reference_type(ref));
 
-    int param_lengths[4] =
-        {strlen(ref_name), sizeof(fmtd_ref_type), ref_tgt_size, ref_peel_size};
+    values[0] = git_reference_name(ref);
+    lengths[0] = strlen(values[0]);
+    values[1] = (const char*)fmtd_type;
+    lengths[1] = sizeof(*fmtd_type);
+    values[2] = ref_tgt;
+    values[3] = (const char*)git_reference_target_peel(ref);
+    lengths[3] = (values[3] == NULL) ? 0 : GIT_OID_RAWSZ;
+    return GIT_OK;
+}
 
-    int param_formats[4] = {1, 1, 1, 1};     /* binary */
+/* fills in the type and target a ref is expected to have; returns 0
+ * when nothing is expected */
+static int old_params(const char **values, int *lengths, uint32_t *fmtd_type,
+    const git_oid *old_id, const char *old_target)
+{
+    if (old_id != NULL) {
+        *fmtd_type = htobe32(GIT_REF_OID);
+        values[1] = (const char*)old_id->id;
+        lengths[1] = GIT_OID_RAWSZ;
+    } else if (old_target != NULL) {
+        *fmtd_type = htobe32(GIT_REF_SYMBOLIC);
+        values[1] = old_target;
+        lengths[1] = strlen(old_target);
+    } else {
+        return 0;
+    }
+
+    values[0] = (const char*)fmtd_type;
+    lengths[0] = sizeof(*fmtd_type);
+    return 1;
+}
+
+/*
+ * A single statement whatever the case, so there's never a moment the
+ * ref is missing.  With an expected old value a forced write replaces
+ * the ref only if it still has that value; an unforced one can't
+ * replace it at all, so it only finds out which error to return, like
+ * the other backends.  Otherwise a forced write is an upsert, and any
+ * other one a plain create.
+ */
+static int pgsql_refdb_backend__write(git_refdb_backend *_backend,
+    const git_reference *ref, int force, const git_signature *who,
+    const char *message, const git_oid *old_id, const char *old_target)
+{
+    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
+    const char *param_values[6];
+    int param_lengths[6];
+    int param_formats[6] = {1, 1, 1, 1, 1, 1};     /* binary */
+    uint32_t fmtd_type, fmtd_old_type;
+    const char *stmt_name;
+    int n_params = 4, has_old, error = GIT_OK;
+    PGresult *result;
+
+    assert(backend && ref);
+
+    /* there's no reflog to write */
+    (void)who;
+    (void)message;
+
+    if (ref_params(param_values, param_lengths, &fmtd_type, ref) < 0)
+        return GIT_ERROR;
+
+    has_old = old_params(param_values + 4, param_lengths + 4, &fmtd_old_type,
+        old_id, old_target);
+
+    if (has_old && !force) {
+        /* either the ref is there, or it can't have the old value */
+        stmt_name = "ref_exists";
+        n_params = 1;
+    } else if (has_old) {
+        stmt_name = "ref_replace";
+        n_params = 6;
+    } else {
+        stmt_name = force ? "ref_upsert" : "ref_create";
+    }
+
+    result = exec_stmt(backend, stmt_name,
+        n_params, param_values, param_lengths, param_formats);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        error = GIT_ERROR;
+    } else if (PQntuples(result) == 0 && has_old) {
+        giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+        error = GIT_EMODIFIED;
+    } else if (PQntuples(result) == 0 || n_params == 1) {
+        giterr_set_str(GITERR_REFERENCE,
+            "failed to write reference: a reference with that name already exists");
+        error = GIT_EEXISTS;
+    }
+
+    PQclear(result);
+    return error;
+}
+
+static int pgsql_refdb_backend__del(git_refdb_backend *_backend,
+    const char *ref_name, const git_oid *old_id, const char *old_target)
+{
+    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
+    PGresult *result;
+    const char *param_values[3] = {ref_name};
+    int param_lengths[3] = {strlen(ref_name)};
+    int param_formats[3] = {0, 1, 1};     /* text name, binary old value */
+    uint32_t fmtd_old_type;
+    int deleted = 0, existed = 0, error = GIT_OK;
+
+    assert(backend && ref_name);
+
+    if (!old_params(param_values + 1, param_lengths + 1, &fmtd_old_type,
+            old_id, old_target)) {
+        result = exec_stmt(backend, "ref_del",
+            1, param_values, param_lengths, param_formats);
+        deleted = PQntuples(result);
+        existed = deleted;
+    } else {
+        result = exec_stmt(backend, "ref_del_cas",
+            3, param_values, param_lengths, param_formats);
+        if (PQresultStatus(result) == PGRES_TUPLES_OK
+            && (get_int_from_result(result, &deleted, 0, 0)
+                || get_int_from_result(result, &existed, 0, 1))) {
+            PQclear(result);
+            return GIT_ERROR;
+        }
+    }
+
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        error = GIT_ERROR;
+    } else if (!existed) {
+        giterr_set_str(GITERR_REFERENCE, "reference not found");
+        error = GIT_ENOTFOUND;
+    } else if (!deleted) {
+        giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+        error = GIT_EMODIFIED;
+    }
+
+    PQclear(result);
+    return error;
+}
+
+/* rolls back whatever is left of a transaction, and lets the next one
+ * begin */
+static void txn_end(pgsql_refdb_backend *backend, pgsql_refdb_txn *txn)
+{
+    size_t i;
+
+    if (txn->conn != NULL) {
+        /* after a COMMIT this just warns there's nothing to roll back */
+        if (complete_pq_exec(PQexec(txn->conn->db, "ROLLBACK")))
+            txn->failed = 1;
+        pg_pool_put(backend->pool, txn->conn, txn->failed ? -1 : 0);
+    }
 
-    if (force && _backend->del(_backend, ref_name)) {
+    for (i = 0; i < txn->n_updates; ++i) {
+        free(txn->updates[i].name);
+        git_reference_free(txn->updates[i].ref);
+    }
+    free(txn->updates);
+
+    pthread_mutex_lock(&backend->txn_lock);
+    backend->txn = NULL;
+    pthread_cond_broadcast(&backend->txn_done);
+    pthread_mutex_unlock(&backend->txn_lock);
+
+    free(txn);
+}
+
+/* joins the calling thread's transaction, beginning it if there isn't
+ * one; another thread's has to end first */
+static int txn_join(pgsql_refdb_txn **out, pgsql_refdb_backend *backend)
+{
+    pgsql_refdb_txn *txn;
+
+    pthread_mutex_lock(&backend->txn_lock);
+
+    while (backend->txn != NULL && !pthread_equal(backend->txn->owner, pthread_self()))
+        pthread_cond_wait(&backend->txn_done, &backend->txn_lock);
+
+    if ((txn = backend->txn) != NULL) {
+        txn->locks++;
+        pthread_mutex_unlock(&backend->txn_lock);
+        *out = txn;
+        return GIT_OK;
+    }
+
+    /* claimed first, so the connection can be waited for outside the
+     * lock */
+    if (NULL == (txn = calloc(1, sizeof(pgsql_refdb_txn)))) {
+        pthread_mutex_unlock(&backend->txn_lock);
+        giterr_set_oom();
         return GIT_ERROR;
     }
+    txn->owner = pthread_self();
+    txn->locks = 1;
+    backend->txn = txn;
 
-    result = PQexecPrepared(backend->db, "write",
-        4, param_values, param_lengths, param_formats,
-        /* binary result */ 1);
-    if (complete_pq_exec(result)) {
-        set_giterr_from_pg(backend);
+    pthread_mutex_unlock(&backend->txn_lock);
+
+    if (pg_pool_get(&txn->conn, backend->pool) < 0) {
+        txn->conn = NULL;
+        giterr_set_str(GITERR_REFERENCE, "could not connect to the database");
+        txn_end(backend, txn);
         return GIT_ERROR;
     }
 
+    if (complete_pq_exec(PQexec(txn->conn->db, "BEGIN"))) {
+        set_giterr_from_pg(txn->conn->db);
+        txn->failed = 1;
+        txn_end(backend, txn);
+        return GIT_ERROR;
+    }
+
+    *out = txn;
     return GIT_OK;
 }
 
-static int pgsql_refdb_backend__del(git_refdb_backend *_backend,
-    const char *ref_name)
+/* queues writing `ref` to the locked `name`, or deleting it if `ref`
+ * is NULL; takes over `name` */
+static int txn_queue(pgsql_refdb_txn *txn, char *name, const git_reference *ref)
+{
+    pgsql_refdb_update *update;
+    git_reference *copy = NULL;
+    size_t alloc;
+
+    if (ref != NULL) {
+        switch (git_reference_type(ref)) {
+        case GIT_REF_OID:
+            copy = git_reference__alloc(name, git_reference_target(ref),
+                git_reference_target_peel(ref));
+            break;
+
+        case GIT_REF_SYMBOLIC:
+            copy = git_reference__alloc_symbolic(name,
+                git_reference_symbolic_target(ref));
+            break;
+
+        default:
+            giterr_set_str(GITERR_REFERENCE, "invalid reference type");
+            free(name);
+            return GIT_ERROR;
+        }
+
+        if (NULL == copy)
+            goto oom;
+    }
+
+    if (txn->n_updates == txn->alloc_updates) {
+        alloc = txn->alloc_updates ? txn->alloc_updates * 2 : 16;
+        update = realloc(txn->updates, alloc * sizeof(pgsql_refdb_update));
+        if (NULL == update)
+            goto oom;
+        txn->updates = update;
+        txn->alloc_updates = alloc;
+    }
+
+    update = &txn->updates[txn->n_updates++];
+    update->name = name;
+    update->ref = copy;
+    return GIT_OK;
+
+oom:
+    git_reference_free(copy);
+    free(name);
+    giterr_set_oom();
+    return GIT_ERROR;
+}
+
+/* sends one queued update down the connection */
+static int send_update(PGconn *db, const pgsql_refdb_update *update)
+{
+    const char *param_values[4] = {update->name};
+    int param_lengths[4] = {strlen(update->name)};
+    int param_formats[4] = {1, 1, 1, 1};     /* binary */
+    uint32_t fmtd_type;
+
+    if (update->ref == NULL)
+        return PQsendQueryPrepared(db, "ref_del",
+            1, param_values, param_lengths, param_formats, /* binary result */ 1);
+
+    if (ref_params(param_values, param_lengths, &fmtd_type, update->ref) < 0)
+        return 0;
+
+    return PQsendQueryPrepared(db, "ref_upsert",
+        4, param_values, param_lengths, param_formats, /* binary result */ 1);
+}
+
+/*
+ * Applies the queued updates and commits.  With libpq pipeline mode the
+ * updates go out GIT2_PIPELINE_DEPTH at a time before any result is
+ * read; the sync points between them don't commit anything, as the
+ * transaction is an explicit one.
+ */
+static int txn_commit(pgsql_refdb_txn *txn)
+{
+    PGconn *db = txn->conn->db;
+    PGresult *result;
+    size_t i;
+#ifdef LIBPQ_HAS_PIPELINING
+    size_t start, end, sent;
+#endif
+    int error = GIT_OK;
+
+    /* PQprepare can't be sent down a pipeline along with the rest */
+    if (pg_pool_prepare(txn->conn, find_stmt("ref_upsert")) < 0
+        || pg_pool_prepare(txn->conn, find_stmt("ref_del")) < 0) {
+        set_giterr_from_pg(db);
+        return GIT_ERROR;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!PQenterPipelineMode(db)) {
+        set_giterr_from_pg(db);
+        return GIT_ERROR;
+    }
+
+    for (start = 0; start < txn->n_updates && error == GIT_OK; start = end) {
+        end = (txn->n_updates - start < GIT2_PIPELINE_DEPTH) ?
+            txn->n_updates : start + GIT2_PIPELINE_DEPTH;
+
+        for (sent = start; sent < end; ++sent) {
+            if (!send_update(db, &txn->updates[sent])) {
+                set_giterr_from_pg(db);
+                error = GIT_ERROR;
+                break;
+            }
+        }
+
+        if (!PQpipelineSync(db)) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+            break;
+        }
+
+        /* every statement yields its result and then a NULL */
+        for (i = start; i < sent; ++i) {
+            result = PQgetResult(db);
+            if (error == GIT_OK && PQresultStatus(result) != PGRES_TUPLES_OK) {
+                set_giterr_from_pg(db);
+                error = GIT_ERROR;
+            }
+            PQclear(result);
+            PQclear(PQgetResult(db));
+        }
+
+        /* and the sync point its own PGRES_PIPELINE_SYNC */
+        PQclear(PQgetResult(db));
+    }
+
+    if (!PQexitPipelineMode(db) && error == GIT_OK) {
+        set_giterr_from_pg(db);
+        error = GIT_ERROR;
+    }
+#else
+    for (i = 0; i < txn->n_updates && error == GIT_OK; ++i) {
+        if (!send_update(db, &txn->updates[i])) {
+            set_giterr_from_pg(db);
+            error = GIT_ERROR;
+            break;
+        }
+
+        while ((result = PQgetResult(db)) != NULL) {
+            if (error == GIT_OK && PQresultStatus(result) != PGRES_TUPLES_OK) {
+                set_giterr_from_pg(db);
+                error = GIT_ERROR;
+            }
+            PQclear(result);
+        }
+    }
+#endif
+
+    if (error < 0) {
+        txn->failed = 1;
+        return error;
+    }
+
+    /* COMMIT of an aborted transaction "succeeds" as a ROLLBACK */
+    result = PQexec(db, "COMMIT");
+    if (PQresultStatus(result) != PGRES_COMMAND_OK
+        || strcmp(PQcmdStatus(result), "COMMIT") != 0) {
+        set_giterr_from_pg(db);
+        txn->failed = 1;
+        error = GIT_ERROR;
+    }
+    PQclear(result);
+
+    return error;
+}
+
+/* drops a lock taken by the calling thread; dropping the last one
+ * commits the queued updates, unless something failed on the way, in
+ * which case none of them happen */
+static int txn_leave(pgsql_refdb_backend *backend, pgsql_refdb_txn *txn, int error)
+{
+    if (error < 0 && error != GIT_ELOCKED)
+        txn->failed = 1;
+
+    if (--txn->locks > 0)
+        return error;
+
+    if (txn->n_updates > 0) {
+        if (!txn->failed) {
+            int commit_error = txn_commit(txn);
+            if (error == GIT_OK)
+                error = commit_error;
+        } else if (error == GIT_OK) {
+            giterr_set_str(GITERR_REFERENCE,
+                "the reference transaction failed and was rolled back");
+            error = GIT_ERROR;
+        }
+    }
+
+    txn_end(backend, txn);
+    return error;
+}
+
+static int pgsql_refdb_backend__lock(void **payload_out,
+    git_refdb_backend *_backend, const char *refname)
 {
     pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
+    pgsql_refdb_txn *txn;
     PGresult *result;
-    const char * const param_values[1] = {ref_name};
-    int param_lengths[1] = {strlen(ref_name)};
-    int param_formats[1] = {0};     /* text */
+    char *name;
+    int locked, error;
 
-    assert(data && backend && oid);
+    assert(payload_out && backend && refname);
 
-    result = PQexecPrepared(backend->db, "del",
-        1, param_values, param_lengths, param_formats,
-        /* binary result */ 1);
-    if (complete_pq_exec(result)) {
-        set_giterr_from_pg(backend);
+    if (NULL == (name = strdup(refname))) {
+        giterr_set_oom();
         return GIT_ERROR;
     }
 
+    if ((error = txn_join(&txn, backend)) < 0) {
+        free(name);
+        return error;
+    }
+
+    /* runs in the transaction just joined */
+    result = exec_read_stmt(backend, "ref_lock", refname);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        /* error string already set by exec_stmt */
+        error = GIT_ERROR;
+    } else if (get_int_from_result(result, &locked, 0, 0)) {
+        error = GIT_ERROR;
+    } else if (!locked) {
+        giterr_set_str(GITERR_REFERENCE,
+            "the reference is locked by another transaction");
+        error = GIT_ELOCKED;
+    }
+    PQclear(result);
+
+    if (error < 0) {
+        free(name);
+        return txn_leave(backend, txn, error);
+    }
+
+    *payload_out = name;
     return GIT_OK;
 }
 
-static int init_db(PGconn *db)
+/* `success` is 1 to write `ref`, 2 to delete it, and 0 to leave it */
+static int pgsql_refdb_backend__unlock(git_refdb_backend *_backend,
+    void *payload, int success, int update_reflog, const git_reference *ref,
+    const git_signature *sig, const char *message)
+{
+    pgsql_refdb_backend *backend = (pgsql_refdb_backend*)_backend;
+    pgsql_refdb_txn *txn = own_txn(backend);
+    char *name = payload;
+    int error = GIT_OK;
+
+    assert(backend && name);
+
+    /* there's no reflog to write */
+    (void)update_reflog;
+    (void)sig;
+    (void)message;
+
+    if (NULL == txn) {
+        free(name);
+        giterr_set_str(GITERR_REFERENCE, "reference unlocked by the wrong thread");
+        return GIT_ERROR;
+    }
+
+    if (success == 1 && ref != NULL)
+        error = txn_queue(txn, name, ref);
+    else if (success == 2)
+        error = txn_queue(txn, name, NULL);
+    else
+        free(name);
+
+    return txn_leave(backend, txn, error);
+}
+
+static int init_db(PGconn *db, void *payload)
 {
     PGresult *result;
 
+    (void)payload;
+
     result = PQexec(db,
         /* run as plpgsql so if statement works */
         "DO $BODY$ BEGIN "
@@ -366,62 +1135,27 @@ static int init_db(PGconn *db)
         "  CONSTRAINT \"" GIT2_REFDB_PK_NAME "\" PRIMARY KEY (\"name\")"
         ");"
 
+        /* byte order, whatever the database's collation, so a prefix
+         * is a contiguous range for the iterator to scan */
+        "CREATE INDEX IF NOT EXISTS \"" GIT2_REFDB_NAME_IDX_NAME "\""
+        "  ON \"" GIT2_REFDB_TABLE_NAME "\" (\"name\" COLLATE \"C\");"
+
         /* end plpgsql statement */
         "END; $BODY$");
     return complete_pq_exec(result);
 }
 
-static int prepare_stmts(PGconn *db)
+int git_refdb_backend_pgsql_pool(git_refdb_backend **backend_out,
+    git_pgsql_pool *pool)
 {
-    PGresult *result;
-
-    result = PQprepare(db, "lookup",
-        "SELECT \"name\", \"type\", \"target\", \"peel\""
-        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
-        "  WHERE \"name\" = $1::text",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
-
-    result = PQprepare(db, "iterator",
-        "SELECT \"name\", \"type\", \"target\", \"peel\""
-        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
-        "  WHERE \"name\" LIKE $1::text ESCAPE '\\\\'",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
-
-    result = PQprepare(db, "exists",
-        "SELECT 1"
-        "  FROM \"" GIT2_REFDB_TABLE_NAME "\""
-        "  WHERE \"name\" = $1::text",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
-
-    result = PQprepare(db, "write",
-        "INSERT INTO \"" GIT2_REFDB_TABLE_NAME "\""
-        "  (\"name\", \"type\", \"target\", \"peel\")"
-        "  VALUES($1::text, $2::int, $3::bytea, $4::bytea)",
-        4, NULL);
-    if (complete_pq_exec(result))
-        return 1;
+    pgsql_refdb_backend *backend;
 
-    result = PQprepare(db, "del",
-        "DELETE FROM \"" GIT2_REFDB_TABLE_NAME "\""
-        "  WHERE \"name\" = $1::text",
-        1, NULL);
-    if (complete_pq_exec(result))
-        return 1;
+    assert(backend_out && pool);
 
-    return 0;
-}
-
-git_error_code git_refdb_backend_pgsql(git_refdb_backend **backend_out,
-    const char *conninfo)
-{
-    pgsql_refdb_backend *backend;
-    int error;
+    if (pg_pool_init_schema(pool, PG_SCHEMA_REFDB, &init_db, NULL) < 0) {
+        giterr_set_str(GITERR_REFERENCE, "failed to set up the refdb table");
+        return GIT_ERROR;
+    }
 
     /* TODO: should be currently nonexistent git_refdb_backend_malloc,
         like the odb version */
@@ -431,17 +1165,10 @@ git_error_code git_refdb_backend_pgsql(git_refdb_backend **backend_out,
         return GIT_ERROR;
     }
 
-    backend->db = PQconnectdb(conninfo);
-    if (PQstatus(backend->db) != CONNECTION_OK)
-        goto cleanup;
-
-    error = init_db(backend->db);
-    if (error)
-        goto cleanup;
-
-    error = prepare_stmts(backend->db);
-    if (error)
-        goto cleanup;
+    pg_pool_ref(pool);
+    backend->pool = pool;
+    pthread_mutex_init(&backend->txn_lock, NULL);
+    pthread_cond_init(&backend->txn_done, NULL);
 
     backend->parent.version = GIT_REFDB_BACKEND_VERSION;
     backend->parent.exists = &pgsql_refdb_backend__exists;
@@ -449,12 +1176,25 @@ git_error_code git_refdb_backend_pgsql(git_refdb_backend **backend_out,
     backend->parent.iterator = &pgsql_refdb_backend__iterator;
     backend->parent.write = &pgsql_refdb_backend__write;
     backend->parent.del = &pgsql_refdb_backend__del;
+    backend->parent.lock = &pgsql_refdb_backend__lock;
+    backend->parent.unlock = &pgsql_refdb_backend__unlock;
+    backend->parent.free = &pgsql_refdb_backend__free;
 
     *backend_out = (git_refdb_backend*)backend;
     return GIT_OK;
+}
 
-cleanup:
-    set_giterr_from_pg(backend);
-    pgsql_refdb_backend__free((git_refdb_backend*)backend);
-    return GIT_ERROR;
+git_error_code git_refdb_backend_pgsql(git_refdb_backend **backend_out,
+    const char *conninfo)
+{
+    git_pgsql_pool *pool;
+    int error;
+
+    if ((error = git_pgsql_pool_new(&pool, conninfo, 1)) < 0)
+        return error;
+
+    /* the backend holds its own reference */
+    error = git_refdb_backend_pgsql_pool(backend_out, pool);
+    git_pgsql_pool_free(pool);
+    return error;
 }
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_git_refdb_pgsql_h__
+#define INCLUDE_git_refdb_pgsql_h__
+
+#include <git2.h>
+#include <git2/sys/refdb_backend.h>
+#include "pgsql-odb.h"
+
+git_error_code git_refdb_backend_pgsql(git_refdb_backend **backend_out,
+    const char *conninfo);
+
+/* shares `pool` (see pgsql-odb.h) with whichever odb and refdb backends
+ * already use it */
+int git_refdb_backend_pgsql_pool(git_refdb_backend **backend_out,
+    git_pgsql_pool *pool);
+
+/*
+ * The refs of a git_transaction are locked in one database transaction,
+ * which holds a connection of the pool until it commits; the updates
+ * go out in pipelined batches and land all together or not at all.  A
+ * backend runs one thread's transaction at a time.  Writes and deletes
+ * outside it, from any backend, wait for it to end before touching a
+ * ref it has locked.
+ *
+ * That connection stays checked out from the first lock to the last
+ * unlock, and the odb and refdb calls libgit2 makes in between, such as
+ * reading the new targets, need another one from the pool.  A shared
+ * pool must therefore have more connections than there can be ref
+ * transactions open at once (one per refdb backend at most); with a
+ * pool of one, the first odb call inside a transaction blocks forever.
+ */
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+
+/* idle connections older than this are pinged before they're reused */
+#define POOL_PING_AFTER 30
+
+struct pg_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    /* held while a schema is being created, so two backends opening at
+     * once don't race each other's DDL */
+    pthread_mutex_t schema_lock;
+    unsigned int schemas;
+    pg_conn *conns;
+    size_t size;
+    size_t refcount;
+    char *conninfo;
+};
+
+static void conn_close(pg_conn *conn)
+{
+    if (conn->db)
+        PQfinish(conn->db);
+    conn->db = NULL;
+
+    free(conn->prepared);
+    conn->prepared = NULL;
+    conn->n_prepared = conn->alloc_prepared = 0;
+}
+
+static int conn_open(pg_pool *pool, pg_conn *conn)
+{
+    conn->db = PQconnectdb(pool->conninfo);
+    if (PQstatus(conn->db) != CONNECTION_OK)
+        return -1;
+
+    return 0;
+}
+
+/* an empty query is the cheapest round trip there is; one that fails
+ * leaves the connection's status bad */
+static int conn_ping(pg_conn *conn)
+{
+    PGresult *result = PQexec(conn->db, "");
+    int ok = (PQresultStatus(result) == PGRES_EMPTY_QUERY);
+
+    PQclear(result);
+    return ok ? 0 : -1;
+}
+
+/* makes sure a connection we're about to hand out is usable */
+static int conn_check(pg_pool *pool, pg_conn *conn)
+{
+    PGresult *result;
+
+    if (conn->db == NULL)
+        return conn_open(pool, conn);
+
+    /* the server or something in between may have dropped a connection
+     * that sat idle for a while */
+    if (!conn->failed &&
+        (time(NULL) - conn->last_used <= POOL_PING_AFTER || conn_ping(conn) == 0))
+        return 0;
+
+    conn->failed = 0;
+
+    /* a lost connection comes back without its prepared statements */
+    if (PQstatus(conn->db) != CONNECTION_OK) {
+        PQreset(conn->db);
+        conn->n_prepared = 0;
+        return (PQstatus(conn->db) == CONNECTION_OK) ? 0 : -1;
+    }
+
+    /* and one left in a failed transaction must be rolled back */
+    if (PQtransactionStatus(conn->db) != PQTRANS_IDLE) {
+        result = PQexec(conn->db, "ROLLBACK");
+        PQclear(result);
+    }
+
+    return 0;
+}
+
+int pg_pool_new(pg_pool **out, const char *conninfo, size_t size)
+{
+    pg_pool *pool;
+
+    if (size == 0)
+        size = 1;
+
+    pool = calloc(1, sizeof(pg_pool));
+    if (pool == NULL)
+        return -1;
+
+    pool->conns = calloc(size, sizeof(pg_conn));
+    pool->conninfo = strdup(conninfo ? conninfo : "");
+    if (pool->conns == NULL || pool->conninfo == NULL) {
+        free(pool->conns);
+        free(pool->conninfo);
+        free(pool);
+        return -1;
+    }
+
+    pool->size = size;
+    pool->refcount = 1;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->freed, NULL);
+    pthread_mutex_init(&pool->schema_lock, NULL);
+
+    *out = pool;
+    return 0;
+}
+
+int pg_pool_get(pg_conn **out, pg_pool *pool)
+{
+    pg_conn *conn;
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        /* an open idle connection, then a slot we haven't connected yet */
+        conn = NULL;
+        for (i = 0; i < pool->size; ++i) {
+            if (pool->conns[i].in_use)
+                continue;
+            if (pool->conns[i].db != NULL) {
+                conn = &pool->conns[i];
+                break;
+            }
+            if (conn == NULL)
+                conn = &pool->conns[i];
+        }
+
+        if (conn != NULL)
+            break;
+
+        pthread_cond_wait(&pool->freed, &pool->lock);
+    }
+
+    conn->in_use = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* connecting and resetting happen outside the lock */
+    if (conn_check(pool, conn) < 0) {
+        conn_close(conn);
+        pg_pool_put(pool, conn, -1);
+        return -1;
+    }
+
+    *out = conn;
+    return 0;
+}
+
+void pg_pool_put(pg_pool *pool, pg_conn *conn, int error)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    conn->failed = (error < 0);
+    conn->last_used = time(NULL);
+    conn->in_use = 0;
+
+    pthread_cond_signal(&pool->freed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pg_pool_ref(pg_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->refcount++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t pg_pool_size(pg_pool *pool)
+{
+    return pool->size;
+}
+
+int pg_pool_init_schema(pg_pool *pool, unsigned int schema,
+    int (*init)(PGconn *db, void *payload), void *payload)
+{
+    pg_conn *conn;
+    int error = 0;
+
+    pthread_mutex_lock(&pool->schema_lock);
+
+    if ((pool->schemas & schema) == 0) {
+        if (pg_pool_get(&conn, pool) < 0) {
+            error = -1;
+        } else {
+            error = init(conn->db, payload) ? -1 : 0;
+            pg_pool_put(pool, conn, error);
+        }
+
+        if (error == 0)
+            pool->schemas |= schema;
+    }
+
+    pthread_mutex_unlock(&pool->schema_lock);
+    return error;
+}
+
+int pg_pool_prepare(pg_conn *conn, const pg_stmt *stmt)
+{
+    const char **grown;
+    PGresult *result;
+    ExecStatusType status;
+    size_t i;
+
+    for (i = 0; i < conn->n_prepared; ++i)
+        if (strcmp(conn->prepared[i], stmt->name) == 0)
+            return 0;
+
+    if (conn->n_prepared == conn->alloc_prepared) {
+        size_t alloc = conn->alloc_prepared ? conn->alloc_prepared * 2 : 16;
+        grown = realloc(conn->prepared, alloc * sizeof(const char *));
+        if (grown == NULL)
+            return -1;
+        conn->prepared = grown;
+        conn->alloc_prepared = alloc;
+    }
+
+    result = PQprepare(conn->db, stmt->name, stmt->sql, 0, NULL);
+    status = PQresultStatus(result);
+    PQclear(result);
+
+    if (status != PGRES_COMMAND_OK)
+        return -1;
+
+    conn->prepared[conn->n_prepared++] = stmt->name;
+    return 0;
+}
+
+void pg_pool_free(pg_pool *pool)
+{
+    size_t i, refcount;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    refcount = --pool->refcount;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (refcount > 0)
+        return;
+
+    for (i = 0; i < pool->size; ++i)
+        conn_close(&pool->conns[i]);
+
+    pthread_mutex_destroy(&pool->schema_lock);
+    pthread_cond_destroy(&pool->freed);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->conninfo);
+    free(pool->conns);
+    free(pool);
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef INCLUDE_git_pgsql_pool_h__
+#define INCLUDE_git_pgsql_pool_h__
+
+#include <stddef.h>
+#include <time.h>
+#include <libpq-fe.h>
+
+/*
+ * A fixed-size pool of connections that the odb and refdb backends of
+ * any number of repositories can share.  A connection prepares each
+ * statement the first time it runs it there, and each schema is
+ * created once per pool, so opening a backend on a pool that is
+ * already in use costs no round trips at all.
+ */
+
+typedef struct {
+    const char *name;
+    const char *sql;
+} pg_stmt;
+
+typedef struct {
+    PGconn *db;
+    /* names of the statements prepared on this connection */
+    const char **prepared;
+    size_t n_prepared;
+    size_t alloc_prepared;
+    time_t last_used;
+    int in_use;
+    int failed;
+} pg_conn;
+
+typedef struct pg_pool pg_pool;
+
+/* schemas pg_pool_init_schema knows about */
+enum {
+    PG_SCHEMA_ODB = 1 << 0,
+    PG_SCHEMA_REFDB = 1 << 1
+};
+
+/* connections are opened lazily, up to `size` of them */
+int pg_pool_new(pg_pool **out, const char *conninfo, size_t size);
+
+/* blocks until a connection is free */
+int pg_pool_get(pg_conn **out, pg_pool *pool);
+
+/* `error` is the result of the operation; a connection that failed is
+ * checked, and reset if it has to be, before it is handed out again */
+void pg_pool_put(pg_pool *pool, pg_conn *conn, int error);
+
+/* the most connections the pool opens */
+size_t pg_pool_size(pg_pool *pool);
+
+/* pools are reference counted; pg_pool_free drops a reference */
+void pg_pool_ref(pg_pool *pool);
+
+/* runs `init` on one of the pool's connections unless some backend
+ * already did for `schema` */
+int pg_pool_init_schema(pg_pool *pool, unsigned int schema,
+    int (*init)(PGconn *db, void *payload), void *payload);
+
+/* prepares `stmt` on `conn` unless it already is; `stmt->name` must
+ * outlive the pool */
+int pg_pool_prepare(pg_conn *conn, const pg_stmt *stmt);
+
+void pg_pool_free(pg_pool *pool);
+
+#endif
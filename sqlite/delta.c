@@ -0,0 +1,313 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+/* size of the base chunks we index and the shortest copy we emit */
+#define DELTA_BLOCK 16
+#define DELTA_MAX_INSERT 127
+#define DELTA_MAX_COPY 0xffffff
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+	size_t max_len;
+} delta_buf;
+
+static int buf_put(delta_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->max_len)
+		return 1;
+
+	if (buf->len + len > buf->alloc) {
+		size_t new_alloc = buf->alloc * 2;
+		unsigned char *new_data;
+
+		if (new_alloc < buf->len + len)
+			new_alloc = buf->len + len;
+		if (new_alloc > buf->max_len)
+			new_alloc = buf->max_len;
+
+		if ((new_data = realloc(buf->data, new_alloc)) == NULL)
+			return -1;
+
+		buf->data = new_data;
+		buf->alloc = new_alloc;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+static int buf_put_varint(delta_buf *buf, size_t value)
+{
+	unsigned char bytes[10];
+	size_t n = 0;
+
+	do {
+		bytes[n] = value & 0x7f;
+		value >>= 7;
+		if (value)
+			bytes[n] |= 0x80;
+		n++;
+	} while (value);
+
+	return buf_put(buf, bytes, n);
+}
+
+static int buf_put_insert(delta_buf *buf, const unsigned char *data, size_t len)
+{
+	unsigned char cmd = (unsigned char)len;
+	int error;
+
+	if ((error = buf_put(buf, &cmd, 1)) != 0)
+		return error;
+
+	return buf_put(buf, data, len);
+}
+
+static int buf_put_copy(delta_buf *buf, size_t offset, size_t len)
+{
+	unsigned char op[8];
+	size_t n = 1;
+	int i;
+
+	op[0] = 0x80;
+
+	for (i = 0; i < 4; ++i) {
+		if ((offset >> (8 * i)) & 0xff) {
+			op[0] |= 1 << i;
+			op[n++] = (offset >> (8 * i)) & 0xff;
+		}
+	}
+
+	for (i = 0; i < 3; ++i) {
+		if ((len >> (8 * i)) & 0xff) {
+			op[0] |= 0x10 << i;
+			op[n++] = (len >> (8 * i)) & 0xff;
+		}
+	}
+
+	return buf_put(buf, op, n);
+}
+
+static size_t hash_block(const unsigned char *p)
+{
+	size_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < DELTA_BLOCK; ++i)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+int delta_create(void **delta_out, size_t *delta_len_out,
+	const void *_base, size_t base_len,
+	const void *_target, size_t target_len, size_t max_len)
+{
+	const unsigned char *base = _base, *target = _target;
+	delta_buf buf = { NULL, 0, 0, 0 };
+	size_t *index = NULL, mask = 0, off, i = 0, lit_start = 0;
+	int error;
+
+	buf.max_len = max_len;
+	buf.alloc = 64;
+	if ((buf.data = malloc(buf.alloc)) == NULL)
+		return -1;
+
+	if ((error = buf_put_varint(&buf, base_len)) != 0 ||
+		(error = buf_put_varint(&buf, target_len)) != 0)
+		goto cleanup;
+
+	if (base_len >= DELTA_BLOCK) {
+		size_t slots = 1;
+		while (slots < base_len / DELTA_BLOCK)
+			slots <<= 1;
+		mask = slots - 1;
+
+		/* slot values are offset + 1 so that 0 means empty */
+		if ((index = calloc(slots, sizeof(size_t))) == NULL) {
+			error = -1;
+			goto cleanup;
+		}
+
+		for (off = 0; off + DELTA_BLOCK <= base_len; off += DELTA_BLOCK)
+			index[hash_block(base + off) & mask] = off + 1;
+	}
+
+	while (i < target_len) {
+		size_t slot, match_off, match_len;
+
+		if (index == NULL || i + DELTA_BLOCK > target_len ||
+			(slot = index[hash_block(target + i) & mask]) == 0 ||
+			memcmp(base + slot - 1, target + i, DELTA_BLOCK) != 0) {
+			if (++i - lit_start == DELTA_MAX_INSERT) {
+				if ((error = buf_put_insert(&buf, target + lit_start, i - lit_start)) != 0)
+					goto cleanup;
+				lit_start = i;
+			}
+			continue;
+		}
+
+		match_off = slot - 1;
+		match_len = DELTA_BLOCK;
+
+		while (match_off + match_len < base_len && i + match_len < target_len &&
+			match_len < DELTA_MAX_COPY &&
+			base[match_off + match_len] == target[i + match_len])
+			match_len++;
+
+		/* give back any literal bytes the match also covers */
+		while (i > lit_start && match_off > 0 && match_len < DELTA_MAX_COPY &&
+			base[match_off - 1] == target[i - 1]) {
+			match_off--;
+			match_len++;
+			i--;
+		}
+
+		if (i > lit_start &&
+			(error = buf_put_insert(&buf, target + lit_start, i - lit_start)) != 0)
+			goto cleanup;
+
+		if ((error = buf_put_copy(&buf, match_off, match_len)) != 0)
+			goto cleanup;
+
+		i += match_len;
+		lit_start = i;
+	}
+
+	if (i > lit_start &&
+		(error = buf_put_insert(&buf, target + lit_start, i - lit_start)) != 0)
+		goto cleanup;
+
+	*delta_out = buf.data;
+	*delta_len_out = buf.len;
+	buf.data = NULL;
+
+cleanup:
+	free(index);
+	free(buf.data);
+	return error;
+}
+
+static int read_varint(size_t *out, const unsigned char **p, const unsigned char *end)
+{
+	size_t value = 0;
+	int shift = 0;
+	unsigned char c;
+
+	do {
+		if (*p >= end || shift > 56)
+			return -1;
+		c = *(*p)++;
+		value |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	*out = value;
+	return 0;
+}
+
+int delta_apply(void **out, size_t *out_len,
+	const void *base, size_t base_len,
+	const void *delta, size_t delta_len)
+{
+	const unsigned char *p = delta, *end = p + delta_len;
+	unsigned char *result, *dst;
+	size_t src_size, res_size, remaining;
+
+	if (read_varint(&src_size, &p, end) < 0 ||
+		read_varint(&res_size, &p, end) < 0 ||
+		src_size != base_len)
+		return -1;
+
+	/* one extra byte so the result can be handled as a C string */
+	if ((result = malloc(res_size + 1)) == NULL)
+		return -1;
+
+	dst = result;
+	remaining = res_size;
+
+	while (p < end) {
+		unsigned char cmd = *p++;
+
+		if (cmd & 0x80) {
+			size_t off = 0, len = 0;
+			int i;
+
+			for (i = 0; i < 4; ++i)
+				if (cmd & (1 << i)) {
+					if (p >= end)
+						goto corrupt;
+					off |= (size_t)*p++ << (8 * i);
+				}
+
+			for (i = 0; i < 3; ++i)
+				if (cmd & (0x10 << i)) {
+					if (p >= end)
+						goto corrupt;
+					len |= (size_t)*p++ << (8 * i);
+				}
+
+			if (len == 0)
+				len = 0x10000;
+
+			if (off + len < off || off + len > base_len || len > remaining)
+				goto corrupt;
+
+			memcpy(dst, (const unsigned char *)base + off, len);
+			dst += len;
+			remaining -= len;
+		} else if (cmd) {
+			if (cmd > (size_t)(end - p) || cmd > remaining)
+				goto corrupt;
+
+			memcpy(dst, p, cmd);
+			p += cmd;
+			dst += cmd;
+			remaining -= cmd;
+		} else {
+			/* opcode 0 is reserved */
+			goto corrupt;
+		}
+	}
+
+	if (remaining != 0)
+		goto corrupt;
+
+	result[res_size] = '\0';
+	*out = result;
+	*out_len = res_size;
+	return 0;
+
+corrupt:
+	free(result);
+	return -1;
+}
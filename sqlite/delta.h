@@ -0,0 +1,42 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stddef.h>
+
+/*
+ * Deltas use git's pack delta format: the base and result sizes as
+ * varints, then a list of "copy from base" and "insert literal" ops.
+ */
+
+/* returns 0 on success, 1 if the delta would be larger than max_len
+ * and -1 if memory ran out */
+int delta_create(void **delta_out, size_t *delta_len_out,
+	const void *base, size_t base_len,
+	const void *target, size_t target_len, size_t max_len);
+
+/* returns 0 on success, -1 if the delta is corrupt or doesn't fit base */
+int delta_apply(void **out, size_t *out_len,
+	const void *base, size_t base_len,
+	const void *delta, size_t delta_len);
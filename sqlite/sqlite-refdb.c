@@ -0,0 +1,990 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * In addition to the permissions in the GNU General Public License,
+ * the authors give you unlimited permission to link the compiled
+ * version of this file into combinations with other programs,
+ * and to distribute those combinations without any restriction
+ * coming from the use of this file.  (The General Public License
+ * restrictions do apply in other respects; for example, they cover
+ * modification of the file, and distribution when not linked into
+ * a combined executable.)
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <git2.h>
+#include <git2/sys/refdb_backend.h>
+#include <git2/sys/refs.h>
+#include <sqlite3.h>
+#include "reflog.h"
+
+#define GIT2_REFDB_TABLE_NAME "git2_refdb"
+#define GIT2_REFLOG_TABLE_NAME "git2_reflog"
+#define GIT2_REFLOG_REFS_TABLE_NAME "git2_reflog_refs"
+#define GIT2_REFLOG_IDX_NAME "git2_reflog_idx_name"
+
+/* how long a writer waits for the odb backend (or another process) to
+ * release the database before giving up */
+#define GIT2_BUSY_TIMEOUT_MS 5000
+
+typedef struct {
+	git_refdb_backend parent;
+	sqlite3 *db;
+	sqlite3_stmt *st_lookup;
+	sqlite3_stmt *st_write;
+	sqlite3_stmt *st_del;
+	sqlite3_stmt *st_has_log;
+	sqlite3_stmt *st_ensure_log;
+	sqlite3_stmt *st_reflog_append;
+	sqlite3_stmt *st_reflog_read;
+} sqlite_refdb_backend;
+
+typedef struct {
+	git_reference_iterator parent;
+	sqlite_refdb_backend *backend;
+	sqlite3_stmt *st_iter;
+	char *cur_name;
+} sqlite_refdb_iterator;
+
+
+static int set_giterr_from_sqlite(sqlite_refdb_backend *backend)
+{
+	giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+	return GIT_ERROR;
+}
+
+static int begin_write(sqlite_refdb_backend *backend)
+{
+	/* take the write lock up front, so the old-value checks below
+	 * can't race with another writer on the same file */
+	if (sqlite3_exec(backend->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		return set_giterr_from_sqlite(backend);
+
+	return GIT_OK;
+}
+
+static int end_write(sqlite_refdb_backend *backend, int error)
+{
+	if (error < 0) {
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		return error;
+	}
+
+	if (sqlite3_exec(backend->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+		set_giterr_from_sqlite(backend);
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/* runs a one-off statement taking up to two text parameters */
+static int exec_names(sqlite_refdb_backend *backend, const char *sql,
+	const char *name1, const char *name2)
+{
+	sqlite3_stmt *st;
+	int error = GIT_ERROR;
+
+	if (sqlite3_prepare_v2(backend->db, sql, -1, &st, NULL) != SQLITE_OK)
+		return set_giterr_from_sqlite(backend);
+
+	if ((name1 == NULL || sqlite3_bind_text(st, 1, name1, -1, SQLITE_TRANSIENT) == SQLITE_OK) &&
+		(name2 == NULL || sqlite3_bind_text(st, 2, name2, -1, SQLITE_TRANSIENT) == SQLITE_OK) &&
+		sqlite3_step(st) == SQLITE_DONE)
+		error = GIT_OK;
+	else
+		set_giterr_from_sqlite(backend);
+
+	sqlite3_finalize(st);
+	return error;
+}
+
+static int ref_from_row(git_reference **out, sqlite3_stmt *st)
+{
+	const char *ref_name = (const char *)sqlite3_column_text(st, 0);
+	int ref_type = sqlite3_column_int(st, 1);
+
+	switch (ref_type) {
+	case GIT_REF_OID:
+		if (sqlite3_column_bytes(st, 2) != GIT_OID_RAWSZ)
+			break;
+
+		*out = git_reference__alloc(ref_name,
+			(const git_oid *)sqlite3_column_blob(st, 2),
+			sqlite3_column_bytes(st, 3) == GIT_OID_RAWSZ ?
+				(const git_oid *)sqlite3_column_blob(st, 3) : NULL);
+		return (*out == NULL) ? GIT_ENOMEM : GIT_OK;
+
+	case GIT_REF_SYMBOLIC:
+		*out = git_reference__alloc_symbolic(ref_name,
+			(const char *)sqlite3_column_text(st, 2));
+		return (*out == NULL) ? GIT_ENOMEM : GIT_OK;
+	}
+
+	giterr_set_str(GITERR_REFERENCE, "corrupt reference row");
+	return GIT_ERROR;
+}
+
+static int sqlite_refdb_backend__exists(
+	int *exists,
+	git_refdb_backend *_backend,
+	const char *ref_name)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	int error = GIT_ERROR;
+
+	assert(exists && backend && ref_name);
+
+	if (sqlite3_bind_text(backend->st_lookup, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK) {
+		switch (sqlite3_step(backend->st_lookup)) {
+		case SQLITE_ROW:
+			*exists = 1;
+			error = GIT_OK;
+			break;
+		case SQLITE_DONE:
+			*exists = 0;
+			error = GIT_OK;
+			break;
+		default:
+			set_giterr_from_sqlite(backend);
+			break;
+		}
+	}
+
+	sqlite3_reset(backend->st_lookup);
+	return error;
+}
+
+static int sqlite_refdb_backend__lookup(
+	git_reference **out,
+	git_refdb_backend *_backend,
+	const char *ref_name)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	int error = GIT_ERROR;
+
+	assert(out && backend && ref_name);
+
+	if (sqlite3_bind_text(backend->st_lookup, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK) {
+		switch (sqlite3_step(backend->st_lookup)) {
+		case SQLITE_ROW:
+			error = ref_from_row(out, backend->st_lookup);
+			break;
+		case SQLITE_DONE:
+			error = GIT_ENOTFOUND;
+			break;
+		default:
+			set_giterr_from_sqlite(backend);
+			break;
+		}
+	}
+
+	sqlite3_reset(backend->st_lookup);
+	return error;
+}
+
+/*
+ * Splits a glob into the literal part in front of its first wildcard
+ * and the smallest string sorting after everything with that prefix.
+ * `name >= lo AND name < hi` is then a range scan on the primary key,
+ * and GLOB only has to filter the rows inside that range.
+ * *hi_out is left NULL when no such upper bound exists.
+ */
+static int glob_to_range(char **lo_out, char **hi_out, const char *glob)
+{
+	size_t prefix_len = strcspn(glob, "*?[\\");
+	char *lo, *hi;
+
+	*lo_out = *hi_out = NULL;
+
+	if ((lo = malloc(prefix_len + 1)) == NULL)
+		return GIT_ENOMEM;
+
+	memcpy(lo, glob, prefix_len);
+	lo[prefix_len] = '\0';
+
+	if ((hi = strdup(lo)) == NULL) {
+		free(lo);
+		return GIT_ENOMEM;
+	}
+
+	while (prefix_len > 0 && (unsigned char)hi[prefix_len - 1] == 0xff)
+		hi[--prefix_len] = '\0';
+
+	if (prefix_len > 0) {
+		hi[prefix_len - 1]++;
+	} else {
+		free(hi);
+		hi = NULL;
+	}
+
+	*lo_out = lo;
+	*hi_out = hi;
+	return GIT_OK;
+}
+
+static int sqlite_refdb_iterator__step(sqlite_refdb_iterator *iter)
+{
+	switch (sqlite3_step(iter->st_iter)) {
+	case SQLITE_ROW:
+		return GIT_OK;
+	case SQLITE_DONE:
+		return GIT_ITEROVER;
+	default:
+		return set_giterr_from_sqlite(iter->backend);
+	}
+}
+
+static int sqlite_refdb_iterator__next(
+	git_reference **ref,
+	git_reference_iterator *_iter)
+{
+	sqlite_refdb_iterator *iter = (sqlite_refdb_iterator *)_iter;
+	int error;
+
+	if ((error = sqlite_refdb_iterator__step(iter)) < 0)
+		return error;
+
+	return ref_from_row(ref, iter->st_iter);
+}
+
+static int sqlite_refdb_iterator__next_name(
+	const char **ref_name,
+	git_reference_iterator *_iter)
+{
+	sqlite_refdb_iterator *iter = (sqlite_refdb_iterator *)_iter;
+	int error;
+
+	if ((error = sqlite_refdb_iterator__step(iter)) < 0)
+		return error;
+
+	/* the column text only lives until the next step, and the caller
+	 * may hold on to the name until it calls us again */
+	free(iter->cur_name);
+	iter->cur_name = strdup((const char *)sqlite3_column_text(iter->st_iter, 0));
+	if (iter->cur_name == NULL)
+		return GIT_ENOMEM;
+
+	*ref_name = iter->cur_name;
+	return GIT_OK;
+}
+
+static void sqlite_refdb_iterator__free(
+	git_reference_iterator *_iter)
+{
+	sqlite_refdb_iterator *iter = (sqlite_refdb_iterator *)_iter;
+
+	sqlite3_finalize(iter->st_iter);
+	free(iter->cur_name);
+	free(iter);
+}
+
+static int sqlite_refdb_backend__iterator(
+	git_reference_iterator **iter_out,
+	struct git_refdb_backend *_backend,
+	const char *glob)
+{
+	static const char *sql_all =
+		"SELECT name, type, target, peel FROM '" GIT2_REFDB_TABLE_NAME "'"
+		" ORDER BY name;";
+
+	static const char *sql_range =
+		"SELECT name, type, target, peel FROM '" GIT2_REFDB_TABLE_NAME "'"
+		" WHERE name >= ?1 AND name < ?2 AND name GLOB ?3 ORDER BY name;";
+
+	static const char *sql_open_range =
+		"SELECT name, type, target, peel FROM '" GIT2_REFDB_TABLE_NAME "'"
+		" WHERE name >= ?1 AND name GLOB ?3 ORDER BY name;";
+
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	sqlite_refdb_iterator *iter;
+	char *lo = NULL, *hi = NULL;
+	const char *sql = sql_all;
+	int error = GIT_ERROR;
+
+	assert(iter_out && backend);
+
+	iter = calloc(1, sizeof(sqlite_refdb_iterator));
+	if (iter == NULL)
+		return GIT_ENOMEM;
+
+	iter->parent.next = &sqlite_refdb_iterator__next;
+	iter->parent.next_name = &sqlite_refdb_iterator__next_name;
+	iter->parent.free = &sqlite_refdb_iterator__free;
+	iter->backend = backend;
+
+	if (glob != NULL) {
+		if ((error = glob_to_range(&lo, &hi, glob)) < 0)
+			goto cleanup;
+
+		sql = (hi != NULL) ? sql_range : sql_open_range;
+	}
+
+	/* each iterator steps its own statement, so several of them can be
+	 * alive at once without stepping on each other */
+	if (sqlite3_prepare_v2(backend->db, sql, -1, &iter->st_iter, NULL) != SQLITE_OK) {
+		error = set_giterr_from_sqlite(backend);
+		goto cleanup;
+	}
+
+	if (glob != NULL &&
+		(sqlite3_bind_text(iter->st_iter, 1, lo, -1, SQLITE_TRANSIENT) != SQLITE_OK ||
+		 (hi != NULL && sqlite3_bind_text(iter->st_iter, 2, hi, -1, SQLITE_TRANSIENT) != SQLITE_OK) ||
+		 sqlite3_bind_text(iter->st_iter, 3, glob, -1, SQLITE_TRANSIENT) != SQLITE_OK)) {
+		error = set_giterr_from_sqlite(backend);
+		goto cleanup;
+	}
+
+	*iter_out = (git_reference_iterator *)iter;
+	iter = NULL;
+	error = GIT_OK;
+
+cleanup:
+	if (iter != NULL)
+		sqlite_refdb_iterator__free((git_reference_iterator *)iter);
+	free(lo);
+	free(hi);
+	return error;
+}
+
+/*
+ * Reads the current row for `ref_name` into the out parameters; *type_out
+ * is GIT_REF_INVALID when the reference doesn't exist.  The symbolic
+ * target, if any, is returned as a freshly allocated string.
+ */
+static int read_current(git_ref_t *type_out, git_oid *oid_out, char **symbolic_out,
+	sqlite_refdb_backend *backend, const char *ref_name)
+{
+	int error = GIT_ERROR;
+
+	*type_out = GIT_REF_INVALID;
+	memset(oid_out, 0, sizeof(git_oid));
+	if (symbolic_out != NULL)
+		*symbolic_out = NULL;
+
+	if (sqlite3_bind_text(backend->st_lookup, 1, ref_name, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+		set_giterr_from_sqlite(backend);
+		goto cleanup;
+	}
+
+	switch (sqlite3_step(backend->st_lookup)) {
+	case SQLITE_ROW:
+		*type_out = (git_ref_t)sqlite3_column_int(backend->st_lookup, 1);
+		if (*type_out == GIT_REF_OID &&
+			sqlite3_column_bytes(backend->st_lookup, 2) == GIT_OID_RAWSZ) {
+			memcpy(oid_out->id, sqlite3_column_blob(backend->st_lookup, 2), GIT_OID_RAWSZ);
+		} else if (*type_out == GIT_REF_SYMBOLIC && symbolic_out != NULL) {
+			*symbolic_out = strdup((const char *)sqlite3_column_text(backend->st_lookup, 2));
+			if (*symbolic_out == NULL) {
+				error = GIT_ENOMEM;
+				goto cleanup;
+			}
+		}
+		error = GIT_OK;
+		break;
+
+	case SQLITE_DONE:
+		error = GIT_OK;
+		break;
+
+	default:
+		set_giterr_from_sqlite(backend);
+		break;
+	}
+
+cleanup:
+	sqlite3_reset(backend->st_lookup);
+	return error;
+}
+
+/* 1 if the ref has a log, 0 if not, or GIT_ERROR */
+static int has_log(sqlite_refdb_backend *backend, const char *ref_name)
+{
+	int found = GIT_ERROR, step;
+
+	if (sqlite3_bind_text(backend->st_has_log, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		((step = sqlite3_step(backend->st_has_log)) == SQLITE_ROW || step == SQLITE_DONE))
+		found = (step == SQLITE_ROW);
+	else
+		set_giterr_from_sqlite(backend);
+
+	sqlite3_reset(backend->st_has_log);
+	return found;
+}
+
+static int ensure_log(sqlite_refdb_backend *backend, const char *ref_name)
+{
+	int error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_ensure_log, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_step(backend->st_ensure_log) == SQLITE_DONE)
+		error = GIT_OK;
+	else
+		set_giterr_from_sqlite(backend);
+
+	sqlite3_reset(backend->st_ensure_log);
+	return error;
+}
+
+/* mirrors git's default of logging updates to branches, remote-tracking
+ * branches, notes and HEAD, plus anything that already has a log; like
+ * has_log, may return GIT_ERROR */
+static int should_log(sqlite_refdb_backend *backend, const char *ref_name)
+{
+	if (!strcmp(ref_name, "HEAD") ||
+		!strncmp(ref_name, "refs/heads/", strlen("refs/heads/")) ||
+		!strncmp(ref_name, "refs/remotes/", strlen("refs/remotes/")) ||
+		!strncmp(ref_name, "refs/notes/", strlen("refs/notes/")))
+		return 1;
+
+	return has_log(backend, ref_name);
+}
+
+static int reflog_append(sqlite_refdb_backend *backend, const char *ref_name,
+	const git_oid *old_id, const git_oid *new_id,
+	const git_signature *committer, const char *msg)
+{
+	sqlite3_stmt *st = backend->st_reflog_append;
+	int error = GIT_ERROR;
+
+	if (ensure_log(backend, ref_name) < 0)
+		return GIT_ERROR;
+
+	if (sqlite3_bind_text(st, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_blob(st, 2, old_id->id, GIT_OID_RAWSZ, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_blob(st, 3, new_id->id, GIT_OID_RAWSZ, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_text(st, 4, committer->name, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_text(st, 5, committer->email, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_int64(st, 6, committer->when.time) == SQLITE_OK &&
+		sqlite3_bind_int(st, 7, committer->when.offset) == SQLITE_OK &&
+		(msg == NULL ? sqlite3_bind_null(st, 8) :
+			sqlite3_bind_text(st, 8, msg, -1, SQLITE_TRANSIENT)) == SQLITE_OK &&
+		sqlite3_step(st) == SQLITE_DONE)
+		error = GIT_OK;
+	else
+		set_giterr_from_sqlite(backend);
+
+	sqlite3_reset(st);
+	return error;
+}
+
+static int check_old_value(git_ref_t cur_type, const git_oid *cur_oid, const char *cur_symbolic,
+	const git_oid *old_id, const char *old_target)
+{
+	if (old_id != NULL &&
+		(cur_type != GIT_REF_OID || git_oid_cmp(old_id, cur_oid) != 0))
+		goto modified;
+
+	if (old_target != NULL &&
+		(cur_type != GIT_REF_SYMBOLIC || strcmp(old_target, cur_symbolic) != 0))
+		goto modified;
+
+	return GIT_OK;
+
+modified:
+	giterr_set_str(GITERR_REFERENCE, "old reference value does not match");
+	return GIT_EMODIFIED;
+}
+
+static int sqlite_refdb_backend__write(git_refdb_backend *_backend,
+	const git_reference *ref, int force, const git_signature *who,
+	const char *message, const git_oid *old_id, const char *old_target)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	const char *ref_name = git_reference_name(ref);
+	git_ref_t ref_type = git_reference_type(ref);
+	const git_oid *peel = git_reference_target_peel(ref);
+	git_ref_t cur_type, tgt_type;
+	git_oid cur_oid, new_oid;
+	char *cur_symbolic = NULL;
+	int error;
+
+	assert(backend && ref);
+
+	if ((error = begin_write(backend)) < 0)
+		return error;
+
+	if ((error = read_current(&cur_type, &cur_oid, &cur_symbolic, backend, ref_name)) < 0)
+		goto cleanup;
+
+	if (!force && cur_type != GIT_REF_INVALID) {
+		giterr_set_str(GITERR_REFERENCE,
+			"failed to write reference: a reference with that name already exists");
+		error = GIT_EEXISTS;
+		goto cleanup;
+	}
+
+	if ((error = check_old_value(cur_type, &cur_oid, cur_symbolic,
+		old_id, old_target)) < 0)
+		goto cleanup;
+
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_write, 1, ref_name, -1, SQLITE_TRANSIENT) != SQLITE_OK ||
+		sqlite3_bind_int(backend->st_write, 2, (int)ref_type) != SQLITE_OK)
+		goto sql_error;
+
+	switch (ref_type) {
+	case GIT_REF_OID:
+		if (sqlite3_bind_blob(backend->st_write, 3, git_reference_target(ref)->id,
+			GIT_OID_RAWSZ, SQLITE_TRANSIENT) != SQLITE_OK)
+			goto sql_error;
+		git_oid_cpy(&new_oid, git_reference_target(ref));
+		break;
+
+	case GIT_REF_SYMBOLIC:
+		if (sqlite3_bind_text(backend->st_write, 3, git_reference_symbolic_target(ref),
+			-1, SQLITE_TRANSIENT) != SQLITE_OK)
+			goto sql_error;
+		break;
+
+	default:
+		giterr_set_str(GITERR_REFERENCE, "invalid reference type");
+		goto cleanup;
+	}
+
+	if ((peel == NULL ? sqlite3_bind_null(backend->st_write, 4) :
+		sqlite3_bind_blob(backend->st_write, 4, peel->id, GIT_OID_RAWSZ, SQLITE_TRANSIENT)) != SQLITE_OK)
+		goto sql_error;
+
+	if (sqlite3_step(backend->st_write) != SQLITE_DONE)
+		goto sql_error;
+
+	sqlite3_reset(backend->st_write);
+
+	if (who != NULL && (error = should_log(backend, ref_name)) < 0)
+		goto cleanup;
+
+	if (who != NULL && error > 0) {
+		/* log what a symbolic ref currently resolves to, one level deep */
+		if (ref_type == GIT_REF_SYMBOLIC &&
+			(error = read_current(&tgt_type, &new_oid, NULL, backend,
+				git_reference_symbolic_target(ref))) < 0)
+			goto cleanup;
+
+		if ((error = reflog_append(backend, ref_name, &cur_oid, &new_oid, who, message)) < 0)
+			goto cleanup;
+	}
+
+	error = GIT_OK;
+	goto cleanup;
+
+sql_error:
+	set_giterr_from_sqlite(backend);
+	sqlite3_reset(backend->st_write);
+	error = GIT_ERROR;
+
+cleanup:
+	free(cur_symbolic);
+	return end_write(backend, error);
+}
+
+static int sqlite_refdb_backend__del(git_refdb_backend *_backend,
+	const char *ref_name, const git_oid *old_id, const char *old_target)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	git_ref_t cur_type;
+	git_oid cur_oid;
+	char *cur_symbolic = NULL;
+	int error;
+
+	assert(backend && ref_name);
+
+	if ((error = begin_write(backend)) < 0)
+		return error;
+
+	if ((error = read_current(&cur_type, &cur_oid, &cur_symbolic, backend, ref_name)) < 0)
+		goto cleanup;
+
+	if (cur_type == GIT_REF_INVALID) {
+		giterr_set_str(GITERR_REFERENCE, "reference not found");
+		error = GIT_ENOTFOUND;
+		goto cleanup;
+	}
+
+	if ((error = check_old_value(cur_type, &cur_oid, cur_symbolic,
+		old_id, old_target)) < 0)
+		goto cleanup;
+
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_del, 1, ref_name, -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_step(backend->st_del) == SQLITE_DONE)
+		error = GIT_OK;
+	else
+		set_giterr_from_sqlite(backend);
+
+	sqlite3_reset(backend->st_del);
+
+	/* like git, a deleted ref takes its log with it */
+	if (error == GIT_OK)
+		error = _backend->reflog_delete(_backend, ref_name);
+
+cleanup:
+	free(cur_symbolic);
+	return end_write(backend, error);
+}
+
+static int sqlite_refdb_backend__reflog_rename(git_refdb_backend *_backend,
+	const char *old_name, const char *new_name)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+
+	assert(backend && old_name && new_name);
+
+	if (exec_names(backend,
+		"DELETE FROM '" GIT2_REFLOG_TABLE_NAME "' WHERE name = ?2;",
+		NULL, new_name) < 0 ||
+		exec_names(backend,
+		"DELETE FROM '" GIT2_REFLOG_REFS_TABLE_NAME "' WHERE name = ?2;",
+		NULL, new_name) < 0 ||
+		exec_names(backend,
+		"UPDATE '" GIT2_REFLOG_TABLE_NAME "' SET name = ?2 WHERE name = ?1;",
+		old_name, new_name) < 0 ||
+		exec_names(backend,
+		"UPDATE '" GIT2_REFLOG_REFS_TABLE_NAME "' SET name = ?2 WHERE name = ?1;",
+		old_name, new_name) < 0)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+static int sqlite_refdb_backend__reflog_delete(git_refdb_backend *_backend,
+	const char *name)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+
+	assert(backend && name);
+
+	if (exec_names(backend,
+		"DELETE FROM '" GIT2_REFLOG_TABLE_NAME "' WHERE name = ?1;",
+		name, NULL) < 0 ||
+		exec_names(backend,
+		"DELETE FROM '" GIT2_REFLOG_REFS_TABLE_NAME "' WHERE name = ?1;",
+		name, NULL) < 0)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+static int sqlite_refdb_backend__rename(git_reference **out,
+	git_refdb_backend *_backend, const char *old_name, const char *new_name,
+	int force, const git_signature *who, const char *message)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	git_ref_t cur_type;
+	git_oid cur_oid;
+	int error;
+
+	assert(out && backend && old_name && new_name);
+
+	if ((error = begin_write(backend)) < 0)
+		return error;
+
+	if ((error = read_current(&cur_type, &cur_oid, NULL, backend, new_name)) < 0)
+		goto cleanup;
+
+	if (cur_type != GIT_REF_INVALID) {
+		if (!force) {
+			giterr_set_str(GITERR_REFERENCE,
+				"failed to rename reference: a reference with that name already exists");
+			error = GIT_EEXISTS;
+			goto cleanup;
+		}
+
+		if ((error = exec_names(backend,
+			"DELETE FROM '" GIT2_REFDB_TABLE_NAME "' WHERE name = ?1;",
+			new_name, NULL)) < 0)
+			goto cleanup;
+	}
+
+	if ((error = read_current(&cur_type, &cur_oid, NULL, backend, old_name)) < 0)
+		goto cleanup;
+
+	if (cur_type == GIT_REF_INVALID) {
+		giterr_set_str(GITERR_REFERENCE, "reference not found");
+		error = GIT_ENOTFOUND;
+		goto cleanup;
+	}
+
+	if ((error = exec_names(backend,
+		"UPDATE '" GIT2_REFDB_TABLE_NAME "' SET name = ?2 WHERE name = ?1;",
+		old_name, new_name)) < 0 ||
+		(error = sqlite_refdb_backend__reflog_rename(_backend, old_name, new_name)) < 0)
+		goto cleanup;
+
+	if (who != NULL && (error = should_log(backend, new_name)) > 0)
+		error = reflog_append(backend, new_name, &cur_oid, &cur_oid, who, message);
+
+cleanup:
+	if ((error = end_write(backend, error)) < 0)
+		return error;
+
+	return sqlite_refdb_backend__lookup(out, _backend, new_name);
+}
+
+static int sqlite_refdb_backend__compress(git_refdb_backend *_backend)
+{
+	/* there are no loose refs to pack */
+	(void)_backend;
+	return GIT_OK;
+}
+
+static int sqlite_refdb_backend__has_log(git_refdb_backend *_backend,
+	const char *refname)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+
+	assert(backend && refname);
+
+	return has_log(backend, refname);
+}
+
+static int sqlite_refdb_backend__ensure_log(git_refdb_backend *_backend,
+	const char *refname)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+
+	assert(backend && refname);
+
+	return ensure_log(backend, refname);
+}
+
+static int sqlite_refdb_backend__reflog_read(git_reflog **out,
+	git_refdb_backend *_backend, const char *name)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	sqlite3_stmt *st = backend->st_reflog_read;
+	git_reflog *log;
+	git_oid old_id, new_id;
+	int error, step;
+
+	assert(out && backend && name);
+
+	if ((error = refdb_reflog_new(&log, name)) < 0)
+		return error;
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(st, 1, name, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+		set_giterr_from_sqlite(backend);
+		goto cleanup;
+	}
+
+	/* libgit2 keeps entries oldest first */
+	while ((step = sqlite3_step(st)) == SQLITE_ROW) {
+		git_oid_fromraw(&old_id, sqlite3_column_blob(st, 0));
+		git_oid_fromraw(&new_id, sqlite3_column_blob(st, 1));
+
+		if ((error = refdb_reflog_push(log, &old_id, &new_id,
+			(const char *)sqlite3_column_text(st, 2),
+			(const char *)sqlite3_column_text(st, 3),
+			sqlite3_column_int64(st, 4),
+			sqlite3_column_int(st, 5),
+			(const char *)sqlite3_column_text(st, 6))) < 0)
+			goto cleanup;
+	}
+
+	if (step != SQLITE_DONE) {
+		set_giterr_from_sqlite(backend);
+		goto cleanup;
+	}
+
+	*out = log;
+	log = NULL;
+	error = GIT_OK;
+
+cleanup:
+	sqlite3_reset(st);
+	refdb_reflog_free(log);
+	return error;
+}
+
+static int sqlite_refdb_backend__reflog_write(git_refdb_backend *_backend,
+	git_reflog *reflog)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	const char *name = refdb_reflog_name(reflog);
+	const git_reflog_entry *entry;
+	size_t i;
+	int error;
+
+	assert(backend && reflog);
+
+	if ((error = begin_write(backend)) < 0)
+		return error;
+
+	if ((error = sqlite_refdb_backend__reflog_delete(_backend, name)) < 0 ||
+		(error = ensure_log(backend, name)) < 0)
+		goto cleanup;
+
+	/* index 0 is the newest entry; store oldest first */
+	for (i = git_reflog_entrycount(reflog); i > 0; --i) {
+		entry = git_reflog_entry_byindex(reflog, i - 1);
+
+		if ((error = reflog_append(backend, name,
+			git_reflog_entry_id_old(entry),
+			git_reflog_entry_id_new(entry),
+			git_reflog_entry_committer(entry),
+			git_reflog_entry_message(entry))) < 0)
+			goto cleanup;
+	}
+
+cleanup:
+	return end_write(backend, error);
+}
+
+static void sqlite_refdb_backend__free(git_refdb_backend *_backend)
+{
+	sqlite_refdb_backend *backend = (sqlite_refdb_backend *)_backend;
+	assert(backend);
+
+	sqlite3_finalize(backend->st_lookup);
+	sqlite3_finalize(backend->st_write);
+	sqlite3_finalize(backend->st_del);
+	sqlite3_finalize(backend->st_has_log);
+	sqlite3_finalize(backend->st_ensure_log);
+	sqlite3_finalize(backend->st_reflog_append);
+	sqlite3_finalize(backend->st_reflog_read);
+	sqlite3_close(backend->db);
+
+	free(backend);
+}
+
+static int init_db(sqlite3 *db)
+{
+	static const char *sql_create =
+		"CREATE TABLE IF NOT EXISTS '" GIT2_REFDB_TABLE_NAME "' ("
+		"'name' TEXT PRIMARY KEY NOT NULL,"
+		"'type' INTEGER NOT NULL,"
+		"'target' BLOB NOT NULL,"
+		"'peel' BLOB);"
+
+		"CREATE TABLE IF NOT EXISTS '" GIT2_REFLOG_REFS_TABLE_NAME "' ("
+		"'name' TEXT PRIMARY KEY NOT NULL);"
+
+		"CREATE TABLE IF NOT EXISTS '" GIT2_REFLOG_TABLE_NAME "' ("
+		"'id' INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"'name' TEXT NOT NULL,"
+		"'old' BLOB NOT NULL,"
+		"'new' BLOB NOT NULL,"
+		"'committer_name' TEXT NOT NULL,"
+		"'committer_email' TEXT NOT NULL,"
+		"'time' INTEGER NOT NULL,"
+		"'time_offset' INTEGER NOT NULL,"
+		"'message' TEXT);"
+
+		"CREATE INDEX IF NOT EXISTS '" GIT2_REFLOG_IDX_NAME "'"
+		" ON '" GIT2_REFLOG_TABLE_NAME "' (name, id);";
+
+	if (sqlite3_exec(db, sql_create, NULL, NULL, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+static int init_statements(sqlite_refdb_backend *backend)
+{
+	static const char *sql_lookup =
+		"SELECT name, type, target, peel FROM '" GIT2_REFDB_TABLE_NAME "' WHERE name = ?;";
+
+	static const char *sql_write =
+		"INSERT OR REPLACE INTO '" GIT2_REFDB_TABLE_NAME "' VALUES (?, ?, ?, ?);";
+
+	static const char *sql_del =
+		"DELETE FROM '" GIT2_REFDB_TABLE_NAME "' WHERE name = ?;";
+
+	static const char *sql_has_log =
+		"SELECT 1 FROM '" GIT2_REFLOG_REFS_TABLE_NAME "' WHERE name = ?;";
+
+	static const char *sql_ensure_log =
+		"INSERT OR IGNORE INTO '" GIT2_REFLOG_REFS_TABLE_NAME "' VALUES (?);";
+
+	static const char *sql_reflog_append =
+		"INSERT INTO '" GIT2_REFLOG_TABLE_NAME "'"
+		" (name, old, new, committer_name, committer_email, time, time_offset, message)"
+		" VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+
+	static const char *sql_reflog_read =
+		"SELECT old, new, committer_name, committer_email, time, time_offset, message"
+		" FROM '" GIT2_REFLOG_TABLE_NAME "' WHERE name = ? ORDER BY id;";
+
+	if (sqlite3_prepare_v2(backend->db, sql_lookup, -1, &backend->st_lookup, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_write, -1, &backend->st_write, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_del, -1, &backend->st_del, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_has_log, -1, &backend->st_has_log, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_ensure_log, -1, &backend->st_ensure_log, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_reflog_append, -1, &backend->st_reflog_append, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(backend->db, sql_reflog_read, -1, &backend->st_reflog_read, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_OK;
+}
+
+/*
+ * Opens a refdb stored in `sqlite_db`.  Pointing this at the same file as
+ * git_odb_backend_sqlite keeps refs, reflogs and objects in one database.
+ */
+int git_refdb_backend_sqlite(git_refdb_backend **backend_out, const char *sqlite_db)
+{
+	sqlite_refdb_backend *backend;
+	int error = GIT_ERROR;
+
+	backend = calloc(1, sizeof(sqlite_refdb_backend));
+	if (backend == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if (sqlite3_open(sqlite_db, &backend->db) != SQLITE_OK)
+		goto cleanup;
+
+	sqlite3_busy_timeout(backend->db, GIT2_BUSY_TIMEOUT_MS);
+
+	error = init_db(backend->db);
+	if (error < 0)
+		goto cleanup;
+
+	error = init_statements(backend);
+	if (error < 0)
+		goto cleanup;
+
+	backend->parent.version = GIT_REFDB_BACKEND_VERSION;
+	backend->parent.exists = &sqlite_refdb_backend__exists;
+	backend->parent.lookup = &sqlite_refdb_backend__lookup;
+	backend->parent.iterator = &sqlite_refdb_backend__iterator;
+	backend->parent.write = &sqlite_refdb_backend__write;
+	backend->parent.rename = &sqlite_refdb_backend__rename;
+	backend->parent.del = &sqlite_refdb_backend__del;
+	backend->parent.compress = &sqlite_refdb_backend__compress;
+	backend->parent.has_log = &sqlite_refdb_backend__has_log;
+	backend->parent.ensure_log = &sqlite_refdb_backend__ensure_log;
+	backend->parent.free = &sqlite_refdb_backend__free;
+	backend->parent.reflog_read = &sqlite_refdb_backend__reflog_read;
+	backend->parent.reflog_write = &sqlite_refdb_backend__reflog_write;
+	backend->parent.reflog_rename = &sqlite_refdb_backend__reflog_rename;
+	backend->parent.reflog_delete = &sqlite_refdb_backend__reflog_delete;
+
+	*backend_out = (git_refdb_backend *)backend;
+	return GIT_OK;
+
+cleanup:
+	if (backend->db != NULL)
+		giterr_set_str(GITERR_REFERENCE, sqlite3_errmsg(backend->db));
+	sqlite_refdb_backend__free((git_refdb_backend *)backend);
+	return GIT_ERROR;
+}
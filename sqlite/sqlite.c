@@ -24,12 +24,46 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <git2.h>
 #include <git2/odb_backend.h>
 #include <sqlite3.h>
+#include <zlib.h>
+#include "delta.h"
 
 #define GIT2_TABLE_NAME "git2_odb"
+#define GIT2_PACKED_TABLE_NAME "git2_odb_packed"
+
+/* recently written objects tried as delta bases, by slot and by total
+ * size */
+#define GIT2_DELTA_WINDOW 10
+#define GIT2_DELTA_WINDOW_BYTES (32 * 1024 * 1024)
+/* objects smaller or larger than this are always stored whole */
+#define GIT2_DELTA_MIN_SIZE 64
+#define GIT2_DELTA_MAX_SIZE (16 * 1024 * 1024)
+/* longest delta chain a reader will follow */
+#define GIT2_DELTA_MAX_DEPTH 50
+/* reconstructed delta bases kept around for the next read, by slot and
+ * by total size */
+#define GIT2_BASE_CACHE_SIZE 32
+#define GIT2_BASE_CACHE_BYTES (32 * 1024 * 1024)
+/* a duplicate write or exists() re-stamps `created` on a row older than
+ * this many seconds, so a sweep running meanwhile keeps it; sweeps add
+ * as much to their grace period */
+#define GIT2_FRESHEN_SECONDS 60
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+	size_t len;
+	unsigned int depth;
+	void *data;
+} sqlite_object;
 
 typedef struct {
 	git_odb_backend parent;
@@ -37,6 +71,22 @@ typedef struct {
 	sqlite3_stmt *st_read;
 	sqlite3_stmt *st_write;
 	sqlite3_stmt *st_read_header;
+	sqlite3_stmt *st_freshen;
+	/* see git_odb_backend_sqlite_freshen() */
+	int freshen;
+
+	/* only used in packed mode, see git_odb_backend_sqlite_packed() */
+	sqlite3_stmt *st_read_packed;
+	sqlite3_stmt *st_write_packed;
+	sqlite3_stmt *st_read_header_packed;
+	sqlite3_stmt *st_freshen_packed;
+	unsigned int max_depth;
+	sqlite_object window[GIT2_DELTA_WINDOW];
+	size_t window_next;
+	size_t window_bytes;
+	sqlite_object cache[GIT2_BASE_CACHE_SIZE];
+	size_t cache_next;
+	size_t cache_bytes;
 } sqlite_backend;
 
 int sqlite_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
@@ -101,7 +151,7 @@ int sqlite_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p,
 					const git_oid *short_oid, unsigned int len) {
 	if (len >= GIT_OID_HEXSZ) {
 		/* Just match the full identifier */
-		int error = sqlite_backend__read(data_p, len_p, type_p, _backend, short_oid);
+		int error = _backend->read(data_p, len_p, type_p, _backend, short_oid);
 		if (error == GIT_SUCCESS)
 			git_oid_cpy(out_oid, short_oid);
 
@@ -111,6 +161,16 @@ int sqlite_backend__read_prefix(git_oid *out_oid, void **data_p, size_t *len_p,
 	}
 }
 
+/* re-stamps `created` on a stale row; libgit2 doesn't write an object
+ * that exists, so a duplicate write only ever gets as far as exists() */
+static void freshen(sqlite3_stmt *st, const git_oid *oid)
+{
+	if (sqlite3_bind_text(st, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK)
+		sqlite3_step(st);
+
+	sqlite3_reset(st);
+}
+
 int sqlite_backend__exists(git_odb_backend *_backend, const git_oid *oid)
 {
 	sqlite_backend *backend;
@@ -129,6 +189,10 @@ int sqlite_backend__exists(git_odb_backend *_backend, const git_oid *oid)
 	}
 
 	sqlite3_reset(backend->st_read_header);
+
+	if (found && backend->freshen)
+		freshen(backend->st_freshen, oid);
+
 	return found;
 }
 
@@ -158,18 +222,636 @@ int sqlite_backend__write(git_oid *id, git_odb_backend *_backend, const void *da
 	return (error == SQLITE_DONE) ? GIT_SUCCESS : GIT_ERROR;
 }
 
+static void object_clear(sqlite_object *obj)
+{
+	free(obj->data);
+	memset(obj, 0, sizeof(*obj));
+}
+
+/* replaces the oldest slot in `ring` with a copy of the given object */
+static void ring_push(sqlite_object *ring, size_t ring_size, size_t *next,
+	const git_oid *oid, git_otype type, const void *data, size_t len, unsigned int depth)
+{
+	sqlite_object *slot = &ring[*next];
+	void *copy;
+
+	if ((copy = malloc(len ? len : 1)) == NULL)
+		return;
+
+	memcpy(copy, data, len);
+	object_clear(slot);
+	git_oid_cpy(&slot->oid, oid);
+	slot->type = type;
+	slot->len = len;
+	slot->depth = depth;
+	slot->data = copy;
+
+	*next = (*next + 1) % ring_size;
+}
+
+static void window_clear(sqlite_backend *backend, sqlite_object *slot)
+{
+	backend->window_bytes -= slot->len;
+	object_clear(slot);
+}
+
+/* keeps a copy of a written object as a delta base, dropping the oldest
+ * ones until the window holds at most GIT2_DELTA_WINDOW_BYTES */
+static void window_push(sqlite_backend *backend, const git_oid *oid,
+	git_otype type, const void *data, size_t len, unsigned int depth)
+{
+	sqlite_object *slot = &backend->window[backend->window_next];
+	size_t i;
+
+	/* the ring is oldest first from the slot about to be reused */
+	for (i = 0; i < GIT2_DELTA_WINDOW &&
+		backend->window_bytes + len > GIT2_DELTA_WINDOW_BYTES; ++i)
+		window_clear(backend,
+			&backend->window[(backend->window_next + i) % GIT2_DELTA_WINDOW]);
+
+	window_clear(backend, slot);
+	ring_push(backend->window, GIT2_DELTA_WINDOW, &backend->window_next,
+		oid, type, data, len, depth);
+	backend->window_bytes += slot->len;
+}
+
+static void cache_clear(sqlite_backend *backend, sqlite_object *slot)
+{
+	backend->cache_bytes -= slot->len;
+	object_clear(slot);
+}
+
+/* keeps a copy of a reconstructed base, dropping the oldest ones until
+ * the cache holds at most GIT2_BASE_CACHE_BYTES; a base bigger than an
+ * eighth of that isn't kept at all */
+static void cache_push(sqlite_backend *backend, const git_oid *oid,
+	git_otype type, const void *data, size_t len)
+{
+	sqlite_object *slot = &backend->cache[backend->cache_next];
+	size_t i;
+
+	if (len > GIT2_BASE_CACHE_BYTES / 8)
+		return;
+
+	/* the ring is oldest first from the slot about to be reused */
+	for (i = 0; i < GIT2_BASE_CACHE_SIZE &&
+		backend->cache_bytes + len > GIT2_BASE_CACHE_BYTES; ++i)
+		cache_clear(backend,
+			&backend->cache[(backend->cache_next + i) % GIT2_BASE_CACHE_SIZE]);
+
+	cache_clear(backend, slot);
+	ring_push(backend->cache, GIT2_BASE_CACHE_SIZE, &backend->cache_next,
+		oid, type, data, len, 0);
+	backend->cache_bytes += slot->len;
+}
+
+static sqlite_object *cache_lookup(sqlite_backend *backend, const git_oid *oid)
+{
+	size_t i;
+
+	for (i = 0; i < GIT2_BASE_CACHE_SIZE; ++i)
+		if (backend->cache[i].data != NULL && git_oid_cmp(&backend->cache[i].oid, oid) == 0)
+			return &backend->cache[i];
+
+	return NULL;
+}
+
+static int inflate_payload(void **out, size_t *out_len, const void *in, size_t in_len, size_t hint)
+{
+	z_stream zs;
+	unsigned char *buf = NULL, *new_buf;
+	size_t alloc = hint ? hint : 64;
+	int zerr;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return GIT_ERROR;
+
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = (uInt)in_len;
+
+	do {
+		/* one extra byte so the result can be handled as a C string */
+		if ((new_buf = realloc(buf, alloc + 1)) == NULL) {
+			zerr = Z_MEM_ERROR;
+			break;
+		}
+		buf = new_buf;
+
+		zs.next_out = buf + zs.total_out;
+		zs.avail_out = (uInt)(alloc - zs.total_out);
+
+		zerr = inflate(&zs, Z_FINISH);
+		if (zerr == Z_BUF_ERROR && zs.avail_out == 0) {
+			alloc *= 2;
+			zerr = Z_OK;
+		}
+	} while (zerr == Z_OK);
+
+	inflateEnd(&zs);
+
+	if (zerr != Z_STREAM_END) {
+		free(buf);
+		return (zerr == Z_MEM_ERROR) ? GIT_ENOMEM : GIT_ERROR;
+	}
+
+	buf[zs.total_out] = '\0';
+	*out = buf;
+	*out_len = zs.total_out;
+	return GIT_SUCCESS;
+}
+
+/*
+ * Fetches one row of the packed table: the inflated payload is either the
+ * whole object or, when *has_base is set, a delta against `base_out`.
+ */
+static int read_packed_row(git_otype *type_p, size_t *len_p, int *has_base, git_oid *base_out,
+	void **payload_p, size_t *payload_len_p, sqlite_backend *backend, const git_oid *oid)
+{
+	sqlite3_stmt *st = backend->st_read_packed;
+	int error = GIT_ERROR;
+
+	if (sqlite3_bind_text(st, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK) {
+		if (sqlite3_step(st) == SQLITE_ROW) {
+			*type_p = (git_otype)sqlite3_column_int(st, 0);
+			*len_p = (size_t)sqlite3_column_int64(st, 1);
+			*has_base = (sqlite3_column_bytes(st, 2) == 20);
+			if (*has_base)
+				memcpy(base_out->id, sqlite3_column_blob(st, 2), 20);
+
+			error = inflate_payload(payload_p, payload_len_p,
+				sqlite3_column_blob(st, 3), sqlite3_column_bytes(st, 3),
+				*has_base ? 0 : *len_p);
+		} else {
+			error = GIT_ENOTFOUND;
+		}
+	}
+
+	sqlite3_reset(st);
+	return error;
+}
+
+int sqlite_backend__read_packed(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	sqlite_object *cached;
+	void *deltas[GIT2_DELTA_MAX_DEPTH];
+	size_t delta_lens[GIT2_DELTA_MAX_DEPTH];
+	git_oid chain[GIT2_DELTA_MAX_DEPTH];
+	size_t n_deltas = 0, row_len, data_len;
+	void *data = NULL, *result;
+	git_otype row_type;
+	git_oid cur, base;
+	int has_base, error;
+
+	assert(data_p && len_p && type_p && _backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+
+	if ((cached = cache_lookup(backend, oid)) != NULL) {
+		if ((*data_p = malloc(cached->len + 1)) == NULL)
+			return GIT_ENOMEM;
+
+		memcpy(*data_p, cached->data, cached->len);
+		((char *)*data_p)[cached->len] = '\0';
+		*len_p = cached->len;
+		*type_p = cached->type;
+		return GIT_SUCCESS;
+	}
+
+	git_oid_cpy(&cur, oid);
+
+	/* walk down the chain until a whole object or a cached base */
+	for (;;) {
+		error = read_packed_row(&row_type, &row_len, &has_base, &base,
+			&data, &data_len, backend, &cur);
+
+		if (error == GIT_ENOTFOUND && n_deltas == 0)
+			/* written before packed mode was turned on */
+			return sqlite_backend__read(data_p, len_p, type_p, _backend, oid);
+
+		if (error < 0)
+			goto cleanup;
+
+		if (n_deltas == 0) {
+			*type_p = row_type;
+			*len_p = row_len;
+		}
+
+		if (!has_base)
+			break;
+
+		if (n_deltas == sizeof(deltas) / sizeof(deltas[0])) {
+			free(data);
+			data = NULL;
+			error = GIT_ERROR;
+			goto cleanup;
+		}
+
+		git_oid_cpy(&chain[n_deltas], &base);
+		deltas[n_deltas] = data;
+		delta_lens[n_deltas++] = data_len;
+		data = NULL;
+
+		if ((cached = cache_lookup(backend, &base)) != NULL) {
+			if ((data = malloc(cached->len + 1)) == NULL) {
+				error = GIT_ENOMEM;
+				goto cleanup;
+			}
+			memcpy(data, cached->data, cached->len);
+			data_len = cached->len;
+			break;
+		}
+
+		git_oid_cpy(&cur, &base);
+	}
+
+	/* apply the deltas from the bottom of the chain back up */
+	while (n_deltas > 0) {
+		--n_deltas;
+
+		if (cache_lookup(backend, &chain[n_deltas]) == NULL)
+			cache_push(backend, &chain[n_deltas], *type_p, data, data_len);
+
+		if (delta_apply(&result, &data_len, data, data_len,
+			deltas[n_deltas], delta_lens[n_deltas]) < 0) {
+			free(deltas[n_deltas]);
+			error = GIT_ERROR;
+			goto cleanup;
+		}
+
+		free(deltas[n_deltas]);
+		free(data);
+		data = result;
+	}
+
+	if (data_len != *len_p) {
+		error = GIT_ERROR;
+		goto cleanup;
+	}
+
+	*data_p = data;
+	return GIT_SUCCESS;
+
+cleanup:
+	while (n_deltas > 0)
+		free(deltas[--n_deltas]);
+	free(data);
+	return error;
+}
+
+int sqlite_backend__read_header_packed(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend;
+	int error;
+
+	assert(len_p && type_p && _backend && oid);
+
+	backend = (sqlite_backend *)_backend;
+	error = GIT_ERROR;
+
+	if (sqlite3_bind_text(backend->st_read_header_packed, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK) {
+		if (sqlite3_step(backend->st_read_header_packed) == SQLITE_ROW) {
+			*type_p = (git_otype)sqlite3_column_int(backend->st_read_header_packed, 0);
+			*len_p = (size_t)sqlite3_column_int64(backend->st_read_header_packed, 1);
+			error = GIT_SUCCESS;
+		} else {
+			error = GIT_ENOTFOUND;
+		}
+	}
+
+	sqlite3_reset(backend->st_read_header_packed);
+
+	if (error == GIT_ENOTFOUND)
+		return sqlite_backend__read_header(len_p, type_p, _backend, oid);
+
+	return error;
+}
+
+/* re-stamps the row it finds when exists() would */
+static int packed_row_exists(sqlite_backend *backend, const git_oid *oid)
+{
+	int found = 0;
+
+	if (sqlite3_bind_text(backend->st_read_header_packed, 1, (char *)oid->id, 20, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_step(backend->st_read_header_packed) == SQLITE_ROW)
+		found = 1;
+
+	sqlite3_reset(backend->st_read_header_packed);
+
+	if (found && backend->freshen)
+		freshen(backend->st_freshen_packed, oid);
+
+	return found;
+}
+
+int sqlite_backend__exists_packed(git_odb_backend *_backend, const git_oid *oid)
+{
+	sqlite_backend *backend = (sqlite_backend *)_backend;
+
+	assert(_backend && oid);
+
+	return packed_row_exists(backend, oid) || sqlite_backend__exists(_backend, oid);
+}
+
+int sqlite_backend__write_packed(git_oid *id, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+{
+	sqlite_backend *backend;
+	sqlite_object *base = NULL, *candidate;
+	void *delta = NULL, *best_delta = NULL, *compressed = NULL;
+	size_t delta_len, best_len, i;
+	const void *payload;
+	size_t payload_len;
+	uLongf compressed_len;
+	unsigned int depth = 0;
+	int error;
+
+	assert(id && _backend && data);
+
+	backend = (sqlite_backend *)_backend;
+
+	if ((error = git_odb_hash(id, data, len, type)) < 0)
+		return error;
+
+	if (sqlite_backend__exists_packed(_backend, id))
+		return GIT_SUCCESS;
+
+	/* only keep a delta if it saves at least half of the object */
+	best_len = len / 2;
+
+	if (len >= GIT2_DELTA_MIN_SIZE && len <= GIT2_DELTA_MAX_SIZE) {
+		for (i = 0; i < GIT2_DELTA_WINDOW; ++i) {
+			candidate = &backend->window[i];
+
+			if (candidate->data == NULL || candidate->type != type ||
+				candidate->depth >= backend->max_depth ||
+				candidate->len / 2 > len || len / 2 > candidate->len)
+				continue;
+
+			if (delta_create(&delta, &delta_len, candidate->data, candidate->len,
+				data, len, best_len) != 0)
+				continue;
+
+			free(best_delta);
+			best_delta = delta;
+			best_len = delta_len;
+			base = candidate;
+		}
+	}
+
+	/* a long-lived writer's window can outlive the sweep grace period,
+	 * so make sure the base wasn't collected in the meantime */
+	if (base != NULL && !packed_row_exists(backend, &base->oid)) {
+		window_clear(backend, base);
+		base = NULL;
+	}
+
+	if (base != NULL) {
+		payload = best_delta;
+		payload_len = best_len;
+		depth = base->depth + 1;
+	} else {
+		payload = data;
+		payload_len = len;
+	}
+
+	compressed_len = compressBound(payload_len);
+	if ((compressed = malloc(compressed_len)) == NULL) {
+		error = GIT_ENOMEM;
+		goto cleanup;
+	}
+
+	if (compress2(compressed, &compressed_len, payload, payload_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		error = GIT_ERROR;
+		goto cleanup;
+	}
+
+	error = SQLITE_ERROR;
+
+	if (sqlite3_bind_text(backend->st_write_packed, 1, (char *)id->id, 20, SQLITE_TRANSIENT) == SQLITE_OK &&
+		sqlite3_bind_int(backend->st_write_packed, 2, (int)type) == SQLITE_OK &&
+		sqlite3_bind_int64(backend->st_write_packed, 3, len) == SQLITE_OK &&
+		(base == NULL ? sqlite3_bind_null(backend->st_write_packed, 4) :
+			sqlite3_bind_text(backend->st_write_packed, 4, (char *)base->oid.id, 20, SQLITE_TRANSIENT)) == SQLITE_OK &&
+		sqlite3_bind_int(backend->st_write_packed, 5, depth) == SQLITE_OK &&
+		sqlite3_bind_blob(backend->st_write_packed, 6, compressed, compressed_len, SQLITE_TRANSIENT) == SQLITE_OK) {
+		error = sqlite3_step(backend->st_write_packed);
+	}
+
+	sqlite3_reset(backend->st_write_packed);
+	error = (error == SQLITE_DONE) ? GIT_SUCCESS : GIT_ERROR;
+
+	if (error == GIT_SUCCESS && len >= GIT2_DELTA_MIN_SIZE && len <= GIT2_DELTA_MAX_SIZE)
+		window_push(backend, id, type, data, len, depth);
+
+cleanup:
+	free(best_delta);
+	free(compressed);
+	return error;
+}
+
+typedef struct {
+	git_oid *oids;
+	size_t len;
+	size_t alloc;
+} sqlite_oid_list;
+
+static int collect_unreachable(sqlite_oid_list *list, sqlite_backend *backend, const char *sql,
+	sqlite3_int64 grace_seconds, int (*is_reachable)(const git_oid *, void *), void *payload)
+{
+	sqlite3_stmt *st;
+	git_oid oid;
+	int error = GIT_SUCCESS, step;
+
+	if (sqlite3_prepare_v2(backend->db, sql, -1, &st, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_bind_int64(st, 1, grace_seconds) != SQLITE_OK) {
+		sqlite3_finalize(st);
+		return GIT_ERROR;
+	}
+
+	while ((step = sqlite3_step(st)) == SQLITE_ROW) {
+		if (sqlite3_column_bytes(st, 0) != 20)
+			continue;
+
+		memcpy(oid.id, sqlite3_column_blob(st, 0), 20);
+		if (is_reachable(&oid, payload))
+			continue;
+
+		if (list->len == list->alloc) {
+			size_t new_alloc = list->alloc ? list->alloc * 2 : 1024;
+			git_oid *oids = realloc(list->oids, new_alloc * sizeof(git_oid));
+			if (oids == NULL) {
+				error = GIT_ENOMEM;
+				break;
+			}
+			list->oids = oids;
+			list->alloc = new_alloc;
+		}
+
+		git_oid_cpy(&list->oids[list->len++], &oid);
+	}
+
+	if (error == GIT_SUCCESS && step != SQLITE_DONE)
+		error = GIT_ERROR;
+
+	sqlite3_finalize(st);
+	return error;
+}
+
+/* deletes the listed rows, committing every `batch_size` deletes so other
+ * writers only ever wait for one batch; `sql` checks the grace period
+ * again, since a row may have been re-stamped after it was listed */
+static int delete_batched(sqlite_backend *backend, const char *sql,
+	const sqlite_oid_list *list, sqlite3_int64 grace_seconds, size_t batch_size)
+{
+	sqlite3_stmt *st;
+	size_t i;
+	int error = GIT_SUCCESS;
+
+	if (sqlite3_prepare_v2(backend->db, sql, -1, &st, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	for (i = 0; i < list->len && error == GIT_SUCCESS; ++i) {
+		if (i % batch_size == 0 &&
+			sqlite3_exec(backend->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+			error = GIT_ERROR;
+			break;
+		}
+
+		if (sqlite3_bind_text(st, 1, (char *)list->oids[i].id, 20, SQLITE_TRANSIENT) != SQLITE_OK ||
+			sqlite3_bind_int64(st, 2, grace_seconds) != SQLITE_OK ||
+			sqlite3_step(st) != SQLITE_DONE)
+			error = GIT_ERROR;
+
+		sqlite3_reset(st);
+
+		if (error == GIT_SUCCESS && (i % batch_size == batch_size - 1 || i == list->len - 1) &&
+			sqlite3_exec(backend->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+			error = GIT_ERROR;
+	}
+
+	if (error < 0)
+		sqlite3_exec(backend->db, "ROLLBACK;", NULL, NULL, NULL);
+
+	sqlite3_finalize(st);
+	return error;
+}
+
+/*
+ * Has exists() re-stamp `created` on the rows it finds, so that an
+ * object libgit2 didn't write again because it was already there isn't
+ * swept as an old one.  Off by default, since it makes lookups write;
+ * only a database that git_odb_backend_sqlite_sweep() runs on needs it.
+ * The re-stamp is best effort and fails quietly on a read-only file.
+ */
+int git_odb_backend_sqlite_freshen(git_odb_backend *_backend, int enabled)
+{
+	assert(_backend);
+
+	((sqlite_backend *)_backend)->freshen = enabled;
+	return GIT_SUCCESS;
+}
+
+/*
+ * Sweep phase of a garbage collection (see gc/gc.h): deletes every row
+ * older than `grace_seconds` that `is_reachable` doesn't claim, in
+ * transactions of at most `batch_size` rows.  In packed mode, rows that
+ * are still the base of another delta are kept until a later sweep.
+ * The grace period is widened by GIT2_FRESHEN_SECONDS; the backends the
+ * repository is used through should have git_odb_backend_sqlite_freshen()
+ * on.
+ */
+int git_odb_backend_sqlite_sweep(git_odb_backend *_backend,
+	int (*is_reachable)(const git_oid *, void *), void *payload,
+	unsigned int grace_seconds, size_t batch_size)
+{
+	static const char *sql_old =
+		"SELECT oid FROM '" GIT2_TABLE_NAME "'"
+		" WHERE created < strftime('%s', 'now') - ?;";
+
+	static const char *sql_del =
+		"DELETE FROM '" GIT2_TABLE_NAME "' WHERE oid = ?"
+		" AND created < strftime('%s', 'now') - ?;";
+
+	static const char *sql_old_packed =
+		"SELECT oid FROM '" GIT2_PACKED_TABLE_NAME "'"
+		" WHERE created < strftime('%s', 'now') - ?"
+		" AND oid NOT IN (SELECT base FROM '" GIT2_PACKED_TABLE_NAME "' WHERE base IS NOT NULL);";
+
+	static const char *sql_del_packed =
+		"DELETE FROM '" GIT2_PACKED_TABLE_NAME "' WHERE oid = ?"
+		" AND created < strftime('%s', 'now') - ?"
+		" AND oid NOT IN (SELECT base FROM '" GIT2_PACKED_TABLE_NAME "' WHERE base IS NOT NULL);";
+
+	sqlite_backend *backend;
+	sqlite_oid_list list = { NULL, 0, 0 };
+	sqlite3_int64 grace;
+	size_t i, j;
+	int error;
+
+	assert(_backend && is_reachable);
+
+	backend = (sqlite_backend *)_backend;
+	grace = (sqlite3_int64)grace_seconds + GIT2_FRESHEN_SECONDS;
+	if (batch_size == 0)
+		batch_size = 1000;
+
+	if ((error = collect_unreachable(&list, backend, sql_old,
+		grace, is_reachable, payload)) < 0 ||
+		(error = delete_batched(backend, sql_del, &list, grace, batch_size)) < 0)
+		goto cleanup;
+
+	if (backend->st_read_packed != NULL) {
+		list.len = 0;
+
+		if ((error = collect_unreachable(&list, backend, sql_old_packed,
+			grace, is_reachable, payload)) < 0 ||
+			(error = delete_batched(backend, sql_del_packed, &list, grace, batch_size)) < 0)
+			goto cleanup;
+
+		for (i = 0; i < list.len; ++i) {
+			for (j = 0; j < GIT2_DELTA_WINDOW; ++j)
+				if (backend->window[j].data != NULL &&
+					git_oid_cmp(&backend->window[j].oid, &list.oids[i]) == 0)
+					window_clear(backend, &backend->window[j]);
+
+			for (j = 0; j < GIT2_BASE_CACHE_SIZE; ++j)
+				if (backend->cache[j].data != NULL &&
+					git_oid_cmp(&backend->cache[j].oid, &list.oids[i]) == 0)
+					cache_clear(backend, &backend->cache[j]);
+		}
+	}
+
+cleanup:
+	free(list.oids);
+	return error;
+}
+
 
 void sqlite_backend__free(git_odb_backend *_backend)
 {
 	sqlite_backend *backend;
+	size_t i;
 	assert(_backend);
 	backend = (sqlite_backend *)_backend;
 
 	sqlite3_finalize(backend->st_read);
 	sqlite3_finalize(backend->st_read_header);
 	sqlite3_finalize(backend->st_write);
+	sqlite3_finalize(backend->st_freshen);
+	sqlite3_finalize(backend->st_read_packed);
+	sqlite3_finalize(backend->st_read_header_packed);
+	sqlite3_finalize(backend->st_write_packed);
+	sqlite3_finalize(backend->st_freshen_packed);
 	sqlite3_close(backend->db);
 
+	for (i = 0; i < GIT2_DELTA_WINDOW; ++i)
+		object_clear(&backend->window[i]);
+	for (i = 0; i < GIT2_BASE_CACHE_SIZE; ++i)
+		object_clear(&backend->cache[i]);
+
 	free(backend);
 }
 
@@ -180,7 +862,8 @@ static int create_table(sqlite3 *db)
 		"'oid' CHARACTER(20) PRIMARY KEY NOT NULL,"
 		"'type' INTEGER NOT NULL,"
 		"'size' INTEGER NOT NULL,"
-		"'data' BLOB);";
+		"'data' BLOB,"
+		"'created' INTEGER NOT NULL DEFAULT (strftime('%s', 'now')));";
 
 	if (sqlite3_exec(db, sql_creat, NULL, NULL, NULL) != SQLITE_OK)
 		return GIT_ERROR;
@@ -188,6 +871,34 @@ static int create_table(sqlite3 *db)
 	return GIT_SUCCESS;
 }
 
+/* tables from before the sweep grace period existed lack `created`;
+ * ALTER TABLE only takes a constant default, so their rows are stamped
+ * with the current time afterwards, and the first sweep after upgrading
+ * only collects them once the grace period has passed */
+static int add_created_column(sqlite3 *db, const char *table)
+{
+	char sql[256];
+	sqlite3_stmt *st_check;
+
+	snprintf(sql, sizeof(sql), "SELECT created FROM '%s' LIMIT 0;", table);
+	if (sqlite3_prepare_v2(db, sql, -1, &st_check, NULL) == SQLITE_OK) {
+		sqlite3_finalize(st_check);
+		return GIT_SUCCESS;
+	}
+
+	snprintf(sql, sizeof(sql),
+		"BEGIN IMMEDIATE;"
+		"ALTER TABLE '%s' ADD COLUMN 'created' INTEGER NOT NULL DEFAULT 0;"
+		"UPDATE '%s' SET created = strftime('%%s', 'now');"
+		"COMMIT;", table, table);
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		return GIT_ERROR;
+	}
+
+	return GIT_SUCCESS;
+}
+
 static int init_db(sqlite3 *db)
 {
 	static const char *sql_check =
@@ -207,7 +918,7 @@ static int init_db(sqlite3 *db)
 
 	case SQLITE_ROW:
 		/* the table was found */
-		error = GIT_SUCCESS;
+		error = add_created_column(db, GIT2_TABLE_NAME);
 		break;
 
 	default:
@@ -228,7 +939,14 @@ static int init_statements(sqlite_backend *backend)
 		"SELECT type, size FROM '" GIT2_TABLE_NAME "' WHERE oid = ?;";
 
 	static const char *sql_write =
-		"INSERT OR IGNORE INTO '" GIT2_TABLE_NAME "' VALUES (?, ?, ?, ?);";
+		"INSERT INTO '" GIT2_TABLE_NAME "' (oid, type, size, data, created)"
+		" VALUES (?, ?, ?, ?, strftime('%s', 'now'))"
+		" ON CONFLICT (oid) DO UPDATE SET created = excluded.created"
+		" WHERE created < excluded.created - " XSTR(GIT2_FRESHEN_SECONDS) ";";
+
+	static const char *sql_freshen =
+		"UPDATE '" GIT2_TABLE_NAME "' SET created = strftime('%s', 'now')"
+		" WHERE oid = ? AND created < strftime('%s', 'now') - " XSTR(GIT2_FRESHEN_SECONDS) ";";
 
 	if (sqlite3_prepare_v2(backend->db, sql_read, -1, &backend->st_read, NULL) != SQLITE_OK)
 		return GIT_ERROR;
@@ -239,6 +957,60 @@ static int init_statements(sqlite_backend *backend)
 	if (sqlite3_prepare_v2(backend->db, sql_write, -1, &backend->st_write, NULL) != SQLITE_OK)
 		return GIT_ERROR;
 
+	if (sqlite3_prepare_v2(backend->db, sql_freshen, -1, &backend->st_freshen, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return GIT_SUCCESS;
+}
+
+static int create_packed_table(sqlite3 *db)
+{
+	static const char *sql_creat =
+		"CREATE TABLE IF NOT EXISTS '" GIT2_PACKED_TABLE_NAME "' ("
+		"'oid' CHARACTER(20) PRIMARY KEY NOT NULL,"
+		"'type' INTEGER NOT NULL,"
+		"'size' INTEGER NOT NULL,"
+		"'base' CHARACTER(20),"
+		"'depth' INTEGER NOT NULL,"
+		"'data' BLOB,"
+		"'created' INTEGER NOT NULL DEFAULT (strftime('%s', 'now')));";
+
+	if (sqlite3_exec(db, sql_creat, NULL, NULL, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	return add_created_column(db, GIT2_PACKED_TABLE_NAME);
+}
+
+static int init_packed_statements(sqlite_backend *backend)
+{
+	static const char *sql_read =
+		"SELECT type, size, base, data FROM '" GIT2_PACKED_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_read_header =
+		"SELECT type, size FROM '" GIT2_PACKED_TABLE_NAME "' WHERE oid = ?;";
+
+	static const char *sql_write =
+		"INSERT INTO '" GIT2_PACKED_TABLE_NAME "' (oid, type, size, base, depth, data, created)"
+		" VALUES (?, ?, ?, ?, ?, ?, strftime('%s', 'now'))"
+		" ON CONFLICT (oid) DO UPDATE SET created = excluded.created"
+		" WHERE created < excluded.created - " XSTR(GIT2_FRESHEN_SECONDS) ";";
+
+	static const char *sql_freshen =
+		"UPDATE '" GIT2_PACKED_TABLE_NAME "' SET created = strftime('%s', 'now')"
+		" WHERE oid = ? AND created < strftime('%s', 'now') - " XSTR(GIT2_FRESHEN_SECONDS) ";";
+
+	if (sqlite3_prepare_v2(backend->db, sql_read, -1, &backend->st_read_packed, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(backend->db, sql_read_header, -1, &backend->st_read_header_packed, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(backend->db, sql_write, -1, &backend->st_write_packed, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
+	if (sqlite3_prepare_v2(backend->db, sql_freshen, -1, &backend->st_freshen_packed, NULL) != SQLITE_OK)
+		return GIT_ERROR;
+
 	return GIT_SUCCESS;
 }
 
@@ -276,3 +1048,43 @@ cleanup:
 	sqlite_backend__free((git_odb_backend *)backend);
 	return error;
 }
+
+/*
+ * Opens `sqlite_db` in packed mode: new objects are zlib-compressed into
+ * git2_odb_packed, and stored as a delta against one of the last few
+ * objects written when that saves at least half the space.  Chains are
+ * capped at `max_depth` deltas.  Objects already in git2_odb stay
+ * readable, so an existing database can be switched over at any time.
+ */
+int git_odb_backend_sqlite_packed(git_odb_backend **backend_out, const char *sqlite_db, unsigned int max_depth)
+{
+	sqlite_backend *backend;
+	int error;
+
+	error = git_odb_backend_sqlite(backend_out, sqlite_db);
+	if (error < 0)
+		return error;
+
+	backend = (sqlite_backend *)*backend_out;
+	backend->max_depth = (max_depth < GIT2_DELTA_MAX_DEPTH) ? max_depth : GIT2_DELTA_MAX_DEPTH;
+
+	error = create_packed_table(backend->db);
+	if (error < 0)
+		goto cleanup;
+
+	error = init_packed_statements(backend);
+	if (error < 0)
+		goto cleanup;
+
+	backend->parent.read = &sqlite_backend__read_packed;
+	backend->parent.read_header = &sqlite_backend__read_header_packed;
+	backend->parent.write = &sqlite_backend__write_packed;
+	backend->parent.exists = &sqlite_backend__exists_packed;
+
+	return GIT_SUCCESS;
+
+cleanup:
+	sqlite_backend__free((git_odb_backend *)backend);
+	*backend_out = NULL;
+	return error;
+}